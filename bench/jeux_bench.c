@@ -0,0 +1,342 @@
+/*
+ * Microbenchmarks for the hot paths of the Jeux server modules.
+ *
+ * Usage: jeux_bench [-f <filter>] [-t <milliseconds>] [-l]
+ *
+ * Each benchmark is run repeatedly, with more iterations each time, until
+ * the run takes at least the minimum time (default 200ms).  The results are
+ * written to stdout as tab-separated lines:
+ *
+ *   benchmark  size  iterations  ns_per_op
+ *
+ * preceded by a header line, so that the output of different builds can be
+ * compared mechanically (for example with join(1) on the first two
+ * columns).  The size column is the registry size or payload size that the
+ * benchmark is parameterized by, or 0.  With -f, only benchmarks whose
+ * names contain the filter string are run.  With -l, the registry and
+ * timeout benchmarks are also run at large sizes (100000 players and
+ * 1000000 timeouts), which take minutes rather than seconds.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "jeux_globals.h"
+#include "protocol.h"
+#include "game.h"
+#include "player.h"
+#include "client.h"
+#include "client_registry.h"
+#include "player_registry.h"
+#include "timeout.h"
+
+/*
+ * A benchmark body runs `n' operations and returns the number performed,
+ * which may differ from n when one call naturally performs several.  It
+ * stores the time taken by the operations, excluding any setup and
+ * teardown, into *elapsed.
+ */
+typedef long (*BENCH_FN)(long n, long size, long *elapsed);
+
+static long min_ns = 200000000;
+static char *filter = NULL;
+static int large = 0;
+
+static long now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void run(char *name, long size, BENCH_FN fn){
+	if(filter != NULL && strstr(name, filter) == NULL){
+		return;
+	}
+	long n = 1, ops, elapsed;
+	while(1){
+		ops = fn(n, size, &elapsed);
+		if(elapsed >= min_ns || n >= (1L << 40)){
+			break;
+		}
+		// aim a little past the target, so that the next run usually suffices
+		n = elapsed > 0 ? n * 1.2 * min_ns / elapsed + 1 : n * 100;
+	}
+	printf("%s\t%ld\t%ld\t%.1f\n", name, size, ops, (double) elapsed / ops);
+	fflush(stdout);
+}
+
+/*
+ * Moves of a drawn game, X first.
+ */
+static char *draw_moves[] = { "5", "1", "9", "3", "2", "8", "4", "6", "7" };
+
+/*
+ * Play a whole drawn game per iteration: parse and apply each move and
+ * test for the end of the game after it.  Reports the cost per move.
+ */
+static long bench_apply_move(long n, long size, long *elapsed){
+	long ops = 0;
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		GAME *game = game_create();
+		for(int m = 0; m < 9; m++){
+			GAME_MOVE *move = game_parse_move(game, m % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE,
+							  draw_moves[m]);
+			game_apply_move(game, move);
+			game_is_over(game);
+			free(move);
+			ops++;
+		}
+		game_unref(game, "benchmark done with game");
+	}
+	*elapsed = now_ns() - start;
+	return ops;
+}
+
+static long bench_parse_move(long n, long size, long *elapsed){
+	GAME *game = game_create();
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		free(game_parse_move(game, FIRST_PLAYER_ROLE, "5"));
+	}
+	*elapsed = now_ns() - start;
+	game_unref(game, "benchmark done with game");
+	return n;
+}
+
+static long bench_unparse_state(long n, long size, long *elapsed){
+	GAME *game = game_create();
+	for(int m = 0; m < 4; m++){
+		GAME_MOVE *move = game_parse_move(game, m % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE,
+						  draw_moves[m]);
+		game_apply_move(game, move);
+		free(move);
+	}
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		free(game_unparse_state(game));
+	}
+	*elapsed = now_ns() - start;
+	game_unref(game, "benchmark done with game");
+	return n;
+}
+
+/*
+ * Send a packet with a payload of the given size over a socketpair and
+ * receive it at the other end.
+ */
+static long bench_proto_roundtrip(long n, long size, long *elapsed){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	char *data = malloc(size + 1);
+	memset(data, 'x', size);
+	JEUX_PACKET_HEADER hdr, rhdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = JEUX_MOVED_PKT;
+	hdr.size = htons(size);
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		void *payload;
+		proto_send_packet(sv[0], &hdr, data);
+		proto_recv_packet(sv[1], &rhdr, &payload);
+		free(payload);
+	}
+	*elapsed = now_ns() - start;
+	free(data);
+	close(sv[0]);
+	close(sv[1]);
+	return n;
+}
+
+/*
+ * Look up each of `size' logged-in clients in turn.  The registry holds at
+ * most MAX_CLIENTS clients, so larger sizes are clamped by the caller.
+ */
+static long bench_creg_lookup(long n, long size, long *elapsed){
+	CLIENT *clients[MAX_CLIENTS];
+	char name[32];
+	client_registry = creg_init();
+	for(int i = 0; i < size; i++){
+		clients[i] = creg_register(client_registry, open("/dev/null", O_RDONLY));
+		snprintf(name, sizeof(name), "user%d", i);
+		PLAYER *player = player_create(name);
+		client_login(clients[i], player);
+		player_unref(player, "benchmark done with player");
+	}
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		snprintf(name, sizeof(name), "user%ld", i % size);
+		CLIENT *client = creg_lookup(client_registry, name);
+		client_unref(client, "benchmark done with lookup result");
+	}
+	*elapsed = now_ns() - start;
+	for(int i = 0; i < size; i++){
+		int fd = client_get_fd(clients[i]);
+		client_logout(clients[i]);
+		creg_unregister(client_registry, clients[i]);
+		close(fd);
+	}
+	creg_fini(client_registry);
+	client_registry = NULL;
+	return n;
+}
+
+/*
+ * Player registry filled with `filled_size' players, kept from one run of
+ * a benchmark to the next because filling a large one is slow.
+ */
+static PLAYER_REGISTRY *filled = NULL;
+static long filled_size = 0;
+
+static PLAYER_REGISTRY *fill_registry(long size){
+	char name[32];
+	if(filled != NULL && filled_size == size){
+		return filled;
+	}
+	if(filled != NULL){
+		preg_fini(filled);
+	}
+	filled = preg_init();
+	filled_size = size;
+	for(long i = 0; i < size; i++){
+		snprintf(name, sizeof(name), "player%ld", i);
+		player_unref(preg_register(filled, name), "benchmark done with player");
+	}
+	return filled;
+}
+
+/*
+ * Register existing names, spread over the whole of a registry of
+ * `size' players.
+ */
+static long bench_preg_register_existing(long n, long size, long *elapsed){
+	char name[32];
+	PLAYER_REGISTRY *preg = fill_registry(size);
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		snprintf(name, sizeof(name), "player%ld", (i * 7919) % size);
+		player_unref(preg_register(preg, name), "benchmark done with player");
+	}
+	*elapsed = now_ns() - start;
+	return n;
+}
+
+/*
+ * Register `size' new players in an initially empty registry per
+ * iteration.  Reports the cost per registration.  The last registry
+ * filled is kept for use by preg_register_existing.
+ */
+static long bench_preg_register_new(long n, long size, long *elapsed){
+	char name[32];
+	long total = 0;
+	for(long i = 0; i < n; i++){
+		PLAYER_REGISTRY *preg = preg_init();
+		long start = now_ns();
+		for(long j = 0; j < size; j++){
+			snprintf(name, sizeof(name), "player%ld", j);
+			player_unref(preg_register(preg, name), "benchmark done with player");
+		}
+		total += now_ns() - start;
+		if(i < n - 1){
+			preg_fini(preg);
+			continue;
+		}
+		if(filled != NULL){
+			preg_fini(filled);
+		}
+		filled = preg;
+		filled_size = size;
+	}
+	*elapsed = total;
+	return n * size;
+}
+
+static long bench_post_result(long n, long size, long *elapsed){
+	PLAYER *p1 = player_create("alice");
+	PLAYER *p2 = player_create("bob");
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		player_post_result(p1, p2, i % 3);
+	}
+	*elapsed = now_ns() - start;
+	player_unref(p1, "benchmark done with player");
+	player_unref(p2, "benchmark done with player");
+	return n;
+}
+
+static void bench_timeout_func(void *arg){
+}
+
+/*
+ * Reset, each to a different time up to an hour away, timeouts spread
+ * over `size' pending ones, as the server does with the time limits of
+ * games and connections.
+ */
+static long bench_timeout_set(long n, long size, long *elapsed){
+	TIMEOUT **timeouts = (TIMEOUT **) malloc(size * sizeof(TIMEOUT *));
+	for(long i = 0; i < size; i++){
+		timeouts[i] = timeout_create(bench_timeout_func, NULL);
+		timeout_set(timeouts[i], 1000 + (i * 7919) % 3600000);
+	}
+	long start = now_ns();
+	for(long i = 0; i < n; i++){
+		timeout_set(timeouts[(i * 7919) % size], 1000 + (i * 104729) % 3600000);
+	}
+	*elapsed = now_ns() - start;
+	for(long i = 0; i < size; i++){
+		timeout_free(timeouts[i]);
+	}
+	free(timeouts);
+	return n;
+}
+
+int main(int argc, char *argv[]){
+	int opt;
+	while((opt = getopt(argc, argv, "f:t:l")) != -1){
+		switch(opt){
+		case 'f':
+			filter = optarg;
+			break;
+		case 't':
+			min_ns = atol(optarg) * 1000000L;
+			break;
+		case 'l':
+			large = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f <filter>] [-t <milliseconds>] [-l]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("benchmark\tsize\titerations\tns_per_op\n");
+	run("game_apply_move", 0, bench_apply_move);
+	run("game_parse_move", 0, bench_parse_move);
+	run("game_unparse_state", 0, bench_unparse_state);
+	run("proto_roundtrip", 0, bench_proto_roundtrip);
+	run("proto_roundtrip", 64, bench_proto_roundtrip);
+	run("proto_roundtrip", 1024, bench_proto_roundtrip);
+	run("creg_lookup", 10, bench_creg_lookup);
+	run("creg_lookup", MAX_CLIENTS, bench_creg_lookup);
+	// each preg_register_existing reuses the registry filled just before
+	run("preg_register_new", 10, bench_preg_register_new);
+	run("preg_register_existing", 10, bench_preg_register_existing);
+	run("preg_register_new", 1000, bench_preg_register_new);
+	run("preg_register_existing", 1000, bench_preg_register_existing);
+	if(large){
+		run("preg_register_new", 100000, bench_preg_register_new);
+		run("preg_register_existing", 100000, bench_preg_register_existing);
+	}
+	run("timeout_set", 1000, bench_timeout_set);
+	if(large){
+		run("timeout_set", 1000000, bench_timeout_set);
+	}
+	run("player_post_result", 0, bench_post_result);
+	return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "client_registry.h"
+#include "protocol.h"
+
+/*
+ * The server's bot.
+ *
+ * The bot is a player that is always logged in and plays perfectly and
+ * instantly, from the tablebase of the GAME module.  It accepts every
+ * invitation it is sent, and as soon as it is its turn in one of its
+ * games it makes the best move.  It is represented by a CLIENT that has
+ * no connection: the packets sent to it are handed to bot_receive(),
+ * which queues them for a thread of the bot's own to answer, off the
+ * strand and the locks of the sender.
+ *
+ * The bot is not in client_registry, so it is not listed in reply to
+ * USERS, and its games are not handed over to a new server process.
+ */
+
+/*
+ * Create the bot and log it in.
+ *
+ * @param name  The username of the bot, which no client can then log in
+ * as.
+ * @return 0 if successful, otherwise -1.
+ */
+int bot_init(char *name);
+
+/*
+ * Find the bot by its username.
+ *
+ * @param name  The username.
+ * @return a reference to the CLIENT of the bot, which the caller must
+ * discard with client_unref(), or NULL if there is no bot with that name.
+ */
+CLIENT *bot_lookup(char *name);
+
+/*
+ * Receive a packet sent to the bot: an invitation is accepted, and a move
+ * made by an opponent is answered.
+ *
+ * @param bot  The CLIENT of the bot.
+ * @param hdr  The header of the packet.
+ * @param id  The bot's ID for the invitation the packet is about.
+ * @return 0, as packets to the bot are not lost.
+ */
+int bot_receive(CLIENT *bot, JEUX_PACKET_HEADER *hdr, int id);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Packet capture.
+ *
+ * When capture is enabled, every packet received or sent by the server is
+ * recorded, together with an identifier of the connection and a monotonic
+ * timestamp, as are the opening and closing of connections.  Records are
+ * appended to an in-memory buffer and written to the capture file by a
+ * background thread, so that the threads handling clients never wait for
+ * the file.  If the writer falls so far behind that the buffer fills up,
+ * further records are dropped (and counted) rather than delaying the server.
+ *
+ * A capture file can be replayed against a server with the jreplay tool
+ * (bin/jreplay), which compares the responses with those captured.
+ */
+
+/*
+ * Kinds of capture records.
+ */
+typedef enum {
+    CAPTURE_OPEN = 1,       // Connection opened
+    CAPTURE_CLOSE,          // Connection closed
+    CAPTURE_IN,             // Packet received by the server
+    CAPTURE_OUT             // Packet sent by the server
+} CAPTURE_KIND;
+
+/*
+ * Format of a capture file: a header, followed by a sequence of records.
+ * Each record consists of a record header, followed for CAPTURE_IN and
+ * CAPTURE_OUT by the packet header exactly as sent on the network and the
+ * packet payload, if any.  Record headers are in host byte order.
+ */
+#define CAPTURE_MAGIC 0x5041434a  // "JCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct capture_file_header {
+    uint32_t magic;
+    uint32_t version;
+} CAPTURE_FILE_HEADER;
+
+typedef struct capture_record {
+    uint64_t timestamp;     // CLOCK_MONOTONIC, in nanoseconds
+    uint32_t conn;          // Connection ID, unique within the capture
+    uint8_t kind;           // CAPTURE_KIND
+    uint8_t unused[3];
+} CAPTURE_RECORD;
+
+/*
+ * Nonzero if capture has been enabled.
+ */
+extern int capture_enabled;
+
+/*
+ * Enable capture and start the background writer.
+ *
+ * @param path  Name of the capture file, which is created or truncated.
+ * @return 0 if successful, -1 if the file cannot be opened.
+ */
+int capture_init(char *path);
+
+/*
+ * Stop capture, write any remaining records and close the capture file.
+ */
+void capture_fini(void);
+
+/*
+ * Record the opening of a connection, assigning it a new connection ID.
+ *
+ * @param fd  The file descriptor of the connection.
+ */
+void capture_open(int fd);
+
+/*
+ * Record the closing of a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ */
+void capture_close(int fd);
+
+/*
+ * Record a packet received or sent on a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @param kind  CAPTURE_IN or CAPTURE_OUT.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param payload  The payload, or NULL if there is none.
+ */
+void capture_packet(int fd, int kind, JEUX_PACKET_HEADER *hdr, void *payload);
+
+#endif
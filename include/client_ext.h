@@ -0,0 +1,337 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include "client.h"
+#include "federation.h"
+#include "sendq.h"
+
+/*
+ * Extensions to the CLIENT module.
+ *
+ * client.h must not be modified, so functions added to the CLIENT module
+ * are declared here.
+ */
+
+/*
+ * Start watching, as a spectator, the game in progress of the player
+ * logged in with a specified username.  If that player has several games
+ * in progress, the one with the lowest ID in the player's list is chosen.
+ * The spectator is assigned an ID for the watch, which is used in the
+ * packets sent for it and to stop watching.  If successful, the client
+ * is sent an ACK whose id field is the ID of the watch and whose payload
+ * is the current state of the game, before any packet for the watch.
+ *
+ * @param client  The CLIENT that is to watch the game.
+ * @param name  The username of a player of the game.
+ * @return the ID assigned to the watch, if successful, otherwise -1.
+ */
+int client_watch_game(CLIENT *client, char *name);
+
+/*
+ * Stop watching a game.  It is an error if the watch has already ended.
+ *
+ * @param client  The CLIENT that is watching the game.
+ * @param id  The ID of the watch.
+ * @return 0 if the watch was active and has been ended, otherwise -1.
+ */
+int client_unwatch_game(CLIENT *client, int id);
+
+/*
+ * Stop all output to a CLIENT, discarding any packets queued for it,
+ * except that when coroutines are in use, the replies queued for it are
+ * written first.  Once this function has returned, nothing more is
+ * written to the client's connection, which may then be closed.
+ *
+ * @param client  The CLIENT.
+ */
+void client_close_output(CLIENT *client);
+
+/*
+ * Shut down the reading side of a CLIENT's connection, so that its service
+ * loop sees EOF.  A parked session, whose connection has already been
+ * closed, is left alone.
+ *
+ * @param client  The CLIENT.
+ */
+void client_shutdown(CLIENT *client);
+
+/*
+ * Send a packet to a client, as client_send_packet() does, with an ID
+ * that need not fit in the id field of the header.  A client using
+ * version 2 of the protocol is sent the ID in full; any other is sent its
+ * low 8 bits.  An ACK or NACK carries the ID of the request being handled
+ * for the client.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent, whose id field is set.
+ * @param id  The invitation or watch ID.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_packet_id(CLIENT *client, JEUX_PACKET_HEADER *pkt, uint32_t id, void *data);
+
+/*
+ * Set the ID of the request being handled for a client, which is echoed
+ * in the ACK or NACK sent to it in response.
+ *
+ * @param client  The CLIENT.
+ * @param request  The request ID.
+ */
+void client_set_request(CLIENT *client, uint32_t request);
+
+/*
+ * Get the version of the protocol used on the connection of a client.
+ *
+ * @param client  The CLIENT.
+ * @return the version.
+ */
+int client_get_version(CLIENT *client);
+
+/*
+ * Set the version of the protocol used on the connection of a client,
+ * for the packets sent to it and received from it from now on.
+ *
+ * @param client  The CLIENT.
+ * @param version  The version.
+ */
+void client_set_version(CLIENT *client, int version);
+
+/*
+ * Get the SENDQ of the connection of a client.
+ *
+ * @param client  The CLIENT.
+ * @return the SENDQ, on which no reference is taken.
+ */
+SENDQ *client_get_sendq(CLIENT *client);
+
+/*
+ * Time limits, in milliseconds, with 0 meaning no limit.  These are set
+ * from the command line before any client connects.
+ *
+ * client_idle_timeout: a connection over which no packet has been received
+ * for this long is shut down, which logs the client out.
+ * client_move_timeout: a player who has not moved this long after it has
+ * become that player's turn resigns the game.
+ * client_invite_timeout: an invitation that has not been accepted this long
+ * after it was made is revoked, and both its source and its target are
+ * sent a REVOKED packet.
+ */
+extern unsigned long client_idle_timeout;
+extern unsigned long client_move_timeout;
+extern unsigned long client_invite_timeout;
+
+/*
+ * Default time control of games, in ms, used for invitations that do not
+ * specify one.  A base time of 0 means that games are not timed.
+ */
+extern unsigned long client_time_base;
+extern unsigned long client_time_increment;
+
+/*
+ * Largest base time and increment of a time control, in seconds.
+ */
+#define CLIENT_TIME_CONTROL_MAX 86400
+
+/*
+ * Parse a time control, given as the base time in seconds, optionally
+ * followed by '+' and the increment in seconds ("300", "180+2").  Neither
+ * may exceed CLIENT_TIME_CONTROL_MAX.
+ *
+ * @param str  The string to be parsed.
+ * @param basep  Variable into which to store the base time, in ms.
+ * @param incrementp  Variable into which to store the increment, in ms.
+ * @return 0 if the string is a valid time control, otherwise -1.
+ */
+int client_parse_time_control(char *str, unsigned long *basep, unsigned long *incrementp);
+
+/*
+ * Make a new invitation, as client_make_invitation() does, to a game
+ * played with a specified time control.  If the game is timed, the
+ * payload of the INVITED packet sent to the target is the username of the
+ * source followed by a space and the time control, in the form accepted
+ * by client_parse_time_control().
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param source_role  The GAME_ROLE to be played by the source of the INVITATION.
+ * @param target_role  The GAME_ROLE to be played by the target of the INVITATION.
+ * @param base_ms  The time given to each player for the whole game, in ms,
+ * or 0 for a game that is not timed.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_timed_invitation(CLIENT *source, CLIENT *target,
+				 GAME_ROLE source_role, GAME_ROLE target_role,
+				 unsigned long base_ms, unsigned long increment_ms);
+
+/*
+ * Grace period, in ms, for which the session of a client whose connection
+ * has dropped is parked rather than logged out, or 0 to log it out at
+ * once.  While a grace period is set, each login is issued a resume token
+ * in the payload of its ACK, which is needed to resume the session.
+ */
+extern unsigned long client_resume_grace;
+
+/*
+ * Park the session of a logged-in CLIENT whose connection has dropped,
+ * instead of logging it out.  The client stays logged in, and keeps its
+ * invitations and games in progress, for client_resume_grace ms; packets
+ * sent to it meanwhile are held, to be sent once the session is resumed
+ * with client_resume().  Games being watched are not kept.  If the
+ * session has not been resumed by the end of the grace period, the client
+ * is logged out and unregistered.  Once this function has returned
+ * successfully, nothing more is written to the client's connection, which
+ * may then be closed, and the caller must not use the CLIENT again.
+ *
+ * @param client  The CLIENT whose session is to be parked.
+ * @return 0 if the session has been parked, or -1 if it has not, because
+ * the client is not logged in, no grace period is set, or the server is
+ * shutting down.
+ */
+int client_park(CLIENT *client);
+
+/*
+ * Resume a parked session over the connection of a CLIENT that is not
+ * logged in.  The session's CLIENT takes over the connection, and is sent
+ * an ACK whose payload is a new resume token, followed by the packets held
+ * for it while it was parked.  The CLIENT of the connection is
+ * unregistered, and must not be used again.
+ *
+ * @param client  The CLIENT of the connection, which is not logged in.
+ * @param player  The PLAYER that the parked session is logged in as.
+ * @param token  The resume token that was last issued to the session.
+ * @return the CLIENT of the resumed session, if a session of the player
+ * was parked with that token and can be resumed, otherwise NULL.
+ */
+CLIENT *client_resume(CLIENT *client, PLAYER *player, char *token);
+
+/*
+ * Get the resume token last issued to a logged-in CLIENT.
+ *
+ * @param client  The CLIENT.
+ * @return the token, or NULL if no grace period is set.
+ */
+char *client_get_resume_token(CLIENT *client);
+
+/*
+ * End all parked sessions, and park no more.  Called when the server is
+ * shutting down, so that the clients of parked sessions are unregistered.
+ */
+void client_resume_shutdown(void);
+
+/*
+ * End all the sessions that are parked at the time, as their grace
+ * periods would, without preventing more from being parked.
+ */
+void client_end_parked(void);
+
+/*
+ * Stop watching all the games that a client is watching.
+ *
+ * @param client  The CLIENT.
+ */
+void client_unwatch_all(CLIENT *client);
+
+/*
+ * Get the invitations in the list of a client, indexed by their IDs.
+ * A reference is taken on each invitation returned.
+ *
+ * @param client  The CLIENT.
+ * @param np  Variable into which to store the length of the list.
+ * @return the list, in malloc'ed storage, with NULL for unused IDs, or
+ * NULL if the list is empty.
+ */
+INVITATION **client_get_invitations(CLIENT *client, int *np);
+
+/*
+ * Register a client, logged in as a specified player, for a connection
+ * handed over by another server process.
+ *
+ * @param fd  File descriptor of the connection.
+ * @param player  The PLAYER that the client is logged in as, or NULL if
+ * it is not logged in.
+ * @param token  The resume token issued to the client, or NULL.
+ * @return the CLIENT, registered in client_registry, or NULL if it cannot
+ * be registered.
+ */
+CLIENT *client_restore(int fd, PLAYER *player, char *token);
+
+/*
+ * Add an INVITATION to the list of a client under a specified ID, as it
+ * was in another server process.
+ *
+ * @param client  The CLIENT.
+ * @param id  The ID of the invitation.
+ * @param inv  The INVITATION, on which a reference is taken.
+ * @return 0 if the invitation has been added, -1 if the ID is in use.
+ */
+int client_restore_invitation(CLIENT *client, int id, INVITATION *inv);
+
+/*
+ * Set the time limit that applies to an invitation, as it is set when
+ * the invitation is made or accepted, or when a move is made: the limit
+ * for accepting an invitation that is open, or for the next move in its
+ * game.  For an invitation that has been accepted, this must be called
+ * from a task running on the game's strand, or before the game is made
+ * visible to other threads.
+ *
+ * @param inv  The INVITATION.
+ */
+void client_set_time_limit(INVITATION *inv);
+
+/*
+ * Create a proxy CLIENT for a player logged in on another node of a
+ * federation.  A proxy has no connection: the packets sent to it are
+ * sent to the player's node instead.  It is not registered in
+ * client_registry, and is logged in as the player from the start.
+ *
+ * @param player  The PLAYER.
+ * @param peer  The node on which the player is logged in.
+ * @return  The newly created CLIENT, with a reference count of one.
+ */
+CLIENT *client_create_proxy(PLAYER *player, FED_PEER *peer);
+
+/*
+ * End a game in progress with a specified winner, as it has ended on
+ * another node, by resigning it on behalf of the loser.
+ *
+ * @param client  Either player of the game.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME.
+ * @param winner  The GAME_ROLE of the winner.
+ * @return 0 if the game has been ended, -1 if it was not in progress or
+ * has no winner.
+ */
+int client_end_game(CLIENT *client, int id, GAME_ROLE winner);
+
+/*
+ * Create the CLIENT of the server's bot.  The bot has no connection: the
+ * packets sent to it are handed to bot_receive() instead.  It is not
+ * registered in client_registry, and is logged in as the player from the
+ * start.
+ *
+ * @param player  The PLAYER of the bot.
+ * @return  The newly created CLIENT, with a reference count of one.
+ */
+CLIENT *client_create_bot(PLAYER *player);
+
+/*
+ * Get the best move, under perfect play, for the player to move in a game
+ * in progress, which may be either player.
+ *
+ * @param client  A player of the game.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME.
+ * @param outcomep  Variable into which to store the GAME_ROLE of the
+ * winner under perfect play, or NULL_ROLE for a draw.
+ * @param distancep  Variable into which to store the number of moves left
+ * under perfect play.
+ * @return the move, in the format of game_unparse_move(), in malloc'ed
+ * storage that the caller must free, or NULL if the ID does not refer to
+ * a game in progress.
+ */
+char *client_get_hint(CLIENT *client, int id, GAME_ROLE *outcomep, int *distancep);
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <semaphore.h>
+
+/*
+ * Stackful coroutines.
+ *
+ * A coroutine runs a function on a small stack of its own, allocated with
+ * mmap so that only the pages it touches take memory, with a guard page
+ * below it.  Coroutines are spread over a fixed number of coroutine
+ * threads, each of which runs the coroutines assigned to it one at a
+ * time, switching between them with swapcontext().  A coroutine runs
+ * until it waits for a file descriptor to become readable, at which point
+ * its thread runs another one; a thread that has no coroutine ready to
+ * run waits in epoll_wait() on the file descriptors its coroutines are
+ * waiting for.  A coroutine stays on the thread it was assigned to, so
+ * thread-local variables behave as they do in an ordinary thread while
+ * the coroutine runs.
+ *
+ * Code running in a coroutine may block in other ways, for example on a
+ * semaphore, but then blocks the other coroutines of its thread as well,
+ * so it must not wait for anything that another coroutine might have to
+ * do first, and must not hold a lock while it waits for a file
+ * descriptor.
+ *
+ * The coroutine threads may also be shards, each owning the connections
+ * of its coroutines and whatever work is homed on it.  A shard can be
+ * posted a message, a function to be run on its thread between
+ * coroutines.  Between any two shards messages go through a queue of
+ * their own, with a single producer and a single consumer, so that
+ * neither takes a lock; messages from other threads take a locked list.
+ * A coroutine that calls a function on another shard waits for it as for
+ * a file descriptor, letting the other coroutines of its thread run.
+ */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/*
+ * Type of a function that may be run as a coroutine.
+ */
+typedef void (*CORO_FUNC)(void *arg);
+
+/*
+ * Something a thread or a coroutine waits for another thread to do.
+ */
+typedef struct coro_event {
+    void *waiter;             // Coroutine to be resumed, or NULL
+    int origin;               // Coroutine thread of the waiting coroutine
+    sem_t done;               // Posted instead if there is none
+} CORO_EVENT;
+
+/*
+ * Start the coroutine threads.
+ *
+ * @param nthreads  Number of coroutine threads.
+ * @param shards  If nonzero, the threads are also shards, with a message
+ * queue from each to each.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_init(int nthreads, int shards);
+
+/*
+ * Determine whether coroutines are in use.
+ *
+ * @return nonzero if coro_init() has succeeded, otherwise 0.
+ */
+int coro_enabled(void);
+
+/*
+ * Start a coroutine, on the coroutine thread that has the fewest.
+ *
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_spawn(CORO_FUNC func, void *arg);
+
+/*
+ * Determine whether the caller is running in a coroutine.
+ *
+ * @return nonzero if the caller is running in a coroutine, otherwise 0.
+ */
+int coro_active(void);
+
+/*
+ * Wait until a file descriptor is readable (or has reached EOF or an
+ * error), letting the other coroutines of the calling thread run
+ * meanwhile.  Outside a coroutine, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ */
+void coro_wait_readable(int fd);
+
+/*
+ * Wait until a file descriptor is writable (or has an error), letting the
+ * other coroutines of the calling thread run meanwhile.  Outside a
+ * coroutine, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ */
+void coro_wait_writable(int fd);
+
+/*
+ * Let the other coroutines of the calling thread run, and its messages,
+ * before carrying on.  Outside a coroutine, this returns at once.
+ */
+void coro_yield(void);
+
+/*
+ * Determine whether the coroutine threads are shards.
+ *
+ * @return nonzero if coro_init() has succeeded with shards, otherwise 0.
+ */
+int coro_sharded(void);
+
+/*
+ * Get the number of shards.
+ *
+ * @return the number of coroutine threads, if they are shards, otherwise 0.
+ */
+int coro_nshards(void);
+
+/*
+ * Get the shard of the calling thread.
+ *
+ * @return the index of the calling coroutine thread, if it is a shard,
+ * otherwise -1.
+ */
+int coro_shard(void);
+
+/*
+ * Post a message to a shard: a function to be run on its coroutine
+ * thread, between coroutines.  From another shard, the message goes
+ * through the queue between the two, without taking a lock, unless that
+ * queue has filled up and the messages that did not fit have yet to be
+ * taken.  The messages posted by a thread are run in the order in which
+ * they were posted.
+ *
+ * @param shard  The shard.
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_post(int shard, CORO_FUNC func, void *arg);
+
+/*
+ * Run a function on a shard and wait for it to complete.  On the shard
+ * itself, the function is simply run in-line.  A coroutine lets the
+ * other coroutines of its thread run while it waits, and so must not hold
+ * a lock; any other thread blocks.
+ *
+ * @param shard  The shard.
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_call(int shard, CORO_FUNC func, void *arg);
+
+/*
+ * Prepare an event for the calling thread or coroutine to wait for.
+ *
+ * @param ev  The event.
+ */
+void coro_event_init(CORO_EVENT *ev);
+
+/*
+ * Wait for an event to be signalled.  A coroutine lets the other
+ * coroutines of its thread run while it waits, and so must not hold a
+ * lock; any other thread blocks.
+ *
+ * @param ev  The event, prepared by the caller with coro_event_init().
+ */
+void coro_event_wait(CORO_EVENT *ev);
+
+/*
+ * Signal an event, waking the thread or coroutine that waits for it.
+ *
+ * @param ev  The event.
+ */
+void coro_event_signal(CORO_EVENT *ev);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef CREG_SNAPSHOT_H
+#define CREG_SNAPSHOT_H
+
+#include "client_registry.h"
+
+/*
+ * The client registry publishes an immutable snapshot of its registered
+ * clients, together with the PLAYER each of them was logged in as at the
+ * time the snapshot was taken.  creg_lookup(), creg_all_players() and
+ * creg_shutdown_all() read the current snapshot inside an epoch read-side
+ * critical section instead of taking the registry lock, so that building
+ * a USERS reply does not hold up logins, lookups and disconnects.
+ *
+ * A new snapshot is published whenever a client is registered or
+ * unregistered, and whenever a registered client logs in or out; the
+ * superseded snapshot is reclaimed once no reader can still be using it.
+ * The registry keeps the PLAYER of each client with its entry, so that a
+ * snapshot is built without taking the lock of any client.
+ */
+
+/*
+ * Record the PLAYER that a registered client is now logged in as, and
+ * publish a new snapshot of a client registry.  This must be called
+ * whenever the login state of a registered client changes, after the
+ * change has been made, by the thread that made it.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT.
+ * @param player  The PLAYER the client is logged in as, or NULL if it has
+ * logged out.
+ */
+void creg_update_snapshot(CLIENT_REGISTRY *cr, CLIENT *client, PLAYER *player);
+
+/*
+ * Return a list of all registered clients, whether logged in or not,
+ * taken from the current snapshot.  The result is returned as a malloc'ed
+ * array of CLIENT pointers, with a NULL pointer marking the end of the
+ * array.  It is the caller's responsibility to decrement the reference
+ * count of each of the entries and to free the array when it is no
+ * longer needed.
+ *
+ * @param cr  The client registry.
+ * @return the list of clients as a NULL-terminated array of pointers.
+ */
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr);
+
+#endif
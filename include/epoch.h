@@ -0,0 +1,55 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation of shared objects.
+ *
+ * Readers access a shared, immutable object (for example, a snapshot of
+ * the client registry) only between a call to epoch_enter() and a call to
+ * epoch_exit(), without taking any lock.  A writer that replaces such an
+ * object publishes the new version and then hands the old version to
+ * epoch_retire().  The old version is freed only once every thread that
+ * might still be reading it has left its read-side critical section.
+ *
+ * Read-side critical sections must be short and must not block, because
+ * they hold back the reclamation of everything retired after they began.
+ * They may not be nested.
+ */
+
+/*
+ * Type of a function that frees a retired object.
+ */
+typedef void (*EPOCH_FREE_FN)(void *obj);
+
+/*
+ * Enter a read-side critical section.  Objects that are reachable from
+ * shared pointers when this function returns will not be freed before
+ * the matching call to epoch_exit().
+ */
+void epoch_enter(void);
+
+/*
+ * Leave a read-side critical section.  Pointers obtained inside the
+ * critical section must not be used afterwards, unless a reference
+ * count has been taken on the object concerned.
+ */
+void epoch_exit(void);
+
+/*
+ * Retire an object that has been unlinked from all shared pointers.
+ * The object is freed by calling the specified function once no reader
+ * can still hold a pointer to it.  Retired objects are reclaimed as a
+ * side effect of later calls to epoch_retire() and epoch_synchronize().
+ *
+ * @param obj  The object that has been retired.
+ * @param free_fn  Function to be called to free the object.
+ */
+void epoch_retire(void *obj, EPOCH_FREE_FN free_fn);
+
+/*
+ * Wait until all objects retired so far have been freed.  This function
+ * must not be called from within a read-side critical section.
+ */
+void epoch_synchronize(void);
+
+#endif
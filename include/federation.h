@@ -0,0 +1,117 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "client_registry.h"
+#include "protocol.h"
+
+/*
+ * Federation of several servers.
+ *
+ * Servers started with the same directory cooperate as the nodes of a
+ * federation.  The directory, a separate process (tools/jdir.c) reached
+ * over a UNIX or TCP socket, maps the username of each logged-in player
+ * to the node it is logged in on, so that a username can only be logged
+ * in on one node at a time.  Requests to the directory are written as
+ * they are made and its replies matched to them in order, so a login
+ * does not wait for the replies to other nodes' or clients' requests,
+ * and a logout does not wait for its reply at all.  Nodes send each other
+ * messages over persistent links, one TCP connection in each direction
+ * between two nodes; messages queued while a link is busy are written
+ * together, with a single system call.  A node opening a link names
+ * itself with a one-time ticket issued by the directory, which the node
+ * at the other end redeems with the directory before it accepts any
+ * message over the link.  A node can claim or release names only for
+ * the address it has joined as, and an address is joined by whichever
+ * connection asks first, so the directory must be reachable only by the
+ * nodes of the federation.
+ *
+ * A player logged in on another node is represented on this one by a
+ * proxy CLIENT, which has no connection.  An invitation between a local
+ * client and a remote player is made on both nodes, between the local
+ * client and a proxy on each, and each node runs its own copy of the
+ * game.  The packets a node sends to a proxy describe what its local
+ * client did (INVITED, REVOKED, DECLINED, ACCEPTED, MOVED, RESIGNED), and
+ * are sent to the node of the proxy's player, which makes the proxy of
+ * the local client there do the same; the ENDED packets each node sends
+ * itself.  An ENDED for a game the other node still has in progress, as
+ * when a flag falls on only one of them, ends it there by resignation.
+ * An invitation is known on both nodes by a key assigned by the node it
+ * was made on, with random bytes so that it cannot be guessed, and only
+ * the messages from the node of its proxy may use the key.
+ *
+ * Messages that cannot be sent because a link fails are lost, and ratings
+ * are kept by each node for the games it has seen.
+ */
+
+/*
+ * The FED_PEER type is a structure type that defines another node and the
+ * link to it.  The complete structure definition is in federation.c.
+ */
+typedef struct fed_peer FED_PEER;
+
+/*
+ * Join a federation: connect to its directory and listen for links from
+ * the other nodes.
+ *
+ * @param directory  The directory: the path of a UNIX socket, or
+ * <host>:<port>.
+ * @param node  The address of this node, [<host>:]<port>, on which it
+ * listens for links and by which the other nodes reach it.  The host
+ * defaults to 127.0.0.1.
+ * @return 0 if successful, otherwise -1.
+ */
+int fed_init(char *directory, char *node);
+
+/*
+ * Determine whether this server is a node of a federation.
+ *
+ * @return nonzero if fed_init() has succeeded, otherwise 0.
+ */
+int fed_enabled(void);
+
+/*
+ * Claim a username for this node in the directory, when a client logs in.
+ * The claims of other clients are made while this one waits for its
+ * reply, and a coroutine lets the others of its thread run.
+ *
+ * @param name  The username.
+ * @return 0 if the username is now logged in on this node, -1 if it is
+ * logged in on another node or the directory cannot be reached.
+ */
+int fed_claim(char *name);
+
+/*
+ * Release a username claimed with fed_claim(), when a client logs out.
+ * This does not wait for the directory's reply.
+ *
+ * @param name  The username.
+ */
+void fed_release(char *name);
+
+/*
+ * Find a player logged in on another node.
+ *
+ * @param name  The username of the player.
+ * @return a reference to the proxy CLIENT of the player, which the caller
+ * must discard with client_unref(), or NULL if the player is not logged
+ * in on another node.
+ */
+CLIENT *fed_lookup(char *name);
+
+/*
+ * Send a packet addressed to a proxy CLIENT to the node of its player.
+ * The packet is queued on the link to the node, and this does not block.
+ *
+ * @param peer  The node of the proxy's player.
+ * @param proxy  The proxy CLIENT.
+ * @param name  The username of the proxy's player.
+ * @param hdr  The header of the packet.
+ * @param id  The invitation ID of the packet, in full.
+ * @param data  For INVITED, its payload; for MOVED, the move made, as
+ * accepted by game_parse_move(); otherwise NULL.
+ * @return 0 if the packet has been queued or has no counterpart on the
+ * other node, otherwise -1.
+ */
+int fed_send(FED_PEER *peer, CLIENT *proxy, char *name, JEUX_PACKET_HEADER *hdr, int id, char *data);
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include "game.h"
+#include "player.h"
+#include "sendq.h"
+
+/*
+ * Extensions to the GAME module.
+ *
+ * game.h must not be modified, so functions added to the GAME module are
+ * declared here.
+ */
+
+/*
+ * Maximum number of moves in a game: one per square of the board.
+ */
+#define GAME_MAX_MOVES 9
+
+/*
+ * Size of the string returned by game_unparse_state(), at most: 40 bytes
+ * for the board and the player to move, then the clocks of a timed game,
+ * and the terminating null byte.
+ */
+#define GAME_STATE_MAX 120
+
+/*
+ * Each move made in a GAME is recorded as a single byte, holding the
+ * GAME_ROLE of the player who made it in the high four bits and the
+ * square (0 to 8) in the low four bits.
+ */
+#define GAME_MOVE_BYTE(role, spot) ((unsigned char) ((role) << 4 | (spot)))
+#define GAME_MOVE_ROLE(byte) ((byte) >> 4)
+#define GAME_MOVE_SPOT(byte) ((byte) & 0xf)
+
+/*
+ * Record the PLAYER who plays a specified role in a GAME.  This must be
+ * done before the GAME is made visible to other threads.  A reference to
+ * the PLAYER is retained by the GAME until the GAME is freed.
+ *
+ * @param game  The GAME.
+ * @param role  The GAME_ROLE played by the PLAYER.
+ * @param player  The PLAYER, or NULL if it is unknown.
+ */
+void game_set_player(GAME *game, GAME_ROLE role, PLAYER *player);
+
+/*
+ * Get the moves made so far in a GAME, in the order in which they were
+ * made.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @param moves  Array of at least GAME_MAX_MOVES bytes, into which the
+ * moves are copied, encoded as described above.
+ * @return the number of moves copied.
+ */
+int game_get_moves(GAME *game, unsigned char *moves);
+
+/*
+ * Get the role of the player whose turn it is to move in a GAME.  Must be
+ * called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the GAME_ROLE of the player to move.
+ */
+GAME_ROLE game_get_next_mover(GAME *game);
+
+/*
+ * A GAME may be played on a chess clock: each player is given a base time
+ * for the whole game, which runs down while it is that player's turn, and
+ * an increment that is added after each of the player's moves.  A player
+ * whose time runs out loses the game (the "flag falls").  A move made
+ * after the flag has fallen is rejected.  The clocks are kept with the
+ * monotonic clock of timeout_now(), and the time left to each player is
+ * shown in the game state.  The flag fall itself is detected by a
+ * TIMEOUT set by the owner of the game for the time left to the player
+ * to move, which then calls game_flag_fall().
+ */
+
+/*
+ * Put a GAME on a clock.  This must be done before the GAME is made
+ * visible to other threads, and starts the clock of the first player.
+ *
+ * @param game  The GAME.
+ * @param base_ms  The time initially given to each player, in ms.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ */
+void game_set_clock(GAME *game, unsigned long base_ms, unsigned long increment_ms);
+
+/*
+ * Get the time left on the clock of a player.  Must be called from a task
+ * running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @param role  The GAME_ROLE of the player.
+ * @return the time left to the player, in ms, which is 0 if the player's
+ * flag has fallen, or -1 if the game is not played on a clock.
+ */
+long game_get_clock(GAME *game, GAME_ROLE role);
+
+/*
+ * Restore a GAME to the state of a game in progress that has been handed
+ * over by another server process, by replaying its moves and setting the
+ * time left on its clocks.  This must be done before the GAME is made
+ * visible to other threads.  The clock of the player to move restarts
+ * now.
+ *
+ * @param game  The GAME, to which no move has yet been made.
+ * @param moves  The moves, encoded as for game_get_moves().
+ * @param nmoves  The number of moves.
+ * @param first_ms  The time left to the first player, in ms, ignored if
+ * the GAME is not played on a clock.
+ * @param second_ms  The time left to the second player, in ms.
+ * @return 0 if the moves have been replayed, otherwise -1.
+ */
+int game_restore(GAME *game, unsigned char *moves, int nmoves, long first_ms, long second_ms);
+
+/*
+ * End a GAME if the player to move has run out of time, the opponent
+ * winning.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME.
+ * @return 0 if the flag of the player to move has fallen and the game has
+ * been ended, otherwise -1.
+ */
+int game_flag_fall(GAME *game);
+
+/*
+ * A WATCH is the subscription of a spectator to a GAME.  While the watch
+ * is active, a MOVED packet is queued to the spectator's SENDQ after every
+ * move, and an ENDED packet when the game ends, which also ends the watch.
+ * The payload of each MOVED packet is encoded once and shared by all the
+ * spectators.  A spectator whose queue is full is dropped from the game.
+ * A WATCH has a reference count, and holds a reference to its GAME.
+ */
+typedef struct watch WATCH;
+
+/*
+ * Start watching a GAME.  Must be called from a task running on the
+ * game's strand.
+ *
+ * @param game  The GAME to be watched.
+ * @param q  The SENDQ of the spectator.
+ * @param id  The ID assigned to the watch by the spectator, which is sent
+ * in the id field of the packets sent for it.
+ * @param statep  Variable into which to store the current state of the
+ * game, in malloc'ed storage, which the caller must free.
+ * @return a new active WATCH, with a reference for the caller, or NULL if
+ * the game is over.
+ */
+WATCH *game_watch(GAME *game, SENDQ *q, int id, char **statep);
+
+/*
+ * Stop watching a GAME, if the WATCH is still active.  Must be called
+ * from a task running on the game's strand.
+ *
+ * @param watch  The WATCH to be ended.
+ */
+void game_unwatch(WATCH *watch);
+
+/*
+ * Determine whether a WATCH is still active.
+ *
+ * @param watch  The WATCH to be queried.
+ * @return 1 if the WATCH is active, 0 if it has ended.
+ */
+int watch_is_active(WATCH *watch);
+
+/*
+ * Get the GAME that is the subject of a WATCH.
+ *
+ * @param watch  The WATCH to be queried.
+ * @return the GAME, which is valid for as long as the WATCH is.
+ */
+GAME *watch_get_game(WATCH *watch);
+
+/*
+ * Discard a reference to a WATCH, freeing it when none remain.
+ *
+ * @param watch  The WATCH.
+ */
+void watch_unref(WATCH *watch);
+
+/*
+ * Tic-tac-toe is solved when the server starts: a tablebase holds, for
+ * every position that can arise, the result under perfect play, the best
+ * move, and the number of moves left.  Each GAME keeps the index of its
+ * position in the tablebase, so the functions below are table lookups.
+ */
+
+/*
+ * Build the tablebase.  Only the first call has any effect; if it has not
+ * been called, then the tablebase is built when it is first needed.
+ */
+void game_tablebase_init(void);
+
+/*
+ * Get the best move, under perfect play, for the player to move in a
+ * GAME.  A player who can win plays for the quickest win, and one who
+ * cannot avoid losing for the slowest loss.  Must be called from a task
+ * running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return a GAME_MOVE, which the caller must free, or NULL if the game
+ * is over.
+ */
+GAME_MOVE *game_best_move(GAME *game);
+
+/*
+ * Get the result of a GAME if both players play perfectly from now on.
+ * Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the GAME_ROLE of the winner, or NULL_ROLE for a draw.  For a
+ * game that is over, this is its actual result.
+ */
+GAME_ROLE game_perfect_outcome(GAME *game);
+
+/*
+ * Get the number of moves left in a GAME if both players play perfectly
+ * from now on.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the number of moves, which is 0 if the game is over.
+ */
+int game_moves_to_end(GAME *game);
+
+#endif
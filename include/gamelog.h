@@ -0,0 +1,100 @@
+#ifndef GAMELOG_H
+#define GAMELOG_H
+
+#include <stdint.h>
+
+#include "game_ext.h"
+
+/*
+ * Game record log.
+ *
+ * When the game log is enabled, the record of every finished game (the
+ * players, the result and the sequence of moves) is appended to an
+ * append-only log in a directory.  Finishing a game only queues its record
+ * in memory; a background flusher, woken when the queue becomes
+ * non-empty, copies the queued records into the current segment of the
+ * log, which is a memory-mapped file, and commits them all to disk with a
+ * single msync().  Records queued while a commit is in progress are
+ * committed together by the next one.  The move path therefore never
+ * waits for the disk.
+ *
+ * The log consists of segment files named 00000000.jlog, 00000001.jlog,
+ * and so on, in the order in which they were written.  Each run of the
+ * server starts a new segment, and a segment that reaches
+ * GAMELOG_SEGMENT_SIZE is closed and a new one started.
+ */
+#define GAMELOG_SEGMENT_SIZE (16 << 20)
+
+/*
+ * Format of a segment: a header, followed by a sequence of records.
+ * Each record consists of a record header, followed by the moves (one
+ * byte each, as described in game_ext.h), the name of the first player
+ * and the name of the second player (without terminating null bytes),
+ * and zero padding to a multiple of 8 bytes.  The records end at the end
+ * of the file, or at a record header whose size is zero.  All fields are
+ * in host byte order.
+ */
+#define GAMELOG_MAGIC 0x474f4c4a  // "JLOG"
+#define GAMELOG_VERSION 1
+
+typedef struct gamelog_segment_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment;       // Number of the segment
+    uint32_t unused;
+} GAMELOG_SEGMENT_HEADER;
+
+/*
+ * How a game ended.
+ */
+typedef enum {
+    GAMELOG_FINISHED = 1,   // The last move won or filled the board
+    GAMELOG_RESIGNED,       // The loser resigned or logged out
+    GAMELOG_FLAGGED         // The loser ran out of time
+} GAMELOG_ENDING;
+
+typedef struct gamelog_record {
+    uint32_t size;          // Size of the record, including padding
+    uint8_t winner;         // GAME_ROLE of the winner, or NULL_ROLE for a draw
+    uint8_t ending;         // GAMELOG_ENDING
+    uint8_t nmoves;         // Number of moves
+    uint8_t unused;
+    uint64_t time;          // CLOCK_REALTIME at the end of the game, in ns
+    uint16_t name_len[2];   // Lengths of the names of the first and second players
+    uint32_t unused2;
+} GAMELOG_RECORD;
+
+/*
+ * Nonzero if the game log has been enabled.
+ */
+extern int gamelog_enabled;
+
+/*
+ * Enable the game log and start the background flusher.
+ *
+ * @param dir  Directory holding the log, which is created if necessary.
+ * @return 0 if successful, -1 if the directory or a new segment in it
+ * cannot be created.
+ */
+int gamelog_init(char *dir);
+
+/*
+ * Stop the game log, commit any queued records and close the current
+ * segment.
+ */
+void gamelog_fini(void);
+
+/*
+ * Queue the record of a finished game for appending to the log.
+ *
+ * @param first  Name of the first player, or NULL if unknown.
+ * @param second  Name of the second player, or NULL if unknown.
+ * @param winner  GAME_ROLE of the winner, or NULL_ROLE for a draw.
+ * @param ending  How the game ended, as a GAMELOG_ENDING.
+ * @param moves  The moves of the game, one byte each.
+ * @param nmoves  The number of moves.
+ */
+void gamelog_append(char *first, char *second, GAME_ROLE winner, int ending,
+                    unsigned char *moves, int nmoves);
+
+#endif
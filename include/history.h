@@ -0,0 +1,131 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+/*
+ * Rating history of a player.
+ *
+ * Each change of a player's rating is appended to the player's history,
+ * with the time of the change, the new rating, the opponent and the
+ * result of the game.  The history is stored by column: each of these
+ * fields is kept in an array of its own, so a scan of a range of times
+ * reads only the times until it has found the range, and a chart of the
+ * ratings reads only the times and the ratings.  The arrays are held in
+ * segments of HISTORY_SEGMENT_ENTRIES entries, each mapped with mmap() when
+ * the previous one is full, so that the history can grow without being
+ * copied, and appending an entry costs a few stores.
+ *
+ * Entries are appended by one thread at a time (player_post_result(),
+ * under the player's mutex), and are read without a lock: the number of
+ * entries is published only once the entry it includes has been stored.
+ *
+ * The history is kept in memory only: it is neither written to disk nor
+ * handed over to a new server process.
+ */
+#define HISTORY_SEGMENT_ENTRIES 1024
+
+/*
+ * Results of a game, for the player whose history it is in.
+ */
+#define HISTORY_LOST -1
+#define HISTORY_DRAWN 0
+#define HISTORY_WON 1
+
+/*
+ * The HISTORY type is a structure type that defines the rating history of
+ * a player.  The complete structure definition is in history.c.
+ */
+typedef struct history HISTORY;
+
+/*
+ * An entry of a history, as it is passed to a HISTORY_FUNC.
+ */
+typedef struct history_entry {
+    uint64_t time;          // CLOCK_REALTIME of the change, in ms
+    int rating;             // The rating after the change
+    PLAYER *opponent;       // The opponent in the game
+    int result;             // HISTORY_LOST, HISTORY_DRAWN or HISTORY_WON
+} HISTORY_ENTRY;
+
+/*
+ * Summary of the entries of a history in an interval of time, as computed
+ * by history_downsample().
+ */
+typedef struct history_bucket {
+    uint64_t start;         // Start of the interval, in ms
+    unsigned long count;    // Number of entries in the interval
+    int min;                // Lowest rating in the interval
+    int max;                // Highest rating in the interval
+    int last;               // Rating at the end of the interval
+} HISTORY_BUCKET;
+
+/*
+ * Type of a function called for each entry in a range of a history.  It
+ * returns 0 for the scan to go on, or -1 for it to stop.
+ */
+typedef int (*HISTORY_FUNC)(HISTORY_ENTRY *entry, void *arg);
+
+/*
+ * Create a new, empty history.
+ *
+ * @return the HISTORY.
+ */
+HISTORY *history_create(void);
+
+/*
+ * Free a history, and unmap its segments.
+ *
+ * @param history  The HISTORY, which must no longer be used.
+ */
+void history_free(HISTORY *history);
+
+/*
+ * Append an entry to a history.  Calls for the same history must not be
+ * made concurrently.  An entry whose time is earlier than that of the
+ * last entry, as when the clock has been set back, is given the time of
+ * the last entry, so that the times of the entries never decrease.
+ *
+ * @param history  The HISTORY.
+ * @param time  CLOCK_REALTIME of the change, in ms.
+ * @param rating  The rating after the change.
+ * @param opponent  The opponent in the game, which must outlive the
+ * history: players are kept by the player registry for as long as the
+ * server runs.
+ * @param result  HISTORY_LOST, HISTORY_DRAWN or HISTORY_WON.
+ */
+void history_append(HISTORY *history, uint64_t time, int rating, PLAYER *opponent, int result);
+
+/*
+ * Call a function for each entry of a history in a range of times, in the
+ * order in which they were appended, until the function asks for the scan
+ * to stop.
+ *
+ * @param history  The HISTORY.
+ * @param from  Start of the range, in ms.
+ * @param to  End of the range, in ms, which is not included.
+ * @param func  The function, which is passed the entry and arg.
+ * @param arg  Argument to be passed to the function.
+ * @return the number of entries for which the function returned 0.
+ */
+unsigned long history_scan(HISTORY *history, uint64_t from, uint64_t to, HISTORY_FUNC func, void *arg);
+
+/*
+ * Downsample the entries of a history in a range of times, by dividing
+ * the range into intervals of equal length and summarizing the entries in
+ * each.
+ *
+ * @param history  The HISTORY.
+ * @param from  Start of the range, in ms.
+ * @param to  End of the range, in ms, which is not included.
+ * @param buckets  Array into which to store a summary of each interval.
+ * Intervals with no entries are left out.
+ * @param nbuckets  The number of intervals into which to divide the range.
+ * @return the number of summaries stored.
+ */
+int history_downsample(HISTORY *history, uint64_t from, uint64_t to,
+		       HISTORY_BUCKET *buckets, int nbuckets);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include "invitation.h"
+
+/*
+ * Extensions to the INVITATION module.
+ *
+ * invitation.h must not be modified, so functions added to the INVITATION
+ * module are declared here.
+ */
+
+/*
+ * Type of a function to be run when the time limit of an INVITATION
+ * expires.
+ */
+typedef void (*INV_TIMEOUT_FUNC)(INVITATION *inv);
+
+/*
+ * Set a time limit on an INVITATION, replacing any limit already set.
+ * When the limit expires, the specified function is submitted to the
+ * scheduler, with a reference to the INVITATION that is discarded once
+ * the function has returned.  Closing the INVITATION cancels its limit.
+ * Since the function may have been submitted just before the limit was
+ * set again or cancelled, it should check inv_timeout_expired() before
+ * doing anything.
+ *
+ * @param inv  The INVITATION.
+ * @param ms  Number of milliseconds from now at which the limit expires,
+ * or 0 to cancel the limit.
+ * @param func  The function to be run when the limit expires.
+ * @return 0 if the limit was set, -1 if the INVITATION is closed.
+ */
+int inv_set_timeout(INVITATION *inv, unsigned long ms, INV_TIMEOUT_FUNC func);
+
+/*
+ * Determine whether the time limit of an INVITATION has been reached.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @return 1 if a limit is set and has been reached, otherwise 0.
+ */
+int inv_timeout_expired(INVITATION *inv);
+
+/*
+ * Set the time control of the game to be played if an INVITATION is
+ * accepted.  This must be done before the INVITATION is made visible to
+ * other threads.
+ *
+ * @param inv  The INVITATION.
+ * @param base_ms  The time given to each player for the whole game, in ms,
+ * or 0 if the game is not to be played on a clock.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ */
+void inv_set_time_control(INVITATION *inv, unsigned long base_ms, unsigned long increment_ms);
+
+/*
+ * Get the time control of the game to be played if an INVITATION is
+ * accepted.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @param incrementp  Variable into which to store the increment, in ms.
+ * @return the base time, in ms, or 0 if the game is not to be played on
+ * a clock.
+ */
+unsigned long inv_get_time_control(INVITATION *inv, unsigned long *incrementp);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include "player.h"
+#include "history.h"
+
+/*
+ * Extensions to the PLAYER module.
+ *
+ * player.h must not be modified, so functions added to the PLAYER module
+ * are declared here.
+ */
+
+/*
+ * The K-factor with which player_post_result() updates ratings, as
+ * described in rating.h.
+ */
+extern int player_k_factor;
+
+/*
+ * Set the rating of a player, as when restoring the state handed over by
+ * another server process.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating);
+
+/*
+ * Besides its rating, each PLAYER keeps the numbers of games it has won,
+ * lost and drawn, and a head-to-head record with each opponent it has
+ * played.  They are counted by player_post_result(), with atomic
+ * increments rather than locks.
+ */
+
+/*
+ * Type of a function called for each opponent of a PLAYER, with the
+ * numbers of games won, lost and drawn by the PLAYER against it.
+ */
+typedef void (*PLAYER_RECORD_FUNC)(PLAYER *player, PLAYER *opponent, unsigned long record[3], void *arg);
+
+/*
+ * Get the numbers of games a player has won, lost and drawn.
+ *
+ * @param player  The PLAYER to be queried.
+ * @param record  Array into which to store the numbers of games won, lost
+ * and drawn, in that order.
+ */
+void player_get_record(PLAYER *player, unsigned long record[3]);
+
+/*
+ * Add to the numbers of games a player has won, lost and drawn, and to
+ * their head-to-head record with an opponent, as when restoring the state
+ * handed over by another server process.
+ *
+ * @param player  The PLAYER.
+ * @param opponent  The opponent, or NULL to add to the player's own
+ * record only.
+ * @param record  The numbers of games won, lost and drawn by the player.
+ */
+void player_add_record(PLAYER *player, PLAYER *opponent, unsigned long record[3]);
+
+/*
+ * Call a function for each opponent a player has played, with their
+ * head-to-head record.  Opponents are visited in the reverse order of the
+ * first game the player played against each of them.
+ *
+ * @param player  The PLAYER.
+ * @param func  The function, which is passed the player, the opponent,
+ * the numbers of games won, lost and drawn by the player against the
+ * opponent, and arg.
+ * @param arg  Argument to be passed to the function.
+ */
+void player_foreach_opponent(PLAYER *player, PLAYER_RECORD_FUNC func, void *arg);
+
+/*
+ * Get the rating history of a player, to which player_post_result()
+ * appends each change of the player's rating.
+ *
+ * @param player  The PLAYER.
+ * @return the HISTORY of the player, which lasts as long as the player.
+ */
+HISTORY *player_get_history(PLAYER *player);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include "player_registry.h"
+
+/*
+ * Extensions to the PLAYER_REGISTRY module.
+ *
+ * player_registry.h must not be modified, so functions added to the
+ * PLAYER_REGISTRY module are declared here.
+ */
+
+/*
+ * Return a list of all registered players, whether logged in or not.
+ * The result is returned as a malloc'ed array of PLAYER pointers, with a
+ * NULL pointer marking the end of the array.  It is the caller's
+ * responsibility to decrement the reference count of each of the entries
+ * and to free the array when it is no longer needed.
+ *
+ * @param preg  The player registry.
+ * @return the list of players as a NULL-terminated array of pointers.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg);
+
+/*
+ * Find the player registered with a specified user name, without
+ * registering one if there is none.
+ *
+ * @param preg  The player registry.
+ * @param name  The user name.
+ * @return a reference to the PLAYER, which the caller must discard with
+ * player_unref(), or NULL if no player is registered with that name.
+ */
+PLAYER *preg_lookup(PLAYER_REGISTRY *preg, char *name);
+
+#endif
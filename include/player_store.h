@@ -0,0 +1,62 @@
+#ifndef PLAYER_STORE_H
+#define PLAYER_STORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Player store.
+ *
+ * The players registered with player_registry, with their ratings and
+ * records, are saved as text, one line for each player and one for each
+ * pair of players who have played each other:
+ *
+ *   P <rating> <won> <lost> <drawn> <len>:<name>
+ *                                           a registered player
+ *   H <won> <lost> <drawn> <len>:<name> <len>:<name>
+ *                                           the head-to-head record of
+ *                                           two players, from the first's
+ *                                           side
+ *
+ * where <len> is the length of the name that follows it.  This is how the
+ * players are handed over to a new server process, and it is the format
+ * of a file loaded with option -P, such as one written by tools/jrerate.c
+ * from the game log.
+ */
+
+/*
+ * Write the lines of all the registered players.
+ *
+ * @param out  The stream to which to write them.
+ */
+void pstore_write(FILE *out);
+
+/*
+ * Restore a player or a head-to-head record from a line of a player
+ * store.  A player that is not yet registered is registered, and the
+ * numbers of games in the line are added to those the player already has.
+ *
+ * @param line  The line, without its newline.
+ * @return 0 if successful, or -1 if the line is malformed.
+ */
+int pstore_restore(char *line);
+
+/*
+ * Load a player store from a file, as with pstore_restore() for each line.
+ *
+ * @param path  The path of the file.
+ * @return 0 if successful, or -1 if the file cannot be read or a line of
+ * it is malformed.
+ */
+int pstore_load(char *path);
+
+/*
+ * Parse a length-prefixed name ("<len>:<name>") at *sp into buf, which
+ * has room for size bytes, and advance *sp past it.
+ *
+ * @return 0 if successful, or -1 if there is no such name or it does not
+ * fit.
+ */
+int pstore_parse_name(char **sp, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+/*
+ * Extensions to the "Jeux" game server protocol.
+ *
+ * protocol.h must not be modified, so packet types added to the protocol
+ * are defined here.  They use the same fixed-size header and are numbered
+ * after the last packet type defined in protocol.h.
+ *
+ * Client-to-server requests:
+ *   (18) STATS:   Request server statistics
+ *             Response: ACK with a text report of packet counts, byte
+ *                       counts and receive-to-ACK latency percentiles
+ *                       for each packet type
+ *   (19) WATCH:   Watch the game in progress of the player whose username
+ *                 is given in the payload, as a spectator
+ *             Response: ACK with the current game state as payload, whose
+ *                       id field is the ID assigned to the watch, or NACK
+ *   (20) UNWATCH: Stop watching the game with the ID given in the id field
+ *             Response: ACK or NACK
+ *
+ * While a game is watched, the spectator is sent a MOVED packet, with the
+ * watch ID, the role of the player who moved and the new game state, after
+ * every move, and an ENDED packet, with the watch ID and the role of the
+ * winner, when the game ends.  The watch then ends by itself.  Spectator
+ * packets are sent without waiting for slow spectators; a spectator that
+ * falls too far behind stops receiving updates for the game.
+ *
+ *   (21) HELLO:   Negotiate the version of the protocol, before logging in
+ *             Header: role field holds the highest version the client
+ *                     speaks
+ *             Response: ACK whose role field holds the version to be used
+ *                       from the next packet on, in both directions, or
+ *                       NACK if the client is already logged in
+ *   (22) BATCH:   Carry out several requests with one packet
+ *             Payload: a sequence of sub-requests, each a JEUX_BATCH_ITEM
+ *                      followed by its payload, of the types INVITE,
+ *                      REVOKE, ACCEPT, DECLINE, MOVE and RESIGN only
+ *             Response: ACK whose payload is a sequence of results, each
+ *                       a JEUX_BATCH_ITEM of type ACK or NACK followed by
+ *                       its payload, holding the id and payload that the
+ *                       response to the sub-request on its own would have;
+ *                       or NACK, with nothing carried out, if a
+ *                       sub-request is malformed or of another type, or
+ *                       the results might not fit in the payload of the
+ *                       ACK
+ *
+ * The sub-requests of a BATCH are carried out in order, as if each had
+ * been sent on its own, and the notifications they cause are sent as
+ * usual.  Every sub-request has a result.  The results have to fit in the
+ * payload of a single ACK, so a BATCH is refused if they might not: each
+ * result takes 8 bytes, and that of an ACCEPT up to 120 more for the
+ * state of the game, so a BATCH of up to 511 ACCEPTs, or 8191 other
+ * sub-requests, is always carried out.
+ *
+ *   (23) HINT:    Get the best move in the game with the ID given in the
+ *                 id field, for the player to move, which may be either
+ *             Response: ACK whose role field holds the result of the game
+ *                       under perfect play (as in ENDED), and whose
+ *                       payload is the move, in the format of MOVE,
+ *                       a space and the number of moves left under perfect
+ *                       play; or NACK if there is no game in progress
+ *                       with that ID
+ *   (24) RECORD:  Get the record of the player whose username is given in
+ *                 the payload, or of the client itself if it is empty
+ *             Response: ACK with a text report, whose first line holds
+ *                       the username, rating and numbers of games won,
+ *                       lost and drawn, and each further line an opponent
+ *                       and the numbers of games won, lost and drawn
+ *                       against it, tab-separated; or NACK if no player
+ *                       has that username
+ *   (25) HISTORY: Get the rating history of a player
+ *             Payload: the username, or nothing for the client itself,
+ *                      optionally followed by tab-separated fields: the
+ *                      start and end of a range of times, in ms since the
+ *                      epoch (the end not included), and then, optionally,
+ *                      a number of intervals (at most 4096) into which to
+ *                      divide the range
+ *             Response: ACK with a text report of the changes of the
+ *                       player's rating in the range (by default, all of
+ *                       them), one per line: the time, the new rating,
+ *                       the opponent and the result (W, L or D); or, if a
+ *                       number of intervals is given, one line for each
+ *                       interval with changes: the start of the interval,
+ *                       the number of changes, the lowest, highest and
+ *                       last rating; fields are tab-separated, and the
+ *                       report ends with the last line that fits in the
+ *                       packet; or NACK if no player has that username or
+ *                       a field is malformed
+ *
+ * Version 1 is the protocol of protocol.h, used until a HELLO is
+ * answered.  Version 2 replaces the fixed-size header with the larger
+ * JEUX_PACKET_HEADER_V2 below, whose 32-bit id field carries invitation
+ * and watch IDs in full, where the id field of version 1 has room for only
+ * their low 8 bits.  Each request also carries a request ID chosen by the
+ * client, which the server echoes in its ACK or NACK, with the
+ * JEUX_FLAG_RESPONSE flag set, so that a client can send many requests
+ * without waiting for each response, and still tell which response is
+ * which.  Responses are still sent in the order of the requests.
+ */
+
+typedef enum {
+    JEUX_STATS_PKT = JEUX_ENDED_PKT + 1,
+    JEUX_WATCH_PKT,
+    JEUX_UNWATCH_PKT,
+    JEUX_HELLO_PKT,
+    JEUX_BATCH_PKT,
+    JEUX_HINT_PKT,
+    JEUX_RECORD_PKT,
+    JEUX_HISTORY_PKT,
+    JEUX_EXT_PKT_LIMIT      // One more than the largest packet type
+} JEUX_EXT_PACKET_TYPE;
+
+/*
+ * Initializer for an array of JEUX_EXT_PKT_LIMIT strings, indexed by
+ * packet type, that holds the name of each type.
+ */
+#define JEUX_PACKET_NAMES { \
+    [JEUX_NO_PKT] = "NONE", \
+    [JEUX_LOGIN_PKT] = "LOGIN", \
+    [JEUX_USERS_PKT] = "USERS", \
+    [JEUX_INVITE_PKT] = "INVITE", \
+    [JEUX_REVOKE_PKT] = "REVOKE", \
+    [JEUX_ACCEPT_PKT] = "ACCEPT", \
+    [JEUX_DECLINE_PKT] = "DECLINE", \
+    [JEUX_MOVE_PKT] = "MOVE", \
+    [JEUX_RESIGN_PKT] = "RESIGN", \
+    [JEUX_ACK_PKT] = "ACK", \
+    [JEUX_NACK_PKT] = "NACK", \
+    [JEUX_INVITED_PKT] = "INVITED", \
+    [JEUX_REVOKED_PKT] = "REVOKED", \
+    [JEUX_ACCEPTED_PKT] = "ACCEPTED", \
+    [JEUX_DECLINED_PKT] = "DECLINED", \
+    [JEUX_MOVED_PKT] = "MOVED", \
+    [JEUX_RESIGNED_PKT] = "RESIGNED", \
+    [JEUX_ENDED_PKT] = "ENDED", \
+    [JEUX_STATS_PKT] = "STATS", \
+    [JEUX_WATCH_PKT] = "WATCH", \
+    [JEUX_UNWATCH_PKT] = "UNWATCH", \
+    [JEUX_HELLO_PKT] = "HELLO", \
+    [JEUX_BATCH_PKT] = "BATCH", \
+    [JEUX_HINT_PKT] = "HINT", \
+    [JEUX_RECORD_PKT] = "RECORD", \
+    [JEUX_HISTORY_PKT] = "HISTORY" \
+}
+
+#define JEUX_VERSION_MAX 2          // Highest version of the protocol spoken
+
+/*
+ * Flags of a version 2 header.
+ */
+#define JEUX_FLAG_RESPONSE 0x01     // An ACK or NACK, for the request ID given
+
+/*
+ * Fixed-size packet header of version 2 of the protocol.  As in version 1,
+ * all multibyte fields are in network byte order.
+ */
+typedef struct jeux_packet_header_v2 {
+    uint8_t type;                  // Type of the packet
+    uint8_t flags;                 // JEUX_FLAG_* bits
+    uint8_t role;                  // Role of player in game
+    uint8_t reserved;              // Zero
+    uint16_t size;                 // Payload size (zero if no payload)
+    uint16_t reserved2;            // Zero
+    uint32_t id;                   // Invitation or watch ID
+    uint32_t request;              // Request ID, echoed in the response
+    uint32_t timestamp_sec;        // Seconds field of time packet was sent
+    uint32_t timestamp_nsec;       // Nanoseconds field of time packet was sent
+} JEUX_PACKET_HEADER_V2;
+
+/*
+ * Header of a sub-request of a BATCH, or of its result, which is followed
+ * by the given number of bytes of payload.  As in packet headers, all
+ * multibyte fields are in network byte order.
+ */
+typedef struct jeux_batch_item {
+    uint8_t type;                  // Type of the sub-request, or ACK or NACK
+    uint8_t role;                  // Role of player in game
+    uint16_t size;                 // Payload size (zero if no payload)
+    uint32_t id;                   // Invitation ID
+} JEUX_BATCH_ITEM;
+
+/*
+ * Fields of a version 2 header that the version 1 header has no room for.
+ * Within the server, a packet is described by its version 1 header
+ * together with these, in host byte order, and is laid out for the
+ * version of its connection only when it is sent.
+ */
+typedef struct jeux_packet_ext {
+    uint32_t id;                   // Invitation or watch ID, in full
+    uint32_t request;              // Request ID
+    uint8_t flags;                 // JEUX_FLAG_* bits
+} JEUX_PACKET_EXT;
+
+/*
+ * A packet header as sent on a connection of either version.
+ */
+typedef union jeux_wire_header {
+    JEUX_PACKET_HEADER v1;
+    JEUX_PACKET_HEADER_V2 v2;
+} JEUX_WIRE_HEADER;
+
+/*
+ * Get the size of the fixed-size header of a version of the protocol.
+ *
+ * @param version  The version.
+ * @return the size of its header.
+ */
+size_t proto_header_size(int version);
+
+/*
+ * Lay out a packet header as it is sent on a connection.
+ *
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  The version 1 header, with multi-byte fields in network byte
+ * order.
+ * @param ext  The fields that version 1 has no room for, or NULL if there
+ * are none, in which case the id field of hdr is used in full.
+ * @param wire  Storage for the header to be sent.
+ * @return the size of the header to be sent.
+ */
+size_t proto_frame_header(int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+                          JEUX_WIRE_HEADER *wire);
+
+/*
+ * Split a header received on a connection into its version 1 header and
+ * the fields that version 1 has no room for.
+ *
+ * @param version  The version of the protocol used on the connection.
+ * @param wire  The header received, proto_header_size(version) bytes.
+ * @param hdr  Storage for the version 1 header, whose id field holds the
+ * low 8 bits of the ID.
+ * @param ext  Storage for the other fields, or NULL if they are not wanted.
+ */
+void proto_unframe_header(int version, void *wire, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext);
+
+/*
+ * Send a packet, as proto_send_packet() does, on a connection using a
+ * given version of the protocol.
+ *
+ * @param fd  The file descriptor on which packet is to be sent.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  The version 1 header, with multi-byte fields in network byte
+ * order.
+ * @param ext  The fields that version 1 has no room for, or NULL.
+ * @param data  The data payload, or NULL, if there is none.
+ * @return  0 in case of successful transmission, -1 otherwise.
+ */
+int proto_send_packet_ext(int fd, int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+                          void *data);
+
+/*
+ * Receive a packet, as proto_recv_packet() does, from a connection using
+ * a given version of the protocol.
+ *
+ * @param fd  The file descriptor from which the packet is to be received.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  Storage for the version 1 header of the packet.
+ * @param ext  Storage for the fields that version 1 has no room for, or
+ * NULL if they are not wanted.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ * any payload received, which the caller must free.
+ * @return  0 in case of successful reception, -1 otherwise.
+ */
+int proto_recv_packet_ext(int fd, int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+                          void **payloadp);
+
+/*
+ * Write the whole of an I/O vector to a file descriptor, continuing after
+ * short writes and interrupted calls.  The I/O vector is modified.  On a
+ * socket whose peer has gone away, this fails with EPIPE rather than
+ * raising SIGPIPE.
+ *
+ * @param fd  The file descriptor to be written.
+ * @param iov  The I/O vector.
+ * @param iovcnt  The number of elements of the I/O vector.
+ * @return 0 if everything was written, -1 otherwise, with errno set to
+ *   indicate the error.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt);
+
+/*
+ * Account for a packet that has been completely written to a connection:
+ * debugging printout, trace event, capture record and statistics.
+ *
+ * @param fd  The file descriptor on which the packet was sent.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ */
+void proto_packet_sent(int fd, JEUX_PACKET_HEADER *hdr, void *data);
+
+/*
+ * Account for a packet that has been completely received from a
+ * connection: debugging printout, trace event, capture record and
+ * statistics.
+ *
+ * @param fd  The file descriptor from which the packet was received.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ */
+void proto_packet_received(int fd, JEUX_PACKET_HEADER *hdr, void *data);
+
+#endif
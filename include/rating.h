@@ -0,0 +1,47 @@
+#ifndef RATING_H
+#define RATING_H
+
+#include <math.h>
+
+/*
+ * The rating model.
+ *
+ * Ratings are updated by a system of a type devised by Arpad Elo.  The
+ * update is defined here, rather than in the PLAYER module, so that the
+ * ratings recomputed from the game log by tools/jrerate.c are exactly
+ * those the server computes, for the same K-factor.
+ */
+#define RATING_K_FACTOR 32
+#define RATING_K_FACTOR_MAX 1000   // Largest K-factor that may be configured
+
+/*
+ * Update the ratings of two players for the result of a game between them.
+ *
+ * Let R1 and R2 be the current ratings of player1 and player2, and S1 and
+ * S2 their scores: 1 for a win, 0.5 for a draw and 0 for a loss.  The
+ * expected scores are:
+ *
+ *     E1 = 1/(1 + 10**((R2-R1)/400))
+ *     E2 = 1/(1 + 10**((R1-R2)/400))
+ *
+ * where the division by 400 is that of integers, and the ratings become:
+ *
+ *     R1' = R1 + (int)(K*(S1-E1))
+ *     R2' = R2 + (int)(K*(S2-E2))
+ *
+ * @param R1p  Variable holding the rating of player1, which is updated.
+ * @param R2p  Variable holding the rating of player2, which is updated.
+ * @param result  0 if draw, 1 if player1 won, 2 if player2 won.
+ * @param k  The K-factor, the largest change of a rating in one game.
+ */
+static inline void rating_update(int *R1p, int *R2p, int result, int k){
+	double S1 = result == 0 ? 0.5 : result == 1 ? 1 : 0;
+	double S2 = 1 - S1;
+	int R1 = *R1p, R2 = *R2p;
+	double E1 = 1/(1 + pow(10, (R2-R1)/400));
+	double E2 = 1/(1 + pow(10, (R1-R2)/400));
+	*R1p = R1 + (int)(k*(S1-E1));
+	*R2p = R2 + (int)(k*(S2-E2));
+}
+
+#endif
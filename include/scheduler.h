@@ -0,0 +1,96 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/*
+ * The scheduler is a pool of worker threads that execute short tasks
+ * submitted by the rest of the server.  Each worker owns a double-ended
+ * queue of tasks.  A worker pushes tasks that it submits itself onto the
+ * bottom of its own deque and pops them from there (most recent first,
+ * while their data is still in cache).  A worker that runs out of work
+ * steals from the top of the deque of some other worker (oldest first).
+ * Tasks submitted from threads that are not workers are spread over the
+ * deques of the workers in round-robin fashion.  In this way a burst of
+ * work generated on one thread is quickly spread across all the workers.
+ *
+ * Tasks must not block for long periods, since a blocked task occupies
+ * its worker.
+ */
+
+/*
+ * Type of a function that may be submitted to the scheduler.
+ */
+typedef void (*SCHED_TASK)(void *arg);
+
+/*
+ * Per-worker statistics maintained by the scheduler.
+ */
+typedef struct sched_stats {
+    int cpu;                      // CPU to which the worker is pinned, or -1
+    unsigned long submitted;      // Tasks pushed onto this worker's deque
+    unsigned long executed;       // Tasks run by this worker
+    unsigned long stolen;         // Tasks this worker took from another deque
+    unsigned long steal_attempts; // Deques examined while looking for work
+} SCHED_STATS;
+
+/*
+ * Start the scheduler.  Only the first call has any effect; if some other
+ * function of the scheduler is used before the scheduler has been started,
+ * then it is started with default settings.
+ *
+ * @param nworkers  Number of worker threads, or 0 for one per online CPU.
+ * @param pin  If nonzero, worker i is pinned to CPU (i mod #CPUs).
+ * @return 0 if the scheduler is running, otherwise -1.
+ */
+int sched_init(int nworkers, int pin);
+
+/*
+ * Submit a task for execution.  If called from a worker, the task is
+ * pushed on the calling worker's own deque, otherwise it is placed on
+ * the deque of some worker chosen in round-robin order.
+ *
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was submitted, otherwise -1.
+ */
+int sched_submit(SCHED_TASK task, void *arg);
+
+/*
+ * Submit a task that should run after the work that is already queued
+ * locally.  If called from a worker, the task is placed on the stealing
+ * end of the worker's own deque, so that it runs after the worker's
+ * other tasks unless some idle worker steals it first.  This is used to
+ * yield the worker to other work.
+ *
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was submitted, otherwise -1.
+ */
+int sched_defer(SCHED_TASK task, void *arg);
+
+/*
+ * Get the number of worker threads.
+ *
+ * @return the number of workers.
+ */
+int sched_nworkers(void);
+
+/*
+ * Get the index of the worker on which the caller is running.
+ *
+ * @return the index of the calling worker, or -1 if the caller is not
+ * a worker thread.
+ */
+int sched_current_worker(void);
+
+/*
+ * Obtain a snapshot of the statistics of one worker.  The counters are
+ * updated without locking, so a snapshot taken while the scheduler is
+ * busy is only approximately consistent.
+ *
+ * @param worker  Index of the worker.
+ * @param stats  Storage into which the statistics are to be copied.
+ * @return 0 if successful, -1 if there is no such worker.
+ */
+int sched_get_stats(int worker, SCHED_STATS *stats);
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef SENDQ_H
+#define SENDQ_H
+
+#include <stddef.h>
+
+#include "protocol_ext.h"
+
+/*
+ * Per-connection output.
+ *
+ * Each connection has a SENDQ, which serializes the packets written to it
+ * and holds a bounded queue of packets waiting to be sent without
+ * blocking the sender.  Packets sent with sendq_send() are written
+ * immediately, after those already queued, blocking until they have been
+ * written, as before.  Packets
+ * added with sendq_push() are queued, and written by a background writer
+ * thread using non-blocking writes, so that a connection whose peer is not
+ * reading can never hold up the thread that queued them.  If such a peer
+ * falls SENDQ_LEN packets behind, further packets are refused.
+ *
+ * Queued packets carry their payload as a SHARED_PAYLOAD, so that a
+ * payload sent to many connections is encoded once and shared by
+ * reference.
+ *
+ * With the io_uring backend, the packets sent while a request is handled
+ * can be collected in a SENDQ_BATCH instead of being written one by one,
+ * and then written together, as a chain of linked sends, with a single
+ * system call.  While a batch is current on a thread, sendq_send() adds
+ * the packet to the batch and returns at once; a thread that runs part
+ * of the request on behalf of another, such as a strand task, joins the
+ * batch of the other thread for the time being.
+ *
+ * Each packet is laid out for the version of the protocol that its
+ * connection is using at the time it is sent or queued.
+ */
+#define SENDQ_LEN 64
+#define SENDQ_BATCH_LEN 8
+
+/*
+ * An immutable, reference-counted packet payload.
+ */
+typedef struct shared_payload {
+    int refcnt;
+    size_t size;
+    char data[];
+} SHARED_PAYLOAD;
+
+/*
+ * The SENDQ type is a structure type that defines the output state of a
+ * connection.  The complete structure definition is in sendq.c.
+ */
+typedef struct sendq SENDQ;
+
+/*
+ * Packets collected to be written together.
+ */
+typedef struct sendq_batch {
+    int count;
+    struct {
+        SENDQ *q;
+        JEUX_PACKET_HEADER hdr;
+        JEUX_WIRE_HEADER wire;      // hdr as laid out for the connection
+        size_t wire_len;
+        SHARED_PAYLOAD *payload;
+    } items[SENDQ_BATCH_LEN];
+} SENDQ_BATCH;
+
+/*
+ * Create a SHARED_PAYLOAD holding a copy of the specified data.  The
+ * returned payload has a reference count of one.
+ *
+ * @param data  The data.
+ * @param size  The number of bytes of data.
+ * @return the newly created SHARED_PAYLOAD.
+ */
+SHARED_PAYLOAD *payload_create(void *data, size_t size);
+
+/*
+ * Increase the reference count on a SHARED_PAYLOAD by one.
+ *
+ * @param payload  The SHARED_PAYLOAD.
+ * @return  The same SHARED_PAYLOAD that was passed as a parameter.
+ */
+SHARED_PAYLOAD *payload_ref(SHARED_PAYLOAD *payload);
+
+/*
+ * Decrease the reference count on a SHARED_PAYLOAD by one, freeing it
+ * when the count reaches zero.
+ *
+ * @param payload  The SHARED_PAYLOAD.
+ */
+void payload_unref(SHARED_PAYLOAD *payload);
+
+/*
+ * Create a SENDQ for a connection.  The returned SENDQ has a reference
+ * count of one.
+ *
+ * @param fd  File descriptor of the connection.
+ * @return the newly created SENDQ.
+ */
+SENDQ *sendq_create(int fd);
+
+/*
+ * Increase the reference count on a SENDQ by one.
+ *
+ * @param q  The SENDQ.
+ * @return  The same SENDQ that was passed as a parameter.
+ */
+SENDQ *sendq_ref(SENDQ *q);
+
+/*
+ * Decrease the reference count on a SENDQ by one, freeing it when the
+ * count reaches zero.
+ *
+ * @param q  The SENDQ.
+ */
+void sendq_unref(SENDQ *q);
+
+/*
+ * Close a SENDQ, discarding any queued packets.  Once this function has
+ * returned, nothing more is written to the connection, and its file
+ * descriptor may be closed.
+ *
+ * @param q  The SENDQ to be closed.
+ */
+void sendq_close(SENDQ *q);
+
+/*
+ * Send a packet on a connection, blocking until it has been written.
+ * The packets queued before it are written first.  If the
+ * SENDQ has been closed, or the peer is found to have gone away, the SENDQ
+ * is closed and the packet silently discarded, just as it would have been
+ * had the peer gone away after the packet was written.  If a batch is
+ * current on the calling thread, the packet is added to it instead.
+ * When coroutines are in use, the packet is queued instead, to be written
+ * by the writer thread after the packets queued before it, so that no
+ * coroutine thread blocks on a connection; a peer that has fallen
+ * SENDQ_LEN packets behind has its connection shut down.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param data  The payload, or NULL if there is none.
+ * @return 0 if the packet was sent, discarded, batched or queued, -1 if
+ * writing failed.
+ */
+int sendq_send(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, void *data);
+
+/*
+ * Wait until the packets queued on a connection have been written, or
+ * dropped because writing failed.  A coroutine lets the others of its
+ * thread run while it waits.
+ *
+ * @param q  The SENDQ of the connection.
+ */
+void sendq_drain(SENDQ *q);
+
+/*
+ * Queue a packet to be sent on a connection by the writer thread.  This
+ * function never blocks on the connection.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte
+ * order.  The size field is taken from the payload.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param payload  The payload, or NULL if there is none.  A reference is
+ * taken on the payload if the packet is queued.
+ * @return 0 if the packet was queued, -1 if the queue is full or closed.
+ */
+int sendq_push(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, SHARED_PAYLOAD *payload);
+
+/*
+ * Queue a packet to be sent on a connection, as sendq_push() does, for a
+ * sender that must not wait for the connection.  If the queue is full, as
+ * many queued packets as the connection will take are written without
+ * blocking, unless another thread is writing to it.  A peer that has
+ * fallen SENDQ_LEN packets behind even so is taken to have stopped
+ * reading, and its connection is shut down.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte
+ * order.  The size field is taken from the payload.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param payload  The payload, or NULL if there is none.  A reference is
+ * taken on the payload if the packet is queued.
+ * @return 0 if the packet was queued, -1 if it was discarded.
+ */
+int sendq_post(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, SHARED_PAYLOAD *payload);
+
+/*
+ * Queue bytes to be written on a connection ahead of the packets sent or
+ * queued after them.  The bytes are those returned by sendq_hold() in
+ * another process, and may begin in the middle of a packet: they are
+ * written in full before any packet sent with sendq_send().
+ *
+ * @param q  The SENDQ of the connection.
+ * @param data  The bytes.
+ * @param size  The number of bytes.
+ * @return 0 if the bytes were queued, -1 if the queue is full or closed.
+ */
+int sendq_push_bytes(SENDQ *q, void *data, size_t size);
+
+/*
+ * Stop all writing to a connection, so that it can be handed over to
+ * another process.  The queued packets are written first, for as long as
+ * the connection takes them within the time allowed, and the bytes of
+ * those that remain are returned, for the other process to write ahead of
+ * its own packets.  Nothing more is written to the connection until
+ * sendq_release() is called.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param timeout_ms  The time allowed for writing queued packets, in ms.
+ * @param sizep  Variable into which to store the number of bytes returned.
+ * @return the bytes not written, in malloc'ed storage, or NULL if there
+ * are none.
+ */
+char *sendq_hold(SENDQ *q, int timeout_ms, size_t *sizep);
+
+/*
+ * Let writing to a connection resume after sendq_hold(), as when the
+ * connection has not been handed over after all.  The packets it left
+ * queued are written as usual.
+ *
+ * @param q  The SENDQ of the connection.
+ */
+void sendq_release(SENDQ *q);
+
+/*
+ * Set the version of the protocol used on a connection, for the packets
+ * sent or queued from now on.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param version  The version.
+ */
+void sendq_set_version(SENDQ *q, int version);
+
+/*
+ * Get the version of the protocol used on a connection.
+ *
+ * @param q  The SENDQ of the connection.
+ * @return the version, 1 unless set with sendq_set_version().
+ */
+int sendq_get_version(SENDQ *q);
+
+/*
+ * Make a batch current on the calling thread, so that the packets it
+ * sends are collected in it, if the io_uring backend is in use.
+ * Otherwise, packets are written as usual.
+ *
+ * @param batch  The batch, which need not be initialized.
+ */
+void sendq_batch_begin(SENDQ_BATCH *batch);
+
+/*
+ * Get the batch current on the calling thread.
+ *
+ * @return the current batch, or NULL if there is none.
+ */
+SENDQ_BATCH *sendq_batch_current(void);
+
+/*
+ * Make a batch begun by another thread current on the calling thread,
+ * or make no batch current.
+ *
+ * @param batch  The batch, or NULL.
+ * @return the batch that was current on the calling thread, or NULL.
+ */
+SENDQ_BATCH *sendq_batch_join(SENDQ_BATCH *batch);
+
+/*
+ * Make no batch current on the calling thread, and write the packets
+ * collected in a batch, in the order in which they were sent.
+ *
+ * @param batch  The batch, which must have been begun with
+ * sendq_batch_begin().
+ */
+void sendq_batch_end(SENDQ_BATCH *batch);
+
+#endif
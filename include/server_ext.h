@@ -0,0 +1,32 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "server.h"
+
+/*
+ * Extensions to the server module.
+ *
+ * server.h must not be modified, so functions added to the server module
+ * are declared here.
+ */
+
+/*
+ * Thread function for the thread that handles a client whose connection
+ * has been handed over by another server process, and which has already
+ * been registered, and logged in if it was logged in before.
+ *
+ * @param  The CLIENT, whose registration is taken over by the thread.
+ * @return  NULL
+ */
+void *jeux_adopted_client_service(void *arg);
+
+/*
+ * Coroutine function for the coroutine that handles a particular client,
+ * as jeux_client_service() does for a thread.
+ *
+ * @param  Pointer to a variable that holds the file descriptor for
+ * the client connection, which is freed.
+ */
+void jeux_client_coroutine(void *arg);
+
+#endif
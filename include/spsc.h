@@ -0,0 +1,72 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+/*
+ * Single-producer, single-consumer message queue.
+ *
+ * An SPSC_QUEUE is a bounded ring of messages, each a function to be run
+ * with its argument, that exactly one thread adds to and exactly one
+ * other thread takes from.  Neither side takes a lock: the producer only
+ * writes the tail index and the consumer only writes the head index, each
+ * on a cache line of its own, and each side keeps a private copy of the
+ * other's index so that it reads the shared one only when the ring looks
+ * full or empty.
+ */
+
+/*
+ * The SPSC_QUEUE type is a structure type that defines the state of a
+ * queue.  The complete structure definition is in spsc.c.
+ */
+typedef struct spsc_queue SPSC_QUEUE;
+
+/*
+ * Type of a function carried by a message.
+ */
+typedef void (*SPSC_FUNC)(void *arg);
+
+/*
+ * Create a new, empty SPSC_QUEUE.
+ *
+ * @param capacity  Maximum number of messages, rounded up to a power of two.
+ * @return the newly created SPSC_QUEUE.
+ */
+SPSC_QUEUE *spsc_create(unsigned int capacity);
+
+/*
+ * Free an SPSC_QUEUE, discarding any messages left in it.
+ *
+ * @param q  The SPSC_QUEUE to be freed.
+ */
+void spsc_free(SPSC_QUEUE *q);
+
+/*
+ * Add a message to a queue.  Only the producer of the queue may call this.
+ *
+ * @param q  The queue.
+ * @param func  The function to be run by the consumer.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the message was added, -1 if the queue is full.
+ */
+int spsc_push(SPSC_QUEUE *q, SPSC_FUNC func, void *arg);
+
+/*
+ * Take the oldest message from a queue.  Only the consumer of the queue
+ * may call this.
+ *
+ * @param q  The queue.
+ * @param funcp  Pointer to a variable into which to store the function.
+ * @param argp  Pointer to a variable into which to store its argument.
+ * @return 0 if a message was taken, -1 if the queue is empty.
+ */
+int spsc_pop(SPSC_QUEUE *q, SPSC_FUNC *funcp, void **argp);
+
+/*
+ * Determine whether a queue is empty.  Only the consumer of the queue may
+ * rely on the answer: to anyone else it may already be out of date.
+ *
+ * @param q  The queue.
+ * @return nonzero if the queue holds no message, otherwise 0.
+ */
+int spsc_empty(SPSC_QUEUE *q);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Server statistics: for each packet type, the number of packets and
+ * bytes received and sent, and a histogram of the latency from the
+ * receipt of a request to the sending of the response.
+ *
+ * Each thread records into its own block of counters, with plain
+ * (unlocked) stores, so that recording costs a few instructions on the
+ * hot path.  The blocks of all threads are summed only when a report
+ * is requested, either through a STATS request or by sending SIGUSR1
+ * to the server, which dumps the report to stderr.
+ *
+ * Latency histograms are log-linear in the manner of HDR histograms:
+ * each power of two is divided into 2^STATS_SUB_BITS equal buckets, so
+ * reported percentiles are within about 12% of the true value over the
+ * whole range from 1ns to about 18 minutes.
+ */
+
+#define STATS_NTYPES 32
+#define STATS_SUB_BITS 3
+#define STATS_NBUCKETS ((40 + 1) << STATS_SUB_BITS)
+
+/*
+ * Get the current time from the monotonic clock, in nanoseconds.
+ */
+uint64_t stats_now(void);
+
+/*
+ * Record the receipt of a packet.
+ *
+ * @param type  The type of the packet.
+ * @param bytes  The total size of the packet, including the header.
+ */
+void stats_record_recv(int type, size_t bytes);
+
+/*
+ * Record the sending of a packet.
+ *
+ * @param type  The type of the packet.
+ * @param bytes  The total size of the packet, including the header.
+ */
+void stats_record_send(int type, size_t bytes);
+
+/*
+ * Record the time taken to process a request.
+ *
+ * @param type  The type of the request packet.
+ * @param ns  The time from receipt of the request to the sending of
+ * the response, in nanoseconds.
+ */
+void stats_record_latency(int type, uint64_t ns);
+
+/*
+ * Produce a report of the statistics accumulated by all threads.
+ * The report is a text string, with one line per packet type that
+ * has been seen, in malloc'ed storage that the caller must free.
+ *
+ * @return the report.
+ */
+char *stats_report(void);
+
+/*
+ * Write a report of the statistics accumulated by all threads.
+ *
+ * @param f  The stream to which the report is to be written.
+ */
+void stats_dump(FILE *f);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef STRAND_H
+#define STRAND_H
+
+#include "game.h"
+
+/*
+ * A STRAND is a serialized task queue.  Tasks posted to a strand are
+ * executed one at a time, in the order in which they were posted, by the
+ * workers of the scheduler, which are shared by all strands.  Tasks posted
+ * to different strands may execute concurrently on different workers.
+ * Because no two tasks of the same strand ever run at the same time,
+ * state that is only touched from within a strand's tasks needs no lock.
+ *
+ * When the coroutine threads are shards, each strand is instead homed on
+ * a shard, normally that of the client whose request created it, and its
+ * tasks are run by that shard's thread: in-line for a request from one of
+ * the shard's own connections, and otherwise as messages posted to the
+ * shard.
+ *
+ * Each GAME owns a strand, and all processing that reads or modifies the
+ * state of the game (moves, resignations, and the sending of the MOVED
+ * and ENDED notifications that result from them) runs on that strand.
+ */
+
+/*
+ * The STRAND type is a structure type that defines the state of a strand.
+ * The complete structure definition is in strand.c.
+ */
+typedef struct strand STRAND;
+
+/*
+ * Type of a function that may be posted to a STRAND.
+ */
+typedef void (*STRAND_TASK)(void *arg);
+
+/*
+ * Create a new, empty STRAND.  When the coroutine threads are shards, the
+ * STRAND is homed on the shard of the calling thread, or if that is not
+ * one, on each shard in turn, and its tasks all run there.
+ *
+ * @return the newly created STRAND, or NULL if creation fails.
+ */
+STRAND *strand_create(void);
+
+/*
+ * Free a STRAND.  No further tasks may be posted to the STRAND, and it
+ * must not be referenced again.  If a worker is still finishing the last
+ * task of the STRAND, then the worker frees it once that task is done.
+ *
+ * @param strand  The STRAND to be freed.
+ */
+void strand_fini(STRAND *strand);
+
+/*
+ * Post a task to a STRAND.  The task will be run asynchronously, after
+ * all the tasks previously posted to the same STRAND have completed.
+ *
+ * @param strand  The STRAND to which the task is to be posted.
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was successfully posted, otherwise -1.
+ */
+int strand_post(STRAND *strand, STRAND_TASK task, void *arg);
+
+/*
+ * Run a task on a STRAND and wait for it to complete.  If the calling
+ * thread is already executing a task of the same STRAND, then the task
+ * is simply run in-line.
+ *
+ * @param strand  The STRAND on which the task is to be run.
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was run, otherwise -1.
+ */
+int strand_call(STRAND *strand, STRAND_TASK task, void *arg);
+
+/*
+ * Determine whether the calling thread is currently executing a task
+ * of the specified STRAND.
+ *
+ * @param strand  The STRAND to be queried.
+ * @return 1 if the caller is running on the STRAND, otherwise 0.
+ */
+int strand_is_current(STRAND *strand);
+
+/*
+ * Get the STRAND that serializes all processing for a GAME.
+ * The returned STRAND is valid for as long as the GAME has not been freed.
+ *
+ * @param game  The GAME to be queried.
+ * @return the STRAND belonging to the GAME.
+ */
+STRAND *game_get_strand(GAME *game);
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include <stdint.h>
+
+/*
+ * Timeouts.
+ *
+ * A TIMEOUT calls a function once a specified amount of time has passed,
+ * unless it is cancelled first.  All timeouts are kept in a hierarchical
+ * timer wheel: TIMEOUT_LEVELS wheels of TIMEOUT_SLOTS slots each, where a
+ * slot of the first wheel spans one tick, a slot of the second wheel spans
+ * one turn of the first, and so on.  A timeout is placed in the slot of
+ * the lowest wheel whose range covers its expiry, and is moved down a wheel
+ * each time the wheel below completes a turn.  Setting, resetting and
+ * cancelling a timeout are therefore constant-time list operations,
+ * however many timeouts are pending, and expiry costs constant time per
+ * timeout, amortized.  Timeouts further away than the range of the top
+ * wheel are parked in its last slot and placed again when it is reached.
+ *
+ * The wheel is advanced by a ticker thread, which calls the functions of
+ * expired timeouts itself.  These functions must therefore be brief and
+ * must never block: a timeout that has real work to do should hand it to
+ * the scheduler or to a strand.  The ticker sleeps while no timeout is
+ * pending.  A timeout never expires before its time, but may expire up to
+ * one tick late.
+ */
+#define TIMEOUT_TICK_MS 10
+#define TIMEOUT_LEVEL_BITS 6
+#define TIMEOUT_SLOTS (1 << TIMEOUT_LEVEL_BITS)
+#define TIMEOUT_LEVELS 4
+
+/*
+ * The TIMEOUT type is a structure type that defines the state of a
+ * timeout.  The complete structure definition is in timeout.c.
+ */
+typedef struct timeout TIMEOUT;
+
+/*
+ * Type of a function to be called when a TIMEOUT expires.
+ */
+typedef void (*TIMEOUT_FUNC)(void *arg);
+
+/*
+ * Create a TIMEOUT, which is initially not pending.
+ *
+ * @param func  The function to be called when the TIMEOUT expires.
+ * @param arg  Argument to be passed to the function.
+ * @return the newly created TIMEOUT.
+ */
+TIMEOUT *timeout_create(TIMEOUT_FUNC func, void *arg);
+
+/*
+ * Set a TIMEOUT to expire after a specified time, replacing any expiry
+ * that was pending.  This may be called from the function of the TIMEOUT
+ * itself, to set it again.
+ *
+ * @param timeout  The TIMEOUT to be set.
+ * @param ms  Number of milliseconds from now at which the TIMEOUT is to
+ * expire.
+ * @return 1 if the TIMEOUT was already pending, otherwise 0.
+ */
+int timeout_set(TIMEOUT *timeout, unsigned long ms);
+
+/*
+ * Cancel a pending TIMEOUT.  If the function of the TIMEOUT is being
+ * called at the time, then this waits for it to return, unless called
+ * from that function; once this has returned, the function is not
+ * running and will not be called until the TIMEOUT is set again.
+ *
+ * @param timeout  The TIMEOUT to be cancelled.
+ * @return 1 if the TIMEOUT was pending, otherwise 0.
+ */
+int timeout_cancel(TIMEOUT *timeout);
+
+/*
+ * Cancel a TIMEOUT, as by timeout_cancel(), and free it.
+ *
+ * @param timeout  The TIMEOUT to be freed.
+ */
+void timeout_free(TIMEOUT *timeout);
+
+/*
+ * Get the current time on the clock used by timeouts.
+ *
+ * @return the current time, in milliseconds since some arbitrary start.
+ */
+uint64_t timeout_now(void);
+
+#endif
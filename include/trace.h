@@ -0,0 +1,120 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Binary event tracing.
+ *
+ * Each thread that records an event gets its own ring buffer of fixed-size
+ * binary records.  Recording an event takes a timestamp and a few stores
+ * into the ring of the calling thread, with no locking and no formatting,
+ * so tracing can be left on under load, unlike the debug() macros, which
+ * format every message and serialize all threads on stderr.  When a ring
+ * is full, the oldest events are overwritten.
+ *
+ * The rings are written to a file on request (when the server terminates
+ * and when it receives SIGUSR1).  The file is decoded offline with the
+ * jtrace tool (bin/jtrace), which prints the events as text or as JSON in the
+ * Chrome trace-event format.
+ */
+
+/*
+ * Types of events.  The meanings of the arguments of each event are
+ * given in the comments.  New events must be added at the end, so that
+ * older trace files continue to decode correctly.
+ */
+typedef enum {
+    TRACE_NONE,
+    TRACE_PKT_RECV,         // fd, packet type, payload size
+    TRACE_PKT_SEND,         // fd, packet type, payload size
+    TRACE_SERVICE_START,    // fd
+    TRACE_SERVICE_END,      // fd
+    TRACE_CLIENT_REF,       // new reference count, CLIENT address
+    TRACE_CLIENT_UNREF,     // new reference count, CLIENT address
+    TRACE_PLAYER_REF,       // new reference count, PLAYER address
+    TRACE_PLAYER_UNREF,     // new reference count, PLAYER address
+    TRACE_GAME_REF,         // new reference count, GAME address
+    TRACE_GAME_UNREF,       // new reference count, GAME address
+    TRACE_INVITATION_REF,   // new reference count, INVITATION address
+    TRACE_INVITATION_UNREF, // new reference count, INVITATION address
+    TRACE_REQUEST,          // fd, packet type, invitation or watch ID
+    TRACE_NEVENTS
+} TRACE_EVENT_ID;
+
+/*
+ * Format of one recorded event.  Trace files store events in this format,
+ * in host byte order.
+ */
+typedef struct trace_event {
+    uint64_t timestamp;     // CLOCK_MONOTONIC, in nanoseconds
+    uint16_t event;         // TRACE_EVENT_ID
+    uint16_t thread;        // Small integer identifying the recording thread
+    uint32_t arg0;
+    uint64_t arg1;
+    uint64_t arg2;
+} TRACE_EVENT;
+
+/*
+ * Header at the start of a trace file, followed by `count' events.
+ * The events of different threads are not interleaved in time order.
+ */
+#define TRACE_MAGIC 0x4352544a  // "JTRC"
+#define TRACE_VERSION 1
+
+typedef struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;    // sizeof(TRACE_EVENT)
+    uint32_t nthreads;      // Number of rings that were dumped
+    uint64_t count;         // Number of events that follow
+} TRACE_FILE_HEADER;
+
+/*
+ * Number of events held by the ring of each thread (a power of two).
+ */
+#define TRACE_RING_SIZE 8192
+
+/*
+ * Nonzero if tracing has been enabled.  Tested by TRACE() so that
+ * disabled tracing costs only a load and a branch.
+ */
+extern int trace_enabled;
+
+/*
+ * Record an event, if tracing is enabled.
+ */
+#define TRACE(ev, a0, a1, a2) \
+    do { \
+        if(trace_enabled) \
+            trace_record((ev), (uint32_t) (a0), (uint64_t) (a1), (uint64_t) (a2)); \
+    } while(0)
+
+/*
+ * Enable tracing.
+ *
+ * @param path  Name of the file to which the rings are to be written
+ * by trace_dump().
+ */
+void trace_init(char *path);
+
+/*
+ * Record an event in the ring of the calling thread.  Normally called
+ * through the TRACE() macro.
+ *
+ * @param event  The type of the event.
+ * @param arg0, arg1, arg2  Arguments of the event.
+ */
+void trace_record(int event, uint32_t arg0, uint64_t arg1, uint64_t arg2);
+
+/*
+ * Write the events currently held in the rings of all threads to the file
+ * given to trace_init(), replacing any previous contents.  Events that are
+ * overwritten while the dump is in progress are omitted.  Does nothing if
+ * tracing is not enabled.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int trace_dump(void);
+
+#endif
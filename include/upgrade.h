@@ -0,0 +1,86 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ * Hot upgrade.
+ *
+ * A server started with an upgrade socket path listens on a UNIX socket
+ * at that path.  A new server process started with the same path connects
+ * to it and takes over: the old process stops every acceptor and service
+ * thread between packets, serializes the players, the logged-in clients,
+ * their invitations and the games in progress, and sends them, together
+ * with the listening sockets and the client connections (as SCM_RIGHTS
+ * ancillary data), over the UNIX socket.  Once the new process has
+ * restored the state and acknowledged it, the old process exits without
+ * shutting down any connection, and the new process carries on serving
+ * the same connections, with the same invitation IDs and games.  If the
+ * handoff fails before then, the old process carries on instead.
+ *
+ * Sessions that are parked waiting to be resumed are ended before the
+ * handoff, games that are being watched are no longer watched, and time
+ * limits start again from the handoff.
+ *
+ * Each acceptor and service thread must be counted with upgrade_enter()
+ * before it starts and upgrade_leave() when it ends, and must call
+ * upgrade_wait() before reading each connection or packet.
+ */
+
+/*
+ * Take over from the server process listening at an upgrade socket path,
+ * if there is one.  Its state is restored, and a service thread is
+ * started for each of its client connections.  This must be called after
+ * the registries and the scheduler have been initialized, and before any
+ * connection is accepted.
+ *
+ * @param path  The path of the upgrade socket.
+ * @param listenfdsp  Variable into which to store a malloc'ed array of
+ * the listening sockets handed over.
+ * @return the number of listening sockets handed over, 0 if there is no
+ * server process to take over from, or -1 if the handoff failed.
+ */
+int upgrade_receive(char *path, int **listenfdsp);
+
+/*
+ * Listen at an upgrade socket path for a new server process to take over
+ * from this one, handing over the specified listening sockets.  The
+ * listening sockets must be non-blocking.  This makes upgrade_wait()
+ * take part in the handoff.
+ *
+ * @param path  The path of the upgrade socket.
+ * @param listenfds  The listening sockets.
+ * @param n  The number of listening sockets.
+ * @return 0 if successful, otherwise -1.
+ */
+int upgrade_listen(char *path, int *listenfds, int n);
+
+/*
+ * Count an acceptor or service thread that is about to start.  A thread
+ * that starts a service thread calls this on its behalf, so that the
+ * connection it was started for cannot be missed by a handoff.
+ */
+void upgrade_enter(void);
+
+/*
+ * Stop counting an acceptor or service thread that is ending.
+ */
+void upgrade_leave(void);
+
+/*
+ * Wait until a file descriptor is readable.  If a handoff starts
+ * meanwhile, the calling thread stays here until it has failed, and
+ * never returns if it succeeds.  If no upgrade socket is being listened
+ * on, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ * @return 0.
+ */
+int upgrade_wait(int fd);
+
+/*
+ * Determine whether a handoff is in progress.
+ *
+ * @return nonzero if a handoff is in progress, otherwise 0.
+ */
+int upgrade_in_progress(void);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+
+#include "protocol_ext.h"
+
+/*
+ * io_uring I/O backend.
+ *
+ * When enabled, a single receiver thread owns an io_uring instance, and
+ * every connection has one multishot recv outstanding on it, drawing its
+ * buffers from a ring of buffers provided to the kernel.  Each time the
+ * receiver thread enters the kernel it collects the data that has arrived
+ * on any number of connections, appends it to the input buffer of each,
+ * returns the buffers to the ring and wakes the service threads that are
+ * waiting for a complete packet.  A service thread therefore makes no
+ * system call to receive a packet that has already arrived.
+ *
+ * Packets to be sent together, such as the ACK to a MOVE and the MOVED
+ * sent to the opponent, can be submitted as a chain of linked sends with
+ * a single system call; their completions are also collected by the
+ * receiver thread.
+ *
+ * The system calls are made directly, as liburing is not used.  The
+ * backend is chosen at runtime: uring_init() checks that the kernel
+ * supports every feature used, and if it does not, the server carries on
+ * with blocking reads and writes on each connection.  A connection whose
+ * input buffer grows beyond URING_MAX_BUFFERED bytes, because its service
+ * thread is not keeping up, stops being received from until its buffer
+ * has been drained to half that.
+ */
+#define URING_ENTRIES 256                     // entries of the submission queue
+#define URING_NBUFS 256                       // buffers provided for receiving
+#define URING_BUF_SIZE 4096                   // size of each buffer
+#define URING_MAX_BUFFERED (4 * (65536 + sizeof(JEUX_PACKET_HEADER_V2)))
+
+/*
+ * The URING_CONN type is a structure type that defines the input state of
+ * a connection received from by the io_uring backend.  The complete
+ * structure definition is in uring.c.
+ */
+typedef struct uring_conn URING_CONN;
+
+/*
+ * A send to be submitted as part of a chain.  The message must remain
+ * valid until the chain has completed.
+ */
+typedef struct uring_send {
+    int fd;
+    struct msghdr msg;
+    int res;                // Result: bytes sent or negated errno
+    void *chain;            // Used by the backend
+} URING_SEND;
+
+/*
+ * Set up the io_uring backend and start its receiver thread, if the
+ * kernel supports it.
+ *
+ * @return 0 if the backend is in use, otherwise -1.
+ */
+int uring_init(void);
+
+/*
+ * Determine whether the io_uring backend is in use.
+ *
+ * @return nonzero if uring_init() has succeeded, otherwise 0.
+ */
+int uring_enabled(void);
+
+/*
+ * Start receiving from a connection with the io_uring backend.
+ *
+ * @param fd  File descriptor of the connection.
+ * @return the URING_CONN of the connection, or NULL if the backend is not
+ * in use, in which case uring_recv_packet() reads the connection directly.
+ */
+URING_CONN *uring_open(int fd);
+
+/*
+ * Stop receiving from a connection and free its URING_CONN.  Once this
+ * has returned, the kernel no longer uses the file descriptor on behalf of
+ * the backend, and it may be closed.
+ *
+ * @param conn  The URING_CONN, or NULL.
+ */
+void uring_close(URING_CONN *conn);
+
+/*
+ * Receive a packet, blocking until one is available, as
+ * proto_recv_packet_ext() does.
+ *
+ * @param conn  The URING_CONN of the connection, or NULL if the
+ * connection is to be read directly.
+ * @param fd  File descriptor of the connection.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  Pointer to caller-supplied storage for the version 1
+ *   packet header.
+ * @param ext  Storage for the fields of the header that version 1 has no
+ *   room for, or NULL if they are not wanted.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ *   any payload received, which the caller must free.
+ * @return  0 in case of successful reception, -1 on EOF or error.
+ */
+int uring_recv_packet(URING_CONN *conn, int fd, int version, JEUX_PACKET_HEADER *hdr,
+                      JEUX_PACKET_EXT *ext, void **payloadp);
+
+/*
+ * Submit a chain of linked sends with a single system call, and wait
+ * until all of them have completed.  Each send starts only once the
+ * previous one has completed in full; if one fails or is short, the rest
+ * of the chain fails with -ECANCELED, and it is up to the caller to
+ * finish them.
+ *
+ * @param sends  The sends.
+ * @param n  The number of sends, at most URING_ENTRIES.
+ * @return 0 if the chain was submitted, -1 if it could not be, in which
+ * case none of the sends has been made.
+ */
+int uring_send_chain(URING_SEND *sends, int n);
+
+#endif
@@ -0,0 +1,133 @@
+#include "bot.h"
+#include "client_ext.h"
+#include "player_registry.h"
+#include "game_ext.h"
+#include "jeux_globals.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * A packet sent to the bot, queued for the bot's thread to answer.
+ */
+typedef struct bot_task {
+	int type;
+	int id;
+	struct bot_task *next;
+} BOT_TASK;
+
+static CLIENT *bot; // the bot, which is kept for as long as the server runs
+static BOT_TASK *tasks;
+static BOT_TASK **tasks_tail = &tasks;
+static sem_t tasks_mutex; // protects tasks and tasks_tail
+static sem_t tasks_items; // posted each time a task is queued
+
+static void *bot_thread(void *arg);
+
+/*
+ * Create the bot and log it in.
+ *
+ * @param name  The username of the bot, which no client can then log in
+ * as.
+ * @return 0 if successful, otherwise -1.
+ */
+int bot_init(char *name){
+	PLAYER *player = preg_register(player_registry, name);
+	if(player == NULL){
+		return -1;
+	}
+	game_tablebase_init();
+	Sem_init(&tasks_mutex, 0, 1);
+	Sem_init(&tasks_items, 0, 0);
+	bot = client_create_bot(player);
+	player_unref(player, "because bot has been created");
+	pthread_t tid;
+	Pthread_create(&tid, NULL, bot_thread, NULL);
+	debug("Bot %p logged in as %s", bot, name);
+	return 0;
+}
+
+/*
+ * Find the bot by its username.
+ *
+ * @param name  The username.
+ * @return a reference to the CLIENT of the bot, which the caller must
+ * discard with client_unref(), or NULL if there is no bot with that name.
+ */
+CLIENT *bot_lookup(char *name){
+	if(bot == NULL || strcmp(player_get_name(client_get_player(bot)), name) != 0){
+		return NULL;
+	}
+	return client_ref(bot, "for reference being returned by bot_lookup()");
+}
+
+/*
+ * Make the best move in a game, if it is the bot's turn.  A move made
+ * when it is not is rejected by the game.
+ */
+static void play(int id){
+	GAME_ROLE outcome;
+	int distance;
+	char *move = client_get_hint(bot, id, &outcome, &distance);
+	if(move == NULL){
+		return;
+	}
+	if(client_make_move(bot, id, move) == 0){
+		debug("Bot made move %s in game %d (%d moves left)", move, id, distance - 1);
+	}
+	Free(move);
+}
+
+/*
+ * Thread that answers the packets sent to the bot, in the order in which
+ * they were sent.  Answering waits for the strands of the games, so it
+ * is not done by the scheduler's workers, which run those strands.
+ */
+static void *bot_thread(void *arg){
+	Pthread_detach(pthread_self());
+	while(1){
+		P(&tasks_items);
+		P(&tasks_mutex);
+		BOT_TASK *task = tasks;
+		if((tasks = task->next) == NULL){
+			tasks_tail = &tasks;
+		}
+		V(&tasks_mutex);
+		if(task->type == JEUX_INVITED_PKT){
+			// a game state is returned only if the bot is to move first
+			char *state = NULL;
+			if(client_accept_invitation(bot, task->id, &state) == 0 && state != NULL){
+				Free(state);
+				play(task->id);
+			}
+		} else {
+			play(task->id);
+		}
+		Free(task);
+	}
+	return NULL;
+}
+
+/*
+ * Receive a packet sent to the bot: an invitation is accepted, and a move
+ * made by an opponent is answered.
+ *
+ * @param bot  The CLIENT of the bot.
+ * @param hdr  The header of the packet.
+ * @param id  The bot's ID for the invitation the packet is about.
+ * @return 0, as packets to the bot are not lost.
+ */
+int bot_receive(CLIENT *bot, JEUX_PACKET_HEADER *hdr, int id){
+	if(hdr->type != JEUX_INVITED_PKT && hdr->type != JEUX_MOVED_PKT){
+		return 0;
+	}
+	BOT_TASK *task = (BOT_TASK *) Malloc(sizeof(BOT_TASK));
+	task->type = hdr->type;
+	task->id = id;
+	task->next = NULL;
+	P(&tasks_mutex);
+	*tasks_tail = task;
+	tasks_tail = &task->next;
+	V(&tasks_mutex);
+	V(&tasks_items);
+	return 0;
+}
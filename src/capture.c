@@ -0,0 +1,212 @@
+#include <time.h>
+
+#include "capture.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Size of each of the two capture buffers.  Producers fill one buffer
+ * while the writer thread writes out the other.
+ */
+#define CAPTURE_BUFFER_SIZE (4 << 20)
+
+/*
+ * Interval at which the writer flushes a buffer that is not yet half full.
+ */
+#define CAPTURE_FLUSH_MS 50
+
+/*
+ * Connection IDs are looked up by file descriptor; connections on higher
+ * descriptors are recorded with ID 0.
+ */
+#define CAPTURE_MAX_FDS 65536
+
+int capture_enabled = 0;
+
+static FILE *capture_file = NULL;
+static char *buffers[2];
+static int active = 0;          // Index of the buffer being filled
+static size_t fill = 0;         // Bytes used in the active buffer
+static int kicked = 0;          // Writer has been woken for a half-full buffer
+static int stopping = 0;
+static unsigned long dropped = 0;
+static sem_t mutex;             // Protects the variables above
+static sem_t kick;              // Wakes the writer
+static pthread_t writer_tid;
+static uint32_t *conn_ids;
+static uint32_t next_conn = 0;
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Thread that writes out the filled buffer whenever it is kicked, or
+ * every CAPTURE_FLUSH_MS otherwise, until capture is stopped.
+ */
+static void *capture_writer(void *arg){
+	while(1){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		sem_timedwait(&kick, &deadline);
+
+		P(&mutex);
+		char *buf = buffers[active];
+		size_t n = fill;
+		active ^= 1;
+		fill = 0;
+		kicked = 0;
+		int stop = stopping;
+		V(&mutex);
+
+		if(n > 0 && fwrite(buf, 1, n, capture_file) != n){
+			debug("Error writing capture file");
+		}
+		fflush(capture_file);
+		if(stop){
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Append a record to the active buffer, or drop it if there is no room.
+ */
+static void append(CAPTURE_RECORD *rec, JEUX_PACKET_HEADER *hdr, void *payload, size_t size){
+	size_t len = sizeof(*rec) + (hdr != NULL ? sizeof(*hdr) + size : 0);
+	P(&mutex);
+	if(fill + len > CAPTURE_BUFFER_SIZE){
+		dropped++;
+		V(&mutex);
+		return;
+	}
+	char *p = buffers[active] + fill;
+	memcpy(p, rec, sizeof(*rec));
+	if(hdr != NULL){
+		memcpy(p + sizeof(*rec), hdr, sizeof(*hdr));
+		if(size > 0){
+			memcpy(p + sizeof(*rec) + sizeof(*hdr), payload, size);
+		}
+	}
+	fill += len;
+	int wake = !kicked && fill >= CAPTURE_BUFFER_SIZE / 2;
+	if(wake){
+		kicked = 1;
+	}
+	V(&mutex);
+	if(wake){
+		V(&kick);
+	}
+}
+
+static void record(int fd, int kind, JEUX_PACKET_HEADER *hdr, void *payload, size_t size){
+	CAPTURE_RECORD rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.timestamp = now_ns();
+	rec.conn = fd >= 0 && fd < CAPTURE_MAX_FDS ? conn_ids[fd] : 0;
+	rec.kind = kind;
+	append(&rec, hdr, payload, size);
+}
+
+/*
+ * Enable capture and start the background writer.
+ *
+ * @param path  Name of the capture file, which is created or truncated.
+ * @return 0 if successful, -1 if the file cannot be opened.
+ */
+int capture_init(char *path){
+	capture_file = fopen(path, "w");
+	if(capture_file == NULL){
+		debug("Cannot open capture file %s", path);
+		return -1;
+	}
+	CAPTURE_FILE_HEADER fh = { CAPTURE_MAGIC, CAPTURE_VERSION };
+	fwrite(&fh, sizeof(fh), 1, capture_file);
+	buffers[0] = (char *) Malloc(CAPTURE_BUFFER_SIZE);
+	buffers[1] = (char *) Malloc(CAPTURE_BUFFER_SIZE);
+	conn_ids = (uint32_t *) Calloc(CAPTURE_MAX_FDS, sizeof(uint32_t));
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&kick, 0, 0);
+	Pthread_create(&writer_tid, NULL, capture_writer, NULL);
+	capture_enabled = 1;
+	debug("Capturing packets to %s", path);
+	return 0;
+}
+
+/*
+ * Stop capture, write any remaining records and close the capture file.
+ */
+void capture_fini(void){
+	if(!capture_enabled){
+		return;
+	}
+	capture_enabled = 0;
+	P(&mutex);
+	stopping = 1;
+	V(&mutex);
+	V(&kick);
+	Pthread_join(writer_tid, NULL);
+	fclose(capture_file);
+	// the buffers are kept, since stray records may still be appended to them
+	if(dropped > 0){
+		debug("%lu capture records were dropped", dropped);
+	}
+}
+
+/*
+ * Record the opening of a connection, assigning it a new connection ID.
+ *
+ * @param fd  The file descriptor of the connection.
+ */
+void capture_open(int fd){
+	if(!capture_enabled){
+		return;
+	}
+	if(fd >= 0 && fd < CAPTURE_MAX_FDS){
+		conn_ids[fd] = __atomic_add_fetch(&next_conn, 1, __ATOMIC_RELAXED);
+	}
+	record(fd, CAPTURE_OPEN, NULL, NULL, 0);
+}
+
+/*
+ * Record the closing of a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ */
+void capture_close(int fd){
+	if(!capture_enabled){
+		return;
+	}
+	record(fd, CAPTURE_CLOSE, NULL, NULL, 0);
+	if(fd >= 0 && fd < CAPTURE_MAX_FDS){
+		conn_ids[fd] = 0;
+	}
+}
+
+/*
+ * Record a packet received or sent on a connection.
+ *
+ * @param fd  The file descriptor of the connection.
+ * @param kind  CAPTURE_IN or CAPTURE_OUT.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param payload  The payload, or NULL if there is none.
+ */
+void capture_packet(int fd, int kind, JEUX_PACKET_HEADER *hdr, void *payload){
+	if(!capture_enabled){
+		return;
+	}
+	// a header announcing a payload that was not sent would corrupt the capture
+	JEUX_PACKET_HEADER h = *hdr;
+	if(payload == NULL){
+		h.size = 0;
+	}
+	record(fd, kind, &h, payload, ntohs(h.size));
+}
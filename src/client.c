@@ -1,12 +1,56 @@
+#include <sys/random.h>
+
 #include "client_registry.h"
+#include "client_ext.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "sendq.h"
+#include "creg_snapshot.h"
 #include "jeux_globals.h"
 #include "protocol.h"
+#include "strand.h"
+#include "scheduler.h"
+#include "timeout.h"
+#include "coro.h"
+#include "federation.h"
+#include "bot.h"
 #include "csapp.h"
 #include "debug.h"
+#include "trace.h"
+
+/*
+ * Maximum number of games a client can watch at once, so that watch IDs
+ * fit in the id field of a packet header.
+ */
+#define MAX_WATCHES 256
+
+/*
+ * Maximum number of packets held for a parked session.  A session whose
+ * held packets would exceed this can no longer be resumed.
+ */
+#define MAX_PARKED_PACKETS 256
+
+/*
+ * Length of a resume token, in hex digits.
+ */
+#define RESUME_TOKEN_LEN 16
 
-// mutex lock of network transmission of the system
-static sem_t network;
+/*
+ * Shard to which rating updates are sent, when the coroutine threads are
+ * shards.
+ */
+#define RATING_SHARD 0
 
+/*
+ * A packet sent to a client whose session is parked, held until the
+ * session is resumed.
+ */
+typedef struct parked_packet {
+	struct parked_packet *next;
+	JEUX_PACKET_HEADER header;
+	JEUX_PACKET_EXT ext;
+	char data[];
+} PARKED_PACKET;
 
 typedef struct client {
 	int connfd;
@@ -14,12 +58,72 @@ typedef struct client {
 	PLAYER *player;
 	INVITATION **invlist;
 	int invlength;
+	WATCH **watchlist; // games being watched, indexed by watch ID
+	int watchlength;
+	SENDQ *sendq; // serializes output to the connection
+	char token[RESUME_TOKEN_LEN + 1]; // resume token issued at login, if any
+	int parked; // whether the session is parked, waiting to be resumed
+	int overflowed; // whether packets held while parked have been lost
+	int nheld;
+	PARKED_PACKET *held; // packets held while parked, oldest first
+	PARKED_PACKET **held_tail;
+	sem_t outlock; // serializes output, and parking and resuming
+	FED_PEER *peer; // for a proxy, the node on which its player is logged in
+	int bot; // whether this is the server's bot
+	uint32_t request; // ID of the request being handled, echoed in its response
 	sem_t mutex; // client's mutex
 } CLIENT;
 
-static void init_network(void){
-	Sem_init(&network, 0, 1);
-}
+/*
+ * A move or resignation request, which is run as a task on the strand
+ * of the game it concerns.
+ */
+typedef struct game_request {
+	CLIENT *client;
+	GAME *game;
+	int id;
+	char *move; // move to be made, or game state that has been read
+	int result;
+	SENDQ_BATCH *batch; // batch of the thread that made the request, if any
+} GAME_REQUEST;
+
+/*
+ * A request for the best move in a game, which is run as a task on the
+ * strand of the game.
+ */
+typedef struct hint_request {
+	GAME *game;
+	char *move;
+	GAME_ROLE outcome;
+	int distance;
+} HINT_REQUEST;
+
+/*
+ * The result of a finished game, whose posting to the players' ratings
+ * is run as a task on the scheduler.
+ */
+typedef struct result_request {
+	PLAYER *player1;
+	PLAYER *player2;
+	int result;
+} RESULT_REQUEST;
+
+static int make_move(CLIENT *client, int id, char *move);
+static int resign_game(CLIENT *client, int id);
+static GAME *client_get_game(CLIENT *client, int id);
+static void unparse_state_task(void *arg);
+static void post_result(PLAYER *player1, PLAYER *player2, int result);
+static void post_game_result(INVITATION *inv, GAME *game);
+static void set_move_limit(INVITATION *inv, GAME *game);
+static void invitation_timeout(INVITATION *inv);
+static int hold_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, JEUX_PACKET_EXT *ext, void *data);
+static int forward_packet(CLIENT *proxy, JEUX_PACKET_HEADER *pkt, int id, void *data);
+static int notify_packet_id(CLIENT *player, JEUX_PACKET_HEADER *pkt, uint32_t id, void *data);
+static int logout(CLIENT *client, int wait);
+static int post_resign_game(CLIENT *client, int id);
+static int find_invitation(CLIENT *client, INVITATION *inv);
+static void drop_held(CLIENT *client);
+static void new_token(CLIENT *client);
 
 /**************************** BASICS ************************************/
 /*
@@ -40,10 +144,54 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
 	client->player = NULL;
 	client->invlist = NULL;
 	client->invlength = 0; // length of invitations array
+	client->watchlist = NULL;
+	client->watchlength = 0;
+	client->sendq = sendq_create(fd);
+	client->token[0] = '\0';
+	client->parked = 0;
+	client->overflowed = 0;
+	client->nheld = 0;
+	client->held = NULL;
+	client->held_tail = &client->held;
+	client->peer = NULL;
+	client->bot = 0;
+	client->request = 0;
+	Sem_init(&client->outlock, 0, 1);
 	Sem_init(&client->mutex, 0, 1);
 	client_ref(client, "for newly created client");
-	pthread_once_t once = PTHREAD_ONCE_INIT;
-	pthread_once(&once, init_network);
+	return client;
+}
+
+/*
+ * Create a proxy CLIENT for a player logged in on another node of a
+ * federation.  A proxy has no connection: the packets sent to it are
+ * sent to the player's node instead.  It is not registered in
+ * client_registry, and is logged in as the player from the start.
+ *
+ * @param player  The PLAYER.
+ * @param peer  The node on which the player is logged in.
+ * @return  The newly created CLIENT, with a reference count of one.
+ */
+CLIENT *client_create_proxy(PLAYER *player, FED_PEER *peer){
+	CLIENT *client = client_create(NULL, -1);
+	client->player = player_ref(player, "for reference being retained by proxy");
+	client->peer = peer;
+	return client;
+}
+
+/*
+ * Create the CLIENT of the server's bot.  The bot has no connection: the
+ * packets sent to it are handed to bot_receive() instead.  It is not
+ * registered in client_registry, and is logged in as the player from the
+ * start.
+ *
+ * @param player  The PLAYER of the bot.
+ * @return  The newly created CLIENT, with a reference count of one.
+ */
+CLIENT *client_create_bot(PLAYER *player){
+	CLIENT *client = client_create(NULL, -1);
+	client->player = player_ref(player, "for reference being retained by bot");
+	client->bot = 1;
 	return client;
 }
 
@@ -60,6 +208,7 @@ CLIENT *client_ref(CLIENT *client, char *why){
 	P(&client->mutex);
 	client->refcnt++;
 	debug("Increase reference count on client %p (%d -> %d) %s", client, client->refcnt - 1, client->refcnt, why);
+	TRACE(TRACE_CLIENT_REF, client->refcnt, client, 0);
 	V(&client->mutex);
 	return client;
 }
@@ -81,6 +230,7 @@ void client_unref(CLIENT *client, char *why){
 	if(client != NULL){
 		client->refcnt--;
 		debug("Decrease reference count on client %p (%d -> %d) %s", client, client->refcnt + 1, client->refcnt, why);
+		TRACE(TRACE_CLIENT_UNREF, client->refcnt, client, 0);
 	}
 	if(client != NULL){
 	if(client->refcnt == 0){
@@ -88,6 +238,16 @@ void client_unref(CLIENT *client, char *why){
 		if(client->invlist != NULL){
 			Free(client->invlist);
 		}
+		for(int i = 0; i < client->watchlength; i++){
+			if(client->watchlist[i] != NULL){
+				watch_unref(client->watchlist[i]);
+			}
+		}
+		if(client->watchlist != NULL){
+			Free(client->watchlist);
+		}
+		drop_held(client);
+		sendq_unref(client->sendq);
 		if(client != NULL){
 			Free(client);
 		}
@@ -127,9 +287,9 @@ int client_get_fd(CLIENT *client){
 
 /**************************** COMMUNICATION ************************************/
 /*
- * Send a packet to a client.  Exclusive access to the network connection
- * is obtained for the duration of this operation, to prevent concurrent
- * invocations from corrupting each other's transmissions.  To prevent
+ * Send a packet to a client.  Exclusive access to the client's network
+ * connection is obtained for the duration of this operation, to prevent
+ * concurrent invocations from corrupting each other's transmissions.  To prevent
  * such interference, only this function should be used to send packets to
  * the client, rather than the lower-level proto_send_packet() function.
  *
@@ -141,12 +301,177 @@ int client_get_fd(CLIENT *client){
 
 // data is always Malloced, Free in caller
 int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data){
+	return client_send_packet_id(player, pkt, pkt->id, data);
+}
+
+/*
+ * Send a packet to a client, as client_send_packet() does, with an ID
+ * that need not fit in the id field of the header.  A client using
+ * version 2 of the protocol is sent the ID in full; any other is sent its
+ * low 8 bits.  An ACK or NACK carries the ID of the request being handled
+ * for the client.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent, whose id field is set.
+ * @param id  The invitation or watch ID.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_packet_id(CLIENT *player, JEUX_PACKET_HEADER *pkt, uint32_t id, void *data){
 	// PKT already in Network Byte Order (210 server.c)
-	P(&network);
+	pkt->id = id;
+	if(player->peer != NULL){
+		return forward_packet(player, pkt, id, data);
+	}
+	if(player->bot){
+		return bot_receive(player, pkt, id);
+	}
+	JEUX_PACKET_EXT ext = { id, 0, 0 };
+	if(pkt->type == JEUX_ACK_PKT || pkt->type == JEUX_NACK_PKT){
+		ext.request = player->request;
+		ext.flags = JEUX_FLAG_RESPONSE;
+	}
 	debug("Send packet (clientfd=%d, type=%d) for client %p", player->connfd, pkt->type, player);
-	int i = proto_send_packet(player->connfd, pkt, data);
-	V(&network);
-	return i;
+	// a packet for a parked session is held until it is resumed
+	P(&player->outlock);
+	int ret = player->parked ? hold_packet(player, pkt, &ext, data) : sendq_send(player->sendq, pkt, &ext, data);
+	V(&player->outlock);
+	return ret;
+}
+
+/*
+ * Send a packet to a client from a strand task, such as a MOVED packet to
+ * the opponent of a player who has moved.  The scheduler worker running
+ * the task must not wait for the client's connection, so the packet is
+ * queued with sendq_post(), and a client too far behind to take it has
+ * its connection shut down.  Packets for a proxy, a bot or a parked
+ * session are handled as by client_send_packet_id().
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent.
+ * @param id  The invitation or watch ID.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @return 0 if the packet was queued, otherwise -1.
+ */
+static int notify_packet_id(CLIENT *player, JEUX_PACKET_HEADER *pkt, uint32_t id, void *data){
+	if(player->peer != NULL || player->bot){
+		return client_send_packet_id(player, pkt, id, data);
+	}
+	pkt->id = id;
+	JEUX_PACKET_EXT ext = { id, 0, 0 };
+	size_t size = ntohs(pkt->size);
+	SHARED_PAYLOAD *payload = size > 0 && data != NULL ? payload_create(data, size) : NULL;
+	int ret = 0;
+	P(&player->outlock);
+	if(player->parked){
+		ret = hold_packet(player, pkt, &ext, data);
+	} else {
+		sendq_post(player->sendq, pkt, &ext, payload);
+	}
+	V(&player->outlock);
+	if(payload != NULL){
+		payload_unref(payload);
+	}
+	return ret;
+}
+
+/*
+ * Set the ID of the request being handled for a client, which is echoed
+ * in the ACK or NACK sent to it in response.
+ *
+ * @param client  The CLIENT.
+ * @param request  The request ID.
+ */
+void client_set_request(CLIENT *client, uint32_t request){
+	client->request = request;
+}
+
+/*
+ * Get the version of the protocol used on the connection of a client.
+ *
+ * @param client  The CLIENT.
+ * @return the version.
+ */
+int client_get_version(CLIENT *client){
+	return sendq_get_version(client->sendq);
+}
+
+/*
+ * Get the SENDQ of the connection of a client.
+ *
+ * @param client  The CLIENT.
+ * @return the SENDQ, on which no reference is taken.
+ */
+SENDQ *client_get_sendq(CLIENT *client){
+	return client->sendq;
+}
+
+/*
+ * Set the version of the protocol used on the connection of a client,
+ * for the packets sent to it and received from it from now on.
+ *
+ * @param client  The CLIENT.
+ * @param version  The version.
+ */
+void client_set_version(CLIENT *client, int version){
+	sendq_set_version(client->sendq, version);
+}
+
+/*
+ * Send a packet for a proxy to the node of its player.  A MOVED packet
+ * is sent with the move that was made, rather than the state of the game,
+ * so that the node can make it too.  It is sent on the strand of the
+ * game, so the move is the last one of the game.
+ */
+static int forward_packet(CLIENT *proxy, JEUX_PACKET_HEADER *pkt, int id, void *data){
+	char move[4];
+	char *text = NULL;
+	if(pkt->type == JEUX_INVITED_PKT){
+		text = (char *) data;
+	} else if(pkt->type == JEUX_MOVED_PKT){
+		GAME *game = id < proxy->invlength && proxy->invlist[id] != NULL ?
+			inv_get_game(proxy->invlist[id]) : NULL;
+		unsigned char moves[GAME_MAX_MOVES];
+		int n = game != NULL ? game_get_moves(game, moves) : 0;
+		if(n == 0){
+			return -1;
+		}
+		snprintf(move, sizeof(move), "%d", GAME_MOVE_SPOT(moves[n - 1]) + 1);
+		text = move;
+	}
+	return fed_send(proxy->peer, proxy, player_get_name(proxy->player), pkt, id, text);
+}
+
+/*
+ * Stop all output to a CLIENT, discarding any packets queued for it,
+ * except that when coroutines are in use, the replies queued for it are
+ * written first.  Once this function has returned, nothing more is
+ * written to the client's connection, which may then be closed.
+ *
+ * @param client  The CLIENT.
+ */
+void client_close_output(CLIENT *client){
+	if(coro_enabled()){
+		sendq_drain(client->sendq);
+	}
+	sendq_close(client->sendq);
+}
+
+/*
+ * Shut down the reading side of a CLIENT's connection, so that its service
+ * loop sees EOF.  A parked session, whose connection has already been
+ * closed, is left alone.
+ *
+ * @param client  The CLIENT.
+ */
+void client_shutdown(CLIENT *client){
+	// client_park() clears connfd under outlock before the connection is closed
+	P(&client->outlock);
+	if(client->connfd >= 0){
+		debug("Shutting down client %d", client->connfd);
+		shutdown(client->connfd, SHUT_RD);
+	}
+	V(&client->outlock);
 }
 
 /*
@@ -161,7 +486,7 @@ int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data){
  */
 int client_send_ack(CLIENT *client, void *data, size_t datalen){
 	// client send ack
-	static JEUX_PACKET_HEADER header;
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_ACK_PKT;
 	header.id = 0;
 	header.role = 0;
@@ -184,7 +509,7 @@ int client_send_ack(CLIENT *client, void *data, size_t datalen){
  */
 int client_send_nack(CLIENT *client){
 	// client send ack
-	static JEUX_PACKET_HEADER header;
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_NACK_PKT;
 	header.id = 0;
 	header.role = 0;
@@ -220,7 +545,18 @@ int client_login(CLIENT *client, PLAYER *player){
 	}
 	// TODO: if there is already some other CLIENT Logged in as the PLAYER
 	// if another client holds this PLAYER *
-	if(creg_lookup(client_registry, player_get_name(player)) != NULL){
+	CLIENT *other = creg_lookup(client_registry, player_get_name(player));
+	if(other != NULL){
+		client_unref(other, "because player is already logged in");
+		return -1;
+	}
+	// nor as the server's bot
+	if((other = bot_lookup(player_get_name(player))) != NULL){
+		client_unref(other, "because player is the bot");
+		return -1;
+	}
+	// nor on another node of a federation
+	if(fed_enabled() && fed_claim(player_get_name(player)) != 0){
 		return -1;
 	}
 
@@ -228,8 +564,12 @@ int client_login(CLIENT *client, PLAYER *player){
 	P(&client->mutex);
 	debug("Log in client %p as player %p [%s]", client, player, player_get_name(player));
 	client->player = player_ref(player, "for reference being retained by client");
+	if(client_resume_grace > 0){
+		new_token(client);
+	}
 
 	V(&client->mutex);
+	creg_update_snapshot(client_registry, client, player);
 	return 0;
 }
 
@@ -247,6 +587,15 @@ int client_login(CLIENT *client, PLAYER *player){
  * logged out, otherwise -1.
  */
 int client_logout(CLIENT *client){
+	return logout(client, 1);
+}
+
+/*
+ * Log out a CLIENT, as client_logout() does.  Unless wait is set, its
+ * games in progress are resigned by tasks posted to their strands, which
+ * the caller does not wait for, as a scheduler worker must not.
+ */
+static int logout(CLIENT *client, int wait){
 	// check if client is logged in
 	if(client->player == NULL){
 		return -1;
@@ -254,8 +603,17 @@ int client_logout(CLIENT *client){
 	// P(&ordered_logout);
 	debug("Log out client %p", client);
 
-	player_unref(client->player, "because client is logging out");
+	if(fed_enabled()){
+		fed_release(player_get_name(client->player));
+	}
+	P(&client->mutex);
+	PLAYER *player = client->player;
 	client->player = NULL;
+	V(&client->mutex);
+	player_unref(player, "because client is logging out");
+	creg_update_snapshot(client_registry, client, NULL);
+
+	client_unwatch_all(client);
 
 	// INVITATIONS
 	// revoke -> for invitations that just sent
@@ -276,7 +634,7 @@ int client_logout(CLIENT *client){
 			}
 			if(j == -1){
 				// V(&client->mutex);
-				j = client_resign_game(client, i);
+				j = wait ? client_resign_game(client, i) : post_resign_game(client, i);
 				// printf("IT GOT TO HERE\n");
 				// P(&client->mutex);
 			}
@@ -380,8 +738,34 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv){
  */
 int client_make_invitation(CLIENT *source, CLIENT *target,
 			   GAME_ROLE source_role, GAME_ROLE target_role){
+	return client_make_timed_invitation(source, target, source_role, target_role,
+					    client_time_base, client_time_increment);
+}
+
+/*
+ * Make a new invitation, as client_make_invitation() does, to a game
+ * played with a specified time control.  If the game is timed, the
+ * payload of the INVITED packet sent to the target is the username of the
+ * source followed by a space and the time control, in the form accepted
+ * by client_parse_time_control().
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param source_role  The GAME_ROLE to be played by the source of the INVITATION.
+ * @param target_role  The GAME_ROLE to be played by the target of the INVITATION.
+ * @param base_ms  The time given to each player for the whole game, in ms,
+ * or 0 for a game that is not timed.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_timed_invitation(CLIENT *source, CLIENT *target,
+				 GAME_ROLE source_role, GAME_ROLE target_role,
+				 unsigned long base_ms, unsigned long increment_ms){
 	debug("[%d] Make an invitation", source->connfd);
 	INVITATION *invitation = inv_create(source, target, source_role, target_role);
+	inv_set_time_control(invitation, base_ms, increment_ms);
 
 	// P(&source->mutex);
 	debug("[%d] add invitation as source", source->connfd);
@@ -400,22 +784,31 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
 		return -1;
 	}
 	// V(&target->mutex);
+	if(client_invite_timeout > 0){
+		inv_set_timeout(invitation, client_invite_timeout, invitation_timeout);
+	}
 
 	// char *name = player_get_name(target->player);
 	// printf("the length of name is: %ld\n", strlen(name));
 	// printf("the length of player_get_name is: %ld\n", strlen(player_get_name(target->player)));
 	// send invited packet to target
-	static JEUX_PACKET_HEADER header;
+	char *name = player_get_name(source->player);
+	char invited[strlen(name) + 48];
+	if(base_ms > 0){
+		snprintf(invited, sizeof(invited), "%s %lu+%lu", name, base_ms / 1000, increment_ms / 1000);
+	} else {
+		strcpy(invited, name);
+	}
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_INVITED_PKT;
-	header.id = targetid;
 	header.role = target_role;
-	header.size = htons(strlen(player_get_name(source->player)));
+	header.size = htons(strlen(invited));
 	clockid_t clock_id = CLOCK_MONOTONIC;
 	struct timespec tp;
 	clock_gettime(clock_id, &tp);
 	header.timestamp_sec = htonl(tp.tv_sec);
 	header.timestamp_nsec = htonl(tp.tv_nsec);
-	int i = client_send_packet(target, &header, player_get_name(source->player));
+	int i = client_send_packet_id(target, &header, targetid, invited);
 	if(i == -1){
 		return -1;
 	}
@@ -447,7 +840,7 @@ int client_revoke_invitation(CLIENT *client, int id){
 	debug("[%d] Revoke invitation %d", client->connfd, id);
 	P(&client->mutex);
 	// find invitation in this client's (should be the source of it) list based on id
-	if(id >= client->invlength){
+	if(id < 0 || id >= client->invlength){
 		debug("invalid invitation id client->invlength = %d, invitationid=%d", client->invlength, id);
 		V(&client->mutex);
 		return -1;
@@ -494,9 +887,8 @@ int client_revoke_invitation(CLIENT *client, int id){
 	}
 
 	// send invited packet to target
-	static JEUX_PACKET_HEADER header;
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_REVOKED_PKT;
-	header.id = targetid;
 	header.role = 0;
 	header.size = 0;
 	clockid_t clock_id = CLOCK_MONOTONIC;
@@ -504,8 +896,9 @@ int client_revoke_invitation(CLIENT *client, int id){
 	clock_gettime(clock_id, &tp);
 	header.timestamp_sec = htonl(tp.tv_sec);
 	header.timestamp_nsec = htonl(tp.tv_nsec);
-	int i = client_send_packet(inv_get_target(inv), &header, NULL);
+	int i = client_send_packet_id(inv_get_target(inv), &header, targetid, NULL);
 
+	inv_close(inv, NULL_ROLE);
 	inv_unref(inv, "because pointer to invitation is now being discarded");
 
 
@@ -536,7 +929,7 @@ int client_decline_invitation(CLIENT *client, int id){
 	debug("[%d] Decline invitation %d", client->connfd, id);
 	P(&client->mutex);
 	// find invitation in this client's (should be the target of it) list based on id
-	if(id >= client->invlength){
+	if(id < 0 || id >= client->invlength){
 		debug("invalid invitation id client->invlength = %d, invitationid=%d", client->invlength, id);
 		V(&client->mutex);
 		return -1;
@@ -591,9 +984,8 @@ int client_decline_invitation(CLIENT *client, int id){
 	}
 
 	// send revoked packet to target
-	static JEUX_PACKET_HEADER header;
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_DECLINED_PKT;
-	header.id = sourceid;
 	header.role = 0;
 	header.size = 0;
 	clockid_t clock_id = CLOCK_MONOTONIC;
@@ -601,8 +993,9 @@ int client_decline_invitation(CLIENT *client, int id){
 	clock_gettime(clock_id, &tp);
 	header.timestamp_sec = htonl(tp.tv_sec);
 	header.timestamp_nsec = htonl(tp.tv_nsec);
-	int i = client_send_packet(inv_get_source(inv), &header, NULL);
+	int i = client_send_packet_id(inv_get_source(inv), &header, sourceid, NULL);
 
+	inv_close(inv, NULL_ROLE);
 	inv_unref(inv, "because pointer to invitation is now being discarded");
 	V(&client->mutex);
 	return i;
@@ -634,7 +1027,8 @@ int client_decline_invitation(CLIENT *client, int id){
  */
 int client_accept_invitation(CLIENT *client, int id, char **strp){
 	P(&client->mutex);
-	if(id >= client->invlength){
+	*strp = NULL;
+	if(id < 0 || id >= client->invlength){
 		debug("Invalid id of invitation");
 		V(&client->mutex);
 		return -1;
@@ -675,12 +1069,14 @@ int client_accept_invitation(CLIENT *client, int id, char **strp){
 		return -1;
 	}
 	// successful
+	// the time limit for accepting is replaced by that for the first move
+	set_move_limit(inv, inv_get_game(inv));
 
 	char *state = NULL; // Malloced storage
+	GAME *game = NULL; // game whose state is to be read for the target
 	// send accepted packet to source
-	static JEUX_PACKET_HEADER header;
+	JEUX_PACKET_HEADER header;
 	header.type = JEUX_ACCEPTED_PKT;
-	header.id = index;
 	header.role = 0;
 	header.size = 0;
 	clockid_t clock_id = CLOCK_MONOTONIC;
@@ -693,19 +1089,21 @@ int client_accept_invitation(CLIENT *client, int id, char **strp){
 		// SOURCE IS FIRST ONE TO MOVE
 		state = game_unparse_state(inv_get_game(inv));
 		header.size = htons(strlen(state));
-		if(client_send_packet(inv_get_source(inv), &header, state) == -1){
+		if(client_send_packet_id(inv_get_source(inv), &header, index, state) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded 11111");
 			V(&client->mutex);
 			return -1;
 		}
 		*strp = NULL;
 	} else {
-		if(client_send_packet(inv_get_source(inv), &header, NULL) == -1){
+		if(client_send_packet_id(inv_get_source(inv), &header, index, NULL) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded");
 			V(&client->mutex);
 			return -1;
 		}
-		*strp = game_unparse_state(inv_get_game(inv));
+		// the source may already be moving, so the state is read on the
+		// game's strand, once the client's lock has been released
+		game = inv_get_game(inv);
 	}
 
 	// char *board = " | | \n-----\n | | \n-----\n | | \n";
@@ -729,37 +1127,33 @@ int client_accept_invitation(CLIENT *client, int id, char **strp){
 	// client_send_packet(inv_get_source(inv), &header, NULL);
 	// }
 
-	inv_unref(inv, "because pointer to invitation is now being discarded");
-
 	if(state != NULL){
 		Free(state);
 	}
 	V(&client->mutex);
+
+	// a task of the strand may need the client's lock, so it is not held
+	// while waiting for one; the invitation keeps the game alive meanwhile
+	if(game != NULL){
+		GAME_REQUEST req = { client, game, id, NULL, 0 };
+		strand_call(game_get_strand(game), unparse_state_task, &req);
+		*strp = req.move;
+	}
+	inv_unref(inv, "because pointer to invitation is now being discarded");
 	return 0;
 
 }
 
 /**************************** RESIGN ************************************/
 /*
- * Resign a game in progress.  This function may be called by a CLIENT
- * that is either source or the target of the INVITATION containing the
- * GAME that is to be resigned.  It is an error if the INVITATION containing
- * the GAME is not in the ACCEPTED state.  If the game is successfully
- * resigned, the INVITATION is set to the CLOSED state, it is removed
- * from the lists of both the source and target, and a RESIGNED packet
- * containing the opponent's ID for the INVITATION is sent to the opponent
- * of the CLIENT that has resigned.
- *
- * @param client  The CLIENT that is resigning.
- * @param id  The ID assigned by the CLIENT to the INVITATION that contains
- * the GAME to be resigned.
- * @return 0 if the game is successfully resigned, otherwise -1.
+ * Resign the game in the invitation with the specified ID.
+ * Runs on the strand of the game.
  */
-int client_resign_game(CLIENT *client, int id){
+static int resign_game(CLIENT *client, int id){
 	debug("[%d] Resign game %d", client->connfd, id);
 	P(&client->mutex); // LOCK THIS CLIENT
 
-	if(id >= client->invlength){
+	if(id < 0 || id >= client->invlength){
 		debug("invalid invitation id client->invlength = %d, invitationid=%d", client->invlength, id);
 		V(&client->mutex);
 		return -1;
@@ -812,9 +1206,8 @@ int client_resign_game(CLIENT *client, int id){
 		}
 
 		// send resigned packet to target
-		static JEUX_PACKET_HEADER header;
+		JEUX_PACKET_HEADER header;
 		header.type = JEUX_RESIGNED_PKT;
-		header.id = targetid;
 		header.role = 0;
 		header.size = 0;
 		clockid_t clock_id = CLOCK_MONOTONIC;
@@ -822,7 +1215,7 @@ int client_resign_game(CLIENT *client, int id){
 		clock_gettime(clock_id, &tp);
 		header.timestamp_sec = htonl(tp.tv_sec);
 		header.timestamp_nsec = htonl(tp.tv_nsec);
-		if(client_send_packet(inv_get_target(inv), &header, NULL) == -1){
+		if(notify_packet_id(inv_get_target(inv), &header, targetid, NULL) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded 19");
 			V(&client->mutex);
 			return -1;
@@ -833,9 +1226,8 @@ int client_resign_game(CLIENT *client, int id){
 		if(game_is_over(game)){
 			// game terminated
 			// send ended packet to client
-			static JEUX_PACKET_HEADER header1;
+			JEUX_PACKET_HEADER header1;
 			header1.type = JEUX_ENDED_PKT;
-			header1.id = id;
 			header1.role = inv_get_target_role(inv);
 			header1.size = 0;
 			clockid_t clock_id = CLOCK_MONOTONIC;
@@ -843,16 +1235,15 @@ int client_resign_game(CLIENT *client, int id){
 			clock_gettime(clock_id, &tp);
 			header1.timestamp_sec = htonl(tp.tv_sec);
 			header1.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(client, &header1, NULL) == -1){
+			if(client_send_packet_id(client, &header1, id, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 3");
 				V(&client->mutex);
 				return -1;
 			}
 
 			// send ended packet to target
-			static JEUX_PACKET_HEADER header2;
+			JEUX_PACKET_HEADER header2;
 			header2.type = JEUX_ENDED_PKT;
-			header2.id = targetid;
 			header2.role = inv_get_target_role(inv);
 			header2.size = 0;
 			// clockid_t clock_id = CLOCK_MONOTONIC;
@@ -860,7 +1251,7 @@ int client_resign_game(CLIENT *client, int id){
 			clock_gettime(clock_id, &tp);
 			header2.timestamp_sec = htonl(tp.tv_sec);
 			header2.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(inv_get_target(inv), &header2, NULL) == -1){
+			if(notify_packet_id(inv_get_target(inv), &header2, targetid, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 4");
 				V(&client->mutex);
 				return -1;
@@ -885,7 +1276,7 @@ int client_resign_game(CLIENT *client, int id){
 			// post final results
 			// printf("!!!!!!!!!!!!!!!!!%p\n", inv_get_source(inv));
 			// printf("!!!!!!!!!!!!!!!!!%p\n", inv_get_target(inv));
-			player_post_result(client_get_player(inv_get_target(inv)), client_get_player(inv_get_source(inv)), game_get_winner(game));
+			post_game_result(inv, game);
 		}
 
 	} else {
@@ -918,9 +1309,8 @@ int client_resign_game(CLIENT *client, int id){
 		}
 
 		// send resigned packet to target
-		static JEUX_PACKET_HEADER header;
+		JEUX_PACKET_HEADER header;
 		header.type = JEUX_RESIGNED_PKT;
-		header.id = sourceid;
 		header.role = 0;
 		header.size = 0;
 		clockid_t clock_id = CLOCK_MONOTONIC;
@@ -928,7 +1318,7 @@ int client_resign_game(CLIENT *client, int id){
 		clock_gettime(clock_id, &tp);
 		header.timestamp_sec = htonl(tp.tv_sec);
 		header.timestamp_nsec = htonl(tp.tv_nsec);
-		if(client_send_packet(inv_get_source(inv), &header, NULL) == -1){
+		if(notify_packet_id(inv_get_source(inv), &header, sourceid, NULL) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded 9");
 			V(&client->mutex);
 			return -1;
@@ -939,9 +1329,8 @@ int client_resign_game(CLIENT *client, int id){
 		if(game_is_over(inv_get_game(inv))){
 			// game terminated
 			// send ended packet to client
-			static JEUX_PACKET_HEADER header1;
+			JEUX_PACKET_HEADER header1;
 			header1.type = JEUX_ENDED_PKT;
-			header1.id = id;
 			header1.role = inv_get_source_role(inv);
 			header1.size = 0;
 			clockid_t clock_id = CLOCK_MONOTONIC;
@@ -949,16 +1338,15 @@ int client_resign_game(CLIENT *client, int id){
 			clock_gettime(clock_id, &tp);
 			header1.timestamp_sec = htonl(tp.tv_sec);
 			header1.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(client, &header1, NULL) == -1){
+			if(client_send_packet_id(client, &header1, id, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 10");
 				V(&client->mutex);
 				return -1;
 			}
 
 			// send ended packet to target
-			static JEUX_PACKET_HEADER header2;
+			JEUX_PACKET_HEADER header2;
 			header2.type = JEUX_ENDED_PKT;
-			header2.id = sourceid;
 			header2.role = inv_get_source_role(inv);
 			header2.size = 0;
 			// clockid_t clock_id = CLOCK_MONOTONIC;
@@ -966,7 +1354,7 @@ int client_resign_game(CLIENT *client, int id){
 			clock_gettime(clock_id, &tp);
 			header2.timestamp_sec = htonl(tp.tv_sec);
 			header2.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(inv_get_source(inv), &header2, NULL) == -1){
+			if(notify_packet_id(inv_get_source(inv), &header2, sourceid, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 11");
 				V(&client->mutex);
 				return -1;
@@ -991,7 +1379,7 @@ int client_resign_game(CLIENT *client, int id){
 			}
 
 			// post final results
-			player_post_result(client_get_player(inv_get_target(inv)), client_get_player(inv_get_source(inv)), game_get_winner(game));
+			post_game_result(inv, game);
 		}
 	}
 
@@ -1006,35 +1394,16 @@ int client_resign_game(CLIENT *client, int id){
 
 /**************************** MOVE ************************************/
 /*
- * Make a move in a game currently in progress, in which the specified
- * CLIENT is a participant.  The GAME in which the move is to be made is
- * specified by passing the ID assigned by the CLIENT to the INVITATION
- * that contains the game.  The move to be made is specified as a string
- * that describes the move in a game-dependent format.  It is an error
- * if the ID does not refer to an INVITATION containing a GAME in progress,
- * if the move cannot be parsed, or if the move is not legal in the current
- * GAME state.  If the move is successfully made, then a MOVED packet is
- * sent to the opponent of the CLIENT making the move.  In addition, if
- * the move that has been made results in the game being over, then an
- * ENDED packet containing the appropriate game ID and the game result
- * is sent to each of the players participating in the game, and the
- * INVITATION containing the now-terminated game is removed from the lists
- * of both the source and target.  The result of the game is posted in
- * order to update both players' ratings.
- *
- * @param client  The CLIENT that is making the move.
- * @param id  The ID assigned by the CLIENT to the GAME in which the move
- * is to be made.
- * @param move  A string that describes the move to be made.
- * @return 0 if the move was made successfully, -1 otherwise.
+ * Make a move in the game in the invitation with the specified ID.
+ * Runs on the strand of the game.
  */
-int client_make_move(CLIENT *client, int id, char *move){
+static int make_move(CLIENT *client, int id, char *move){
 	debug("[%d] Make move '%s' in game %d", client->connfd, move, id);
 	P(&client->mutex);
 
 	//CHECKS
 
-	if(id >= client->invlength){
+	if(id < 0 || id >= client->invlength){
 		debug("invalid invitation id client->invlength = %d, invitationid=%d", client->invlength, id);
 		V(&client->mutex);
 		return -1;
@@ -1091,10 +1460,12 @@ int client_make_move(CLIENT *client, int id, char *move){
 
 		// apply move
 		if(game_apply_move(game, pmove) == -1){
+			Free(pmove);
 			inv_unref(inv, "discarding 3");
 			V(&client->mutex);
 			return -1;
 		}
+		set_move_limit(inv, game);
 
 		if(pmove != NULL){
 			Free(pmove);
@@ -1107,9 +1478,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 		state = game_unparse_state(game);
 
 		// send resigned packet to target
-		static JEUX_PACKET_HEADER header;
+		JEUX_PACKET_HEADER header;
 		header.type = JEUX_MOVED_PKT;
-		header.id = targetid;
 		header.role = 0;
 		header.size = htons(strlen(state));
 		clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1117,7 +1487,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 		clock_gettime(clock_id, &tp);
 		header.timestamp_sec = htonl(tp.tv_sec);
 		header.timestamp_nsec = htonl(tp.tv_nsec);
-		if(client_send_packet(inv_get_target(inv), &header, state) == -1){
+		if(notify_packet_id(inv_get_target(inv), &header, targetid, state) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded 19");
 			if(state != NULL){ Free(state); }
 			V(&client->mutex);
@@ -1129,9 +1499,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 		if(game_is_over(inv_get_game(inv))){
 			// game terminated
 			// send ended packet to client
-			static JEUX_PACKET_HEADER header1;
+			JEUX_PACKET_HEADER header1;
 			header1.type = JEUX_ENDED_PKT;
-			header1.id = id;
 			header1.role = game_get_winner(game);
 			header1.size = 0;
 			clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1139,7 +1508,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			clock_gettime(clock_id, &tp);
 			header1.timestamp_sec = htonl(tp.tv_sec);
 			header1.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(client, &header1, NULL) == -1){
+			if(client_send_packet_id(client, &header1, id, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 3");
 				if(state != NULL){ Free(state); }
 				V(&client->mutex);
@@ -1147,9 +1516,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 			}
 
 			// send ended packet to target
-			static JEUX_PACKET_HEADER header2;
+			JEUX_PACKET_HEADER header2;
 			header2.type = JEUX_ENDED_PKT;
-			header2.id = targetid;
 			header2.role = game_get_winner(game);
 			header2.size = 0;
 			// clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1157,7 +1525,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			clock_gettime(clock_id, &tp);
 			header2.timestamp_sec = htonl(tp.tv_sec);
 			header2.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(inv_get_target(inv), &header2, NULL) == -1){
+			if(notify_packet_id(inv_get_target(inv), &header2, targetid, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 4");
 				if(state != NULL){ Free(state); }
 				V(&client->mutex);
@@ -1185,7 +1553,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			// post final results
 			// printf("!!!!!!!!!!!!!!!!!%p\n", inv_get_source(inv));
 			// printf("!!!!!!!!!!!!!!!!!%p\n", inv_get_target(inv));
-			player_post_result(client_get_player(inv_get_target(inv)), client_get_player(inv_get_source(inv)), game_get_winner(game));
+			post_game_result(inv, game);
 		}
 
 
@@ -1215,10 +1583,12 @@ int client_make_move(CLIENT *client, int id, char *move){
 
 		// apply move
 		if(game_apply_move(game, pmove) == -1){
+			Free(pmove);
 			inv_unref(inv, "discarding 3");
 			V(&client->mutex);
 			return -1;
 		}
+		set_move_limit(inv, game);
 
 		if(pmove != NULL){
 			Free(pmove);
@@ -1231,9 +1601,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 		state = game_unparse_state(game);
 
 		// send moved packet to source
-		static JEUX_PACKET_HEADER header;
+		JEUX_PACKET_HEADER header;
 		header.type = JEUX_MOVED_PKT;
-		header.id = sourceid;
 		header.role = 0;
 		header.size = htons(strlen(state));
 		clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1241,7 +1610,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 		clock_gettime(clock_id, &tp);
 		header.timestamp_sec = htonl(tp.tv_sec);
 		header.timestamp_nsec = htonl(tp.tv_nsec);
-		if(client_send_packet(inv_get_source(inv), &header, state) == -1){
+		if(notify_packet_id(inv_get_source(inv), &header, sourceid, state) == -1){
 			inv_unref(inv, "because pointer to invitation is now being discarded 9");
 			if(state != NULL){ Free(state); }
 			V(&client->mutex);
@@ -1252,9 +1621,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 		if(game_is_over(inv_get_game(inv))){
 			// game terminated
 			// send ended packet to client
-			static JEUX_PACKET_HEADER header1;
+			JEUX_PACKET_HEADER header1;
 			header1.type = JEUX_ENDED_PKT;
-			header1.id = id;
 			header1.role = game_get_winner(game);
 			header1.size = 0;
 			clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1262,7 +1630,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			clock_gettime(clock_id, &tp);
 			header1.timestamp_sec = htonl(tp.tv_sec);
 			header1.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(client, &header1, NULL) == -1){
+			if(client_send_packet_id(client, &header1, id, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 10");
 				if(state != NULL){ Free(state); }
 				V(&client->mutex);
@@ -1270,9 +1638,8 @@ int client_make_move(CLIENT *client, int id, char *move){
 			}
 
 			// send ended packet to target
-			static JEUX_PACKET_HEADER header2;
+			JEUX_PACKET_HEADER header2;
 			header2.type = JEUX_ENDED_PKT;
-			header2.id = sourceid;
 			header2.role = game_get_winner(game);
 			header2.size = 0;
 			// clockid_t clock_id = CLOCK_MONOTONIC;
@@ -1280,7 +1647,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			clock_gettime(clock_id, &tp);
 			header2.timestamp_sec = htonl(tp.tv_sec);
 			header2.timestamp_nsec = htonl(tp.tv_nsec);
-			if(client_send_packet(inv_get_source(inv), &header2, NULL) == -1){
+			if(notify_packet_id(inv_get_source(inv), &header2, sourceid, NULL) == -1){
 				inv_unref(inv, "because pointer to invitation is now being discarded 11");
 				if(state != NULL){ Free(state); }
 				V(&client->mutex);
@@ -1308,7 +1675,7 @@ int client_make_move(CLIENT *client, int id, char *move){
 			}
 
 			// post final results
-			player_post_result(client_get_player(inv_get_target(inv)), client_get_player(inv_get_source(inv)), game_get_winner(game));
+			post_game_result(inv, game);
 		}
 	}
 	inv_unref(inv, "client_make_move() ended");
@@ -1318,4 +1685,1002 @@ int client_make_move(CLIENT *client, int id, char *move){
 	return 0;
 }
 
+/**************************** STRAND DISPATCH ************************************/
+static void resign_game_task(void *arg){
+	GAME_REQUEST *req = (GAME_REQUEST *) arg;
+	req->result = resign_game(req->client, req->id);
+}
+
+static void make_move_task(void *arg){
+	GAME_REQUEST *req = (GAME_REQUEST *) arg;
+	// the mover's ENDED goes out in the same batch as the reply to the MOVE
+	SENDQ_BATCH *previous = sendq_batch_join(req->batch);
+	req->result = make_move(req->client, req->id, req->move);
+	sendq_batch_join(previous);
+}
+
+static void hint_task(void *arg){
+	HINT_REQUEST *req = (HINT_REQUEST *) arg;
+	GAME_MOVE *move = game_best_move(req->game);
+	if(move == NULL){
+		return;
+	}
+	req->move = game_unparse_move(move);
+	Free(move);
+	req->outcome = game_perfect_outcome(req->game);
+	req->distance = game_moves_to_end(req->game);
+}
+
+static void unparse_state_task(void *arg){
+	GAME_REQUEST *req = (GAME_REQUEST *) arg;
+	req->move = game_unparse_state(req->game);
+}
+
+static void post_result_task(void *arg){
+	RESULT_REQUEST *req = (RESULT_REQUEST *) arg;
+	player_post_result(req->player1, req->player2, req->result);
+	player_unref(req->player1, "because posting of game result is done");
+	player_unref(req->player2, "because posting of game result is done");
+	Free(req);
+}
+
+/*
+ * Post the result of a game to the players' ratings, off the path of the
+ * move or resignation that ended the game.  If either player is no longer
+ * logged in, nothing is posted.  When the coroutine threads are shards,
+ * every rating update is sent to one of them, so that the updates are
+ * serialized there rather than contending for the players' locks.
+ */
+static void post_result(PLAYER *player1, PLAYER *player2, int result){
+	if(player1 == NULL || player2 == NULL){
+		return;
+	}
+	RESULT_REQUEST *req = (RESULT_REQUEST *) Malloc(sizeof(RESULT_REQUEST));
+	req->player1 = player_ref(player1, "for game result being posted");
+	req->player2 = player_ref(player2, "for game result being posted");
+	req->result = result;
+	if(coro_sharded()){
+		coro_post(RATING_SHARD, post_result_task, req);
+	} else {
+		sched_submit(post_result_task, req);
+	}
+}
+
+/*
+ * Post the result of the game of an invitation, with its players in the
+ * order of their roles, as the winner is given by role.
+ */
+static void post_game_result(INVITATION *inv, GAME *game){
+	CLIENT *source = inv_get_source(inv), *target = inv_get_target(inv);
+	if(inv_get_source_role(inv) == FIRST_PLAYER_ROLE){
+		post_result(client_get_player(source), client_get_player(target), game_get_winner(game));
+	} else {
+		post_result(client_get_player(target), client_get_player(source), game_get_winner(game));
+	}
+}
+
+/*
+ * Get a reference to the GAME (if any) in the invitation with the specified
+ * ID in a client's list.  The caller must discard the reference with
+ * game_unref() when it is no longer needed.
+ */
+static GAME *client_get_game(CLIENT *client, int id){
+	GAME *game = NULL;
+	P(&client->mutex);
+	if(id >= 0 && id < client->invlength && client->invlist[id] != NULL){
+		game = inv_get_game(client->invlist[id]);
+		if(game != NULL){
+			game_ref(game, "for game being dispatched to its strand");
+		}
+	}
+	V(&client->mutex);
+	return game;
+}
+
+/*
+ * Resign a game in progress.  This function may be called by a CLIENT
+ * that is either source or the target of the INVITATION containing the
+ * GAME that is to be resigned.  It is an error if the INVITATION containing
+ * the GAME is not in the ACCEPTED state.  If the game is successfully
+ * resigned, the INVITATION is set to the CLOSED state, it is removed
+ * from the lists of both the source and target, and a RESIGNED packet
+ * containing the opponent's ID for the INVITATION is sent to the opponent
+ * of the CLIENT that has resigned.
+ *
+ * @param client  The CLIENT that is resigning.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME to be resigned.
+ * @return 0 if the game is successfully resigned, otherwise -1.
+ */
+int client_resign_game(CLIENT *client, int id){
+	GAME *game = client_get_game(client, id);
+	if(game == NULL){
+		debug("[%d] No game in progress for invitation %d", client->connfd, id);
+		return -1;
+	}
+	GAME_REQUEST req = { client, game, id, NULL, -1 };
+	strand_call(game_get_strand(game), resign_game_task, &req);
+	game_unref(game, "because game dispatch has completed");
+	return req.result;
+}
+
+/*
+ * Strand task posted by post_resign_game(), which owns the request and
+ * the references in it.
+ */
+static void posted_resign_task(void *arg){
+	GAME_REQUEST *req = (GAME_REQUEST *) arg;
+	resign_game(req->client, req->id);
+	game_unref(req->game, "because game dispatch has completed");
+	client_unref(req->client, "because posted resignation is done");
+	Free(req);
+}
+
+/*
+ * Resign a game in progress, as client_resign_game() does, by a task
+ * posted to the strand of the game, without waiting for it.
+ *
+ * @return 0 if the task has been posted, otherwise -1.
+ */
+static int post_resign_game(CLIENT *client, int id){
+	GAME *game = client_get_game(client, id);
+	if(game == NULL){
+		return -1;
+	}
+	GAME_REQUEST *req = (GAME_REQUEST *) Calloc(1, sizeof(GAME_REQUEST));
+	req->client = client_ref(client, "for resignation being posted");
+	req->game = game;
+	req->id = id;
+	if(strand_post(game_get_strand(game), posted_resign_task, req) != 0){
+		game_unref(game, "because game dispatch has failed");
+		client_unref(client, "because resignation cannot be posted");
+		Free(req);
+		return -1;
+	}
+	return 0;
+}
 
+/*
+ * Make a move in a game currently in progress, in which the specified
+ * CLIENT is a participant.  The GAME in which the move is to be made is
+ * specified by passing the ID assigned by the CLIENT to the INVITATION
+ * that contains the game.  The move to be made is specified as a string
+ * that describes the move in a game-dependent format.  It is an error
+ * if the ID does not refer to an INVITATION containing a GAME in progress,
+ * if the move cannot be parsed, or if the move is not legal in the current
+ * GAME state.  If the move is successfully made, then a MOVED packet is
+ * sent to the opponent of the CLIENT making the move.  In addition, if
+ * the move that has been made results in the game being over, then an
+ * ENDED packet containing the appropriate game ID and the game result
+ * is sent to each of the players participating in the game, and the
+ * INVITATION containing the now-terminated game is removed from the lists
+ * of both the source and target.  The result of the game is posted in
+ * order to update both players' ratings.
+ *
+ * @param client  The CLIENT that is making the move.
+ * @param id  The ID assigned by the CLIENT to the GAME in which the move
+ * is to be made.
+ * @param move  A string that describes the move to be made.
+ * @return 0 if the move was made successfully, -1 otherwise.
+ */
+int client_make_move(CLIENT *client, int id, char *move){
+	GAME *game = client_get_game(client, id);
+	if(game == NULL){
+		debug("[%d] No game in progress for invitation %d", client->connfd, id);
+		return -1;
+	}
+	GAME_REQUEST req = { client, game, id, move, -1, sendq_batch_current() };
+	strand_call(game_get_strand(game), make_move_task, &req);
+	game_unref(game, "because game dispatch has completed");
+	return req.result;
+}
+
+/*
+ * Get the best move, under perfect play, for the player to move in a game
+ * in progress, which may be either player.
+ *
+ * @param client  A player of the game.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME.
+ * @param outcomep  Variable into which to store the GAME_ROLE of the
+ * winner under perfect play, or NULL_ROLE for a draw.
+ * @param distancep  Variable into which to store the number of moves left
+ * under perfect play.
+ * @return the move, in the format of game_unparse_move(), in malloc'ed
+ * storage that the caller must free, or NULL if the ID does not refer to
+ * a game in progress.
+ */
+char *client_get_hint(CLIENT *client, int id, GAME_ROLE *outcomep, int *distancep){
+	GAME *game = client_get_game(client, id);
+	if(game == NULL){
+		return NULL;
+	}
+	HINT_REQUEST req = { game, NULL, NULL_ROLE, 0 };
+	strand_call(game_get_strand(game), hint_task, &req);
+	game_unref(game, "because game dispatch has completed");
+	*outcomep = req.outcome;
+	*distancep = req.distance;
+	return req.move;
+}
+
+/*
+ * End a game in progress with a specified winner, as it has ended on
+ * another node, by resigning it on behalf of the loser.
+ *
+ * @param client  Either player of the game.
+ * @param id  The ID assigned by the CLIENT to the INVITATION that contains
+ * the GAME.
+ * @param winner  The GAME_ROLE of the winner.
+ * @return 0 if the game has been ended, -1 if it was not in progress or
+ * has no winner.
+ */
+int client_end_game(CLIENT *client, int id, GAME_ROLE winner){
+	if(winner != FIRST_PLAYER_ROLE && winner != SECOND_PLAYER_ROLE){
+		return -1;
+	}
+	P(&client->mutex);
+	if(id < 0 || id >= client->invlength || client->invlist[id] == NULL
+	   || inv_get_game(client->invlist[id]) == NULL){
+		V(&client->mutex);
+		return -1;
+	}
+	INVITATION *inv = inv_ref(client->invlist[id], "for game being ended");
+	V(&client->mutex);
+	CLIENT *loser = inv_get_source_role(inv) == winner ? inv_get_target(inv) : inv_get_source(inv);
+	int loser_id = find_invitation(loser, inv);
+	// a game already over cannot be resigned
+	int ret = loser_id >= 0 ? client_resign_game(loser, loser_id) : -1;
+	inv_unref(inv, "because game has been ended");
+	return ret;
+}
+
+/**************************** WATCH ************************************/
+/*
+ * A request to start or stop watching a game, which is run as a task on
+ * the strand of the game.
+ */
+typedef struct watch_request {
+	CLIENT *client;
+	GAME *game;
+	int id;
+	WATCH *watch;
+} WATCH_REQUEST;
+
+/*
+ * Start a watch on the game's strand.  The ACK naming the watch is queued
+ * here, before the strand can send any packet for the watch.
+ */
+static void watch_task(void *arg){
+	WATCH_REQUEST *req = (WATCH_REQUEST *) arg;
+	char *state;
+	req->watch = game_watch(req->game, req->client->sendq, req->id, &state);
+	if(req->watch == NULL){
+		return;
+	}
+	JEUX_PACKET_HEADER header;
+	header.type = JEUX_ACK_PKT;
+	header.role = 0;
+	header.size = htons(strlen(state));
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	header.timestamp_sec = htonl(tp.tv_sec);
+	header.timestamp_nsec = htonl(tp.tv_nsec);
+	if(client_send_packet_id(req->client, &header, req->id, state) == -1){
+		debug("[%d] Cannot send ACK for watch %d", req->client->connfd, req->id);
+	}
+	Free(state);
+}
+
+static void unwatch_task(void *arg){
+	game_unwatch((WATCH *) arg);
+}
+
+/*
+ * Start watching, as a spectator, the game in progress of the player
+ * logged in with a specified username.  If that player has several games
+ * in progress, the one with the lowest ID in the player's list is chosen.
+ * The spectator is assigned an ID for the watch, which is used in the
+ * packets sent for it and to stop watching.  If successful, the client
+ * is sent an ACK whose id field is the ID of the watch and whose payload
+ * is the current state of the game, before any packet for the watch.
+ *
+ * @param client  The CLIENT that is to watch the game.
+ * @param name  The username of a player of the game.
+ * @return the ID assigned to the watch, if successful, otherwise -1.
+ */
+int client_watch_game(CLIENT *client, char *name){
+	CLIENT *player = creg_lookup(client_registry, name);
+	if(player == NULL){
+		debug("[%d] No player '%s' to watch", client->connfd, name);
+		return -1;
+	}
+	GAME *game = NULL;
+	P(&player->mutex);
+	for(int i = 0; i < player->invlength && game == NULL; i++){
+		if(player->invlist[i] != NULL && inv_get_game(player->invlist[i]) != NULL){
+			game = game_ref(inv_get_game(player->invlist[i]), "for game to be watched");
+		}
+	}
+	V(&player->mutex);
+	client_unref(player, "because lookup of player to watch is done");
+	if(game == NULL){
+		debug("[%d] Player '%s' has no game in progress", client->connfd, name);
+		return -1;
+	}
+
+	// find a free watch ID; those of watches that have ended are reused
+	P(&client->mutex);
+	int id = -1;
+	for(int i = 0; i < client->watchlength && id == -1; i++){
+		if(client->watchlist[i] == NULL || !watch_is_active(client->watchlist[i])){
+			id = i;
+		}
+	}
+	if(id == -1 && client->watchlength < MAX_WATCHES){
+		// IDs stay below MAX_WATCHES, which fits the id field of version 1
+		int grow = MAX_WATCHES - client->watchlength < 10 ? MAX_WATCHES - client->watchlength : 10;
+		id = client->watchlength;
+		client->watchlist = (WATCH **) Realloc(client->watchlist, (client->watchlength + grow) * sizeof(WATCH *));
+		for(int i = client->watchlength; i < client->watchlength + grow; i++){
+			client->watchlist[i] = NULL;
+		}
+		client->watchlength += grow;
+	}
+	WATCH *old = id != -1 ? client->watchlist[id] : NULL;
+	if(id != -1){
+		client->watchlist[id] = NULL;
+	}
+	V(&client->mutex);
+	if(old != NULL){
+		watch_unref(old);
+	}
+	if(id == -1){
+		debug("[%d] Too many games watched", client->connfd);
+		game_unref(game, "because game cannot be watched");
+		return -1;
+	}
+
+	WATCH_REQUEST req = { client, game, id, NULL };
+	strand_call(game_get_strand(game), watch_task, &req);
+	game_unref(game, "because game dispatch has completed");
+	if(req.watch == NULL){
+		debug("[%d] Game to be watched is already over", client->connfd);
+		return -1;
+	}
+	P(&client->mutex);
+	client->watchlist[id] = req.watch;
+	V(&client->mutex);
+	debug("[%d] Watching game of '%s' as %d", client->connfd, name, id);
+	return id;
+}
+
+/*
+ * Stop watching a game.  It is an error if the watch has already ended.
+ *
+ * @param client  The CLIENT that is watching the game.
+ * @param id  The ID of the watch.
+ * @return 0 if the watch was active and has been ended, otherwise -1.
+ */
+int client_unwatch_game(CLIENT *client, int id){
+	P(&client->mutex);
+	if(id < 0 || id >= client->watchlength || client->watchlist[id] == NULL){
+		V(&client->mutex);
+		return -1;
+	}
+	WATCH *watch = client->watchlist[id];
+	client->watchlist[id] = NULL;
+	V(&client->mutex);
+	int ret = -1;
+	if(watch_is_active(watch)){
+		strand_call(game_get_strand(watch_get_game(watch)), unwatch_task, watch);
+		ret = 0;
+	}
+	watch_unref(watch);
+	return ret;
+}
+
+/*
+ * Stop watching all the games that a client is watching.
+ *
+ * @param client  The CLIENT.
+ */
+void client_unwatch_all(CLIENT *client){
+	for(int i = 0; i < client->watchlength; i++){
+		if(client->watchlist[i] != NULL){
+			client_unwatch_game(client, i);
+		}
+	}
+}
+
+/**************************** TIME LIMITS ************************************/
+unsigned long client_idle_timeout = 0;
+unsigned long client_move_timeout = 0;
+unsigned long client_invite_timeout = 0;
+unsigned long client_time_base = 0;
+unsigned long client_time_increment = 0;
+
+/*
+ * Parse a time control, given as the base time in seconds, optionally
+ * followed by '+' and the increment in seconds ("300", "180+2").  Neither
+ * may exceed CLIENT_TIME_CONTROL_MAX.
+ *
+ * @param str  The string to be parsed.
+ * @param basep  Variable into which to store the base time, in ms.
+ * @param incrementp  Variable into which to store the increment, in ms.
+ * @return 0 if the string is a valid time control, otherwise -1.
+ */
+int client_parse_time_control(char *str, unsigned long *basep, unsigned long *incrementp){
+	char *end;
+	if(*str < '0' || *str > '9'){
+		return -1;
+	}
+	unsigned long base = strtoul(str, &end, 10);
+	unsigned long increment = 0;
+	if(*end == '+'){
+		str = end + 1;
+		if(*str < '0' || *str > '9'){
+			return -1;
+		}
+		increment = strtoul(str, &end, 10);
+	}
+	// strtoul() saturates on overflow, so this also rejects numbers too large for it
+	if(*end != '\0' || base == 0 || base > CLIENT_TIME_CONTROL_MAX
+	   || increment > CLIENT_TIME_CONTROL_MAX){
+		return -1;
+	}
+	*basep = base * 1000;
+	*incrementp = increment * 1000;
+	return 0;
+}
+
+/*
+ * Find the ID that a client has assigned to an invitation.
+ * Returns -1 if the invitation is not in the client's list.
+ */
+static int find_invitation(CLIENT *client, INVITATION *inv){
+	int id = -1;
+	P(&client->mutex);
+	for(int i = 0; i < client->invlength; i++){
+		if(client->invlist[i] == inv){
+			id = i;
+			break;
+		}
+	}
+	V(&client->mutex);
+	return id;
+}
+
+/*
+ * Set the time limit for the next move in a game, or cancel it if the
+ * game is over.  In a timed game, the limit is also never later than the
+ * fall of the flag of the player to move.  Runs on the strand of the game,
+ * unless the game has not yet been made visible to other threads.
+ */
+static void set_move_limit(INVITATION *inv, GAME *game){
+	if(game_is_over(game)){
+		inv_set_timeout(inv, 0, NULL);
+		return;
+	}
+	unsigned long limit = client_move_timeout;
+	long left = game_get_clock(game, game_get_next_mover(game));
+	if(left >= 0 && (limit == 0 || (unsigned long) left < limit)){
+		// a limit of 0 would mean none, so a fallen flag is checked at once
+		limit = left > 0 ? left : 1;
+	}
+	inv_set_timeout(inv, limit, invitation_timeout);
+}
+
+/*
+ * End a game whose flag has just fallen: each player is sent an ENDED
+ * packet, the invitation is removed from the lists of both players, and
+ * the result is posted.  Runs on the strand of the game.
+ */
+static void end_game_on_time(INVITATION *inv, GAME *game){
+	CLIENT *players[2] = { inv_get_source(inv), inv_get_target(inv) };
+	for(int i = 0; i < 2; i++){
+		// client_remove_invitation() releases the client's mutex when it succeeds
+		P(&players[i]->mutex);
+		int id = client_remove_invitation(players[i], inv);
+		if(id == -1){
+			V(&players[i]->mutex);
+			continue;
+		}
+		JEUX_PACKET_HEADER header;
+		header.type = JEUX_ENDED_PKT;
+		header.role = game_get_winner(game);
+		header.size = 0;
+		struct timespec tp;
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		header.timestamp_sec = htonl(tp.tv_sec);
+		header.timestamp_nsec = htonl(tp.tv_nsec);
+		notify_packet_id(players[i], &header, id, NULL);
+	}
+	post_game_result(inv, game);
+}
+
+/*
+ * Handle the expiry of the time limit for a move in a game: if the flag of
+ * the player to move has fallen, the game is over, and otherwise the
+ * player has run out of the time allowed for a move and resigns.  Runs on
+ * the strand of the game, so no move can be made meanwhile.
+ */
+static void move_timeout(INVITATION *inv){
+	GAME *game = inv_get_game(inv);
+	// the player may have moved just before the limit expired
+	if(!inv_timeout_expired(inv) || game_is_over(game)){
+		return;
+	}
+	if(game_flag_fall(game) == 0){
+		end_game_on_time(inv, game);
+		return;
+	}
+	if(client_move_timeout == 0){
+		return;
+	}
+	CLIENT *client = game_get_next_mover(game) == inv_get_source_role(inv) ?
+		inv_get_source(inv) : inv_get_target(inv);
+	int id = find_invitation(client, inv);
+	debug("[%d] Time limit for move in game %d expired", client->connfd, id);
+	if(id == -1 || resign_game(client, id) == -1){
+		debug("[%d] Cannot resign game %d after time limit", client->connfd, id);
+	}
+}
+
+/*
+ * Strand task posted by invitation_timeout(), which owns a reference to
+ * the invitation (and through it, the game).
+ */
+static void move_timeout_task(void *arg){
+	INVITATION *inv = (INVITATION *) arg;
+	move_timeout(inv);
+	inv_unref(inv, "because move time limit has been handled");
+}
+
+/*
+ * Called on the scheduler when the time limit of an invitation expires.
+ * An invitation that has not been accepted in time is revoked, and its
+ * source is sent a REVOKED packet as well as its target.  In a game in
+ * progress, the player to move resigns.
+ */
+static void invitation_timeout(INVITATION *inv){
+	if(!inv_timeout_expired(inv)){
+		return;
+	}
+	GAME *game = inv_get_game(inv);
+	if(game != NULL){
+		// this runs on a scheduler worker, which must not wait for the
+		// strand's task, itself run by the scheduler
+		inv_ref(inv, "for move time limit being handled on the game's strand");
+		if(strand_post(game_get_strand(game), move_timeout_task, inv) != 0){
+			inv_unref(inv, "because move time limit cannot be handled");
+		}
+		return;
+	}
+	CLIENT *source = inv_get_source(inv);
+	int id = find_invitation(source, inv);
+	debug("[%d] Invitation %d expired", source->connfd, id);
+	if(id == -1 || client_revoke_invitation(source, id) == -1){
+		// it has just been accepted, declined or revoked
+		return;
+	}
+	JEUX_PACKET_HEADER header;
+	header.type = JEUX_REVOKED_PKT;
+	header.role = 0;
+	header.size = 0;
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	header.timestamp_sec = htonl(tp.tv_sec);
+	header.timestamp_nsec = htonl(tp.tv_nsec);
+	client_send_packet_id(source, &header, id, NULL);
+}
+
+/**************************** RESUME ************************************/
+/*
+ * A parked session: the CLIENT of a connection that has dropped, which
+ * stays logged in, with its invitations and games, for the grace period.
+ * The session is removed from the list either when it is resumed or when
+ * its timeout expires, by whichever comes first; the task run on expiry
+ * always frees the entry, unless the timeout was cancelled before it
+ * expired.
+ */
+typedef struct parked_session {
+	CLIENT *client;
+	TIMEOUT *timeout;
+	int removed; // set when removed from the list
+	struct parked_session *next;
+} PARKED_SESSION;
+
+unsigned long client_resume_grace = 0;
+
+static PARKED_SESSION *parked_sessions;
+static int parking_closed; // set once the server is shutting down
+static sem_t park_mutex;
+static pthread_once_t park_once = PTHREAD_ONCE_INIT;
+
+static void park_init(void){
+	Sem_init(&park_mutex, 0, 1);
+}
+
+/*
+ * Issue a new resume token to a client.
+ */
+static void new_token(CLIENT *client){
+	unsigned char bytes[RESUME_TOKEN_LEN / 2];
+	if(getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)){
+		// tokens must still differ between sessions
+		uint64_t seed = timeout_now() ^ (uintptr_t) client;
+		memcpy(bytes, &seed, sizeof(bytes));
+	}
+	for(int i = 0; i < (int) sizeof(bytes); i++){
+		sprintf(client->token + 2 * i, "%02x", bytes[i]);
+	}
+}
+
+/*
+ * Determine whether a parked session is that of a player, resumed with
+ * the specified token.  The token is compared in full whatever its
+ * contents, so that the time taken tells nothing about how much of a
+ * guess was right.
+ */
+static int session_matches(CLIENT *client, PLAYER *player, char *token){
+	if(strlen(token) != RESUME_TOKEN_LEN){
+		return 0;
+	}
+	P(&client->mutex);
+	unsigned char diff = client->player != player;
+	for(int i = 0; i < RESUME_TOKEN_LEN; i++){
+		diff |= client->token[i] ^ token[i];
+	}
+	V(&client->mutex);
+	return diff == 0;
+}
+
+/*
+ * Hold a packet for a parked session.  Must be called with the client's
+ * output lock held.  Once too many packets are held, further packets are
+ * discarded and the session can no longer be resumed.
+ */
+static int hold_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, JEUX_PACKET_EXT *ext, void *data){
+	if(client->nheld >= MAX_PARKED_PACKETS){
+		client->overflowed = 1;
+		return 0;
+	}
+	size_t size = ntohs(pkt->size);
+	PARKED_PACKET *held = (PARKED_PACKET *) Malloc(sizeof(PARKED_PACKET) + size);
+	held->next = NULL;
+	held->header = *pkt;
+	held->ext = *ext;
+	if(size > 0){
+		memcpy(held->data, data, size);
+	}
+	*client->held_tail = held;
+	client->held_tail = &held->next;
+	client->nheld++;
+	return 0;
+}
+
+/*
+ * Discard the packets held for a client.
+ */
+static void drop_held(CLIENT *client){
+	while(client->held != NULL){
+		PARKED_PACKET *held = client->held;
+		client->held = held->next;
+		Free(held);
+	}
+	client->held_tail = &client->held;
+	client->nheld = 0;
+}
+
+/*
+ * End a parked session that has been removed from the list: the client is
+ * logged out, as it would have been when its connection dropped, and
+ * unregistered.  Unless wait is set, its games are resigned without
+ * waiting for their strands.
+ */
+static void end_parked_session(CLIENT *client, int wait){
+	debug("End parked session of client %p", client);
+	logout(client, wait);
+	// packets still being sent to it now go to its closed connection
+	P(&client->outlock);
+	client->parked = 0;
+	drop_held(client);
+	V(&client->outlock);
+	if(creg_unregister(client_registry, client) != 0){
+		debug("creg_unregister failed for parked client %p", client);
+	}
+}
+
+/*
+ * Scheduler task that ends a parked session whose grace period has ended.
+ * Its games are resigned by tasks posted to their strands, which it does
+ * not wait for, as the strands may need this worker.
+ */
+static void park_expired_task(void *arg){
+	PARKED_SESSION *session = (PARKED_SESSION *) arg;
+	P(&park_mutex);
+	int expired = !session->removed;
+	if(expired){
+		PARKED_SESSION **pp = &parked_sessions;
+		while(*pp != session){
+			pp = &(*pp)->next;
+		}
+		*pp = session->next;
+		session->removed = 1;
+	}
+	V(&park_mutex);
+	if(expired){
+		end_parked_session(session->client, 0);
+	}
+	timeout_free(session->timeout);
+	Free(session);
+}
+
+/*
+ * Called by the ticker when the grace period of a parked session ends.
+ */
+static void park_expired(void *arg){
+	sched_submit(park_expired_task, arg);
+}
+
+/*
+ * Remove a parked session from the list, and free it unless its expiry
+ * task has already been submitted, in which case that task frees it.
+ * Must be called with the park mutex held, which is released.
+ *
+ * @return the CLIENT of the session.
+ */
+static CLIENT *unpark(PARKED_SESSION **pp){
+	PARKED_SESSION *session = *pp;
+	CLIENT *client = session->client;
+	*pp = session->next;
+	session->removed = 1;
+	V(&park_mutex);
+	if(timeout_cancel(session->timeout)){
+		timeout_free(session->timeout);
+		Free(session);
+	}
+	return client;
+}
+
+/*
+ * Park the session of a logged-in CLIENT whose connection has dropped,
+ * instead of logging it out.  The client stays logged in, and keeps its
+ * invitations and games in progress, for client_resume_grace ms; packets
+ * sent to it meanwhile are held, to be sent once the session is resumed
+ * with client_resume().  Games being watched are not kept.  If the
+ * session has not been resumed by the end of the grace period, the client
+ * is logged out and unregistered.  Once this function has returned
+ * successfully, nothing more is written to the client's connection, which
+ * may then be closed, and the caller must not use the CLIENT again.
+ *
+ * @param client  The CLIENT whose session is to be parked.
+ * @return 0 if the session has been parked, or -1 if it has not, because
+ * the client is not logged in, no grace period is set, or the server is
+ * shutting down.
+ */
+int client_park(CLIENT *client){
+	if(client->player == NULL || client_resume_grace == 0){
+		return -1;
+	}
+	pthread_once(&park_once, park_init);
+	client_unwatch_all(client);
+	P(&park_mutex);
+	if(parking_closed){
+		V(&park_mutex);
+		return -1;
+	}
+	debug("[%d] Park session of client %p for %lu ms", client->connfd, client, client_resume_grace);
+	P(&client->outlock);
+	sendq_close(client->sendq);
+	client->connfd = -1;
+	client->parked = 1;
+	client->overflowed = 0;
+	V(&client->outlock);
+	PARKED_SESSION *session = (PARKED_SESSION *) Malloc(sizeof(PARKED_SESSION));
+	session->client = client;
+	session->timeout = timeout_create(park_expired, session);
+	session->removed = 0;
+	session->next = parked_sessions;
+	parked_sessions = session;
+	timeout_set(session->timeout, client_resume_grace);
+	V(&park_mutex);
+	return 0;
+}
+
+/*
+ * Resume a parked session over the connection of a CLIENT that is not
+ * logged in.  The session's CLIENT takes over the connection, and is sent
+ * an ACK whose payload is a new resume token, followed by the packets held
+ * for it while it was parked.  The CLIENT of the connection is
+ * unregistered, and must not be used again.
+ *
+ * @param client  The CLIENT of the connection, which is not logged in.
+ * @param player  The PLAYER that the parked session is logged in as.
+ * @param token  The resume token that was last issued to the session.
+ * @return the CLIENT of the resumed session, if a session of the player
+ * was parked with that token and can be resumed, otherwise NULL.
+ */
+CLIENT *client_resume(CLIENT *client, PLAYER *player, char *token){
+	pthread_once(&park_once, park_init);
+	P(&park_mutex);
+	PARKED_SESSION **pp = &parked_sessions;
+	while(*pp != NULL && !session_matches((*pp)->client, player, token)){
+		pp = &(*pp)->next;
+	}
+	if(*pp == NULL){
+		V(&park_mutex);
+		return NULL;
+	}
+	CLIENT *resumed = unpark(pp);
+	P(&resumed->outlock);
+	if(resumed->overflowed){
+		V(&resumed->outlock);
+		debug("Cannot resume session of client %p, which has lost packets", resumed);
+		end_parked_session(resumed, 1);
+		return NULL;
+	}
+	debug("[%d] Resume session of client %p", client->connfd, resumed);
+	new_token(resumed);
+	sendq_unref(resumed->sendq);
+	resumed->sendq = sendq_ref(client->sendq);
+	resumed->connfd = client->connfd;
+	JEUX_PACKET_HEADER header;
+	header.type = JEUX_ACK_PKT;
+	header.id = 0;
+	header.role = 0;
+	header.size = htons(RESUME_TOKEN_LEN);
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	header.timestamp_sec = htonl(tp.tv_sec);
+	header.timestamp_nsec = htonl(tp.tv_nsec);
+	JEUX_PACKET_EXT ext = { 0, client->request, JEUX_FLAG_RESPONSE };
+	sendq_send(resumed->sendq, &header, &ext, resumed->token);
+	for(PARKED_PACKET *held = resumed->held; held != NULL; held = held->next){
+		sendq_send(resumed->sendq, &held->header, &held->ext, held->data);
+	}
+	drop_held(resumed);
+	resumed->parked = 0;
+	V(&resumed->outlock);
+	if(creg_unregister(client_registry, client) != 0){
+		debug("creg_unregister failed for client %p", client);
+	}
+	return resumed;
+}
+
+/*
+ * Get the resume token last issued to a logged-in CLIENT.
+ *
+ * @param client  The CLIENT.
+ * @return the token, or NULL if no grace period is set.
+ */
+char *client_get_resume_token(CLIENT *client){
+	return client->token[0] != '\0' ? client->token : NULL;
+}
+
+/*
+ * End all parked sessions, and park no more.  Called when the server is
+ * shutting down, so that the clients of parked sessions are unregistered.
+ */
+void client_resume_shutdown(void){
+	pthread_once(&park_once, park_init);
+	P(&park_mutex);
+	parking_closed = 1;
+	while(parked_sessions != NULL){
+		end_parked_session(unpark(&parked_sessions), 1);
+		P(&park_mutex);
+	}
+	V(&park_mutex);
+}
+
+/*
+ * End all the sessions that are parked at the time, as their grace
+ * periods would, without preventing more from being parked.
+ */
+void client_end_parked(void){
+	pthread_once(&park_once, park_init);
+	P(&park_mutex);
+	while(parked_sessions != NULL){
+		end_parked_session(unpark(&parked_sessions), 1);
+		P(&park_mutex);
+	}
+	V(&park_mutex);
+}
+
+/**************************** HANDOFF ************************************/
+/*
+ * Get the invitations in the list of a client, indexed by their IDs.
+ * A reference is taken on each invitation returned.
+ *
+ * @param client  The CLIENT.
+ * @param np  Variable into which to store the length of the list.
+ * @return the list, in malloc'ed storage, with NULL for unused IDs, or
+ * NULL if the list is empty.
+ */
+INVITATION **client_get_invitations(CLIENT *client, int *np){
+	P(&client->mutex);
+	INVITATION **list = NULL;
+	*np = client->invlength;
+	if(client->invlength > 0){
+		list = (INVITATION **) Malloc(client->invlength * sizeof(INVITATION *));
+		for(int i = 0; i < client->invlength; i++){
+			list[i] = client->invlist[i] != NULL ?
+				inv_ref(client->invlist[i], "for reference being added to invitations list") : NULL;
+		}
+	}
+	V(&client->mutex);
+	return list;
+}
+
+/*
+ * Register a client, logged in as a specified player, for a connection
+ * handed over by another server process.
+ *
+ * @param fd  File descriptor of the connection.
+ * @param player  The PLAYER that the client is logged in as, or NULL if
+ * it is not logged in.
+ * @param token  The resume token issued to the client, or NULL.
+ * @return the CLIENT, registered in client_registry, or NULL if it cannot
+ * be registered.
+ */
+CLIENT *client_restore(int fd, PLAYER *player, char *token){
+	CLIENT *client = creg_register(client_registry, fd);
+	if(client == NULL || player == NULL){
+		return client;
+	}
+	if(client_login(client, player) == -1){
+		creg_unregister(client_registry, client);
+		return NULL;
+	}
+	if(token != NULL && strlen(token) == RESUME_TOKEN_LEN){
+		strcpy(client->token, token);
+	}
+	return client;
+}
+
+/*
+ * Add an INVITATION to the list of a client under a specified ID, as it
+ * was in another server process.
+ *
+ * @param client  The CLIENT.
+ * @param id  The ID of the invitation.
+ * @param inv  The INVITATION, on which a reference is taken.
+ * @return 0 if the invitation has been added, -1 if the ID is in use.
+ */
+int client_restore_invitation(CLIENT *client, int id, INVITATION *inv){
+	P(&client->mutex);
+	if(id < 0 || id >= client->invlength){
+		int length = (id / 10 + 1) * 10;
+		client->invlist = (INVITATION **) Realloc(client->invlist, length * sizeof(INVITATION *) + sizeof(INVITATION **));
+		for(int i = client->invlength; i < length; i++){
+			client->invlist[i] = NULL;
+		}
+		client->invlength = length;
+	}
+	if(client->invlist[id] != NULL){
+		V(&client->mutex);
+		return -1;
+	}
+	client->invlist[id] = inv_ref(inv, "for invitation being added to client's list");
+	V(&client->mutex);
+	return 0;
+}
+
+/*
+ * Set the time limit that applies to an invitation, as it is set when
+ * the invitation is made or accepted, or when a move is made: the limit
+ * for accepting an invitation that is open, or for the next move in its
+ * game.  For an invitation that has been accepted, this must be called
+ * from a task running on the game's strand, or before the game is made
+ * visible to other threads.
+ *
+ * @param inv  The INVITATION.
+ */
+void client_set_time_limit(INVITATION *inv){
+	GAME *game = inv_get_game(inv);
+	if(game != NULL){
+		set_move_limit(inv, game);
+	} else if(client_invite_timeout > 0){
+		inv_set_timeout(inv, client_invite_timeout, invitation_timeout);
+	}
+}
@@ -1,14 +1,109 @@
 #include "csapp.h"
 #include "client_registry.h"
+#include "client_ext.h"
+#include "creg_snapshot.h"
+#include "epoch.h"
+#include "coro.h"
 #include "debug.h"
 
+/*
+ * The login state of a registered client: the client and the PLAYER it is
+ * logged in as, with a reference to each.  An entry never changes once it
+ * has been made; a login or logout replaces it with a new one.  It is
+ * shared by the registry and the snapshots that list it, each holding a
+ * count on it, and is freed when the last of them lets it go.  Entries are
+ * made and freed outside the registry mutex, as taking the references
+ * needs the locks of the client and the player.
+ */
+typedef struct creg_entry {
+	int refcnt;
+	CLIENT *client;
+	PLAYER *player; // NULL if the client is not logged in
+} CREG_ENTRY;
+
+/*
+ * Immutable snapshot of the registered clients.
+ */
+typedef struct creg_snapshot {
+	int count;
+	int nplayers;
+	CREG_ENTRY *entries[];
+} CREG_SNAPSHOT;
+
+/*
+ * The registry has room for MAX_CLIENTS clients, except that when the
+ * clients are served by coroutines, which cost far less than a thread
+ * each, the room is doubled whenever it runs out.
+ */
 typedef struct client_registry{
-	CLIENT *buf[MAX_CLIENTS];
+	CREG_ENTRY **buf;
+	int size;  // number of slots in buf
 	int count;
-	sem_t mutex;
+	CREG_SNAPSHOT *snapshot; // current snapshot, read without the mutex
+	sem_t mutex; // serializes writers
 	sem_t empty;
 } CLIENT_REGISTRY;
 
+static CREG_ENTRY *entry_create(CLIENT *client, PLAYER *player){
+	CREG_ENTRY *entry = (CREG_ENTRY *) Malloc(sizeof(CREG_ENTRY));
+	entry->refcnt = 1;
+	entry->client = client_ref(client, "for reference being retained by registry entry");
+	entry->player = player != NULL ? player_ref(player, "for reference being retained by registry entry") : NULL;
+	return entry;
+}
+
+static void entry_unref(CREG_ENTRY *entry){
+	if(__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		if(entry->player != NULL){
+			player_unref(entry->player, "because registry entry is being freed");
+		}
+		client_unref(entry->client, "because registry entry is being freed");
+		Free(entry);
+	}
+}
+
+static void snapshot_free(void *arg){
+	CREG_SNAPSHOT *snap = (CREG_SNAPSHOT *) arg;
+	for(int i = 0; i < snap->count; i++){
+		entry_unref(snap->entries[i]);
+	}
+	Free(snap);
+}
+
+/*
+ * Build a snapshot of the registry from its entries and make it the
+ * current one.  The caller must hold the registry mutex, and must retire
+ * the superseded snapshot with retire() once it has released the mutex.
+ *
+ * @return the superseded snapshot, or NULL if there was none.
+ */
+static CREG_SNAPSHOT *publish(CLIENT_REGISTRY *cr){
+	CREG_SNAPSHOT *snap = (CREG_SNAPSHOT *) Malloc(sizeof(CREG_SNAPSHOT) + cr->count * sizeof(CREG_ENTRY *));
+	snap->count = 0;
+	snap->nplayers = 0;
+	for(int i = 0; i < cr->size; i++){
+		if(cr->buf[i] != NULL){
+			CREG_ENTRY *entry = cr->buf[i];
+			__atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+			snap->entries[snap->count++] = entry;
+			if(entry->player != NULL){
+				snap->nplayers++;
+			}
+		}
+	}
+	return __atomic_exchange_n(&cr->snapshot, snap, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Hand a superseded snapshot to be reclaimed once no reader can still be
+ * using it.
+ */
+static void retire(CREG_SNAPSHOT *old){
+	if(old != NULL){
+		epoch_retire(old, snapshot_free);
+	}
+}
+
 // CLIENT_REGISTRY cr;
 
 /*
@@ -24,10 +119,13 @@ CLIENT_REGISTRY *creg_init(){
 		debug("malloc Error when Initializing CLIENT_REGISTRY");
 		return NULL; // Initialization fails
 	}
-	memset(&cr->buf, 0, sizeof(CLIENT *)*MAX_CLIENTS);
+	cr->buf = (CREG_ENTRY **) Calloc(MAX_CLIENTS, sizeof(CREG_ENTRY *));
+	cr->size = MAX_CLIENTS;
 	cr->count = 0;
+	cr->snapshot = NULL;
 	Sem_init(&cr->mutex, 0, 1);
 	Sem_init(&cr->empty, 0 ,1);
+	publish(cr);
 	return cr;
 }
 
@@ -46,6 +144,9 @@ void creg_fini(CLIENT_REGISTRY *cr){
 	// 	}
 	// }
 	if(cr != NULL){
+		epoch_retire(cr->snapshot, snapshot_free);
+		epoch_synchronize();
+		Free(cr->buf);
 		Free(cr);
 	}
 }
@@ -62,22 +163,31 @@ void creg_fini(CLIENT_REGISTRY *cr){
  */
 CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
 	CLIENT *cp = client_create(cr, fd); // increase reference count
+	CREG_ENTRY *entry = entry_create(cp, NULL);
 	P(&cr->mutex);
+	if(cr->count == cr->size && coro_enabled()){
+		cr->buf = (CREG_ENTRY **) Realloc(cr->buf, 2 * cr->size * sizeof(CREG_ENTRY *));
+		memset(cr->buf + cr->size, 0, cr->size * sizeof(CREG_ENTRY *));
+		cr->size *= 2;
+	}
 	// Insert fd into a NULL spot in array
-	for(int i = 0; i < MAX_CLIENTS; i++){
+	for(int i = 0; i < cr->size; i++){
 		if(cr->buf[i] == NULL){
-			cr->buf[i] = cp;
+			cr->buf[i] = entry;
 			if(cr->count == 0){
 				P(&cr->empty);
 			}
 			cr->count++;
 			debug("Register client fd %d (total connected: %d)", fd, cr->count);
+			CREG_SNAPSHOT *old = publish(cr);
 			V(&cr->mutex);
+			retire(old);
 			return cp;
 		}
 	}
 	debug("Failed to register client fd %d (total connected: %d)", fd, cr->count);
 	V(&cr->mutex);
+	entry_unref(entry);
 	return NULL;
 }
 
@@ -97,16 +207,20 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
  */
 int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
 	P(&cr->mutex);
-	for(int i=0; i<MAX_CLIENTS; i++){
-		if(cr->buf[i] == client){
+	for(int i=0; i<cr->size; i++){
+		if(cr->buf[i] != NULL && cr->buf[i]->client == client){
 			debug("Unregister client fd %d (total connected %d)", client_get_fd(client), cr->count);
-			client_unref(client, "because client is being unregistered.");
+			CREG_ENTRY *entry = cr->buf[i];
 			cr->buf[i] = NULL;
 			cr->count--;
+			CREG_SNAPSHOT *old = publish(cr);
 			if(cr->count == 0){
 				V(&cr->empty);
 			}
 			V(&cr->mutex);
+			retire(old);
+			entry_unref(entry);
+			client_unref(client, "because client is being unregistered.");
 			return 0;
 		}
 	}
@@ -125,23 +239,19 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
  * username, if there is one, otherwise NULL.
  */
 CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
-	P(&cr->mutex);
 	CLIENT *client = NULL;
+	epoch_enter();
+	CREG_SNAPSHOT *snap = __atomic_load_n(&cr->snapshot, __ATOMIC_SEQ_CST);
 
 	// iterate through all logged in clients and check their usernames
-	for(int i=0; i<MAX_CLIENTS; i++){
-		if(cr->buf[i] != NULL){ // if there is a client pointer there
-			if( client_get_player(cr->buf[i]) != NULL ){ // If that client is logged in
-				int r = strcmp(user, player_get_name(client_get_player(cr->buf[i])));
-				if(r == 0){ // the usernames are equal
-					client = client_ref(cr->buf[i], "for reference being returned by creg_lookup()");
-					V(&cr->mutex);
-					return client;
-				}
-			}
+	for(int i = 0; i < snap->count; i++){
+		PLAYER *player = snap->entries[i]->player;
+		if(player != NULL && strcmp(user, player_get_name(player)) == 0){
+			client = client_ref(snap->entries[i]->client, "for reference being returned by creg_lookup()");
+			break;
 		}
 	}
-	V(&cr->mutex);
+	epoch_exit();
 	return client;
 }
 
@@ -157,39 +267,28 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
  * @return the list of players as a NULL-terminated array of pointers.
  */
 PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
-	P(&cr->mutex);
-
-	// Count the number of players inside cr
-	int count = 0;
-	for(int i=0; i < MAX_CLIENTS; i++){
-		PLAYER *player;
-		if(cr->buf[i] != NULL){
-			if((player = client_get_player(cr->buf[i])) != NULL )
-				count++;
-		}
-	}
+	epoch_enter();
+	CREG_SNAPSHOT *snap = __atomic_load_n(&cr->snapshot, __ATOMIC_SEQ_CST);
 
 	// Calloc Result Array
-	PLAYER **result = calloc(count + 1, sizeof(PLAYER *));
+	PLAYER **result = calloc(snap->nplayers + 1, sizeof(PLAYER *));
 	if(result == NULL){
 		debug("calloc error.");
+		epoch_exit();
 		return NULL;
 	}
 
 	// Insert all players into result array
 	int index = 0;
-	for(int i=0; i < MAX_CLIENTS; i++){
-		if(cr->buf[i] != NULL){
-			if( (client_get_player(cr->buf[i])) != NULL ){
-				result[index] = client_get_player(cr->buf[i]);
-				player_ref(result[index], "for reference being added to players list");
-				index++;
-			}
+	for(int i = 0; i < snap->count; i++){
+		if(snap->entries[i]->player != NULL){
+			result[index] = player_ref(snap->entries[i]->player, "for reference being added to players list");
+			index++;
 		}
 	}
-	result[count] = NULL; // NULL terminator
+	result[index] = NULL; // NULL terminator
 
-	V(&cr->mutex);
+	epoch_exit();
 	return result;
 }
 
@@ -216,12 +315,67 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr){
  * @param cr  The client registry.
  */
 void creg_shutdown_all(CLIENT_REGISTRY *cr){
+	// a snapshot may still list clients whose connections have since been
+	// closed, and their descriptors reused; a registered client's
+	// connection is only closed after it has been unregistered
 	P(&cr->mutex);
-	for(int i = 0; i < MAX_CLIENTS; i++){
+	for(int i = 0; i < cr->size; i++){
 		if(cr->buf[i] != NULL){
-			debug("Shutting down client %d", client_get_fd(cr->buf[i]));
-			shutdown(client_get_fd(cr->buf[i]),SHUT_RD);
+			client_shutdown(cr->buf[i]->client);
+		}
+	}
+	V(&cr->mutex);
+}
+
+/*
+ * Record the PLAYER that a registered client is now logged in as, and
+ * publish a new snapshot of a client registry.  This must be called
+ * whenever the login state of a registered client changes, after the
+ * change has been made, by the thread that made it.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT.
+ * @param player  The PLAYER the client is logged in as, or NULL if it has
+ * logged out.
+ */
+void creg_update_snapshot(CLIENT_REGISTRY *cr, CLIENT *client, PLAYER *player){
+	CREG_ENTRY *entry = entry_create(client, player);
+	CREG_SNAPSHOT *old = NULL;
+	P(&cr->mutex);
+	for(int i = 0; i < cr->size; i++){
+		if(cr->buf[i] != NULL && cr->buf[i]->client == client){
+			CREG_ENTRY *replaced = cr->buf[i];
+			cr->buf[i] = entry;
+			entry = replaced;
+			old = publish(cr);
+			break;
 		}
 	}
 	V(&cr->mutex);
+	retire(old);
+	// the replaced entry, or the new one if the client is not registered
+	entry_unref(entry);
+}
+
+/*
+ * Return a list of all registered clients, whether logged in or not,
+ * taken from the current snapshot.  The result is returned as a malloc'ed
+ * array of CLIENT pointers, with a NULL pointer marking the end of the
+ * array.  It is the caller's responsibility to decrement the reference
+ * count of each of the entries and to free the array when it is no
+ * longer needed.
+ *
+ * @param cr  The client registry.
+ * @return the list of clients as a NULL-terminated array of pointers.
+ */
+CLIENT **creg_all_clients(CLIENT_REGISTRY *cr){
+	epoch_enter();
+	CREG_SNAPSHOT *snap = __atomic_load_n(&cr->snapshot, __ATOMIC_SEQ_CST);
+	CLIENT **result = (CLIENT **) Malloc((snap->count + 1) * sizeof(CLIENT *));
+	for(int i = 0; i < snap->count; i++){
+		result[i] = client_ref(snap->entries[i]->client, "for reference being added to clients list");
+	}
+	result[snap->count] = NULL;
+	epoch_exit();
+	return result;
 }
@@ -0,0 +1,540 @@
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "coro.h"
+#include "spsc.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define CORO_EVENTS 64
+#define CORO_QUEUE_LEN 1024       // messages between each pair of shards
+
+typedef struct coro_thread CORO_THREAD;
+
+typedef struct coro {
+	ucontext_t ctx;
+	char *stack;              // Lowest address of the mapping, the guard page
+	CORO_FUNC func;
+	void *arg;
+	CORO_THREAD *thread;
+	int fd;                   // File descriptor registered with epoll, or -1
+	int done;
+	struct coro *next;        // Link in a run queue
+} CORO;
+
+/*
+ * A message posted to a coroutine thread from a thread that is not one,
+ * or that found the queue between the two full.
+ */
+typedef struct posted {
+	CORO_FUNC func;
+	void *arg;
+	int shard;                // Shard that posted it, or -1
+	struct posted *next;
+} POSTED;
+
+/*
+ * Completion record used by coro_call() to wait for its function.
+ */
+typedef struct coro_call {
+	CORO_FUNC func;
+	void *arg;
+	CORO_EVENT done;
+} CORO_CALL;
+
+struct coro_thread {
+	pthread_t tid;
+	int index;
+	int epfd;
+	int wake_pipe[2];         // Made readable when coroutines are spawned
+	ucontext_t sched_ctx;     // Context of the thread's scheduling loop
+	CORO *current;
+	CORO *ready;              // Coroutines ready to run, oldest first
+	CORO *ready_tail;
+	CORO *incoming;           // Coroutines spawned from other threads
+	int count;                // Coroutines assigned to the thread
+	POSTED *posted;           // Messages from other threads, newest first
+	sem_t mutex;              // Protects incoming, count and posted
+	SPSC_QUEUE **inbound;     // When sharded, messages from each shard
+	int *overflowed;          // When sharded, messages from each shard in posted
+	int sleeping;             // Waiting, or about to wait, in epoll_wait()
+};
+
+static CORO_THREAD *threads;
+static int nthreads;
+static int sharded;
+static size_t page_size;
+static __thread CORO_THREAD *self = NULL;
+
+static void make_ready(CORO_THREAD *t, CORO *c){
+	c->next = NULL;
+	if(t->ready_tail != NULL){
+		t->ready_tail->next = c;
+	} else {
+		t->ready = c;
+	}
+	t->ready_tail = c;
+}
+
+static void trampoline(void){
+	CORO *c = self->current;
+	c->func(c->arg);
+	c->done = 1;
+	// returning resumes the scheduling loop, through uc_link
+}
+
+static void free_coro(CORO_THREAD *t, CORO *c){
+	munmap(c->stack, CORO_STACK_SIZE + page_size);
+	Free(c);
+	P(&t->mutex);
+	t->count--;
+	V(&t->mutex);
+}
+
+/*
+ * Run the messages that have been posted to a coroutine thread: first
+ * those from each shard, then those from other threads, oldest first.
+ * A shard whose queue has filled up posts to the locked list until this
+ * has taken all it posted there, so each shard's messages are run in the
+ * order in which they were posted.
+ */
+static void deliver(CORO_THREAD *t){
+	for(int i = 0; sharded && i < nthreads; i++){
+		CORO_FUNC func;
+		void *arg;
+		while(spsc_pop(t->inbound[i], &func, &arg) == 0){
+			func(arg);
+		}
+	}
+	if(__atomic_load_n(&t->posted, __ATOMIC_ACQUIRE) != NULL){
+		P(&t->mutex);
+		POSTED *in = t->posted;
+		t->posted = NULL;
+		POSTED *reversed = NULL;
+		while(in != NULL){
+			POSTED *m = in;
+			in = m->next;
+			m->next = reversed;
+			reversed = m;
+			if(m->shard >= 0){
+				__atomic_sub_fetch(&t->overflowed[m->shard], 1, __ATOMIC_RELEASE);
+			}
+		}
+		V(&t->mutex);
+		while(reversed != NULL){
+			POSTED *m = reversed;
+			reversed = m->next;
+			m->func(m->arg);
+			Free(m);
+		}
+	}
+}
+
+/*
+ * Determine whether a coroutine thread has anything to do without
+ * waiting in epoll_wait().
+ */
+static int pending(CORO_THREAD *t){
+	if(t->ready != NULL || __atomic_load_n(&t->incoming, __ATOMIC_ACQUIRE) != NULL
+	   || __atomic_load_n(&t->posted, __ATOMIC_ACQUIRE) != NULL){
+		return 1;
+	}
+	for(int i = 0; sharded && i < nthreads; i++){
+		if(!spsc_empty(t->inbound[i])){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Wake a coroutine thread that may be waiting in epoll_wait(), after
+ * something has been given to it.  The fence pairs with the one in the
+ * scheduling loop: either the thread sees what was given to it before it
+ * waits, or this sees that it is waiting.
+ */
+static void wake(CORO_THREAD *t){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&t->sleeping, __ATOMIC_RELAXED)
+	   || !__atomic_exchange_n(&t->sleeping, 0, __ATOMIC_RELAXED)){
+		return;
+	}
+	char one = 0;
+	if(write(t->wake_pipe[1], &one, 1) < 0 && errno != EAGAIN){
+		debug("Cannot wake coroutine thread");
+	}
+}
+
+/*
+ * Scheduling loop of a coroutine thread: run the messages posted to it
+ * and the coroutines that are ready, each until it waits or ends, then
+ * wait for some of them to become ready again.  Signals are blocked, so
+ * that they go to the main thread.
+ */
+static void *coro_thread(void *arg){
+	CORO_THREAD *t = (CORO_THREAD *) arg;
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	Pthread_detach(pthread_self());
+	self = t;
+	struct epoll_event events[CORO_EVENTS];
+	while(1){
+		P(&t->mutex);
+		CORO *in = t->incoming;
+		t->incoming = NULL;
+		V(&t->mutex);
+		// spawned coroutines are pushed on a stack: start them in order
+		CORO *reversed = NULL;
+		while(in != NULL){
+			CORO *c = in;
+			in = c->next;
+			c->next = reversed;
+			reversed = c;
+		}
+		while(reversed != NULL){
+			CORO *c = reversed;
+			reversed = c->next;
+			make_ready(t, c);
+		}
+
+		deliver(t);
+
+		// coroutines made ready meanwhile wait for the next round
+		CORO *round = t->ready;
+		t->ready = t->ready_tail = NULL;
+		while(round != NULL){
+			CORO *c = round;
+			round = c->next;
+			t->current = c;
+			swapcontext(&t->sched_ctx, &c->ctx);
+			t->current = NULL;
+			if(c->done){
+				free_coro(t, c);
+			}
+		}
+
+		__atomic_store_n(&t->sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int n = epoll_wait(t->epfd, events, CORO_EVENTS, pending(t) ? 0 : -1);
+		__atomic_store_n(&t->sleeping, 0, __ATOMIC_RELAXED);
+		for(int i = 0; i < n; i++){
+			if(events[i].data.ptr == NULL){
+				char buf[64];
+				while(read(t->wake_pipe[0], buf, sizeof(buf)) > 0)
+					;
+			} else {
+				make_ready(t, (CORO *) events[i].data.ptr);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start the coroutine threads.
+ *
+ * @param n  Number of coroutine threads.
+ * @param shards  If nonzero, the threads are also shards, with a message
+ * queue from each to each.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_init(int n, int shards){
+	if(n <= 0){
+		return -1;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+	threads = (CORO_THREAD *) Calloc(n, sizeof(CORO_THREAD));
+	for(int i = 0; i < n; i++){
+		CORO_THREAD *t = &threads[i];
+		t->index = i;
+		Sem_init(&t->mutex, 0, 1);
+		if(shards){
+			t->inbound = (SPSC_QUEUE **) Calloc(n, sizeof(SPSC_QUEUE *));
+			for(int j = 0; j < n; j++){
+				t->inbound[j] = spsc_create(CORO_QUEUE_LEN);
+			}
+			t->overflowed = (int *) Calloc(n, sizeof(int));
+		}
+		if((t->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || pipe(t->wake_pipe) < 0){
+			debug("Cannot set up coroutine thread: %s", strerror(errno));
+			return -1;
+		}
+		fcntl(t->wake_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(t->wake_pipe[1], F_SETFL, O_NONBLOCK);
+		struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+		epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wake_pipe[0], &ev);
+	}
+	sharded = shards;
+	nthreads = n;
+	for(int i = 0; i < n; i++){
+		Pthread_create(&threads[i].tid, NULL, coro_thread, &threads[i]);
+	}
+	debug("Running client services as coroutines on %d threads%s", n, shards ? " (sharded)" : "");
+	return 0;
+}
+
+/*
+ * Determine whether coroutines are in use.
+ *
+ * @return nonzero if coro_init() has succeeded, otherwise 0.
+ */
+int coro_enabled(void){
+	return nthreads > 0;
+}
+
+/*
+ * Start a coroutine, on the coroutine thread that has the fewest.
+ *
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_spawn(CORO_FUNC func, void *arg){
+	CORO *c = (CORO *) Calloc(1, sizeof(CORO));
+	c->stack = mmap(NULL, CORO_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(c->stack == MAP_FAILED){
+		unix_error("Cannot allocate coroutine stack");
+	}
+	// an overflow faults on the guard page instead of corrupting memory
+	mprotect(c->stack, page_size, PROT_NONE);
+	c->func = func;
+	c->arg = arg;
+	c->fd = -1;
+
+	CORO_THREAD *t = &threads[0];
+	for(int i = 1; i < nthreads; i++){
+		if(__atomic_load_n(&threads[i].count, __ATOMIC_RELAXED) < __atomic_load_n(&t->count, __ATOMIC_RELAXED)){
+			t = &threads[i];
+		}
+	}
+	c->thread = t;
+	getcontext(&c->ctx);
+	c->ctx.uc_stack.ss_sp = c->stack + page_size;
+	c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+	c->ctx.uc_link = &t->sched_ctx;
+	makecontext(&c->ctx, trampoline, 0);
+
+	P(&t->mutex);
+	t->count++;
+	c->next = t->incoming;
+	t->incoming = c;
+	V(&t->mutex);
+	char one = 0;
+	if(write(t->wake_pipe[1], &one, 1) < 0 && errno != EAGAIN){
+		debug("Cannot wake coroutine thread");
+	}
+}
+
+/*
+ * Determine whether the caller is running in a coroutine.
+ *
+ * @return nonzero if the caller is running in a coroutine, otherwise 0.
+ */
+int coro_active(void){
+	return self != NULL && self->current != NULL;
+}
+
+/*
+ * Suspend the calling coroutine until a file descriptor has one of the
+ * specified events, or an error.
+ */
+static void wait_fd(int fd, uint32_t events){
+	if(!coro_active()){
+		return;
+	}
+	CORO *c = self->current;
+	struct epoll_event ev = { events | EPOLLONESHOT, { .ptr = c } };
+	int op = c->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if(epoll_ctl(self->epfd, op, fd, &ev) < 0){
+		// a descriptor number reused since it was last registered
+		if(errno != EEXIST && errno != ENOENT){
+			debug("Cannot wait for %d in coroutine: %s", fd, strerror(errno));
+			return;
+		}
+		op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if(epoll_ctl(self->epfd, op, fd, &ev) < 0){
+			debug("Cannot wait for %d in coroutine: %s", fd, strerror(errno));
+			return;
+		}
+	}
+	c->fd = fd;
+	swapcontext(&c->ctx, &self->sched_ctx);
+}
+
+/*
+ * Wait until a file descriptor is readable (or has reached EOF or an
+ * error), letting the other coroutines of the calling thread run
+ * meanwhile.  Outside a coroutine, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ */
+void coro_wait_readable(int fd){
+	wait_fd(fd, EPOLLIN | EPOLLRDHUP);
+}
+
+/*
+ * Wait until a file descriptor is writable (or has an error), letting the
+ * other coroutines of the calling thread run meanwhile.  Outside a
+ * coroutine, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ */
+void coro_wait_writable(int fd){
+	wait_fd(fd, EPOLLOUT);
+}
+
+/*
+ * Let the other coroutines of the calling thread run, and its messages,
+ * before carrying on.  Outside a coroutine, this returns at once.
+ */
+void coro_yield(void){
+	if(!coro_active()){
+		return;
+	}
+	CORO *c = self->current;
+	make_ready(self, c);
+	swapcontext(&c->ctx, &self->sched_ctx);
+}
+
+/*
+ * Determine whether the coroutine threads are shards.
+ *
+ * @return nonzero if coro_init() has succeeded with shards, otherwise 0.
+ */
+int coro_sharded(void){
+	return nthreads > 0 && sharded;
+}
+
+/*
+ * Get the number of shards.
+ *
+ * @return the number of coroutine threads, if they are shards, otherwise 0.
+ */
+int coro_nshards(void){
+	return coro_sharded() ? nthreads : 0;
+}
+
+/*
+ * Get the shard of the calling thread.
+ *
+ * @return the index of the calling coroutine thread, if it is a shard,
+ * otherwise -1.
+ */
+int coro_shard(void){
+	return self != NULL && sharded ? self->index : -1;
+}
+
+/*
+ * Post a message to a shard: a function to be run on its coroutine
+ * thread, between coroutines.  From another shard, the message goes
+ * through the queue between the two, without taking a lock, unless that
+ * queue has filled up and the messages that did not fit have yet to be
+ * taken.  The messages posted by a thread are run in the order in which
+ * they were posted.
+ *
+ * @param shard  The shard.
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_post(int shard, CORO_FUNC func, void *arg){
+	CORO_THREAD *t = &threads[shard];
+	int from = self != NULL && sharded ? self->index : -1;
+	if(from == -1 || __atomic_load_n(&t->overflowed[from], __ATOMIC_ACQUIRE) > 0
+	   || spsc_push(t->inbound[from], func, arg) != 0){
+		// not from a shard, or the queue is full: take the slow path
+		POSTED *m = (POSTED *) Malloc(sizeof(POSTED));
+		m->func = func;
+		m->arg = arg;
+		m->shard = from;
+		P(&t->mutex);
+		if(from >= 0){
+			__atomic_add_fetch(&t->overflowed[from], 1, __ATOMIC_RELAXED);
+		}
+		m->next = t->posted;
+		t->posted = m;
+		V(&t->mutex);
+	}
+	if(t != self){
+		wake(t);
+	}
+}
+
+static void resume_message(void *arg){
+	make_ready(self, (CORO *) arg);
+}
+
+/*
+ * Prepare an event for the calling thread or coroutine to wait for.
+ *
+ * @param ev  The event.
+ */
+void coro_event_init(CORO_EVENT *ev){
+	if(coro_active()){
+		ev->waiter = self->current;
+		ev->origin = self->index;
+	} else {
+		ev->waiter = NULL;
+		Sem_init(&ev->done, 0, 0);
+	}
+}
+
+/*
+ * Wait for an event to be signalled.  A coroutine lets the other
+ * coroutines of its thread run while it waits, and so must not hold a
+ * lock; any other thread blocks.
+ *
+ * @param ev  The event, prepared by the caller with coro_event_init().
+ */
+void coro_event_wait(CORO_EVENT *ev){
+	if(ev->waiter != NULL){
+		// resumed by a message, which is not run until this has switched away
+		swapcontext(&((CORO *) ev->waiter)->ctx, &self->sched_ctx);
+	} else {
+		P(&ev->done);
+		sem_destroy(&ev->done);
+	}
+}
+
+/*
+ * Signal an event, waking the thread or coroutine that waits for it.
+ *
+ * @param ev  The event.
+ */
+void coro_event_signal(CORO_EVENT *ev){
+	if(ev->waiter != NULL){
+		coro_post(ev->origin, resume_message, ev->waiter);
+	} else {
+		V(&ev->done);
+	}
+}
+
+static void call_message(void *arg){
+	CORO_CALL *call = (CORO_CALL *) arg;
+	call->func(call->arg);
+	coro_event_signal(&call->done);
+}
+
+/*
+ * Run a function on a shard and wait for it to complete.  On the shard
+ * itself, the function is simply run in-line.  A coroutine lets the
+ * other coroutines of its thread run while it waits, and so must not hold
+ * a lock; any other thread blocks.
+ *
+ * @param shard  The shard.
+ * @param func  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ */
+void coro_call(int shard, CORO_FUNC func, void *arg){
+	if(coro_shard() == shard){
+		func(arg);
+		return;
+	}
+	CORO_CALL call;
+	call.func = func;
+	call.arg = arg;
+	coro_event_init(&call.done);
+	coro_post(shard, call_message, &call);
+	coro_event_wait(&call.done);
+}
@@ -0,0 +1,183 @@
+#include "epoch.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Per-thread record of read-side activity.  Records are never freed;
+ * when a thread exits its record is released for reuse by a later thread.
+ */
+typedef struct epoch_record {
+	unsigned long epoch; // global epoch observed on entry
+	int active;          // thread is inside a read-side critical section
+	int in_use;          // record is owned by some thread
+	struct epoch_record *next;
+} EPOCH_RECORD;
+
+/*
+ * An object waiting for reclamation.
+ */
+typedef struct retired {
+	void *obj;
+	EPOCH_FREE_FN free_fn;
+	unsigned long epoch; // global epoch at the time of retirement
+	struct retired *next;
+} RETIRED;
+
+static unsigned long global_epoch = 0;
+static EPOCH_RECORD *records = NULL;
+static RETIRED *limbo = NULL;
+static sem_t limbo_mutex;
+static pthread_key_t record_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static __thread EPOCH_RECORD *my_record = NULL;
+
+static void release_record(void *arg){
+	EPOCH_RECORD *rec = (EPOCH_RECORD *) arg;
+	__atomic_store_n(&rec->active, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_init(void){
+	Sem_init(&limbo_mutex, 0, 1);
+	pthread_key_create(&record_key, release_record);
+}
+
+/*
+ * Get the record of the calling thread, claiming a free one or
+ * allocating a new one the first time the thread gets here.
+ */
+static EPOCH_RECORD *get_record(void){
+	if(my_record != NULL){
+		return my_record;
+	}
+	pthread_once(&epoch_once, epoch_init);
+	EPOCH_RECORD *rec;
+	for(rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next){
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+					       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+	if(rec == NULL){
+		rec = (EPOCH_RECORD *) Malloc(sizeof(EPOCH_RECORD));
+		rec->epoch = 0;
+		rec->active = 0;
+		rec->in_use = 1;
+		rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+						   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	my_record = rec;
+	pthread_setspecific(record_key, rec);
+	return rec;
+}
+
+/*
+ * Advance the global epoch, if every thread that is inside a read-side
+ * critical section has observed the current one.
+ */
+static void try_advance(void){
+	unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	for(EPOCH_RECORD *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next){
+		if(__atomic_load_n(&rec->in_use, __ATOMIC_SEQ_CST)
+		   && __atomic_load_n(&rec->active, __ATOMIC_SEQ_CST)
+		   && __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST) != e){
+			return;
+		}
+	}
+	__atomic_compare_exchange_n(&global_epoch, &e, e + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Free the retired objects that are two or more epochs old: no reader
+ * that could have seen them is still inside its critical section.
+ * Returns the number of objects still waiting.
+ */
+static int reclaim(void){
+	unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	RETIRED *done = NULL;
+	int waiting = 0;
+	P(&limbo_mutex);
+	RETIRED **pp = &limbo;
+	while(*pp != NULL){
+		RETIRED *r = *pp;
+		if(r->epoch + 2 <= e){
+			*pp = r->next;
+			r->next = done;
+			done = r;
+		} else {
+			pp = &r->next;
+			waiting++;
+		}
+	}
+	V(&limbo_mutex);
+	// free outside the lock, since the free functions may drop references
+	while(done != NULL){
+		RETIRED *r = done;
+		done = r->next;
+		r->free_fn(r->obj);
+		Free(r);
+	}
+	return waiting;
+}
+
+/*
+ * Enter a read-side critical section.  Objects that are reachable from
+ * shared pointers when this function returns will not be freed before
+ * the matching call to epoch_exit().
+ */
+void epoch_enter(void){
+	EPOCH_RECORD *rec = get_record();
+	__atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	__atomic_store_n(&rec->active, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Leave a read-side critical section.  Pointers obtained inside the
+ * critical section must not be used afterwards, unless a reference
+ * count has been taken on the object concerned.
+ */
+void epoch_exit(void){
+	__atomic_store_n(&my_record->active, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Retire an object that has been unlinked from all shared pointers.
+ * The object is freed by calling the specified function once no reader
+ * can still hold a pointer to it.  Retired objects are reclaimed as a
+ * side effect of later calls to epoch_retire() and epoch_synchronize().
+ *
+ * @param obj  The object that has been retired.
+ * @param free_fn  Function to be called to free the object.
+ */
+void epoch_retire(void *obj, EPOCH_FREE_FN free_fn){
+	pthread_once(&epoch_once, epoch_init);
+	RETIRED *r = (RETIRED *) Malloc(sizeof(RETIRED));
+	r->obj = obj;
+	r->free_fn = free_fn;
+	r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	P(&limbo_mutex);
+	r->next = limbo;
+	limbo = r;
+	V(&limbo_mutex);
+	try_advance();
+	reclaim();
+}
+
+/*
+ * Wait until all objects retired so far have been freed.  This function
+ * must not be called from within a read-side critical section.
+ */
+void epoch_synchronize(void){
+	pthread_once(&epoch_once, epoch_init);
+	while(1){
+		try_advance();
+		if(reclaim() == 0){
+			break;
+		}
+		usleep(1000);
+	}
+}
@@ -0,0 +1,838 @@
+#include <sys/un.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+
+#include "client_registry.h"
+#include "client_ext.h"
+#include "player_registry.h"
+#include "federation.h"
+#include "protocol_ext.h"
+#include "jeux_globals.h"
+#include "coro.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define FED_LINE_MAX 1024  // longest message or directory line
+#define FED_KEY_MAX 96     // longest invitation key
+
+/*
+ * The proxy CLIENT of a player logged in on another node.  Proxies are
+ * kept for as long as the server runs.
+ */
+typedef struct proxy {
+	CLIENT *client;
+	char *name;
+	struct proxy *next;
+} PROXY;
+
+struct fed_peer {
+	char *addr;               // <host>:<port> of the node
+	int fd;                   // outgoing link, or -1 while not connected
+	char *buf;                // messages waiting to be written
+	size_t len;
+	size_t size;
+	PROXY *proxies;
+	sem_t mutex;              // protects buf, len, size and proxies
+	sem_t items;              // posted each time messages are queued
+	struct fed_peer *next;
+};
+
+/*
+ * The key of an invitation between a local client and a proxy, which
+ * identifies the invitation to the proxy's node.
+ */
+typedef struct fed_inv {
+	FED_PEER *peer;           // the proxy's node, the only one that may use the key
+	CLIENT *proxy;
+	int id;                   // the proxy's ID for the invitation, or -1
+	char key[FED_KEY_MAX];
+	struct fed_inv *next;
+} FED_INV;
+
+/*
+ * A request to the directory whose reply has not been read yet.  The
+ * directory replies to the requests made over a connection in order, so
+ * replies are matched to requests by a reader thread, and a request need
+ * not wait for the replies to those made before it.
+ */
+typedef struct dir_wait {
+	char *reply;              // where to store the reply, or NULL to discard it
+	size_t size;
+	int status;               // 0 once the reply is stored, -1 if the connection was lost
+	CORO_EVENT done;          // signalled once status is set
+	struct dir_wait *next;
+} DIR_WAIT;
+
+typedef struct dir_conn {
+	int fd;
+	rio_t rio;
+	DIR_WAIT *head;           // requests waiting for their replies, oldest first
+	DIR_WAIT **tail;
+} DIR_CONN;
+
+static char *self;            // address of this node
+static char *dir_addr;
+static DIR_CONN *dir_conn;    // connection to the directory, or NULL
+static sem_t dir_mutex;       // protects dir_conn and its requests, and
+                              // orders the requests written to it
+static FED_PEER *peers;
+static sem_t peers_mutex;
+static FED_INV *invs;
+static sem_t invs_mutex;      // protects invs
+
+/*
+ * Write all of a buffer to a socket, failing rather than raising SIGPIPE
+ * if the peer has gone away.
+ */
+static int write_all(int fd, char *buf, size_t len){
+	struct iovec iov = { buf, len };
+	return proto_writev(fd, &iov, 1);
+}
+
+/*
+ * Connect to an address: the path of a UNIX socket, or <host>:<port>.
+ */
+static int connect_to(char *addr){
+	if(strchr(addr, '/') != NULL){
+		struct sockaddr_un sun;
+		if(strlen(addr) >= sizeof(sun.sun_path)){
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd >= 0 && connect(fd, (SA *) &sun, sizeof(sun)) < 0){
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	char host[strlen(addr) + 1];
+	strcpy(host, addr);
+	char *port = strrchr(host, ':');
+	if(port == NULL){
+		return -1;
+	}
+	*port++ = '\0';
+	int fd = open_clientfd(host, port);
+	if(fd < 0){
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/*
+ * Reader thread of a connection to the directory, which hands each reply
+ * to the oldest request still waiting.  Once the connection is lost, the
+ * requests still waiting fail, and the next request makes a new one.
+ */
+static void *dir_reader(void *arg){
+	DIR_CONN *conn = (DIR_CONN *) arg;
+	Pthread_detach(pthread_self());
+	char line[FED_LINE_MAX];
+	while(rio_readlineb(&conn->rio, line, sizeof(line)) > 0){
+		line[strcspn(line, "\n")] = '\0';
+		P(&dir_mutex);
+		DIR_WAIT *w = conn->head;
+		if(w != NULL && (conn->head = w->next) == NULL){
+			conn->tail = &conn->head;
+		}
+		V(&dir_mutex);
+		if(w == NULL){
+			debug("Unexpected reply from directory %s: %s", dir_addr, line);
+		} else if(w->reply == NULL){
+			Free(w);
+		} else {
+			snprintf(w->reply, w->size, "%s", line);
+			w->status = 0;
+			coro_event_signal(&w->done);
+		}
+	}
+	debug("Lost connection to directory %s", dir_addr);
+	P(&dir_mutex);
+	if(dir_conn == conn){
+		dir_conn = NULL;
+	}
+	DIR_WAIT *w = conn->head;
+	conn->head = NULL;
+	V(&dir_mutex);
+	while(w != NULL){
+		DIR_WAIT *next = w->next;
+		if(w->reply == NULL){
+			Free(w);
+		} else {
+			w->status = -1;
+			coro_event_signal(&w->done);
+		}
+		w = next;
+	}
+	close(conn->fd);
+	Free(conn);
+	return NULL;
+}
+
+/*
+ * Connect to the directory and join as this node, which the directory
+ * refuses if another connection has joined as the same node.  Must be
+ * called with dir_mutex held; this is the only round trip made with it
+ * held, as nothing else can be sent over the connection before the join.
+ */
+static DIR_CONN *dir_connect(void){
+	int fd = connect_to(dir_addr);
+	if(fd < 0){
+		return NULL;
+	}
+	DIR_CONN *conn = (DIR_CONN *) Malloc(sizeof(DIR_CONN));
+	conn->fd = fd;
+	conn->head = NULL;
+	conn->tail = &conn->head;
+	rio_readinitb(&conn->rio, fd);
+	char line[FED_LINE_MAX];
+	snprintf(line, sizeof(line), "JOIN %s\n", self);
+	if(write_all(fd, line, strlen(line)) == -1 || rio_readlineb(&conn->rio, line, sizeof(line)) <= 0
+	   || strcmp(line, "OK\n") != 0){
+		debug("Cannot join directory %s as node %s", dir_addr, self);
+		close(fd);
+		Free(conn);
+		return NULL;
+	}
+	pthread_t tid;
+	Pthread_create(&tid, NULL, dir_reader, conn);
+	return conn;
+}
+
+/*
+ * Write a request line to the directory, to be replied to in its turn.
+ * Must be called with dir_mutex held.  A request whose connection fails
+ * is failed by the reader thread, along with the others still waiting.
+ *
+ * @param connect  Nonzero if a new connection may be made.
+ * @return 0 if the request has been written, otherwise -1.
+ */
+static int dir_send(DIR_WAIT *w, char *request, int connect){
+	if(dir_conn == NULL && (!connect || (dir_conn = dir_connect()) == NULL)){
+		return -1;
+	}
+	w->next = NULL;
+	*dir_conn->tail = w;
+	dir_conn->tail = &w->next;
+	if(write_all(dir_conn->fd, request, strlen(request)) == -1){
+		// the reader finds the connection closed, and fails the request
+		shutdown(dir_conn->fd, SHUT_RDWR);
+		dir_conn = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Send a request line to the directory and wait for its one-line reply,
+ * without the newline.  Requests from other threads are written and
+ * replied to while this one waits, and a coroutine lets the others of
+ * its thread run.  A lost connection to the directory is made again
+ * once; the claims made over it are then lost.
+ */
+static int dir_request(char *reply, size_t size, char *request){
+	for(int attempt = 0; attempt < 2; attempt++){
+		DIR_WAIT w;
+		w.reply = reply;
+		w.size = size;
+		w.status = -1;
+		coro_event_init(&w.done);
+		P(&dir_mutex);
+		int ret = dir_send(&w, request, 1);
+		V(&dir_mutex);
+		if(ret == -1){
+			break;
+		}
+		coro_event_wait(&w.done);
+		if(w.status == 0){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Send a request line to the directory without waiting for its reply,
+ * which is discarded.  Nothing is sent if there is no connection to the
+ * directory, as the claims made over the one lost went with it.
+ */
+static void dir_notify(char *request){
+	DIR_WAIT *w = (DIR_WAIT *) Malloc(sizeof(DIR_WAIT));
+	w->reply = NULL;
+	P(&dir_mutex);
+	if(dir_send(w, request, 0) == -1){
+		Free(w);
+	}
+	V(&dir_mutex);
+}
+
+/**************************** LINKS ************************************/
+
+/*
+ * Queue a message on the link to a node, for its writer thread.
+ */
+static void queue_message(FED_PEER *peer, char *msg, size_t n){
+	P(&peer->mutex);
+	if(peer->len + n > peer->size){
+		peer->size = peer->len + n > 2 * peer->size ? peer->len + n + FED_LINE_MAX : 2 * peer->size;
+		peer->buf = (char *) Realloc(peer->buf, peer->size);
+	}
+	memcpy(peer->buf + peer->len, msg, n);
+	peer->len += n;
+	V(&peer->mutex);
+	V(&peer->items);
+}
+
+/*
+ * Connect the link to a node, and name this node over it with a ticket
+ * from the directory, which the node redeems to make sure of the name.
+ */
+static int link_connect(FED_PEER *peer){
+	char request[FED_LINE_MAX], reply[FED_LINE_MAX];
+	snprintf(request, sizeof(request), "TICKET %s\n", peer->addr);
+	if(dir_request(reply, sizeof(reply), request) == -1 || strncmp(reply, "TICKET ", 7) != 0){
+		debug("No ticket for link to node %s", peer->addr);
+		return -1;
+	}
+	int fd = connect_to(peer->addr);
+	if(fd < 0){
+		return -1;
+	}
+	char hello[FED_LINE_MAX];
+	snprintf(hello, sizeof(hello), "NODE %s %s\n", self, reply + 7);
+	if(write_all(fd, hello, strlen(hello)) == -1){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Writer thread of the link to a node.  It connects the first time there
+ * is something to send, and then writes all the messages queued since its
+ * last write with a single write.  If the link fails, the messages being
+ * written are lost, and the next messages are sent over a new connection.
+ */
+static void *link_writer(void *arg){
+	FED_PEER *peer = (FED_PEER *) arg;
+	Pthread_detach(pthread_self());
+	while(1){
+		P(&peer->items);
+		P(&peer->mutex);
+		char *buf = peer->buf;
+		size_t len = peer->len;
+		peer->buf = NULL;
+		peer->len = peer->size = 0;
+		V(&peer->mutex);
+		// one write carried everything queued by the earlier posts
+		if(len == 0){
+			continue;
+		}
+		if(peer->fd < 0){
+			peer->fd = link_connect(peer);
+		}
+		if(peer->fd < 0 || write_all(peer->fd, buf, len) == -1){
+			debug("Lost %lu bytes of messages to node %s", len, peer->addr);
+			if(peer->fd >= 0){
+				close(peer->fd);
+				peer->fd = -1;
+			}
+		}
+		Free(buf);
+	}
+	return NULL;
+}
+
+/*
+ * Get the FED_PEER of a node, creating it and starting the writer thread
+ * of its link the first time.
+ */
+static FED_PEER *get_peer(char *addr){
+	P(&peers_mutex);
+	FED_PEER *peer;
+	for(peer = peers; peer != NULL; peer = peer->next){
+		if(strcmp(peer->addr, addr) == 0){
+			V(&peers_mutex);
+			return peer;
+		}
+	}
+	peer = (FED_PEER *) Calloc(1, sizeof(FED_PEER));
+	peer->addr = strdup(addr);
+	peer->fd = -1;
+	Sem_init(&peer->mutex, 0, 1);
+	Sem_init(&peer->items, 0, 0);
+	peer->next = peers;
+	peers = peer;
+	V(&peers_mutex);
+	pthread_t tid;
+	Pthread_create(&tid, NULL, link_writer, peer);
+	return peer;
+}
+
+/*
+ * Get a reference to the proxy CLIENT of a player of a node, creating it
+ * the first time.
+ */
+static CLIENT *get_proxy(FED_PEER *peer, char *name){
+	P(&peer->mutex);
+	PROXY *p;
+	for(p = peer->proxies; p != NULL; p = p->next){
+		if(strcmp(p->name, name) == 0){
+			break;
+		}
+	}
+	if(p == NULL){
+		PLAYER *player = preg_register(player_registry, name);
+		if(player == NULL){
+			V(&peer->mutex);
+			return NULL;
+		}
+		p = (PROXY *) Malloc(sizeof(PROXY));
+		p->client = client_create_proxy(player, peer);
+		p->name = strdup(name);
+		p->next = peer->proxies;
+		peer->proxies = p;
+		player_unref(player, "because proxy has been created");
+	}
+	CLIENT *client = client_ref(p->client, "for reference to proxy being returned");
+	V(&peer->mutex);
+	return client;
+}
+
+/**************************** KEYS ************************************/
+
+/*
+ * Make the key of an invitation made on this node: the node's address and
+ * random bytes, so that the key cannot be guessed from those seen before.
+ */
+static void new_key(char *key, size_t size){
+	unsigned char bytes[16];
+	if(getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)){
+		unix_error("getrandom error");
+	}
+	char hex[2 * sizeof(bytes) + 1];
+	for(int i = 0; i < (int) sizeof(bytes); i++){
+		sprintf(hex + 2 * i, "%02x", bytes[i]);
+	}
+	snprintf(key, size, "%s/%s", self, hex);
+}
+
+static void add_key(FED_PEER *peer, CLIENT *proxy, int id, char *key){
+	FED_INV *inv = (FED_INV *) Malloc(sizeof(FED_INV));
+	inv->peer = peer;
+	inv->proxy = proxy;
+	inv->id = id;
+	snprintf(inv->key, sizeof(inv->key), "%s", key);
+	P(&invs_mutex);
+	inv->next = invs;
+	invs = inv;
+	V(&invs_mutex);
+}
+
+/*
+ * Find the key of a proxy's invitation, removing it if the invitation
+ * is over.  An invitation received from another node is added with ID -1
+ * while it is being made, as its ID is not known until then, and the
+ * first packet for it may go to the proxy before that.  It is the only
+ * one without an ID, as each link is read by a single thread.
+ */
+static int find_key(CLIENT *proxy, int id, char *key, int remove){
+	P(&invs_mutex);
+	FED_INV **pp, **pending = NULL;
+	for(pp = &invs; *pp != NULL; pp = &(*pp)->next){
+		if((*pp)->proxy != proxy){
+			continue;
+		}
+		if((*pp)->id == id){
+			break;
+		}
+		if((*pp)->id == -1){
+			pending = pp;
+		}
+	}
+	if(*pp == NULL && pending != NULL){
+		pp = pending;
+		(*pp)->id = id;
+	}
+	if(*pp == NULL){
+		V(&invs_mutex);
+		return -1;
+	}
+	FED_INV *inv = *pp;
+	strcpy(key, inv->key);
+	if(remove){
+		*pp = inv->next;
+		Free(inv);
+	}
+	V(&invs_mutex);
+	return 0;
+}
+
+/*
+ * Find the proxy and its ID for the invitation with a key, removing the
+ * key if the invitation is over.  Only the node of the proxy may use the
+ * key.
+ */
+static CLIENT *find_invitation(FED_PEER *peer, char *key, int *idp, int remove){
+	P(&invs_mutex);
+	FED_INV **pp;
+	for(pp = &invs; *pp != NULL; pp = &(*pp)->next){
+		if((*pp)->peer == peer && strcmp((*pp)->key, key) == 0){
+			break;
+		}
+	}
+	FED_INV *inv = *pp;
+	CLIENT *proxy = NULL;
+	if(inv != NULL && inv->id >= 0){
+		proxy = inv->proxy;
+		*idp = inv->id;
+		if(remove){
+			*pp = inv->next;
+			Free(inv);
+		}
+	}
+	V(&invs_mutex);
+	return proxy;
+}
+
+/*
+ * Set the ID of an invitation received from another node, once it has
+ * been made, or drop its key if it could not be.
+ */
+static void set_id(CLIENT *proxy, char *key, int id){
+	P(&invs_mutex);
+	for(FED_INV **pp = &invs; *pp != NULL; pp = &(*pp)->next){
+		FED_INV *inv = *pp;
+		if(inv->proxy == proxy && strcmp(inv->key, key) == 0){
+			if(id == -1){
+				*pp = inv->next;
+				Free(inv);
+			} else {
+				inv->id = id;
+			}
+			break;
+		}
+	}
+	V(&invs_mutex);
+}
+
+/**************************** RECEIVING ************************************/
+
+/*
+ * Make an invitation received from another node, from the proxy of its
+ * source to a local client.  If there is no such client, the invitation
+ * is declined at once.
+ */
+static void receive_invitation(FED_PEER *peer, char *key, char *to, int role, char *data){
+	char *control = strchr(data, ' ');
+	unsigned long base = 0, increment = 0;
+	if(control != NULL){
+		*control++ = '\0';
+		if(client_parse_time_control(control, &base, &increment) == -1){
+			base = increment = 0;
+		}
+	}
+	CLIENT *proxy = get_proxy(peer, data);
+	CLIENT *target = creg_lookup(client_registry, to);
+	int id = -1;
+	if(proxy != NULL && target != NULL && client_get_player(target) != NULL){
+		add_key(peer, proxy, -1, key);
+		GAME_ROLE source_role = role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+		id = client_make_timed_invitation(proxy, target, source_role, role, base, increment);
+		set_id(proxy, key, id);
+	}
+	if(target != NULL){
+		client_unref(target, "after invitation from another node");
+	}
+	if(proxy != NULL){
+		client_unref(proxy, "after invitation from another node");
+	}
+	if(id == -1){
+		char msg[FED_LINE_MAX];
+		int n = snprintf(msg, sizeof(msg), "%d\t0\t%s\t%s\t\n", JEUX_DECLINED_PKT, key, data);
+		if(n < sizeof(msg)){
+			queue_message(peer, msg, n);
+		}
+	}
+}
+
+/*
+ * Carry out a message received from another node: make the proxy of the
+ * player who acted there do the same here.
+ */
+static void receive_message(FED_PEER *peer, char *msg){
+	char *fields[5];
+	for(int i = 0; i < 5; i++){
+		fields[i] = strsep(&msg, i < 4 ? "\t" : "\n");
+		if(fields[i] == NULL){
+			debug("Malformed message from node %s", peer->addr);
+			return;
+		}
+	}
+	int type = atoi(fields[0]);
+	int role = atoi(fields[1]);
+	char *key = fields[2];
+	char *data = fields[4];
+	if(type == JEUX_INVITED_PKT){
+		receive_invitation(peer, key, fields[3], role, data);
+		return;
+	}
+	int id;
+	int over = type == JEUX_REVOKED_PKT || type == JEUX_DECLINED_PKT || type == JEUX_ENDED_PKT;
+	CLIENT *proxy = find_invitation(peer, key, &id, over);
+	if(proxy == NULL){
+		// already over here
+		return;
+	}
+	char *state = NULL;
+	switch(type){
+	case JEUX_REVOKED_PKT:
+		client_revoke_invitation(proxy, id);
+		break;
+	case JEUX_DECLINED_PKT:
+		client_decline_invitation(proxy, id);
+		break;
+	case JEUX_ACCEPTED_PKT:
+		if(client_accept_invitation(proxy, id, &state) == 0 && state != NULL){
+			Free(state);
+		}
+		break;
+	case JEUX_MOVED_PKT:
+		client_make_move(proxy, id, data);
+		break;
+	case JEUX_RESIGNED_PKT:
+		client_resign_game(proxy, id);
+		break;
+	case JEUX_ENDED_PKT:
+		client_end_game(proxy, id, role);
+		break;
+	default:
+		debug("Unexpected message type %d from node %s", type, peer->addr);
+	}
+}
+
+/*
+ * Make sure of the name a node gives itself over a link, by redeeming its
+ * ticket with the directory: a ticket is issued to a node for a link to
+ * this one, and can be redeemed only once, and only by this node.
+ *
+ * @return 0 if the ticket was issued to the named node, otherwise -1.
+ */
+static int check_ticket(char *node, char *ticket){
+	char request[FED_LINE_MAX], reply[FED_LINE_MAX];
+	snprintf(request, sizeof(request), "REDEEM %s\n", ticket);
+	if(dir_request(reply, sizeof(reply), request) == -1 || strncmp(reply, "NODE ", 5) != 0
+	   || strcmp(reply + 5, node) != 0){
+		debug("Link claiming to be node %s refused", node);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Reader thread of a link from another node, which first names itself
+ * and gives its ticket.
+ */
+static void *link_reader(void *arg){
+	int fd = *(int *) arg;
+	Free(arg);
+	Pthread_detach(pthread_self());
+	rio_t rio;
+	rio_readinitb(&rio, fd);
+	char line[FED_LINE_MAX];
+	char *ticket;
+	if(rio_readlineb(&rio, line, sizeof(line)) > 0 && strncmp(line, "NODE ", 5) == 0
+	   && (ticket = strchr(line + 5, ' ')) != NULL){
+		line[strcspn(line, "\n")] = '\0';
+		*ticket++ = '\0';
+		if(check_ticket(line + 5, ticket) == -1){
+			close(fd);
+			return NULL;
+		}
+		FED_PEER *peer = get_peer(line + 5);
+		debug("Link from node %s", peer->addr);
+		while(rio_readlineb(&rio, line, sizeof(line)) > 0){
+			receive_message(peer, line);
+		}
+		debug("Link from node %s closed", peer->addr);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *link_listener(void *arg){
+	int listenfd = *(int *) arg;
+	Free(arg);
+	Pthread_detach(pthread_self());
+	while(1){
+		int fd = accept(listenfd, NULL, NULL);
+		if(fd < 0){
+			if(errno != EINTR){
+				debug("Cannot accept link: %s", strerror(errno));
+			}
+			continue;
+		}
+		int *fdp = (int *) Malloc(sizeof(int));
+		*fdp = fd;
+		pthread_t tid;
+		Pthread_create(&tid, NULL, link_reader, fdp);
+	}
+	return NULL;
+}
+
+/**************************** API ************************************/
+
+/*
+ * Join a federation: connect to its directory and listen for links from
+ * the other nodes.
+ *
+ * @param directory  The directory: the path of a UNIX socket, or
+ * <host>:<port>.
+ * @param node  The address of this node, [<host>:]<port>, on which it
+ * listens for links and by which the other nodes reach it.  The host
+ * defaults to 127.0.0.1.
+ * @return 0 if successful, otherwise -1.
+ */
+int fed_init(char *directory, char *node){
+	Sem_init(&dir_mutex, 0, 1);
+	Sem_init(&peers_mutex, 0, 1);
+	Sem_init(&invs_mutex, 0, 1);
+	dir_addr = strdup(directory);
+	char *port = strrchr(node, ':');
+	if(port != NULL){
+		self = strdup(node);
+		port++;
+	} else {
+		self = (char *) Malloc(strlen(node) + 16);
+		sprintf(self, "127.0.0.1:%s", node);
+		port = node;
+	}
+	// the first request joins the directory as this node
+	char reply[FED_LINE_MAX];
+	if(dir_request(reply, sizeof(reply), "PING\n") == -1){
+		debug("Cannot reach directory %s", directory);
+		return -1;
+	}
+	int listenfd = open_listenfd(port);
+	if(listenfd < 0){
+		debug("Cannot listen for links on port %s", port);
+		return -1;
+	}
+	int *fdp = (int *) Malloc(sizeof(int));
+	*fdp = listenfd;
+	pthread_t tid;
+	Pthread_create(&tid, NULL, link_listener, fdp);
+	debug("Node %s of federation with directory %s", self, directory);
+	return 0;
+}
+
+/*
+ * Determine whether this server is a node of a federation.
+ *
+ * @return nonzero if fed_init() has succeeded, otherwise 0.
+ */
+int fed_enabled(void){
+	return self != NULL;
+}
+
+/*
+ * Claim a username for this node in the directory, when a client logs in.
+ * The claims of other clients are made while this one waits for its
+ * reply, and a coroutine lets the others of its thread run.
+ *
+ * @param name  The username.
+ * @return 0 if the username is now logged in on this node, -1 if it is
+ * logged in on another node or the directory cannot be reached.
+ */
+int fed_claim(char *name){
+	char request[FED_LINE_MAX], reply[FED_LINE_MAX];
+	snprintf(request, sizeof(request), "REG %s %s\n", name, self);
+	if(dir_request(reply, sizeof(reply), request) == -1 || strcmp(reply, "OK") != 0){
+		debug("Cannot claim %s: %s", name, reply);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Release a username claimed with fed_claim(), when a client logs out.
+ * This does not wait for the directory's reply.
+ *
+ * @param name  The username.
+ */
+void fed_release(char *name){
+	char request[FED_LINE_MAX];
+	snprintf(request, sizeof(request), "UNREG %s %s\n", name, self);
+	dir_notify(request);
+}
+
+/*
+ * Find a player logged in on another node.
+ *
+ * @param name  The username of the player.
+ * @return a reference to the proxy CLIENT of the player, which the caller
+ * must discard with client_unref(), or NULL if the player is not logged
+ * in on another node.
+ */
+CLIENT *fed_lookup(char *name){
+	char request[FED_LINE_MAX], reply[FED_LINE_MAX];
+	snprintf(request, sizeof(request), "LOOKUP %s\n", name);
+	if(dir_request(reply, sizeof(reply), request) == -1 || strncmp(reply, "NODE ", 5) != 0
+	   || strcmp(reply + 5, self) == 0){
+		return NULL;
+	}
+	return get_proxy(get_peer(reply + 5), name);
+}
+
+/*
+ * Send a packet addressed to a proxy CLIENT to the node of its player.
+ * The packet is queued on the link to the node, and this does not block.
+ *
+ * @param peer  The node of the proxy's player.
+ * @param proxy  The proxy CLIENT.
+ * @param name  The username of the proxy's player.
+ * @param hdr  The header of the packet.
+ * @param id  The invitation ID of the packet, in full.
+ * @param data  For INVITED, its payload; for MOVED, the move made, as
+ * accepted by game_parse_move(); otherwise NULL.
+ * @return 0 if the packet has been queued or has no counterpart on the
+ * other node, otherwise -1.
+ */
+int fed_send(FED_PEER *peer, CLIENT *proxy, char *name, JEUX_PACKET_HEADER *hdr, int id, char *data){
+	char key[FED_KEY_MAX];
+	switch(hdr->type){
+	case JEUX_INVITED_PKT:
+		new_key(key, sizeof(key));
+		add_key(peer, proxy, id, key);
+		break;
+	case JEUX_ACCEPTED_PKT:
+	case JEUX_MOVED_PKT:
+	case JEUX_RESIGNED_PKT:
+		if(find_key(proxy, id, key, 0) == -1){
+			return 0;
+		}
+		break;
+	case JEUX_REVOKED_PKT:
+	case JEUX_DECLINED_PKT:
+	case JEUX_ENDED_PKT:
+		if(find_key(proxy, id, key, 1) == -1){
+			return 0;
+		}
+		break;
+	default:
+		// replies and the like concern only this node
+		return 0;
+	}
+	char msg[FED_LINE_MAX];
+	int n = snprintf(msg, sizeof(msg), "%d\t%d\t%s\t%s\t%s\n", hdr->type, hdr->role, key, name,
+			 data != NULL ? data : "");
+	if(n >= sizeof(msg)){
+		return -1;
+	}
+	queue_message(peer, msg, n);
+	return 0;
+}
@@ -1,10 +1,17 @@
 #include "game.h"
+#include "game_ext.h"
+#include "gamelog.h"
+#include "strand.h"
+#include "timeout.h"
 #include "csapp.h"
 #include "debug.h"
+#include "trace.h"
 
 static GAME_ROLE check(GAME_ROLE *board);
 static char role_to_xo(GAME_ROLE role);
 static void fill_string(char *string, GAME_ROLE *board, GAME_ROLE nextmover);
+static void log_game(GAME *game, int ending);
+static void notify_watchers(GAME *game, int type, GAME_ROLE role, char *state);
 
 /*
  * The GAME type is a structure type that defines the state of a game.
@@ -17,7 +24,17 @@ typedef struct game {
 	int winner;
 	GAME_ROLE nextmover;
 	GAME_ROLE board[9]; // [9xboard spots]
-	sem_t mutex;
+	int position; // the board packed in base 3, its index in the tablebase
+	unsigned char moves[GAME_MAX_MOVES]; // moves made, one byte each
+	int nmoves;
+	PLAYER *players[2]; // players of the first and second roles, if known
+	struct watch *watchers; // active watches of spectators
+	int timed; // whether the game is played on a clock
+	long clock[2]; // time left to each player, in ms, at the start of the turn
+	long increment; // time added to a player's clock after each move, in ms
+	uint64_t turn_start; // timeout_now() when the current turn began
+	STRAND *strand; // serializes all access to the fields above
+	sem_t mutex; // protects refcnt only
 } GAME;
 
 /*
@@ -29,6 +46,41 @@ typedef struct game_move {
 	GAME_ROLE role;
 } GAME_MOVE;
 
+/*
+ * The WATCH type is a structure type that defines the subscription of a
+ * spectator to a game.  It is referenced by the spectator's CLIENT and,
+ * while it is active, by the game's list of watchers.
+ */
+typedef struct watch {
+	int refcnt;
+	int active; // cleared on the game's strand when the watch ends
+	int id;
+	SENDQ *sendq;
+	GAME *game;
+	struct watch *next; // link in the game's list of watchers
+} WATCH;
+
+/*
+ * The tablebase holds the solution of every position of the game, indexed
+ * by the board packed in base 3: the square at index i, holding 0 if it is
+ * empty or else the GAME_ROLE of the player who took it, counts for 3^i.
+ * The player to move follows from the board, as the first player always
+ * moves first.  Positions that cannot be reached are left unsolved.
+ */
+#define TABLEBASE_SIZE 19683 // 3^9
+
+typedef struct tb_entry {
+	signed char outcome;     // winner under perfect play, 0 for a draw, -1 if unsolved
+	unsigned char best;      // best square for the player to move, 9 if the game is over
+	unsigned char distance;  // moves left until the end of the game
+} TB_ENTRY;
+
+static TB_ENTRY tablebase[TABLEBASE_SIZE];
+static pthread_once_t tablebase_once = PTHREAD_ONCE_INIT;
+static const int powers_of_3[9] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+
+static TB_ENTRY *tablebase_lookup(GAME *game);
+
 /*
  * Create a new game in an initial state.  The returned game has a
  * reference count of one.
@@ -40,8 +92,14 @@ GAME *game_create(void){
 	GAME *game = (GAME *) Malloc(sizeof(GAME));
 	game->refcnt = 0;
 	memset(game->board, 0, sizeof(game->board));
+	game->position = 0;
+	game->nmoves = 0;
+	game->players[0] = game->players[1] = NULL;
+	game->watchers = NULL;
+	game->timed = 0;
 	game->winner = -1; // -1 indicating game not ended
 	game -> nextmover = 1;
+	game->strand = strand_create();
 	Sem_init(&game->mutex, 0, 1);
 	game_ref(game, "for newly created game");
 	return game;
@@ -60,6 +118,7 @@ GAME *game_ref(GAME *game, char *why){
 	P(&game->mutex);
 	game->refcnt++;
 	debug("Increase reference count on game %p (%d -> %d) %s", game, game->refcnt - 1, game->refcnt, why);
+	TRACE(TRACE_GAME_REF, game->refcnt, game, 0);
 	V(&game->mutex);
 	return game;
 }
@@ -79,9 +138,16 @@ void game_unref(GAME *game, char *why){
 
 	game->refcnt--;
 	debug("Decrease reference count on game %p (%d -> %d) %s", game, game->refcnt + 1, game->refcnt, why);
+	TRACE(TRACE_GAME_UNREF, game->refcnt, game, 0);
 
 	if(game->refcnt == 0){
 		debug("Free game %p", game);
+		strand_fini(game->strand);
+		for(int i = 0; i < 2; i++){
+			if(game->players[i] != NULL){
+				player_unref(game->players[i], "because game is being freed");
+			}
+		}
 		if(game != NULL){
 			Free(game);
 		}
@@ -94,6 +160,7 @@ void game_unref(GAME *game, char *why){
 /*
  * Apply a GAME_MOVE to a GAME.
  * If the move is illegal in the current GAME state, then it is an error.
+ * Must be called from a task running on the game's strand.
  *
  * @param game  The GAME to which the move is to be applied.
  * @param move  The GAME_MOVE to be applied to the game.
@@ -111,39 +178,54 @@ int game_apply_move(GAME *game, GAME_MOVE *move){
 	if(move->role < 1 || move->role > 2){
 		return -1;
 	}
-	P(&game->mutex);
 	// check if game has all valid values
 	if(game->winner != -1){ // then game has ended
-		V(&game->mutex);
 		return -1;
 	}
 	// check if move is illegal
-	if(game->board[move->spot] != 0){
-		V(&game->mutex);
+	if(game->board[move->spot] != 0 || move->role != game->nextmover){
 		return -1;
 	}
+	if(game->timed){
+		// a move made after the flag has fallen does not count
+		uint64_t now = timeout_now();
+		long used = (long) (now - game->turn_start);
+		if(used >= game->clock[move->role - 1]){
+			return -1;
+		}
+		game->clock[move->role - 1] += game->increment - used;
+		game->turn_start = now;
+	}
  	// debug("Apply move %s to game %p", game_unparse_move(move), game);
 	// Passed all checks
 	game->board[move->spot] = move->role;
+	game->position += move->role * powers_of_3[move->spot];
+	game->moves[game->nmoves++] = GAME_MOVE_BYTE(move->role, move->spot);
 
 	// update game winner based on new move
-	if(game->board != NULL){
-		game->winner = check(game->board);
-     debug("Game is over, %c wins", role_to_xo(game->winner));
-	}
+	game->winner = check(game->board);
+	debug("Game is over, %c wins", role_to_xo(game->winner));
 	if(game->nextmover == 1){
 		game->nextmover = 2;
 	} else {
 		game->nextmover = 1;
 	}
-
-	V(&game->mutex);
+	if(game->watchers != NULL){
+		char *state = game_unparse_state(game);
+		notify_watchers(game, JEUX_MOVED_PKT, move->role, state);
+		Free(state);
+	}
+	if(game->winner != -1){
+		log_game(game, GAMELOG_FINISHED);
+		notify_watchers(game, JEUX_ENDED_PKT, game->winner, NULL);
+	}
 	return 0;
 }
 
 /*
  * Submit the resignation of the GAME by the player in a specified
  * GAME_ROLE. It is an error if the game has already terminated.
+ * Must be called from a task running on the game's strand.
  *
  * @param game  The GAME to be resigned.
  * @param role  The GAME_ROLE of the player making the resignation.
@@ -156,9 +238,7 @@ int game_resign(GAME *game, GAME_ROLE role){
 	if(role != 1 && role != 2){
 		return -1;
 	}
-	P(&game->mutex);
 	if(game->winner != -1){ // game already terminiated
-		V(&game->mutex);
 		return -1;
 	}
 	if(role == 1){
@@ -168,8 +248,8 @@ int game_resign(GAME *game, GAME_ROLE role){
 		game->winner = FIRST_PLAYER_ROLE;
      debug("Game is over, %c wins", role_to_xo(game->winner));
 	}
-
-	V(&game->mutex);
+	log_game(game, GAMELOG_RESIGNED);
+	notify_watchers(game, JEUX_ENDED_PKT, game->winner, NULL);
 	return 0;
 
 }
@@ -179,6 +259,8 @@ int game_resign(GAME *game, GAME_ROLE role){
  * appropriate for human users.  The returned string is in malloc'ed
  * storage, which the caller is responsible for freeing when the string
  * is no longer required.
+ * Must be called from a task running on the game's strand, unless the
+ * game has not yet been made visible to other threads.
  *
  * @param game  The GAME for which the state description is to be
  * obtained.
@@ -188,16 +270,17 @@ char *game_unparse_state(GAME *game){
 	if(game == NULL){
 		return NULL;
 	}
-	P(&game->mutex);
-
-	char *string = (char *) Malloc(41*sizeof(char));
+	char *string = (char *) Malloc((game->timed ? GAME_STATE_MAX : 41)*sizeof(char));
 	if(string == NULL){
-		V(&game->mutex);
 		return NULL;
 	}
 	fill_string(string, game->board, game->nextmover);
-
-	V(&game->mutex);
+	if(game->timed){
+		long x = game_get_clock(game, FIRST_PLAYER_ROLE);
+		long o = game_get_clock(game, SECOND_PLAYER_ROLE);
+		snprintf(string + 40, GAME_STATE_MAX - 40, "X %ld:%02ld.%ld  O %ld:%02ld.%ld\n",
+			 x / 60000, x / 1000 % 60, x / 100 % 10, o / 60000, o / 1000 % 60, o / 100 % 10);
+	}
 	return string;
 }
 
@@ -292,6 +375,403 @@ char *game_unparse_move(GAME_MOVE *move){
 	return string;
 }
 
+/*
+ * Get the STRAND that serializes all processing for a GAME.
+ * The returned STRAND is valid for as long as the GAME has not been freed.
+ *
+ * @param game  The GAME to be queried.
+ * @return the STRAND belonging to the GAME.
+ */
+STRAND *game_get_strand(GAME *game){
+	return game->strand;
+}
+
+/*
+ * Record the PLAYER who plays a specified role in a GAME.  This must be
+ * done before the GAME is made visible to other threads.  A reference to
+ * the PLAYER is retained by the GAME until the GAME is freed.
+ *
+ * @param game  The GAME.
+ * @param role  The GAME_ROLE played by the PLAYER.
+ * @param player  The PLAYER, or NULL if it is unknown.
+ */
+void game_set_player(GAME *game, GAME_ROLE role, PLAYER *player){
+	if(role != FIRST_PLAYER_ROLE && role != SECOND_PLAYER_ROLE){
+		return;
+	}
+	if(game->players[role - 1] != NULL){
+		player_unref(game->players[role - 1], "because player of game is being replaced");
+	}
+	game->players[role - 1] = player != NULL ? player_ref(player, "for player of game") : NULL;
+}
+
+/*
+ * Get the moves made so far in a GAME, in the order in which they were
+ * made.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @param moves  Array of at least GAME_MAX_MOVES bytes, into which the
+ * moves are copied, encoded as described above.
+ * @return the number of moves copied.
+ */
+int game_get_moves(GAME *game, unsigned char *moves){
+	memcpy(moves, game->moves, game->nmoves);
+	return game->nmoves;
+}
+
+/*
+ * Get the role of the player whose turn it is to move in a GAME.  Must be
+ * called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the GAME_ROLE of the player to move.
+ */
+GAME_ROLE game_get_next_mover(GAME *game){
+	return game->nextmover;
+}
+
+/*
+ * Put a GAME on a clock.  This must be done before the GAME is made
+ * visible to other threads, and starts the clock of the first player.
+ *
+ * @param game  The GAME.
+ * @param base_ms  The time initially given to each player, in ms.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ */
+void game_set_clock(GAME *game, unsigned long base_ms, unsigned long increment_ms){
+	game->timed = 1;
+	// time controls are bounded by CLIENT_TIME_CONTROL_MAX, so these fit in a long
+	game->clock[0] = game->clock[1] = (long) base_ms;
+	game->increment = (long) increment_ms;
+	game->turn_start = timeout_now();
+}
+
+/*
+ * Get the time left on the clock of a player.  Must be called from a task
+ * running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @param role  The GAME_ROLE of the player.
+ * @return the time left to the player, in ms, which is 0 if the player's
+ * flag has fallen, or -1 if the game is not played on a clock.
+ */
+long game_get_clock(GAME *game, GAME_ROLE role){
+	if(!game->timed || (role != FIRST_PLAYER_ROLE && role != SECOND_PLAYER_ROLE)){
+		return -1;
+	}
+	long left = game->clock[role - 1];
+	if(role == game->nextmover && game->winner == -1){
+		left -= (long) (timeout_now() - game->turn_start);
+	}
+	return left > 0 ? left : 0;
+}
+
+/*
+ * Restore a GAME to the state of a game in progress that has been handed
+ * over by another server process, by replaying its moves and setting the
+ * time left on its clocks.  This must be done before the GAME is made
+ * visible to other threads.  The clock of the player to move restarts
+ * now.
+ *
+ * @param game  The GAME, to which no move has yet been made.
+ * @param moves  The moves, encoded as for game_get_moves().
+ * @param nmoves  The number of moves.
+ * @param first_ms  The time left to the first player, in ms, ignored if
+ * the GAME is not played on a clock.
+ * @param second_ms  The time left to the second player, in ms.
+ * @return 0 if the moves have been replayed, otherwise -1.
+ */
+int game_restore(GAME *game, unsigned char *moves, int nmoves, long first_ms, long second_ms){
+	// the clocks are not to run while the moves are replayed
+	int timed = game->timed;
+	game->timed = 0;
+	for(int i = 0; i < nmoves; i++){
+		GAME_MOVE move = { GAME_MOVE_SPOT(moves[i]), GAME_MOVE_ROLE(moves[i]) };
+		if(game_apply_move(game, &move) == -1){
+			game->timed = timed;
+			return -1;
+		}
+	}
+	game->timed = timed;
+	game->clock[0] = first_ms;
+	game->clock[1] = second_ms;
+	game->turn_start = timeout_now();
+	return 0;
+}
+
+/*
+ * End a GAME if the player to move has run out of time, the opponent
+ * winning.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME.
+ * @return 0 if the flag of the player to move has fallen and the game has
+ * been ended, otherwise -1.
+ */
+int game_flag_fall(GAME *game){
+	if(game->winner != -1 || game_get_clock(game, game->nextmover) != 0){
+		return -1;
+	}
+	game->winner = game->nextmover == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+	debug("Game is over, %c's flag has fallen", role_to_xo(game->nextmover));
+	log_game(game, GAMELOG_FLAGGED);
+	notify_watchers(game, JEUX_ENDED_PKT, game->winner, NULL);
+	return 0;
+}
+
+/*
+ * Start watching a GAME.  Must be called from a task running on the
+ * game's strand.
+ *
+ * @param game  The GAME to be watched.
+ * @param q  The SENDQ of the spectator.
+ * @param id  The ID assigned to the watch by the spectator, which is sent
+ * in the id field of the packets sent for it.
+ * @param statep  Variable into which to store the current state of the
+ * game, in malloc'ed storage, which the caller must free.
+ * @return a new active WATCH, with a reference for the caller, or NULL if
+ * the game is over.
+ */
+WATCH *game_watch(GAME *game, SENDQ *q, int id, char **statep){
+	if(game->winner != -1){
+		return NULL;
+	}
+	WATCH *watch = (WATCH *) Malloc(sizeof(WATCH));
+	watch->refcnt = 2; // one for the caller, one for the list of watchers
+	watch->active = 1;
+	watch->id = id;
+	watch->sendq = sendq_ref(q);
+	watch->game = game_ref(game, "for game being watched");
+	watch->next = game->watchers;
+	game->watchers = watch;
+	*statep = game_unparse_state(game);
+	return watch;
+}
+
+/*
+ * Remove a watch from the list of watchers of its game and end it.
+ * Must be called on the game's strand.
+ */
+static void end_watch(WATCH *watch){
+	WATCH **wp = &watch->game->watchers;
+	while(*wp != NULL && *wp != watch){
+		wp = &(*wp)->next;
+	}
+	if(*wp == NULL){
+		return;
+	}
+	*wp = watch->next;
+	__atomic_store_n(&watch->active, 0, __ATOMIC_RELEASE);
+	watch_unref(watch);
+}
+
+/*
+ * Stop watching a GAME, if the WATCH is still active.  Must be called
+ * from a task running on the game's strand.
+ *
+ * @param watch  The WATCH to be ended.
+ */
+void game_unwatch(WATCH *watch){
+	end_watch(watch);
+}
+
+/*
+ * Determine whether a WATCH is still active.
+ *
+ * @param watch  The WATCH to be queried.
+ * @return 1 if the WATCH is active, 0 if it has ended.
+ */
+int watch_is_active(WATCH *watch){
+	return __atomic_load_n(&watch->active, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Get the GAME that is the subject of a WATCH.
+ *
+ * @param watch  The WATCH to be queried.
+ * @return the GAME, which is valid for as long as the WATCH is.
+ */
+GAME *watch_get_game(WATCH *watch){
+	return watch->game;
+}
+
+/*
+ * Discard a reference to a WATCH, freeing it when none remain.
+ *
+ * @param watch  The WATCH.
+ */
+void watch_unref(WATCH *watch){
+	if(__atomic_sub_fetch(&watch->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		sendq_unref(watch->sendq);
+		game_unref(watch->game, "because watch of game is being freed");
+		Free(watch);
+	}
+}
+
+/*
+ * Solve a position, and every position that can follow it, by searching
+ * the game tree, and record them in the tablebase.  A player who can win
+ * plays for the quickest win, and one who cannot avoid losing for the
+ * slowest loss.  Among equally good moves the lowest square is chosen.
+ */
+static TB_ENTRY *solve(GAME_ROLE *board, GAME_ROLE mover, int position){
+	TB_ENTRY *entry = &tablebase[position];
+	if(entry->outcome != -1){
+		return entry;
+	}
+	GAME_ROLE result = check(board);
+	if(result != -1){
+		entry->outcome = result;
+		entry->best = 9;
+		entry->distance = 0;
+		return entry;
+	}
+	GAME_ROLE opponent = mover == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+	TB_ENTRY *best = NULL;
+	int best_spot = -1, best_score = 0;
+	for(int spot = 0; spot < 9; spot++){
+		if(board[spot] != 0){
+			continue;
+		}
+		board[spot] = mover;
+		TB_ENTRY *next = solve(board, opponent, position + mover * powers_of_3[spot]);
+		board[spot] = 0;
+		// any win scores above a draw, and a draw above any loss
+		int score = next->outcome == mover ? 10 - next->distance
+			: next->outcome == 0 ? 0 : next->distance - 10;
+		if(best == NULL || score > best_score){
+			best = next;
+			best_spot = spot;
+			best_score = score;
+		}
+	}
+	entry->outcome = best->outcome;
+	entry->best = best_spot;
+	entry->distance = best->distance + 1;
+	return entry;
+}
+
+static void tablebase_build(void){
+	GAME_ROLE board[9] = { NULL_ROLE };
+	memset(tablebase, -1, sizeof(tablebase));
+	solve(board, FIRST_PLAYER_ROLE, 0);
+	int n = 0;
+	for(int i = 0; i < TABLEBASE_SIZE; i++){
+		n += tablebase[i].outcome != -1;
+	}
+	debug("Tablebase of %d positions built", n);
+}
+
+/*
+ * Build the tablebase, which solves every position of the game under
+ * perfect play.  Only the first call has any effect; the tablebase is
+ * otherwise built by the first function that needs it.
+ */
+void game_tablebase_init(void){
+	pthread_once(&tablebase_once, tablebase_build);
+}
+
+static TB_ENTRY *tablebase_lookup(GAME *game){
+	game_tablebase_init();
+	return &tablebase[game->position];
+}
+
+/*
+ * Get the best move, under perfect play, for the player to move in a
+ * GAME.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return a GAME_MOVE, which the caller must free, or NULL if the game
+ * is over.
+ */
+GAME_MOVE *game_best_move(GAME *game){
+	if(game->winner != -1){
+		return NULL;
+	}
+	GAME_MOVE *move = (GAME_MOVE *) Malloc(sizeof(GAME_MOVE));
+	move->spot = tablebase_lookup(game)->best;
+	move->role = game->nextmover;
+	return move;
+}
+
+/*
+ * Get the result of a GAME if both players play perfectly from now on.
+ * Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the GAME_ROLE of the winner, or NULL_ROLE for a draw.  For a
+ * game that is over, this is its actual result.
+ */
+GAME_ROLE game_perfect_outcome(GAME *game){
+	if(game->winner != -1){
+		return game->winner;
+	}
+	return tablebase_lookup(game)->outcome;
+}
+
+/*
+ * Get the number of moves left in a GAME if both players play perfectly
+ * from now on.  Must be called from a task running on the game's strand.
+ *
+ * @param game  The GAME to be queried.
+ * @return the number of moves, which is 0 if the game is over.
+ */
+int game_moves_to_end(GAME *game){
+	if(game->winner != -1){
+		return 0;
+	}
+	return tablebase_lookup(game)->distance;
+}
+
+/*
+ * Queue a MOVED or ENDED packet to every spectator of a game.  The
+ * payload, if any, is encoded once and shared.  Spectators whose queue
+ * is full are dropped, and after ENDED all the watches end.
+ */
+static void notify_watchers(GAME *game, int type, GAME_ROLE role, char *state){
+	if(game->watchers == NULL){
+		return;
+	}
+	SHARED_PAYLOAD *payload = state != NULL ? payload_create(state, strlen(state)) : NULL;
+	JEUX_PACKET_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.role = role;
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	header.timestamp_sec = htonl(tp.tv_sec);
+	header.timestamp_nsec = htonl(tp.tv_nsec);
+	WATCH *watch = game->watchers;
+	while(watch != NULL){
+		WATCH *next = watch->next;
+		JEUX_PACKET_EXT ext = { watch->id, 0, 0 };
+		header.id = watch->id;
+		if(sendq_push(watch->sendq, &header, &ext, payload) == -1){
+			debug("Spectator of game %p is too far behind, watch %d ended", game, watch->id);
+			end_watch(watch);
+		} else if(type == JEUX_ENDED_PKT){
+			end_watch(watch);
+		}
+		watch = next;
+	}
+	if(payload != NULL){
+		payload_unref(payload);
+	}
+}
+
+/*
+ * Queue the record of a game that has just ended for the game log.
+ */
+static void log_game(GAME *game, int ending){
+	if(!gamelog_enabled){
+		return;
+	}
+	char *names[2];
+	for(int i = 0; i < 2; i++){
+		names[i] = game->players[i] != NULL ? player_get_name(game->players[i]) : NULL;
+	}
+	gamelog_append(names[0], names[1], game->winner, ending, game->moves, game->nmoves);
+}
 
 /*
  * Fills a string of length 41 exactly, based on board and nextmover.
@@ -0,0 +1,272 @@
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gamelog.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * A record waiting to be copied into the log by the flusher.
+ */
+typedef struct pending {
+	struct pending *next;
+	size_t size;
+	char data[];
+} PENDING;
+
+int gamelog_enabled = 0;
+
+static char *log_dir = NULL;
+static PENDING *queue_head = NULL;     // Records queued, oldest first
+static PENDING *queue_tail = NULL;
+static int stopping = 0;
+static sem_t mutex;                    // Protects the variables above
+static sem_t kick;                     // Wakes the flusher when records are queued
+static pthread_t flusher_tid;
+
+// State of the current segment, used only by the flusher once it is running
+static uint32_t segment_no = 0;
+static int segment_fd = -1;
+static char *segment = NULL;            // Mapping of the current segment
+static size_t used = 0;                // Bytes of the segment written so far
+static size_t committed = 0;           // Bytes of the segment committed to disk
+
+/*
+ * Create and map a new segment, with the specified number.
+ */
+static int open_segment(uint32_t no){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%08u.jlog", log_dir, no);
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0){
+		debug("Cannot create game log segment %s", path);
+		return -1;
+	}
+	if(ftruncate(fd, GAMELOG_SEGMENT_SIZE) < 0){
+		close(fd);
+		return -1;
+	}
+	char *map = mmap(NULL, GAMELOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED){
+		close(fd);
+		return -1;
+	}
+	GAMELOG_SEGMENT_HEADER hdr = { GAMELOG_MAGIC, GAMELOG_VERSION, no, 0 };
+	memcpy(map, &hdr, sizeof(hdr));
+	segment_no = no;
+	segment_fd = fd;
+	segment = map;
+	used = sizeof(hdr);
+	committed = 0;
+	// make the new file itself durable, so that its records can be found
+	int dirfd = open(log_dir, O_RDONLY);
+	if(dirfd >= 0){
+		fsync(dirfd);
+		close(dirfd);
+	}
+	debug("Game log segment %s opened", path);
+	return 0;
+}
+
+/*
+ * Commit to disk the records written to the current segment since the
+ * last commit.
+ */
+static void commit(void){
+	if(used == committed){
+		return;
+	}
+	size_t start = committed & ~((size_t) sysconf(_SC_PAGESIZE) - 1);
+	if(msync(segment + start, used - start, MS_SYNC) < 0){
+		debug("Error committing game log segment %u", segment_no);
+	}
+	committed = used;
+}
+
+/*
+ * Commit and unmap the current segment, and cut the file down to the
+ * part that has been written.
+ */
+static void close_segment(void){
+	commit();
+	munmap(segment, GAMELOG_SEGMENT_SIZE);
+	if(ftruncate(segment_fd, used) < 0 || fsync(segment_fd) < 0){
+		debug("Error closing game log segment %u", segment_no);
+	}
+	close(segment_fd);
+	segment = NULL;
+	segment_fd = -1;
+}
+
+/*
+ * Copy a record into the current segment, starting a new segment first
+ * if there is no room for it.  Returns -1 if the record is lost.
+ */
+static int write_record(PENDING *p){
+	if(used + p->size > GAMELOG_SEGMENT_SIZE){
+		close_segment();
+		if(open_segment(segment_no + 1) == -1){
+			return -1;
+		}
+	}
+	memcpy(segment + used, p->data, p->size);
+	used += p->size;
+	return 0;
+}
+
+/*
+ * Thread that, whenever records are queued, takes all of them, copies them
+ * into the log and commits them together, until the log is stopped.  The
+ * records queued while a commit is in progress are committed together by
+ * the next one.
+ */
+static void *gamelog_flusher(void *arg){
+	while(1){
+		// kicked when the queue becomes non-empty, and to stop
+		P(&kick);
+
+		P(&mutex);
+		PENDING *batch = queue_head;
+		queue_head = queue_tail = NULL;
+		int stop = stopping;
+		V(&mutex);
+
+		int n = 0;
+		while(batch != NULL){
+			PENDING *p = batch;
+			batch = p->next;
+			if(segment != NULL && write_record(p) == 0){
+				n++;
+			} else {
+				debug("Game record lost");
+			}
+			Free(p);
+		}
+		if(segment != NULL){
+			commit();
+		}
+		if(n > 0){
+			debug("Committed %d game records", n);
+		}
+		if(stop){
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Enable the game log and start the background flusher.
+ *
+ * @param dir  Directory holding the log, which is created if necessary.
+ * @return 0 if successful, -1 if the directory or a new segment in it
+ * cannot be created.
+ */
+int gamelog_init(char *dir){
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+		debug("Cannot create game log directory %s", dir);
+		return -1;
+	}
+	DIR *d = opendir(dir);
+	if(d == NULL){
+		return -1;
+	}
+	// start a new segment after the last one written by an earlier run
+	uint32_t next = 0;
+	struct dirent *ent;
+	while((ent = readdir(d)) != NULL){
+		unsigned int no;
+		char ext[8];
+		if(sscanf(ent->d_name, "%8u.%7s", &no, ext) == 2 && strcmp(ext, "jlog") == 0
+		   && no + 1 > next){
+			next = no + 1;
+		}
+	}
+	closedir(d);
+	log_dir = dir;
+	if(open_segment(next) == -1){
+		return -1;
+	}
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&kick, 0, 0);
+	Pthread_create(&flusher_tid, NULL, gamelog_flusher, NULL);
+	gamelog_enabled = 1;
+	debug("Logging games to %s", dir);
+	return 0;
+}
+
+/*
+ * Stop the game log, commit any queued records and close the current
+ * segment.
+ */
+void gamelog_fini(void){
+	if(!gamelog_enabled){
+		return;
+	}
+	gamelog_enabled = 0;
+	P(&mutex);
+	stopping = 1;
+	V(&mutex);
+	V(&kick);
+	Pthread_join(flusher_tid, NULL);
+	if(segment != NULL){
+		close_segment();
+	}
+}
+
+/*
+ * Queue the record of a finished game for appending to the log.
+ *
+ * @param first  Name of the first player, or NULL if unknown.
+ * @param second  Name of the second player, or NULL if unknown.
+ * @param winner  GAME_ROLE of the winner, or NULL_ROLE for a draw.
+ * @param ending  How the game ended, as a GAMELOG_ENDING.
+ * @param moves  The moves of the game, one byte each.
+ * @param nmoves  The number of moves.
+ */
+void gamelog_append(char *first, char *second, GAME_ROLE winner, int ending,
+		    unsigned char *moves, int nmoves){
+	if(!gamelog_enabled){
+		return;
+	}
+	size_t len1 = first != NULL ? strnlen(first, UINT16_MAX) : 0;
+	size_t len2 = second != NULL ? strnlen(second, UINT16_MAX) : 0;
+	size_t size = (sizeof(GAMELOG_RECORD) + nmoves + len1 + len2 + 7) & ~(size_t) 7;
+	PENDING *p = (PENDING *) Calloc(1, sizeof(PENDING) + size);
+	p->size = size;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	GAMELOG_RECORD *rec = (GAMELOG_RECORD *) p->data;
+	rec->size = size;
+	rec->winner = winner;
+	rec->ending = ending;
+	rec->nmoves = nmoves;
+	rec->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->name_len[0] = len1;
+	rec->name_len[1] = len2;
+	char *q = p->data + sizeof(GAMELOG_RECORD);
+	memcpy(q, moves, nmoves);
+	if(len1 > 0){
+		memcpy(q + nmoves, first, len1);
+	}
+	if(len2 > 0){
+		memcpy(q + nmoves + len1, second, len2);
+	}
+
+	P(&mutex);
+	int was_empty = queue_head == NULL;
+	if(queue_tail != NULL){
+		queue_tail->next = p;
+	} else {
+		queue_head = p;
+	}
+	queue_tail = p;
+	V(&mutex);
+	// the flusher is kicked once for each batch, not for each record
+	if(was_empty){
+		V(&kick);
+	}
+}
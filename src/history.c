@@ -0,0 +1,224 @@
+#include <sys/mman.h>
+
+#include "history.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * A segment of a history: HISTORY_SEGMENT_ENTRIES entries, stored by
+ * column.  Entry i of the history is entry i % HISTORY_SEGMENT_ENTRIES of
+ * segment i / HISTORY_SEGMENT_ENTRIES.
+ */
+typedef struct history_segment {
+	uint64_t time[HISTORY_SEGMENT_ENTRIES];
+	PLAYER *opponent[HISTORY_SEGMENT_ENTRIES];
+	int32_t rating[HISTORY_SEGMENT_ENTRIES];
+	int8_t result[HISTORY_SEGMENT_ENTRIES];
+	struct history_segment *next; // the following segment, once there is one
+} HISTORY_SEGMENT;
+
+struct history {
+	unsigned long count;        // number of entries, stored with release semantics
+	HISTORY_SEGMENT *head;      // the first segment, once there is one
+	HISTORY_SEGMENT *tail;      // the segment being appended to, used by the writer only
+};
+
+/*
+ * Create a new, empty history.
+ *
+ * @return the HISTORY.
+ */
+HISTORY *history_create(void){
+	HISTORY *history = (HISTORY *) Malloc(sizeof(HISTORY));
+	history->count = 0;
+	history->head = NULL;
+	history->tail = NULL;
+	return history;
+}
+
+/*
+ * Free a history, and unmap its segments.
+ *
+ * @param history  The HISTORY, which must no longer be used.
+ */
+void history_free(HISTORY *history){
+	HISTORY_SEGMENT *seg = history->head;
+	while(seg != NULL){
+		HISTORY_SEGMENT *next = seg->next;
+		munmap(seg, sizeof(HISTORY_SEGMENT));
+		seg = next;
+	}
+	Free(history);
+}
+
+/*
+ * Append an entry to a history.  Calls for the same history must not be
+ * made concurrently.  An entry whose time is earlier than that of the
+ * last entry, as when the clock has been set back, is given the time of
+ * the last entry, so that the times of the entries never decrease.
+ *
+ * @param history  The HISTORY.
+ * @param time  CLOCK_REALTIME of the change, in ms.
+ * @param rating  The rating after the change.
+ * @param opponent  The opponent in the game, which must outlive the
+ * history: players are kept by the player registry for as long as the
+ * server runs.
+ * @param result  HISTORY_LOST, HISTORY_DRAWN or HISTORY_WON.
+ */
+void history_append(HISTORY *history, uint64_t time, int rating, PLAYER *opponent, int result){
+	unsigned long n = history->count;
+	int i = n % HISTORY_SEGMENT_ENTRIES;
+	HISTORY_SEGMENT *seg = history->tail;
+	if(i == 0 && seg != NULL && time < seg->time[HISTORY_SEGMENT_ENTRIES - 1]){
+		time = seg->time[HISTORY_SEGMENT_ENTRIES - 1];
+	}
+	if(i == 0){
+		// the pages of a new mapping are zero, so next is NULL
+		seg = mmap(NULL, sizeof(HISTORY_SEGMENT), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(seg == MAP_FAILED){
+			debug("Cannot map history segment (%s), entry dropped", strerror(errno));
+			return;
+		}
+		if(history->tail == NULL){
+			__atomic_store_n(&history->head, seg, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&history->tail->next, seg, __ATOMIC_RELEASE);
+		}
+		history->tail = seg;
+	} else if(time < seg->time[i - 1]){
+		time = seg->time[i - 1];
+	}
+	seg->time[i] = time;
+	seg->opponent[i] = opponent;
+	seg->rating[i] = rating;
+	seg->result[i] = result;
+	__atomic_store_n(&history->count, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find the first entry of a history whose time is not earlier than a
+ * given time.  Segments are skipped by their last entry, and the entry is
+ * found in its segment by binary search.
+ *
+ * @param count  The number of entries of the history to consider.
+ * @param segp  Set to the segment holding the entry.
+ * @return the index of the entry in the history, or count if there is
+ * none.
+ */
+static unsigned long find(HISTORY *history, unsigned long count, uint64_t from, HISTORY_SEGMENT **segp){
+	HISTORY_SEGMENT *seg = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+	for(unsigned long base = 0; base < count; base += HISTORY_SEGMENT_ENTRIES){
+		unsigned long n = count - base;
+		if(n > HISTORY_SEGMENT_ENTRIES){
+			n = HISTORY_SEGMENT_ENTRIES;
+		}
+		if(seg->time[n - 1] >= from){
+			unsigned long lo = 0, hi = n - 1;
+			while(lo < hi){
+				unsigned long mid = (lo + hi) / 2;
+				if(seg->time[mid] < from){
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			*segp = seg;
+			return base + lo;
+		}
+		seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+	}
+	return count;
+}
+
+/*
+ * Call a function for each entry of a history in a range of times, in the
+ * order in which they were appended, until the function asks for the scan
+ * to stop.
+ *
+ * @param history  The HISTORY.
+ * @param from  Start of the range, in ms.
+ * @param to  End of the range, in ms, which is not included.
+ * @param func  The function, which is passed the entry and arg.
+ * @param arg  Argument to be passed to the function.
+ * @return the number of entries for which the function returned 0.
+ */
+unsigned long history_scan(HISTORY *history, uint64_t from, uint64_t to, HISTORY_FUNC func, void *arg){
+	unsigned long count = __atomic_load_n(&history->count, __ATOMIC_ACQUIRE);
+	HISTORY_SEGMENT *seg;
+	unsigned long first = find(history, count, from, &seg);
+	unsigned long k;
+	for(k = first; k < count; k++){
+		int i = k % HISTORY_SEGMENT_ENTRIES;
+		if(i == 0 && k != first){
+			seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+		}
+		if(seg->time[i] >= to){
+			break;
+		}
+		HISTORY_ENTRY entry = {
+			.time = seg->time[i],
+			.rating = seg->rating[i],
+			.opponent = seg->opponent[i],
+			.result = seg->result[i]
+		};
+		if(func(&entry, arg) != 0){
+			break;
+		}
+	}
+	return k - first;
+}
+
+/*
+ * Downsample the entries of a history in a range of times, by dividing
+ * the range into intervals of equal length and summarizing the entries in
+ * each.
+ *
+ * @param history  The HISTORY.
+ * @param from  Start of the range, in ms.
+ * @param to  End of the range, in ms, which is not included.
+ * @param buckets  Array into which to store a summary of each interval.
+ * Intervals with no entries are left out.
+ * @param nbuckets  The number of intervals into which to divide the range.
+ * @return the number of summaries stored.
+ */
+int history_downsample(HISTORY *history, uint64_t from, uint64_t to,
+		       HISTORY_BUCKET *buckets, int nbuckets){
+	if(nbuckets <= 0 || to <= from){
+		return 0;
+	}
+	uint64_t width = (to - from) / nbuckets + ((to - from) % nbuckets != 0);
+	unsigned long count = __atomic_load_n(&history->count, __ATOMIC_ACQUIRE);
+	HISTORY_SEGMENT *seg;
+	unsigned long first = find(history, count, from, &seg);
+	HISTORY_BUCKET *b = NULL;
+	int n = 0;
+	// only the time and rating columns are read
+	for(unsigned long k = first; k < count; k++){
+		int i = k % HISTORY_SEGMENT_ENTRIES;
+		if(i == 0 && k != first){
+			seg = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+		}
+		uint64_t time = seg->time[i];
+		if(time >= to){
+			break;
+		}
+		int rating = seg->rating[i];
+		uint64_t start = from + (time - from) / width * width;
+		if(b == NULL || b->start != start){
+			b = &buckets[n++];
+			b->start = start;
+			b->count = 0;
+			b->min = b->max = rating;
+		}
+		b->count++;
+		if(rating < b->min){
+			b->min = rating;
+		}
+		if(rating > b->max){
+			b->max = rating;
+		}
+		b->last = rating;
+	}
+	return n;
+}
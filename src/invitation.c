@@ -1,6 +1,11 @@
 #include "csapp.h"
 #include "client_registry.h"
+#include "invitation_ext.h"
+#include "game_ext.h"
+#include "scheduler.h"
+#include "timeout.h"
 #include "debug.h"
+#include "trace.h"
 
 typedef struct invitation {
 	INVITATION_STATE state;
@@ -10,6 +15,11 @@ typedef struct invitation {
 	GAME_ROLE source_role;
 	GAME_ROLE target_role;
 	GAME *game;
+	TIMEOUT *timeout;           // Time limit, holding a reference while set
+	INV_TIMEOUT_FUNC timeout_func;
+	uint64_t deadline;          // When the time limit expires, or 0 if none
+	unsigned long clock_base;   // Time control of the game, in ms, or 0
+	unsigned long clock_increment;
 	sem_t mutex;
 } INVITATION;
 
@@ -35,6 +45,10 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target, GAME_ROLE source_role, GA
 	invitation->source_role = source_role;
 	invitation->target_role = target_role;
 	invitation->game = NULL;
+	invitation->timeout = NULL;
+	invitation->deadline = 0;
+	invitation->clock_base = 0;
+	invitation->clock_increment = 0;
 	Sem_init(&invitation->mutex, 0, 1);
 	inv_ref(invitation, "for newly created invitation");
 	return invitation;
@@ -53,6 +67,7 @@ INVITATION *inv_ref(INVITATION *inv, char *why){
 	P(&inv->mutex);
 	inv->refcnt++;
 	debug("Increase reference count on invitation %p (%d -> %d) %s", inv, inv->refcnt - 1, inv->refcnt, why);
+	TRACE(TRACE_INVITATION_REF, inv->refcnt, inv, 0);
 	V(&inv->mutex);
 	return inv;
 }
@@ -73,6 +88,7 @@ void inv_unref(INVITATION *inv, char *why){
 
 	inv->refcnt--;
 	debug("Decrease reference count on invitation %p (%d -> %d) %s", inv, inv->refcnt + 1, inv->refcnt, why);
+	TRACE(TRACE_INVITATION_UNREF, inv->refcnt, inv, 0);
 
 	if(inv->refcnt == 0){
 		debug("Free invitation %p", inv);
@@ -81,6 +97,9 @@ void inv_unref(INVITATION *inv, char *why){
 		if(inv->game != NULL){
 			game_unref(inv->game, "because invitation is being freed");
 		}
+		if(inv->timeout != NULL){
+			timeout_free(inv->timeout);
+		}
 		if(inv != NULL){
 			Free(inv);
 		}
@@ -165,14 +184,20 @@ int inv_accept(INVITATION *inv){
 		V(&inv->mutex);
 		return -1;
 	}
-	inv->state = INV_ACCEPTED_STATE;
-	inv->game = game_create();
-	if(inv->game == NULL){
+	GAME *game = game_create();
+	if(game == NULL){
 		debug("Failed to create a game in inv_accept()");
-		inv->state=INV_OPEN_STATE;
 		V(&inv->mutex);
 		return -1;
 	}
+	// the players are recorded before the game can be reached through the invitation
+	game_set_player(game, inv->source_role, client_get_player(inv->source));
+	game_set_player(game, inv->target_role, client_get_player(inv->target));
+	if(inv->clock_base > 0){
+		game_set_clock(game, inv->clock_base, inv->clock_increment);
+	}
+	inv->game = game;
+	inv->state = INV_ACCEPTED_STATE;
 	V(&inv->mutex);
 	return 0;
 }
@@ -198,6 +223,11 @@ int inv_close(INVITATION *inv, GAME_ROLE role){
 		V(&inv->mutex);
 		return -1;
 	}
+	int cancelled = 0;
+	if(inv->timeout != NULL){
+		cancelled = timeout_cancel(inv->timeout);
+		inv->deadline = 0;
+	}
 	if(inv->game != NULL){
 		// there's game in progress
 		if(role == NULL_ROLE){
@@ -216,11 +246,120 @@ int inv_close(INVITATION *inv, GAME_ROLE role){
 		inv->state = INV_CLOSED_STATE;
 	}
 	V(&inv->mutex);
+	if(cancelled){
+		inv_unref(inv, "because time limit of invitation has been cancelled");
+	}
 	return 0;
 }
 
+/*
+ * Scheduler task run when the time limit of an invitation expires.
+ */
+static void timeout_task(void *arg){
+	INVITATION *inv = (INVITATION *) arg;
+	inv->timeout_func(inv);
+	inv_unref(inv, "because time limit of invitation has been handled");
+}
+
+/*
+ * Called by the ticker when the time limit of an invitation expires.
+ */
+static void timeout_expired(void *arg){
+	sched_submit(timeout_task, arg);
+}
+
+/*
+ * Set a time limit on an INVITATION, replacing any limit already set.
+ * When the limit expires, the specified function is submitted to the
+ * scheduler, with a reference to the INVITATION that is discarded once
+ * the function has returned.  Closing the INVITATION cancels its limit.
+ * Since the function may have been submitted just before the limit was
+ * set again or cancelled, it should check inv_timeout_expired() before
+ * doing anything.
+ *
+ * @param inv  The INVITATION.
+ * @param ms  Number of milliseconds from now at which the limit expires,
+ * or 0 to cancel the limit.
+ * @param func  The function to be run when the limit expires.
+ * @return 0 if the limit was set, -1 if the INVITATION is closed.
+ */
+int inv_set_timeout(INVITATION *inv, unsigned long ms, INV_TIMEOUT_FUNC func){
+	// the reference for the time limit is taken in advance, as the limit
+	// may expire as soon as it is set
+	inv_ref(inv, "for time limit of invitation");
+	P(&inv->mutex);
+	if(inv->state == INV_CLOSED_STATE){
+		V(&inv->mutex);
+		inv_unref(inv, "because invitation is closed");
+		return -1;
+	}
+	int was_set;
+	if(ms == 0){
+		was_set = inv->timeout != NULL && timeout_cancel(inv->timeout);
+		inv->deadline = 0;
+		// the reference taken above is not needed either
+		V(&inv->mutex);
+		inv_unref(inv, "because time limit of invitation has been cancelled");
+	} else {
+		if(inv->timeout == NULL){
+			inv->timeout = timeout_create(timeout_expired, inv);
+		}
+		inv->timeout_func = func;
+		inv->deadline = timeout_now() + ms;
+		was_set = timeout_set(inv->timeout, ms);
+		V(&inv->mutex);
+	}
+	if(was_set){
+		inv_unref(inv, "because time limit of invitation has been replaced");
+	}
+	return 0;
+}
+
+/*
+ * Determine whether the time limit of an INVITATION has been reached.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @return 1 if a limit is set and has been reached, otherwise 0.
+ */
+int inv_timeout_expired(INVITATION *inv){
+	P(&inv->mutex);
+	int expired = inv->deadline != 0 && timeout_now() >= inv->deadline;
+	V(&inv->mutex);
+	return expired;
+}
 
 
 
 
 
+
+
+/*
+ * Set the time control of the game to be played if an INVITATION is
+ * accepted.  This must be done before the INVITATION is made visible to
+ * other threads.
+ *
+ * @param inv  The INVITATION.
+ * @param base_ms  The time given to each player for the whole game, in ms,
+ * or 0 if the game is not to be played on a clock.
+ * @param increment_ms  The time added to a player's clock after each of
+ * that player's moves, in ms.
+ */
+void inv_set_time_control(INVITATION *inv, unsigned long base_ms, unsigned long increment_ms){
+	inv->clock_base = base_ms;
+	inv->clock_increment = increment_ms;
+}
+
+/*
+ * Get the time control of the game to be played if an INVITATION is
+ * accepted.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @param incrementp  Variable into which to store the increment, in ms.
+ * @return the base time, in ms, or 0 if the game is not to be played on
+ * a clock.
+ */
+unsigned long inv_get_time_control(INVITATION *inv, unsigned long *incrementp){
+	*incrementp = inv->clock_increment;
+	return inv->clock_base;
+}
@@ -8,30 +8,151 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include "csapp.h"
 
 #include "debug.h"
 #include "protocol.h"
 #include "server.h"
+#include "server_ext.h"
 #include "client_registry.h"
+#include "client_ext.h"
 #include "player_registry.h"
+#include "player_ext.h"
+#include "player_store.h"
+#include "rating.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "gamelog.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "coro.h"
+#include "federation.h"
+#include "bot.h"
+#include "game_ext.h"
 #include "jeux_globals.h"
 
 #ifdef DEBUG
 int _debug_packets_ = 1;
 #endif
 
-static int listenfd, *connfdp = NULL;
+static int *listenfds; // one listening socket per acceptor
+static int nacceptors;
 // static pthread_attr_t attr;
 
 static void terminate(int status);
 
+/*
+ * Thread that waits for SIGUSR1, which the other threads keep blocked,
+ * and dumps the server statistics and the trace each time it arrives.
+ */
+static void *dump_thread(void *arg){
+    sigset_t *set = (sigset_t *) arg;
+    Pthread_detach(pthread_self());
+    while(1){
+        int sig;
+        if(sigwait(set, &sig) == 0 && sig == SIGUSR1){
+            stats_dump(stderr);
+            trace_dump();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Open a listening socket on a port with SO_REUSEPORT set, as
+ * open_listenfd() does otherwise, so that each acceptor can have its own
+ * socket on the same port and the kernel spreads new connections across
+ * them.
+ *
+ * @return the listening socket, or -1 on error.
+ */
+static int open_reuseport_listenfd(char *port){
+    struct addrinfo hints, *listp, *p;
+    int fd = -1, optval = 1;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &listp) != 0){
+        return -1;
+    }
+    for(p = listp; p; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if(bind(fd, p->ai_addr, p->ai_addrlen) == 0){
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    if(fd >= 0 && listen(fd, LISTENQ) < 0){
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/*
+ * Accept connections on a listening socket, starting a thread to run
+ * jeux_client_service() for each, until the socket fails.  accept4() is
+ * used so that the connection is close-on-exec from the start; it is left
+ * blocking, as the service loop reads it with blocking reads.  The raw
+ * system call is used because the glibc wrapper requires _GNU_SOURCE,
+ * which csapp.h does not tolerate.  With an upgrade socket, the listening
+ * socket is non-blocking and is waited on with upgrade_wait(), so that a
+ * handoff cannot happen while a connection is being accepted.
+ */
+static void accept_loop(int listenfd){
+    while(1){
+        struct sockaddr_storage clientaddr;
+        socklen_t clientlen = sizeof(struct sockaddr_storage);
+        upgrade_wait(listenfd);
+        int connfd = syscall(SYS_accept4, listenfd, (SA *) &clientaddr, &clientlen, SOCK_CLOEXEC);
+        if(connfd < 0){
+            if(errno == EINTR || errno == ECONNABORTED || errno == EPROTO
+               || errno == EAGAIN || errno == EWOULDBLOCK){
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                // out of resources: leave the connection queued for a while
+                debug("Accept failed on socket %d: %s", listenfd, strerror(errno));
+                usleep(10000);
+                continue;
+            }
+            debug("Accept failed on socket %d: %s", listenfd, strerror(errno));
+            return;
+        }
+        int *connfdp = Malloc(sizeof(int));
+        *connfdp = connfd;
+        upgrade_enter();
+        if(coro_enabled()){
+            coro_spawn(jeux_client_coroutine, connfdp);
+        } else {
+            pthread_t tid;
+            Pthread_create(&tid, NULL, jeux_client_service, connfdp);
+        }
+    }
+}
+
+static void *acceptor_thread(void *arg){
+    Pthread_detach(pthread_self());
+    accept_loop(*(int *) arg);
+    upgrade_leave();
+    return NULL;
+}
+
 void handler(int signum){
-    Close(listenfd);
-    if(connfdp != NULL){
-        Free(connfdp);
+    for(int i = 0; i < nacceptors; i++){
+        Close(listenfds[i]);
     }
     // pthread_attr_destroy(&attr);
     terminate(EXIT_SUCCESS);
@@ -75,30 +196,199 @@ int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
-    if(argc < 3){ // if -p exists and is valid, argc must be at least 3
-        exit(0);
-    }
+    // Option '-w <workers>' sets the number of scheduler worker threads
+    // (default: one per CPU), and '-a' pins each worker to a CPU.
+    // Option '-A <acceptors>' sets the number of threads accepting
+    // connections, each on its own listening socket (default: one per
+    // worker).
+    // Option '-t <file>' enables tracing to the specified file,
+    // '-c <file>' captures all packets to the specified file, and
+    // '-g <dir>' logs the record of every finished game in the specified
+    // directory.  Options '-i <secs>', '-m <secs>' and '-e <secs>' set the
+    // time limits for idle connections, for each move and for accepting an
+    // invitation, '-T <base>[+<inc>]' the default time control of games,
+    // and '-r <secs>' the grace period for resuming a dropped session.
+    // Option '-U <path>' takes over from the server listening at the
+    // specified upgrade socket, if there is one, and then listens there
+    // for a new server to take over from this one.  Option '-u' receives
+    // and sends packets with io_uring, if the kernel supports it, and
+    // '-C <threads>' runs client services as coroutines on the specified
+    // number of threads instead of one thread each.  Option '-S' makes
+    // the coroutine threads shards (one per CPU unless '-C' is given),
+    // each running the games started by its own clients.  Options
+    // '-D <directory>' and '-N [<host>:]<port>' make the server a node of
+    // the federation whose directory is at the specified UNIX socket path
+    // or <host>:<port>, listening for links from the other nodes on the
+    // specified port.  Option '-B <name>' logs in a bot under the
+    // specified username, which plays every invitation it is sent.
+    // Option '-P <file>' loads the players, their ratings and records from
+    // the specified player store, such as one written by bin/jrerate,
+    // unless they are handed over by an upgrade, and '-K <k>' sets the
+    // K-factor with which ratings are updated.
     char *port_number = NULL; // port number we take from the CLI
-    int index = 1; // index in argv array
-    while(index < argc){
-        if(strcmp(argv[index], "-p") == 0){
-            // found an -p, if it is not the last argument then we have found
-            if(index < argc - 1){
-                port_number = argv[index + 1];
-                break;
+    char *trace_file = NULL;
+    char *capture_file = NULL;
+    char *gamelog_dir = NULL;
+    char *upgrade_path = NULL;
+    char *directory = NULL, *node = NULL;
+    char *bot_name = NULL;
+    char *player_store = NULL;
+    int nworkers = 0, pin_workers = 0, use_uring = 0, ncoro_threads = 0, sharded = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "p:w:A:at:c:g:i:m:e:T:r:U:uC:SD:N:B:P:K:")) != -1){
+        switch(opt){
+        case 'p':
+            port_number = optarg;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'A':
+            nacceptors = atoi(optarg);
+            break;
+        case 'a':
+            pin_workers = 1;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'c':
+            capture_file = optarg;
+            break;
+        case 'g':
+            gamelog_dir = optarg;
+            break;
+        case 'i':
+            client_idle_timeout = strtoul(optarg, NULL, 10) * 1000;
+            break;
+        case 'm':
+            client_move_timeout = strtoul(optarg, NULL, 10) * 1000;
+            break;
+        case 'e':
+            client_invite_timeout = strtoul(optarg, NULL, 10) * 1000;
+            break;
+        case 'r':
+            client_resume_grace = strtoul(optarg, NULL, 10) * 1000;
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'C':
+            ncoro_threads = atoi(optarg);
+            break;
+        case 'S':
+            sharded = 1;
+            break;
+        case 'D':
+            directory = optarg;
+            break;
+        case 'N':
+            node = optarg;
+            break;
+        case 'B':
+            bot_name = optarg;
+            break;
+        case 'P':
+            player_store = optarg;
+            break;
+        case 'K': {
+            char *end;
+            errno = 0;
+            long k = strtol(optarg, &end, 10);
+            if(errno != 0 || end == optarg || *end != '\0' || k <= 0 || k > RATING_K_FACTOR_MAX){
+                fprintf(stderr, "Invalid K-factor: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            player_k_factor = k;
+            break;
+        }
+        case 'T':
+            if(client_parse_time_control(optarg, &client_time_base, &client_time_increment) == -1){
+                fprintf(stderr, "Invalid time control: %s\n", optarg);
+                exit(EXIT_FAILURE);
             }
+            break;
+        default:
+            exit(0);
         }
-        index++;
     }
     if(port_number == NULL){ // if port if empty then terminate (depends on whether port number can be 0)
         exit(0);
     }
 
 
+    if(trace_file != NULL){
+        trace_init(trace_file);
+    }
+
+    // Block SIGUSR1 before any other thread exists, so that only the
+    // dump thread receives it.
+    static sigset_t usr1_mask;
+    pthread_t dump_tid;
+    sigemptyset(&usr1_mask);
+    sigaddset(&usr1_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1_mask, NULL);
+    Pthread_create(&dump_tid, NULL, dump_thread, &usr1_mask);
+
+    if(capture_file != NULL && capture_init(capture_file) != 0){
+        fprintf(stderr, "Cannot open capture file %s\n", capture_file);
+        exit(EXIT_FAILURE);
+    }
+    if(gamelog_dir != NULL && gamelog_init(gamelog_dir) != 0){
+        fprintf(stderr, "Cannot open game log in %s\n", gamelog_dir);
+        exit(EXIT_FAILURE);
+    }
+
     // Perform required initializations of the client_registry and
     // player_registry.
     client_registry = creg_init();
     player_registry = preg_init();
+    sched_init(nworkers, pin_workers);
+
+    // Every position of the game is solved before any client connects,
+    // for HINT and the bot.
+    game_tablebase_init();
+    if(bot_name != NULL && bot_init(bot_name) == -1){
+        fprintf(stderr, "Cannot log in bot %s\n", bot_name);
+        exit(EXIT_FAILURE);
+    }
+
+    // Data received by the io_uring backend cannot be handed over to a
+    // new server process, so the two do not go together.
+    if(use_uring && upgrade_path != NULL){
+        debug("io_uring backend not used with an upgrade socket");
+    } else if(use_uring && uring_init() == -1){
+        debug("io_uring backend not available, reading connections directly");
+    }
+
+    // Coroutines wait for their connections through epoll, which neither
+    // a handoff nor the io_uring backend can take part in.
+    if(sharded && ncoro_threads <= 0){
+        ncoro_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(ncoro_threads > 0 && (upgrade_path != NULL || uring_enabled())){
+        debug("Coroutines not used with an upgrade socket or io_uring");
+    } else if(ncoro_threads > 0 && coro_init(ncoro_threads, sharded) == -1){
+        fprintf(stderr, "Cannot start coroutine threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A node needs both the directory and its own address.  Its players
+    // are only known to the directory once they log in again, so a node
+    // cannot take over from another server.
+    if((directory == NULL) != (node == NULL)){
+        fprintf(stderr, "Options -D and -N must be given together\n");
+        exit(EXIT_FAILURE);
+    }
+    if(directory != NULL && upgrade_path != NULL){
+        debug("Federation not joined with an upgrade socket");
+    } else if(directory != NULL && fed_init(directory, node) == -1){
+        fprintf(stderr, "Cannot join federation with directory %s\n", directory);
+        exit(EXIT_FAILURE);
+    }
 
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
@@ -119,28 +409,56 @@ int main(int argc, char* argv[]){
     //     terminate(EXIT_FAILURE);
     // }
 
-    // Set up listenfd
-    struct sockaddr_storage clientaddr; socklen_t clientlen;
-    pthread_t tid;
-
-    listenfd = Open_listenfd(argv[2]); /* Pass in Port Number */ // TODO: free listenfd
-    debug("Jeux server listening on port %s", argv[2]);
-
-    // _______
-
-    // pthread_attr_init(&attr);
-    // pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    // ______
-    // Master thread while loop
-    while(1){
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen); // TODO: free connfd
+    // Take over the listening sockets and the connections of the server
+    // being upgraded, if any; otherwise set up one listening socket per
+    // acceptor.
+    int nhanded = 0;
+    if(upgrade_path != NULL && (nhanded = upgrade_receive(upgrade_path, &listenfds)) < 0){
+        fprintf(stderr, "Cannot take over from server at %s\n", upgrade_path);
+        exit(EXIT_FAILURE);
+    }
+    if(nhanded > 0){
+        nacceptors = nhanded;
+    } else {
+        if(player_store != NULL && pstore_load(player_store) == -1){
+            fprintf(stderr, "Cannot load player store %s\n", player_store);
+            exit(EXIT_FAILURE);
+        }
+        if(nacceptors <= 0){
+            nacceptors = sched_nworkers();
+        }
+        listenfds = Malloc(nacceptors * sizeof(int));
+        for(int i = 0; i < nacceptors; i++){
+            if((listenfds[i] = open_reuseport_listenfd(port_number)) < 0){
+                fprintf(stderr, "Cannot listen on port %s\n", port_number);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    debug("Jeux server listening on port %s with %d acceptors", port_number, nacceptors);
+    if(upgrade_path != NULL){
+        for(int i = 0; i < nacceptors; i++){
+            fcntl(listenfds[i], F_SETFL, fcntl(listenfds[i], F_GETFL) | O_NONBLOCK);
+            upgrade_enter();
+        }
+        if(upgrade_listen(upgrade_path, listenfds, nacceptors) == -1){
+            fprintf(stderr, "Cannot listen for upgrades at %s\n", upgrade_path);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-        // Create a thread to handle this Request
-        Pthread_create(&tid, NULL, jeux_client_service, connfdp);
-        // Pthread_create(&tid, NULL, thread, connfdp);
+    // The other acceptors block SIGHUP, so that its handler runs in the
+    // main thread, which is the first acceptor.
+    sigset_t hup_mask, old_mask;
+    sigemptyset(&hup_mask);
+    sigaddset(&hup_mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup_mask, &old_mask);
+    for(int i = 1; i < nacceptors; i++){
+        pthread_t tid;
+        Pthread_create(&tid, NULL, acceptor_thread, &listenfds[i]);
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    accept_loop(listenfds[0]);
 
     // fprintf(stderr, "You have to finish implementing main() "
 	//     "before the Jeux server will function.\n");
@@ -152,6 +470,9 @@ int main(int argc, char* argv[]){
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
+    // End parked sessions, which have no service thread, and park no more.
+    client_resume_shutdown();
+
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
     creg_shutdown_all(client_registry);
@@ -160,6 +481,18 @@ void terminate(int status) {
     creg_wait_for_empty(client_registry);
     debug("%ld: All service threads terminated.", pthread_self());
 
+    for(int i = 0; i < sched_nworkers(); i++){
+        SCHED_STATS stats;
+        if(sched_get_stats(i, &stats) == 0){
+            debug("Worker %d (cpu %d): submitted %lu, executed %lu, stolen %lu",
+                  i, stats.cpu, stats.submitted, stats.executed, stats.stolen);
+        }
+    }
+
+    trace_dump();
+    capture_fini();
+    gamelog_fini();
+
     // Finalize modules.
     creg_fini(client_registry);
     preg_fini(player_registry);
@@ -1,7 +1,10 @@
 #include "player.h"
+#include "player_ext.h"
+#include "history.h"
+#include "rating.h"
 #include "csapp.h"
 #include "debug.h"
-#include "math.h"
+#include "trace.h"
 
 /*
  * The PLAYER type is a structure type that defines the state of a player.
@@ -13,9 +16,36 @@ typedef struct player {
 	int refcnt;
 	char *username;
 	int rating;
+	unsigned long record[3]; // games won, lost and drawn, counted atomically
+	struct h2h *h2h; // head-to-head records with the player's opponents
+	HISTORY *history; // changes of the rating, appended under mutex
 	sem_t mutex;
 } PLAYER;
 
+/*
+ * The head-to-head record of two players who have played each other.
+ * These form a sparse matrix of all the pairs of players: a hash table
+ * keyed by the pair, whose chains only ever grow, and in which each entry
+ * is also on a list of each of its two players.  Entries are added with
+ * compare-and-swap and their counters incremented atomically, so posting
+ * a result takes no lock.
+ */
+typedef struct h2h {
+	PLAYER *players[2];     // the two players, in address order, referenced
+	unsigned long wins[2];  // games won by each of them
+	unsigned long draws;
+	struct h2h *next;       // next entry in the hash chain
+	struct h2h *link[2];    // next entry on the list of each player
+} H2H;
+
+#define H2H_BUCKETS 4096
+
+static H2H *h2h_table[H2H_BUCKETS];
+
+int player_k_factor = RATING_K_FACTOR;
+
+static void record_result(PLAYER *player1, PLAYER *player2, int result);
+
 /*
  * Create a new PLAYER with a specified username.  A private copy is
  * made of the username that is passed.  The newly created PLAYER has
@@ -38,6 +68,9 @@ PLAYER *player_create(char *name){
 	strcpy(player->username, name);
 	player->username[strlen(name)] = '\0';
 	player->rating = PLAYER_INITIAL_RATING;
+	memset(player->record, 0, sizeof(player->record));
+	player->h2h = NULL;
+	player->history = history_create();
 	Sem_init(&player->mutex, 0, 1);
 	player_ref(player, "for newly created player");
 	return player;
@@ -56,6 +89,7 @@ PLAYER *player_ref(PLAYER *player, char *why){
 	P(&player->mutex);
 	player->refcnt++;
 	debug("Increase reference count on invitation %p (%d -> %d) %s", player, player->refcnt - 1, player->refcnt, why);
+	TRACE(TRACE_PLAYER_REF, player->refcnt, player, 0);
 	V(&player->mutex);
 	return player;
 }
@@ -75,11 +109,13 @@ void player_unref(PLAYER *player, char *why){
 	P(&player->mutex);
 	player->refcnt--;
 	debug("Decrease reference count on player %p (%d -> %d) %s", player, player->refcnt + 1, player->refcnt, why);
+	TRACE(TRACE_PLAYER_UNREF, player->refcnt, player, 0);
 	if(player->refcnt == 0){
 		debug("Free player %p", player);
 		if(player->username != NULL){
 			Free(player->username);
 		}
+		history_free(player->history);
 		V(&player->mutex);
 		if(player != NULL){
 			Free(player);
@@ -110,6 +146,19 @@ int player_get_rating(PLAYER *player){
 	return player->rating;
 }
 
+/*
+ * Set the rating of a player, as when restoring the state handed over by
+ * another server process.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating){
+	P(&player->mutex);
+	player->rating = rating;
+	V(&player->mutex);
+}
+
 /*
  * Post the result of a game between two players.
  * To update ratings, we use a system of a type devised by Arpad Elo,
@@ -122,8 +171,10 @@ int player_get_rating(PLAYER *player){
  * Let E1 = 1/(1 + 10**((R2-R1)/400)), and
  *     E2 = 1/(1 + 10**((R1-R2)/400))
  * Update the players ratings to R1' and R2' using the formula:
- *     R1' = R1 + 32*(S1-E1)
- *     R2' = R2 + 32*(S2-E2)
+ *     R1' = R1 + K*(S1-E1)
+ *     R2' = R2 + K*(S2-E2)
+ * where K is player_k_factor.  The update itself is rating_update(), in
+ * rating.h.
  *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
@@ -131,36 +182,166 @@ int player_get_rating(PLAYER *player){
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result){
 	if(player1 != NULL && player2 != NULL){
-		double S1, S2;
-		if(result == 0){
-			S1 = 0.5;
-			S2 = 0.5;
-		} else if(result == 1){
-			S1 = 1;
-			S2 = 0;
-		} else if(result == 2){
-			S2 = 1;
-			S1 = 0;
-		} else {
+		if(result < 0 || result > 2){
 			return;
 		}
 
 		int R1 = player1->rating;
 		int R2 = player2->rating;
-
-		double E1 = 1/(1 + pow(10, (R2-R1)/400));
-		double E2 = 1/(1 + pow(10, (R1-R2)/400));
-
-		R1 += (int)(32*(S1-E1));
-		R2 += (int)(32*(S2-E2));
+		rating_update(&R1, &R2, result, player_k_factor);
 
 		debug("Post result(%s, %s, %d)", player_get_name(player1), player_get_name(player2), result);
 
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		uint64_t now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
 		P(&player1->mutex);
 		player1->rating = R1;
+		history_append(player1->history, now, R1, player2, result == 0 ? HISTORY_DRAWN
+			       : result == 1 ? HISTORY_WON : HISTORY_LOST);
 		V(&player1->mutex);
 		P(&player2->mutex);
 		player2->rating = R2;
+		history_append(player2->history, now, R2, player1, result == 0 ? HISTORY_DRAWN
+			       : result == 2 ? HISTORY_WON : HISTORY_LOST);
 		V(&player2->mutex);
+
+		record_result(player1, player2, result);
+	}
+}
+
+/*
+ * Find the head-to-head record of two players, adding one if they have
+ * not played each other before.
+ */
+static H2H *find_h2h(PLAYER *player1, PLAYER *player2){
+	if(player2 < player1){
+		PLAYER *p = player1;
+		player1 = player2;
+		player2 = p;
 	}
-}
\ No newline at end of file
+	H2H **bucket = &h2h_table[((uintptr_t) player1 * 31 + (uintptr_t) player2) / sizeof(PLAYER) % H2H_BUCKETS];
+	H2H *entry = NULL;
+	H2H *head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	while(1){
+		for(H2H *h = head; h != NULL; h = h->next){
+			if(h->players[0] == player1 && h->players[1] == player2){
+				if(entry != NULL){
+					// another thread added the pair first
+					player_unref(player1, "because head-to-head record is a duplicate");
+					player_unref(player2, "because head-to-head record is a duplicate");
+					Free(entry);
+				}
+				return h;
+			}
+		}
+		if(entry == NULL){
+			entry = (H2H *) Calloc(1, sizeof(H2H));
+			entry->players[0] = player_ref(player1, "for head-to-head record");
+			entry->players[1] = player_ref(player2, "for head-to-head record");
+		}
+		// only the chain seen above may be extended, or it is searched again
+		entry->next = head;
+		if(__atomic_compare_exchange_n(bucket, &head, entry, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			break;
+		}
+	}
+	for(int i = 0; i < 2; i++){
+		PLAYER *player = entry->players[i];
+		entry->link[i] = __atomic_load_n(&player->h2h, __ATOMIC_ACQUIRE);
+		while(!__atomic_compare_exchange_n(&player->h2h, &entry->link[i], entry, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+	}
+	return entry;
+}
+
+/*
+ * Count the result of a game in the records of its two players and in
+ * their head-to-head record.
+ */
+static void record_result(PLAYER *player1, PLAYER *player2, int result){
+	H2H *h2h = find_h2h(player1, player2);
+	if(result == 0){
+		__atomic_add_fetch(&player1->record[2], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&player2->record[2], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&h2h->draws, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	PLAYER *winner = result == 1 ? player1 : player2;
+	PLAYER *loser = result == 1 ? player2 : player1;
+	__atomic_add_fetch(&winner->record[0], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&loser->record[1], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h2h->wins[h2h->players[0] == winner ? 0 : 1], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get the numbers of games a player has won, lost and drawn.
+ *
+ * @param player  The PLAYER to be queried.
+ * @param record  Array into which to store the numbers of games won, lost
+ * and drawn, in that order.
+ */
+void player_get_record(PLAYER *player, unsigned long record[3]){
+	for(int i = 0; i < 3; i++){
+		record[i] = __atomic_load_n(&player->record[i], __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Add to the numbers of games a player has won, lost and drawn, and to
+ * their head-to-head record with an opponent, as when restoring the state
+ * handed over by another server process.
+ *
+ * @param player  The PLAYER.
+ * @param opponent  The opponent, or NULL to add to the player's own
+ * record only.
+ * @param record  The numbers of games won, lost and drawn by the player.
+ */
+void player_add_record(PLAYER *player, PLAYER *opponent, unsigned long record[3]){
+	if(opponent == NULL){
+		for(int i = 0; i < 3; i++){
+			__atomic_add_fetch(&player->record[i], record[i], __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	H2H *h2h = find_h2h(player, opponent);
+	int i = h2h->players[0] == player ? 0 : 1;
+	__atomic_add_fetch(&h2h->wins[i], record[0], __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h2h->wins[1 - i], record[1], __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h2h->draws, record[2], __ATOMIC_RELAXED);
+}
+
+/*
+ * Call a function for each opponent a player has played, with their
+ * head-to-head record.  Opponents are visited in the reverse order of the
+ * first game the player played against each of them.
+ *
+ * @param player  The PLAYER.
+ * @param func  The function, which is passed the player, the opponent,
+ * the numbers of games won, lost and drawn by the player against the
+ * opponent, and arg.
+ * @param arg  Argument to be passed to the function.
+ */
+void player_foreach_opponent(PLAYER *player, PLAYER_RECORD_FUNC func, void *arg){
+	for(H2H *h = __atomic_load_n(&player->h2h, __ATOMIC_ACQUIRE); h != NULL; ){
+		int i = h->players[0] == player ? 0 : 1;
+		unsigned long record[3] = {
+			__atomic_load_n(&h->wins[i], __ATOMIC_RELAXED),
+			__atomic_load_n(&h->wins[1 - i], __ATOMIC_RELAXED),
+			__atomic_load_n(&h->draws, __ATOMIC_RELAXED)
+		};
+		func(player, h->players[1 - i], record, arg);
+		h = h->link[i];
+	}
+}
+/*
+ * Get the rating history of a player, to which player_post_result()
+ * appends each change of the player's rating.
+ *
+ * @param player  The PLAYER.
+ * @return the HISTORY of the player, which lasts as long as the player.
+ */
+HISTORY *player_get_history(PLAYER *player){
+	return player->history;
+}
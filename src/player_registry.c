@@ -1,4 +1,5 @@
 #include "player_registry.h"
+#include "player_registry_ext.h"
 #include "csapp.h"
 #include "debug.h"
 
@@ -148,7 +149,6 @@ PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name){
 
 	pmap->name = pname;
 
-	printf("%p\n", preg->buf);
 	preg->buf[preg->num_users] = pmap;
 
 	preg->num_users++;
@@ -159,3 +159,49 @@ PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name){
 	return pmap->player;
 }
 
+
+/*
+ * Return a list of all registered players, whether logged in or not.
+ * The result is returned as a malloc'ed array of PLAYER pointers, with a
+ * NULL pointer marking the end of the array.  It is the caller's
+ * responsibility to decrement the reference count of each of the entries
+ * and to free the array when it is no longer needed.
+ *
+ * @param preg  The player registry.
+ * @return the list of players as a NULL-terminated array of pointers.
+ */
+PLAYER **preg_all_players(PLAYER_REGISTRY *preg){
+	P(&preg->mutex);
+	PLAYER **result = (PLAYER **) Malloc((preg->num_users + 1) * sizeof(PLAYER *));
+	int n = 0;
+	for(int i = 0; i < preg->num_users; i++){
+		if(preg->buf[i] != NULL && preg->buf[i]->player != NULL){
+			result[n++] = player_ref(preg->buf[i]->player, "for reference being added to players list");
+		}
+	}
+	result[n] = NULL;
+	V(&preg->mutex);
+	return result;
+}
+
+/*
+ * Find the player registered with a specified user name, without
+ * registering one if there is none.
+ *
+ * @param preg  The player registry.
+ * @param name  The user name.
+ * @return a reference to the PLAYER, which the caller must discard with
+ * player_unref(), or NULL if no player is registered with that name.
+ */
+PLAYER *preg_lookup(PLAYER_REGISTRY *preg, char *name){
+	PLAYER *player = NULL;
+	P(&preg->mutex);
+	for(int i = 0; i < preg->num_users; i++){
+		if(preg->buf[i] != NULL && preg->buf[i]->player != NULL && strcmp(preg->buf[i]->name, name) == 0){
+			player = player_ref(preg->buf[i]->player, "for reference being returned by preg_lookup()");
+			break;
+		}
+	}
+	V(&preg->mutex);
+	return player;
+}
@@ -0,0 +1,138 @@
+#include "player_store.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "jeux_globals.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Write the head-to-head record of two players, once for each pair.
+ */
+static void write_h2h(PLAYER *player, PLAYER *opponent, unsigned long record[3], void *arg){
+	char *name = player_get_name(player), *other = player_get_name(opponent);
+	if(strcmp(name, other) < 0){
+		fprintf((FILE *) arg, "H %lu %lu %lu %zu:%s %zu:%s\n", record[0], record[1], record[2],
+			strlen(name), name, strlen(other), other);
+	}
+}
+
+/*
+ * Write the lines of all the registered players.
+ *
+ * @param out  The stream to which to write them.
+ */
+void pstore_write(FILE *out){
+	PLAYER **players = preg_all_players(player_registry);
+	for(int i = 0; players[i] != NULL; i++){
+		char *name = player_get_name(players[i]);
+		unsigned long record[3];
+		player_get_record(players[i], record);
+		fprintf(out, "P %d %lu %lu %lu %zu:%s\n", player_get_rating(players[i]),
+			record[0], record[1], record[2], strlen(name), name);
+	}
+	for(int i = 0; players[i] != NULL; i++){
+		player_foreach_opponent(players[i], write_h2h, out);
+		player_unref(players[i], "player removed from players list");
+	}
+	Free(players);
+}
+
+/*
+ * Parse a length-prefixed name ("<len>:<name>") at *sp into buf, which
+ * has room for size bytes, and advance *sp past it.
+ *
+ * @return 0 if successful, or -1 if there is no such name or it does not
+ * fit.
+ */
+int pstore_parse_name(char **sp, char *buf, size_t size){
+	char *end;
+	size_t len = strtoul(*sp, &end, 10);
+	if(*end != ':' || len >= size || strlen(end + 1) < len){
+		return -1;
+	}
+	memcpy(buf, end + 1, len);
+	buf[len] = '\0';
+	*sp = end + 1 + len;
+	return 0;
+}
+
+/*
+ * Restore a player or a head-to-head record from a line of a player
+ * store.  A player that is not yet registered is registered, and the
+ * numbers of games in the line are added to those the player already has.
+ *
+ * @param line  The line, without its newline.
+ * @return 0 if successful, or -1 if the line is malformed.
+ */
+int pstore_restore(char *line){
+	char name[1024];
+	if(strlen(line) < 2){
+		return -1;
+	}
+	char *s = line + 2;
+	if(line[0] == 'P'){
+		int rating = strtol(s, &s, 10);
+		unsigned long record[3];
+		for(int i = 0; i < 3; i++){
+			record[i] = strtoul(s, &s, 10);
+		}
+		if(*s++ != ' ' || pstore_parse_name(&s, name, sizeof(name)) == -1){
+			return -1;
+		}
+		PLAYER *player = preg_register(player_registry, name);
+		player_set_rating(player, rating);
+		player_add_record(player, NULL, record);
+		player_unref(player, "because player has been restored");
+	} else if(line[0] == 'H'){
+		unsigned long record[3];
+		for(int i = 0; i < 3; i++){
+			record[i] = strtoul(s, &s, 10);
+		}
+		char other[sizeof(name)];
+		if(*s++ != ' ' || pstore_parse_name(&s, name, sizeof(name)) == -1 || *s++ != ' '
+		   || pstore_parse_name(&s, other, sizeof(other)) == -1){
+			return -1;
+		}
+		PLAYER *player = preg_register(player_registry, name);
+		PLAYER *opponent = preg_register(player_registry, other);
+		player_add_record(player, opponent, record);
+		player_unref(player, "because head-to-head record has been restored");
+		player_unref(opponent, "because head-to-head record has been restored");
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Load a player store from a file, as with pstore_restore() for each line.
+ *
+ * @param path  The path of the file.
+ * @return 0 if successful, or -1 if the file cannot be read or a line of
+ * it is malformed.
+ */
+int pstore_load(char *path){
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		return -1;
+	}
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret = 0, nlines = 0;
+	while((len = getline(&line, &size, f)) != -1){
+		if(len > 0 && line[len - 1] == '\n'){
+			line[--len] = '\0';
+		}
+		if(pstore_restore(line) == -1){
+			debug("Malformed line %d of player store %s", nlines + 1, path);
+			ret = -1;
+			break;
+		}
+		nlines++;
+	}
+	free(line);
+	fclose(f);
+	debug("Loaded %d lines of player store %s", nlines, path);
+	return ret;
+}
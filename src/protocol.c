@@ -1,7 +1,179 @@
 #include "csapp.h"
-#include "protocol.h"
+#include "protocol_ext.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "coro.h"
 #include "debug.h"
 
+/*
+ * Write the whole of an I/O vector to a file descriptor, continuing after
+ * short writes and interrupted calls.  The I/O vector is modified.  On a
+ * socket whose peer has gone away, this fails with EPIPE rather than
+ * raising SIGPIPE.
+ *
+ * @param fd  The file descriptor to be written.
+ * @param iov  The I/O vector.
+ * @param iovcnt  The number of elements of the I/O vector.
+ * @return 0 if everything was written, -1 otherwise, with errno set to
+ *   indicate the error.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt){
+	int is_socket = 1;
+	while(iovcnt > 0){
+		ssize_t n;
+		if(is_socket){
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iovcnt;
+			n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		} else {
+			n = writev(fd, iov, iovcnt);
+		}
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno == ENOTSOCK && is_socket){
+				is_socket = 0;
+				continue;
+			}
+			return -1;
+		}
+		while(iovcnt > 0 && (size_t) n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0){
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Account for a packet that has been completely written to a connection:
+ * debugging printout, trace event, capture record and statistics.
+ *
+ * @param fd  The file descriptor on which the packet was sent.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ */
+void proto_packet_sent(int fd, JEUX_PACKET_HEADER *hdr, void *data){
+    uint16_t payload_size = ntohs(hdr->size);
+	if(payload_size > 0 && data != NULL){
+        debug("=> %d.%d: type=%d size=%d id=%d role=%d, payload=[%p]", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role, (char *) data);
+	} else {
+        debug("=> %d.%d: type=%d size=%d id=%d role=%d (no payload)", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+    }
+    TRACE(TRACE_PKT_SEND, fd, hdr->type, payload_size);
+    capture_packet(fd, CAPTURE_OUT, hdr, data);
+    stats_record_send(hdr->type, sizeof(JEUX_PACKET_HEADER) + (data != NULL ? payload_size : 0));
+}
+
+/*
+ * Account for a packet that has been completely received from a
+ * connection: debugging printout, trace event, capture record and
+ * statistics.
+ *
+ * @param fd  The file descriptor from which the packet was received.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param data  The payload, or NULL if there is none.
+ */
+void proto_packet_received(int fd, JEUX_PACKET_HEADER *hdr, void *data){
+    uint16_t payload_size = ntohs(hdr->size);
+    if(payload_size > 0 && data != NULL){
+        debug("<= %d.%d: type=%d, size=%d, id=%d, role=%d, payload=%s", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role, (char *) data);
+    } else {
+        debug("<= %d.%d: type=%d, size=%d, id=%d, role=%d (no payload)", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+    }
+    TRACE(TRACE_PKT_RECV, fd, hdr->type, payload_size);
+    capture_packet(fd, CAPTURE_IN, hdr, data);
+    stats_record_recv(hdr->type, sizeof(JEUX_PACKET_HEADER) + payload_size);
+}
+
+/*
+ * Get the size of the fixed-size header of a version of the protocol.
+ *
+ * @param version  The version.
+ * @return the size of its header.
+ */
+size_t proto_header_size(int version){
+	return version >= 2 ? sizeof(JEUX_PACKET_HEADER_V2) : sizeof(JEUX_PACKET_HEADER);
+}
+
+/*
+ * Lay out a packet header as it is sent on a connection.
+ *
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  The version 1 header, with multi-byte fields in network byte
+ * order.
+ * @param ext  The fields that version 1 has no room for, or NULL if there
+ * are none, in which case the id field of hdr is used in full.
+ * @param wire  Storage for the header to be sent.
+ * @return the size of the header to be sent.
+ */
+size_t proto_frame_header(int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+			  JEUX_WIRE_HEADER *wire){
+	if(version < 2){
+		wire->v1 = *hdr;
+		return sizeof(JEUX_PACKET_HEADER);
+	}
+	memset(&wire->v2, 0, sizeof(JEUX_PACKET_HEADER_V2));
+	wire->v2.type = hdr->type;
+	wire->v2.role = hdr->role;
+	wire->v2.size = hdr->size;
+	wire->v2.timestamp_sec = hdr->timestamp_sec;
+	wire->v2.timestamp_nsec = hdr->timestamp_nsec;
+	if(ext != NULL){
+		wire->v2.flags = ext->flags;
+		wire->v2.id = htonl(ext->id);
+		wire->v2.request = htonl(ext->request);
+	} else {
+		wire->v2.id = htonl(hdr->id);
+	}
+	return sizeof(JEUX_PACKET_HEADER_V2);
+}
+
+/*
+ * Split a header received on a connection into its version 1 header and
+ * the fields that version 1 has no room for.
+ *
+ * @param version  The version of the protocol used on the connection.
+ * @param wire  The header received, proto_header_size(version) bytes.
+ * @param hdr  Storage for the version 1 header, whose id field holds the
+ * low 8 bits of the ID.
+ * @param ext  Storage for the other fields, or NULL if they are not wanted.
+ */
+void proto_unframe_header(int version, void *wire, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext){
+	if(version < 2){
+		memcpy(hdr, wire, sizeof(JEUX_PACKET_HEADER));
+		if(ext != NULL){
+			ext->id = hdr->id;
+			ext->request = 0;
+			ext->flags = 0;
+		}
+		return;
+	}
+	JEUX_PACKET_HEADER_V2 v2;
+	memcpy(&v2, wire, sizeof(JEUX_PACKET_HEADER_V2));
+	memset(hdr, 0, sizeof(JEUX_PACKET_HEADER));
+	hdr->type = v2.type;
+	hdr->id = ntohl(v2.id);
+	hdr->role = v2.role;
+	hdr->size = v2.size;
+	hdr->timestamp_sec = v2.timestamp_sec;
+	hdr->timestamp_nsec = v2.timestamp_nsec;
+	if(ext != NULL){
+		ext->id = ntohl(v2.id);
+		ext->request = ntohl(v2.request);
+		ext->flags = v2.flags;
+	}
+}
+
 /*
  * Send a packet, which consists of a fixed-size header followed by an
  * optional associated data payload.
@@ -14,22 +186,71 @@
  *   In the latter case, errno is set to indicate the error.
  *
  * All multi-byte fields in the packet are assumed to be in network byte order.
+ * The header and payload are written with a single system call where
+ * possible, so that they leave in the same segment.
  */
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data){
-	ssize_t n;
-	if((n = rio_writen(fd, (void *) hdr, sizeof(JEUX_PACKET_HEADER)) ) == -1){
+	return proto_send_packet_ext(fd, 1, hdr, NULL, data);
+}
+
+/*
+ * Send a packet, as proto_send_packet() does, on a connection using a
+ * given version of the protocol.
+ *
+ * @param fd  The file descriptor on which packet is to be sent.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  The version 1 header, with multi-byte fields in network byte
+ * order.
+ * @param ext  The fields that version 1 has no room for, or NULL.
+ * @param data  The data payload, or NULL, if there is none.
+ * @return  0 in case of successful transmission, -1 otherwise.
+ */
+int proto_send_packet_ext(int fd, int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+			  void *data){
+    uint16_t payload_size = ntohs(hdr->size);
+	JEUX_WIRE_HEADER wire;
+	struct iovec iov[2];
+	iov[0].iov_base = &wire;
+	iov[0].iov_len = proto_frame_header(version, hdr, ext, &wire);
+	iov[1].iov_base = data;
+	iov[1].iov_len = payload_size;
+	if(proto_writev(fd, iov, payload_size > 0 && data != NULL ? 2 : 1) == -1){
         return -1;
     }
-    uint16_t payload_size = ntohs(hdr->size);
-	if(payload_size > 0 && data != NULL){
-		if((n = rio_writen(fd, data, payload_size)) == -1){
+    proto_packet_sent(fd, hdr, data);
+	return 0;
+}
+
+/*
+ * Read exactly n bytes, as rio_readn() does.  In a coroutine, a read that
+ * would block waits for the connection to become readable by yielding to
+ * the other coroutines of the thread, instead of blocking the thread.
+ */
+static ssize_t readn(int fd, void *buf, size_t n){
+    if(!coro_active()){
+        return rio_readn(fd, buf, n);
+    }
+    char *p = buf;
+    size_t left = n;
+    while(left > 0){
+        ssize_t r = recv(fd, p, left, MSG_DONTWAIT);
+        if(r < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                coro_wait_readable(fd);
+                continue;
+            }
             return -1;
         }
-        debug("=> %d.%d: type=%d size=%d id=%d role=%d, payload=[%p]", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role, (char *) data);
-	} else {
-        debug("=> %d.%d: type=%d size=%d id=%d role=%d (no payload)", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
+        if(r == 0){
+            return -1; // EOF
+        }
+        p += r;
+        left -= r;
     }
-	return 0;
+    return n;
 }
 
 /*
@@ -48,27 +269,47 @@ int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data){
  * responsibility of freeing that storage.
  */
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
+    return proto_recv_packet_ext(fd, 1, hdr, NULL, payloadp);
+}
+
+/*
+ * Receive a packet, as proto_recv_packet() does, from a connection using
+ * a given version of the protocol.
+ *
+ * @param fd  The file descriptor from which the packet is to be received.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  Storage for the version 1 header of the packet.
+ * @param ext  Storage for the fields that version 1 has no room for, or
+ * NULL if they are not wanted.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ * any payload received, which the caller must free.
+ * @return  0 in case of successful reception, -1 otherwise.
+ */
+int proto_recv_packet_ext(int fd, int version, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext,
+                          void **payloadp){
     // // read header
     ssize_t n;
-    if((n = rio_readn(fd, (void *) hdr, sizeof(JEUX_PACKET_HEADER))) == -1){
+    JEUX_WIRE_HEADER wire;
+    if((n = readn(fd, (void *) &wire, proto_header_size(version))) == -1){
         *payloadp = NULL;
         return -1;
     }
+    proto_unframe_header(version, &wire, hdr, ext);
     int header_size = ntohs(hdr->size);
     char *payload;
     if(header_size != 0){
         payload = (char *) Malloc(header_size + 1);
-        if((n = rio_readn(fd, (void *) payload, header_size)) == -1){
+        if((n = readn(fd, (void *) payload, header_size)) == -1){
+            Free(payload);
             *payloadp = NULL;
             return -1;
         }
         payload[header_size] = '\0';
         *payloadp = payload;
-        debug("<= %d.%d: type=%d, size=%d, id=%d, role=%d, payload=%s", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role, payload);
     } else {
         *payloadp = NULL;
-        debug("<= %d.%d: type=%d, size=%d, id=%d, role=%d (no payload)", ntohl(hdr->timestamp_sec), ntohl(hdr->timestamp_nsec), hdr->type, ntohs(hdr->size), hdr->id, hdr->role);
     }
+    proto_packet_received(fd, hdr, *payloadp);
 
     return 0;
 }
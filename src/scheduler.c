@@ -0,0 +1,312 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "scheduler.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define DEQUE_INITIAL_SIZE 64
+#define CPU_MASK_WORDS 16
+
+typedef struct sched_item {
+	SCHED_TASK task;
+	void *arg;
+} SCHED_ITEM;
+
+/*
+ * A worker's deque of tasks: a circular buffer that grows on demand.
+ * The owner works at the bottom; thieves take from the top.
+ */
+typedef struct worker {
+	SCHED_ITEM *buf;
+	unsigned long size;   // capacity of buf, a power of two
+	unsigned long top;    // index of oldest task
+	unsigned long bottom; // index one past the newest task
+	sem_t mutex;
+	pthread_t tid;
+	int index;
+	SCHED_STATS stats;
+} WORKER;
+
+static WORKER *workers = NULL;
+static int num_workers = 0;
+static int started = 0;
+static sem_t init_mutex;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Number of tasks that have been submitted but not yet claimed by a worker.
+ * A worker claims a task by decrementing this semaphore, after which it is
+ * guaranteed to find an unclaimed task in some deque.
+ */
+static sem_t pending;
+static unsigned int next_victim = 0;
+static __thread WORKER *self = NULL;
+
+static void init_mutex_init(void){
+	Sem_init(&init_mutex, 0, 1);
+}
+
+/*
+ * Enlarge a full deque.  The caller holds the deque's mutex.
+ */
+static void deque_grow(WORKER *w){
+	SCHED_ITEM *buf = (SCHED_ITEM *) Malloc(2 * w->size * sizeof(SCHED_ITEM));
+	unsigned long n = w->bottom - w->top;
+	for(unsigned long i = 0; i < n; i++){
+		buf[i] = w->buf[(w->top + i) & (w->size - 1)];
+	}
+	Free(w->buf);
+	w->buf = buf;
+	w->size *= 2;
+	w->top = 0;
+	w->bottom = n;
+}
+
+static void deque_push_bottom(WORKER *w, SCHED_TASK task, void *arg){
+	P(&w->mutex);
+	if(w->bottom - w->top == w->size){
+		deque_grow(w);
+	}
+	w->buf[w->bottom & (w->size - 1)] = (SCHED_ITEM) { task, arg };
+	w->bottom++;
+	w->stats.submitted++;
+	V(&w->mutex);
+	V(&pending);
+}
+
+static void deque_push_top(WORKER *w, SCHED_TASK task, void *arg){
+	P(&w->mutex);
+	if(w->bottom - w->top == w->size){
+		deque_grow(w);
+	}
+	// top is never allowed to wrap below zero
+	if(w->top == 0){
+		unsigned long n = w->bottom;
+		for(unsigned long i = n; i > 0; i--){
+			w->buf[i & (w->size - 1)] = w->buf[(i - 1) & (w->size - 1)];
+		}
+		w->bottom++;
+	} else {
+		w->top--;
+	}
+	w->buf[w->top & (w->size - 1)] = (SCHED_ITEM) { task, arg };
+	w->stats.submitted++;
+	V(&w->mutex);
+	V(&pending);
+}
+
+static int deque_pop_bottom(WORKER *w, SCHED_ITEM *item){
+	int found = 0;
+	P(&w->mutex);
+	if(w->bottom != w->top){
+		w->bottom--;
+		*item = w->buf[w->bottom & (w->size - 1)];
+		found = 1;
+	}
+	V(&w->mutex);
+	return found;
+}
+
+static int deque_steal_top(WORKER *w, SCHED_ITEM *item){
+	int found = 0;
+	P(&w->mutex);
+	if(w->bottom != w->top){
+		*item = w->buf[w->top & (w->size - 1)];
+		w->top++;
+		found = 1;
+	}
+	V(&w->mutex);
+	return found;
+}
+
+/*
+ * Find a task for worker w, which has already claimed one from the
+ * pending count: first from its own deque, otherwise from the others.
+ */
+static void find_task(WORKER *w, SCHED_ITEM *item){
+	if(deque_pop_bottom(w, item)){
+		return;
+	}
+	for(int i = 1; ; i++){
+		WORKER *victim = &workers[(w->index + i) % num_workers];
+		if(victim == w){
+			if(deque_pop_bottom(w, item)){
+				return;
+			}
+			continue;
+		}
+		w->stats.steal_attempts++;
+		if(deque_steal_top(victim, item)){
+			w->stats.stolen++;
+			return;
+		}
+	}
+}
+
+/*
+ * Pin the calling thread to a CPU.  The raw system call is used because
+ * the glibc wrappers require _GNU_SOURCE, which csapp.h does not tolerate.
+ */
+static int pin_self(int cpu){
+	unsigned long mask[CPU_MASK_WORDS];
+	int bits = 8 * sizeof(unsigned long);
+	if(cpu < 0 || cpu >= CPU_MASK_WORDS * bits){
+		return -1;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[cpu / bits] |= 1UL << (cpu % bits);
+	return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+}
+
+static void *sched_worker(void *arg){
+	WORKER *w = (WORKER *) arg;
+	self = w;
+	Pthread_detach(pthread_self());
+	if(w->stats.cpu >= 0 && pin_self(w->stats.cpu) != 0){
+		debug("Failed to pin worker %d to CPU %d", w->index, w->stats.cpu);
+		w->stats.cpu = -1;
+	}
+	while(1){
+		SCHED_ITEM item;
+		P(&pending);
+		find_task(w, &item);
+		item.task(item.arg);
+		w->stats.executed++;
+	}
+	return NULL;
+}
+
+/*
+ * Start the scheduler.  Only the first call has any effect; if some other
+ * function of the scheduler is used before the scheduler has been started,
+ * then it is started with default settings.
+ *
+ * @param nworkers  Number of worker threads, or 0 for one per online CPU.
+ * @param pin  If nonzero, worker i is pinned to CPU (i mod #CPUs).
+ * @return 0 if the scheduler is running, otherwise -1.
+ */
+int sched_init(int nworkers, int pin){
+	int n = nworkers;
+	pthread_once(&init_once, init_mutex_init);
+	P(&init_mutex);
+	if(started){
+		V(&init_mutex);
+		return 0;
+	}
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(ncpus < 1){
+		ncpus = 1;
+	}
+	if(n <= 0){
+		// at least two, so that one task blocked on a lock does not stall the pool
+		n = ncpus < 2 ? 2 : ncpus;
+	}
+	debug("Starting scheduler with %d workers%s", n, pin ? " (pinned)" : "");
+	Sem_init(&pending, 0, 0);
+	workers = (WORKER *) Malloc(n * sizeof(WORKER));
+	for(int i = 0; i < n; i++){
+		WORKER *w = &workers[i];
+		w->size = DEQUE_INITIAL_SIZE;
+		w->buf = (SCHED_ITEM *) Malloc(w->size * sizeof(SCHED_ITEM));
+		w->top = 0;
+		w->bottom = 0;
+		w->index = i;
+		memset(&w->stats, 0, sizeof(SCHED_STATS));
+		w->stats.cpu = pin ? (int) (i % ncpus) : -1;
+		Sem_init(&w->mutex, 0, 1);
+	}
+	num_workers = n;
+	for(int i = 0; i < n; i++){
+		Pthread_create(&workers[i].tid, NULL, sched_worker, &workers[i]);
+	}
+	started = 1;
+	V(&init_mutex);
+	return 0;
+}
+
+static WORKER *submit_target(void){
+	if(!started){
+		sched_init(0, 0);
+	}
+	if(self != NULL){
+		return self;
+	}
+	unsigned int i = __atomic_fetch_add(&next_victim, 1, __ATOMIC_RELAXED);
+	return &workers[i % num_workers];
+}
+
+/*
+ * Submit a task for execution.  If called from a worker, the task is
+ * pushed on the calling worker's own deque, otherwise it is placed on
+ * the deque of some worker chosen in round-robin order.
+ *
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was submitted, otherwise -1.
+ */
+int sched_submit(SCHED_TASK task, void *arg){
+	if(task == NULL){
+		return -1;
+	}
+	deque_push_bottom(submit_target(), task, arg);
+	return 0;
+}
+
+/*
+ * Submit a task that should run after the work that is already queued
+ * locally.  If called from a worker, the task is placed on the stealing
+ * end of the worker's own deque, so that it runs after the worker's
+ * other tasks unless some idle worker steals it first.  This is used to
+ * yield the worker to other work.
+ *
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was submitted, otherwise -1.
+ */
+int sched_defer(SCHED_TASK task, void *arg){
+	if(task == NULL){
+		return -1;
+	}
+	deque_push_top(submit_target(), task, arg);
+	return 0;
+}
+
+/*
+ * Get the number of worker threads.
+ *
+ * @return the number of workers.
+ */
+int sched_nworkers(void){
+	if(!started){
+		sched_init(0, 0);
+	}
+	return num_workers;
+}
+
+/*
+ * Get the index of the worker on which the caller is running.
+ *
+ * @return the index of the calling worker, or -1 if the caller is not
+ * a worker thread.
+ */
+int sched_current_worker(void){
+	return self != NULL ? self->index : -1;
+}
+
+/*
+ * Obtain a snapshot of the statistics of one worker.  The counters are
+ * updated without locking, so a snapshot taken while the scheduler is
+ * busy is only approximately consistent.
+ *
+ * @param worker  Index of the worker.
+ * @param stats  Storage into which the statistics are to be copied.
+ * @return 0 if successful, -1 if there is no such worker.
+ */
+int sched_get_stats(int worker, SCHED_STATS *stats){
+	if(!started || worker < 0 || worker >= num_workers || stats == NULL){
+		return -1;
+	}
+	*stats = workers[worker].stats;
+	return 0;
+}
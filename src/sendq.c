@@ -0,0 +1,887 @@
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "sendq.h"
+#include "protocol_ext.h"
+#include "uring.h"
+#include "coro.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * A queued packet.
+ */
+typedef struct sendq_item {
+	JEUX_PACKET_HEADER hdr;
+	JEUX_WIRE_HEADER wire;  // hdr as laid out for the connection
+	size_t wire_len;
+	SHARED_PAYLOAD *payload;
+} SENDQ_ITEM;
+
+typedef struct sendq {
+	int fd;
+	int refcnt;
+	int version;            // Version of the protocol used on the connection
+	int closed;
+	int scheduled;          // On the writer's ready list or being written by it
+	size_t sent;            // Bytes of the first queued packet already written
+	SENDQ_ITEM items[SENDQ_LEN];
+	int head;
+	int count;
+	sem_t lock;             // Held while writing to the connection
+	sem_t mutex;            // Protects the queue and the flags; never held
+	                        // while blocked on the connection
+	struct sendq *next;     // Link in the writer's lists
+} SENDQ;
+
+static SENDQ *ready = NULL;     // Queues with packets for the writer
+static sem_t ready_mutex;
+static int wake_pipe[2];        // Wakes the writer when a queue is made ready
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static __thread SENDQ_BATCH *current_batch = NULL;
+
+static void *sendq_writer(void *arg);
+
+static void writer_init(void){
+	Sem_init(&ready_mutex, 0, 1);
+	if(pipe(wake_pipe) < 0){
+		unix_error("pipe error");
+	}
+	fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+	pthread_t tid;
+	Pthread_create(&tid, NULL, sendq_writer, NULL);
+}
+
+static void wake_writer(void){
+	char c = 0;
+	if(write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN){
+		debug("Cannot wake send queue writer");
+	}
+}
+
+/*
+ * Hand a queue to the writer.  Must be called with the mutex of the queue
+ * held, and only if the queue is not already scheduled.
+ */
+static void schedule(SENDQ *q){
+	q->scheduled = 1;
+	sendq_ref(q);
+	P(&ready_mutex);
+	q->next = ready;
+	ready = q;
+	V(&ready_mutex);
+	wake_writer();
+}
+
+/*
+ * Remove the first queued packet.  Must be called with the mutex held.
+ */
+static void pop(SENDQ *q){
+	SENDQ_ITEM *item = &q->items[q->head];
+	if(item->payload != NULL){
+		payload_unref(item->payload);
+	}
+	q->head = (q->head + 1) % SENDQ_LEN;
+	q->count--;
+	q->sent = 0;
+}
+
+static void drop_all(SENDQ *q){
+	while(q->count > 0){
+		pop(q);
+	}
+}
+
+/*
+ * Write the rest of a queued packet.  Must be called with the lock held.
+ * With MSG_DONTWAIT in flags, stops when the connection cannot take more.
+ * Returns 1 if the packet has been completely written, 0 if writing would
+ * block, and -1 on an error.
+ */
+static int write_item(SENDQ *q, SENDQ_ITEM *item, int flags){
+	size_t hdr_size = item->wire_len;
+	size_t total = hdr_size + (item->payload != NULL ? item->payload->size : 0);
+	while(q->sent < total){
+		struct iovec iov[2];
+		int n = 0;
+		if(q->sent < hdr_size){
+			iov[n].iov_base = (char *) &item->wire + q->sent;
+			iov[n++].iov_len = hdr_size - q->sent;
+		}
+		if(item->payload != NULL){
+			size_t off = q->sent > hdr_size ? q->sent - hdr_size : 0;
+			iov[n].iov_base = item->payload->data + off;
+			iov[n++].iov_len = item->payload->size - off;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		ssize_t w = sendmsg(q->fd, &msg, flags | MSG_NOSIGNAL);
+		if(w < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				return 0;
+			}
+			return -1;
+		}
+		q->sent += w;
+	}
+	q->sent = 0;
+	if(item->wire_len != 0){
+		proto_packet_sent(q->fd, &item->hdr, item->payload != NULL ? item->payload->data : NULL);
+	}
+	return 1;
+}
+
+/*
+ * Write as many queued packets as the connection will take without
+ * blocking.  Returns 1 if packets remain and the writer should wait until
+ * the connection is writable, otherwise 0, in which case the queue is no
+ * longer scheduled.
+ */
+static int flush(SENDQ *q){
+	P(&q->mutex);
+	if(sem_trywait(&q->lock) != 0){
+		// a blocking send is in progress, and will reschedule the queue
+		q->scheduled = 0;
+		V(&q->mutex);
+		return 0;
+	}
+	while(!q->closed && q->count > 0){
+		SENDQ_ITEM *item = &q->items[q->head];
+		V(&q->mutex);
+		int r = write_item(q, item, MSG_DONTWAIT);
+		P(&q->mutex);
+		if(r == 0){
+			V(&q->lock);
+			V(&q->mutex);
+			return 1;
+		}
+		if(r == -1){
+			debug("Error writing to connection %d, queued packets dropped", q->fd);
+			drop_all(q);
+			break;
+		}
+		pop(q);
+	}
+	q->scheduled = 0;
+	V(&q->lock);
+	V(&q->mutex);
+	return 0;
+}
+
+/*
+ * Thread that writes queued packets.  Queues handed to it are written
+ * until they are empty or their connection cannot take more; the latter
+ * are kept, and polled until their connection becomes writable.
+ */
+static void *sendq_writer(void *arg){
+	Pthread_detach(pthread_self());
+	SENDQ **blocked = NULL;
+	struct pollfd *fds = NULL;
+	int nblocked = 0, size = 0;
+	while(1){
+		if(nblocked + 1 > size){
+			size = 2 * (nblocked + 1);
+			blocked = (SENDQ **) Realloc(blocked, size * sizeof(SENDQ *));
+			fds = (struct pollfd *) Realloc(fds, size * sizeof(struct pollfd));
+		}
+		fds[0].fd = wake_pipe[0];
+		fds[0].events = POLLIN;
+		for(int i = 0; i < nblocked; i++){
+			fds[i + 1].fd = blocked[i]->fd;
+			fds[i + 1].events = POLLOUT;
+			fds[i + 1].revents = 0;
+		}
+		if(poll(fds, nblocked + 1, -1) < 0 && errno != EINTR){
+			debug("poll error in send queue writer");
+		}
+		if(fds[0].revents & POLLIN){
+			char buf[64];
+			while(read(wake_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		}
+
+		// collect the queues that can make progress
+		SENDQ *work = NULL;
+		int k = 0;
+		for(int i = 0; i < nblocked; i++){
+			SENDQ *q = blocked[i];
+			if(fds[i + 1].revents != 0 || __atomic_load_n(&q->closed, __ATOMIC_RELAXED)){
+				q->next = work;
+				work = q;
+			} else {
+				blocked[k++] = q;
+			}
+		}
+		nblocked = k;
+		P(&ready_mutex);
+		SENDQ *r = ready;
+		ready = NULL;
+		V(&ready_mutex);
+		while(r != NULL){
+			SENDQ *q = r;
+			r = q->next;
+			q->next = work;
+			work = q;
+		}
+
+		while(work != NULL){
+			SENDQ *q = work;
+			work = q->next;
+			if(flush(q)){
+				if(nblocked + 1 >= size){
+					size = 2 * (nblocked + 1);
+					blocked = (SENDQ **) Realloc(blocked, size * sizeof(SENDQ *));
+					fds = (struct pollfd *) Realloc(fds, size * sizeof(struct pollfd));
+				}
+				blocked[nblocked++] = q;
+			} else {
+				sendq_unref(q);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Create a SHARED_PAYLOAD holding a copy of the specified data.  The
+ * returned payload has a reference count of one.
+ *
+ * @param data  The data.
+ * @param size  The number of bytes of data.
+ * @return the newly created SHARED_PAYLOAD.
+ */
+SHARED_PAYLOAD *payload_create(void *data, size_t size){
+	SHARED_PAYLOAD *payload = (SHARED_PAYLOAD *) Malloc(sizeof(SHARED_PAYLOAD) + size);
+	payload->refcnt = 1;
+	payload->size = size;
+	memcpy(payload->data, data, size);
+	return payload;
+}
+
+/*
+ * Increase the reference count on a SHARED_PAYLOAD by one.
+ *
+ * @param payload  The SHARED_PAYLOAD.
+ * @return  The same SHARED_PAYLOAD that was passed as a parameter.
+ */
+SHARED_PAYLOAD *payload_ref(SHARED_PAYLOAD *payload){
+	__atomic_add_fetch(&payload->refcnt, 1, __ATOMIC_RELAXED);
+	return payload;
+}
+
+/*
+ * Decrease the reference count on a SHARED_PAYLOAD by one, freeing it
+ * when the count reaches zero.
+ *
+ * @param payload  The SHARED_PAYLOAD.
+ */
+void payload_unref(SHARED_PAYLOAD *payload){
+	if(__atomic_sub_fetch(&payload->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		Free(payload);
+	}
+}
+
+/*
+ * Create a SENDQ for a connection.  The returned SENDQ has a reference
+ * count of one.
+ *
+ * @param fd  File descriptor of the connection.
+ * @return the newly created SENDQ.
+ */
+SENDQ *sendq_create(int fd){
+	pthread_once(&writer_once, writer_init);
+	SENDQ *q = (SENDQ *) Calloc(1, sizeof(SENDQ));
+	q->fd = fd;
+	q->refcnt = 1;
+	q->version = 1;
+	Sem_init(&q->lock, 0, 1);
+	Sem_init(&q->mutex, 0, 1);
+	return q;
+}
+
+/*
+ * Increase the reference count on a SENDQ by one.
+ *
+ * @param q  The SENDQ.
+ * @return  The same SENDQ that was passed as a parameter.
+ */
+SENDQ *sendq_ref(SENDQ *q){
+	__atomic_add_fetch(&q->refcnt, 1, __ATOMIC_RELAXED);
+	return q;
+}
+
+/*
+ * Decrease the reference count on a SENDQ by one, freeing it when the
+ * count reaches zero.
+ *
+ * @param q  The SENDQ.
+ */
+void sendq_unref(SENDQ *q){
+	if(__atomic_sub_fetch(&q->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		drop_all(q);
+		Free(q);
+	}
+}
+
+/*
+ * Close a SENDQ, discarding any queued packets.  Once this function has
+ * returned, nothing more is written to the connection, and its file
+ * descriptor may be closed.
+ *
+ * @param q  The SENDQ to be closed.
+ */
+void sendq_close(SENDQ *q){
+	P(&q->lock);
+	P(&q->mutex);
+	__atomic_store_n(&q->closed, 1, __ATOMIC_RELAXED);
+	drop_all(q);
+	int scheduled = q->scheduled;
+	V(&q->mutex);
+	V(&q->lock);
+	if(scheduled){
+		// let the writer drop the queue, if it is waiting for the connection
+		wake_writer();
+	}
+}
+
+/*
+ * Finish writing the packets queued on a connection, and any bytes handed
+ * over by another process, so that a packet written directly neither
+ * splits one of them nor overtakes it.  Must be called with the lock held.
+ */
+static void finish_queued(SENDQ *q){
+	P(&q->mutex);
+	while(!q->closed && q->count > 0){
+		SENDQ_ITEM *item = &q->items[q->head];
+		V(&q->mutex);
+		int r = write_item(q, item, 0);
+		P(&q->mutex);
+		if(r != 1){
+			drop_all(q);
+			break;
+		}
+		pop(q);
+	}
+	V(&q->mutex);
+}
+
+/*
+ * Account for the result of writing a packet directly, and release the
+ * lock.  A peer that has gone away closes the SENDQ.
+ */
+static int finish_send(SENDQ *q, int ret){
+	P(&q->mutex);
+	if(ret == -1 && (errno == EPIPE || errno == ECONNRESET)){
+		debug("Peer of connection %d has gone away, output closed", q->fd);
+		__atomic_store_n(&q->closed, 1, __ATOMIC_RELAXED);
+		drop_all(q);
+		ret = 0;
+	}
+	V(&q->lock);
+	// the writer skips the queue while the lock is held, so resume it
+	if(q->count > 0 && !q->scheduled && !q->closed){
+		schedule(q);
+	}
+	V(&q->mutex);
+	return ret;
+}
+
+/*
+ * Write the packets collected in a batch as a chain of linked sends.
+ * The locks of all the queues involved are taken, in order of address,
+ * so that batches written at the same time cannot deadlock.  A send of
+ * the chain that is short, or is cancelled because an earlier one was,
+ * is finished with ordinary writes, in order.
+ */
+static void flush_batch(SENDQ_BATCH *batch){
+	SENDQ *queues[SENDQ_BATCH_LEN];
+	int nqueues = 0;
+	for(int i = 0; i < batch->count; i++){
+		SENDQ *q = batch->items[i].q;
+		int j = 0;
+		while(j < nqueues && queues[j] < q){
+			j++;
+		}
+		if(j < nqueues && queues[j] == q){
+			continue;
+		}
+		memmove(&queues[j + 1], &queues[j], (nqueues - j) * sizeof(SENDQ *));
+		queues[j] = q;
+		nqueues++;
+	}
+	for(int j = 0; j < nqueues; j++){
+		P(&queues[j]->lock);
+		finish_queued(queues[j]);
+	}
+
+	URING_SEND sends[SENDQ_BATCH_LEN];
+	struct iovec iov[SENDQ_BATCH_LEN][2];
+	int chain_index[SENDQ_BATCH_LEN];
+	int n = 0;
+	for(int i = 0; i < batch->count; i++){
+		SHARED_PAYLOAD *payload = batch->items[i].payload;
+		iov[i][0].iov_base = &batch->items[i].wire;
+		iov[i][0].iov_len = batch->items[i].wire_len;
+		iov[i][1].iov_base = payload != NULL ? payload->data : NULL;
+		iov[i][1].iov_len = payload != NULL ? payload->size : 0;
+		chain_index[i] = -1;
+		if(batch->items[i].q->closed){
+			continue;
+		}
+		chain_index[i] = n;
+		memset(&sends[n], 0, sizeof(URING_SEND));
+		sends[n].fd = batch->items[i].q->fd;
+		sends[n].msg.msg_iov = iov[i];
+		sends[n].msg.msg_iovlen = payload != NULL ? 2 : 1;
+		n++;
+	}
+	int chained = n > 0 && uring_send_chain(sends, n) == 0;
+
+	for(int i = 0; i < batch->count; i++){
+		SENDQ *q = batch->items[i].q;
+		if(q->closed){
+			continue;
+		}
+		int res = chained ? sends[chain_index[i]].res : 0;
+		int ret = 0;
+		if(res < 0 && res != -ECANCELED){
+			errno = -res;
+			ret = -1;
+		} else {
+			// skip what the chain has written, and write the rest
+			size_t done = res > 0 ? res : 0;
+			int iovcnt = iov[i][1].iov_len > 0 ? 2 : 1;
+			struct iovec *v = iov[i];
+			while(iovcnt > 0 && done >= v->iov_len){
+				done -= v->iov_len;
+				v++;
+				iovcnt--;
+			}
+			if(iovcnt > 0){
+				v->iov_base = (char *) v->iov_base + done;
+				v->iov_len -= done;
+				ret = proto_writev(q->fd, v, iovcnt);
+			}
+		}
+		if(ret == 0){
+			SHARED_PAYLOAD *payload = batch->items[i].payload;
+			proto_packet_sent(q->fd, &batch->items[i].hdr, payload != NULL ? payload->data : NULL);
+		} else if(errno == EPIPE || errno == ECONNRESET){
+			debug("Peer of connection %d has gone away, output closed", q->fd);
+			P(&q->mutex);
+			__atomic_store_n(&q->closed, 1, __ATOMIC_RELAXED);
+			drop_all(q);
+			V(&q->mutex);
+		} else {
+			debug("Error writing batched packet to connection %d", q->fd);
+		}
+	}
+
+	for(int j = 0; j < nqueues; j++){
+		finish_send(queues[j], 0);
+	}
+	for(int i = 0; i < batch->count; i++){
+		if(batch->items[i].payload != NULL){
+			payload_unref(batch->items[i].payload);
+		}
+		sendq_unref(batch->items[i].q);
+	}
+	batch->count = 0;
+}
+
+/*
+ * Write as many queued packets as the connection will take without
+ * blocking, to make room in a full queue.  The lock is only ever held
+ * briefly while coroutines are in use, as nothing then blocks on the
+ * connection with it held; otherwise, unless wait is set, nothing is
+ * written if another thread holds the lock.
+ */
+static void make_room(SENDQ *q, int wait){
+	int ret = 0;
+	if(wait){
+		P(&q->lock);
+	} else if(sem_trywait(&q->lock) != 0){
+		return;
+	}
+	P(&q->mutex);
+	while(!q->closed && q->count > 0){
+		SENDQ_ITEM *item = &q->items[q->head];
+		V(&q->mutex);
+		int r = write_item(q, item, MSG_DONTWAIT);
+		P(&q->mutex);
+		if(r == 0){
+			break;
+		}
+		if(r == -1){
+			// a peer that has gone away closes the SENDQ
+			ret = -1;
+			drop_all(q);
+			break;
+		}
+		pop(q);
+	}
+	V(&q->mutex);
+	finish_send(q, ret);
+}
+
+/*
+ * Queue a packet to be sent on a connection.  The sender does not wait
+ * for room in the queue, as it may hold locks that the other coroutines
+ * of its thread need: a full queue is written out for as long as the
+ * connection takes it, and a peer that has fallen SENDQ_LEN packets
+ * behind even so is taken to have stopped reading, and its connection
+ * is shut down.
+ */
+static void queue_send(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, void *data){
+	uint16_t size = ntohs(hdr->size);
+	SHARED_PAYLOAD *payload = size > 0 && data != NULL ? payload_create(data, size) : NULL;
+	if(sendq_push(q, hdr, ext, payload) == -1 && !__atomic_load_n(&q->closed, __ATOMIC_RELAXED)){
+		make_room(q, 1);
+		if(sendq_push(q, hdr, ext, payload) == -1 && !__atomic_load_n(&q->closed, __ATOMIC_RELAXED)){
+			debug("Connection %d is %d packets behind, shut down", q->fd, SENDQ_LEN);
+			shutdown(q->fd, SHUT_RDWR);
+		}
+	}
+	if(payload != NULL){
+		payload_unref(payload);
+	}
+}
+
+/*
+ * Send a packet on a connection, blocking until it has been written.
+ * The packets queued before it are written first.  If the
+ * SENDQ has been closed, or the peer is found to have gone away, the SENDQ
+ * is closed and the packet silently discarded, just as it would have been
+ * had the peer gone away after the packet was written.  If a batch is
+ * current on the calling thread, the packet is added to it instead.
+ * When coroutines are in use, the packet is queued instead, to be written
+ * by the writer thread after the packets queued before it, so that no
+ * coroutine thread blocks on a connection; a peer that has fallen
+ * SENDQ_LEN packets behind has its connection shut down.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte order.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param data  The payload, or NULL if there is none.
+ * @return 0 if the packet was sent, discarded, batched or queued, -1 if
+ * writing failed.
+ */
+int sendq_send(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, void *data){
+	SENDQ_BATCH *batch = current_batch;
+	if(batch != NULL){
+		if(batch->count == SENDQ_BATCH_LEN){
+			flush_batch(batch);
+		}
+		uint16_t size = ntohs(hdr->size);
+		batch->items[batch->count].q = sendq_ref(q);
+		batch->items[batch->count].hdr = *hdr;
+		batch->items[batch->count].wire_len = proto_frame_header(sendq_get_version(q), hdr, ext,
+									 &batch->items[batch->count].wire);
+		batch->items[batch->count].payload = size > 0 && data != NULL ? payload_create(data, size) : NULL;
+		batch->count++;
+		return 0;
+	}
+	if(coro_enabled()){
+		queue_send(q, hdr, ext, data);
+		return 0;
+	}
+	int ret = 0;
+	P(&q->lock);
+	finish_queued(q);
+	if(!q->closed){
+		ret = proto_send_packet_ext(q->fd, q->version, hdr, ext, data);
+	}
+	return finish_send(q, ret);
+}
+
+/*
+ * Wait until the packets queued on a connection have been written, or
+ * dropped because writing failed.  A coroutine lets the others of its
+ * thread run while it waits.
+ *
+ * @param q  The SENDQ of the connection.
+ */
+void sendq_drain(SENDQ *q){
+	P(&q->mutex);
+	while(!q->closed && q->count > 0){
+		V(&q->mutex);
+		if(coro_active()){
+			coro_wait_writable(q->fd);
+		} else {
+			struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+			poll(&pfd, 1, -1);
+		}
+		P(&q->mutex);
+	}
+	V(&q->mutex);
+}
+
+/*
+ * Queue a packet to be sent on a connection by the writer thread.  This
+ * function never blocks on the connection.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte
+ * order.  The size field is taken from the payload.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param payload  The payload, or NULL if there is none.  A reference is
+ * taken on the payload if the packet is queued.
+ * @return 0 if the packet was queued, -1 if the queue is full or closed.
+ */
+int sendq_push(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, SHARED_PAYLOAD *payload){
+	P(&q->mutex);
+	if(q->closed || q->count == SENDQ_LEN){
+		V(&q->mutex);
+		return -1;
+	}
+	SENDQ_ITEM *item = &q->items[(q->head + q->count) % SENDQ_LEN];
+	item->hdr = *hdr;
+	item->hdr.size = htons(payload != NULL ? payload->size : 0);
+	item->wire_len = proto_frame_header(q->version, &item->hdr, ext, &item->wire);
+	item->payload = payload != NULL ? payload_ref(payload) : NULL;
+	q->count++;
+	if(!q->scheduled){
+		schedule(q);
+	}
+	V(&q->mutex);
+	return 0;
+}
+
+/*
+ * Queue a packet to be sent on a connection, as sendq_push() does, for a
+ * sender that must not wait for the connection.  If the queue is full, as
+ * many queued packets as the connection will take are written without
+ * blocking, unless another thread is writing to it.  A peer that has
+ * fallen SENDQ_LEN packets behind even so is taken to have stopped
+ * reading, and its connection is shut down.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param hdr  The packet header, with multi-byte fields in network byte
+ * order.  The size field is taken from the payload.
+ * @param ext  The fields of the header that version 1 of the protocol has
+ * no room for, or NULL.
+ * @param payload  The payload, or NULL if there is none.  A reference is
+ * taken on the payload if the packet is queued.
+ * @return 0 if the packet was queued, -1 if it was discarded.
+ */
+int sendq_post(SENDQ *q, JEUX_PACKET_HEADER *hdr, JEUX_PACKET_EXT *ext, SHARED_PAYLOAD *payload){
+	if(sendq_push(q, hdr, ext, payload) == 0){
+		return 0;
+	}
+	make_room(q, 0);
+	if(sendq_push(q, hdr, ext, payload) == 0){
+		return 0;
+	}
+	P(&q->mutex);
+	// the file descriptor of a closed SENDQ may have been closed and reused
+	if(!q->closed){
+		debug("Connection %d is %d packets behind, shut down", q->fd, SENDQ_LEN);
+		shutdown(q->fd, SHUT_RDWR);
+	}
+	V(&q->mutex);
+	return -1;
+}
+
+/*
+ * Queue bytes to be written on a connection ahead of the packets sent or
+ * queued after them.  The bytes are those returned by sendq_hold() in
+ * another process, and may begin in the middle of a packet: they are
+ * written in full before any packet sent with sendq_send().
+ *
+ * @param q  The SENDQ of the connection.
+ * @param data  The bytes.
+ * @param size  The number of bytes.
+ * @return 0 if the bytes were queued, -1 if the queue is full or closed.
+ */
+int sendq_push_bytes(SENDQ *q, void *data, size_t size){
+	P(&q->mutex);
+	if(q->closed || q->count == SENDQ_LEN){
+		V(&q->mutex);
+		return -1;
+	}
+	SENDQ_ITEM *item = &q->items[(q->head + q->count) % SENDQ_LEN];
+	memset(&item->hdr, 0, sizeof(item->hdr));
+	item->wire_len = 0;
+	item->payload = payload_create(data, size);
+	q->count++;
+	if(!q->scheduled){
+		schedule(q);
+	}
+	V(&q->mutex);
+	return 0;
+}
+
+static size_t item_size(SENDQ_ITEM *item){
+	return item->wire_len + (item->payload != NULL ? item->payload->size : 0);
+}
+
+/*
+ * Stop all writing to a connection, so that it can be handed over to
+ * another process.  The queued packets are written first, for as long as
+ * the connection takes them within the time allowed, and the bytes of
+ * those that remain are returned, for the other process to write ahead of
+ * its own packets.  Nothing more is written to the connection until
+ * sendq_release() is called.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param timeout_ms  The time allowed for writing queued packets, in ms.
+ * @param sizep  Variable into which to store the number of bytes returned.
+ * @return the bytes not written, in malloc'ed storage, or NULL if there
+ * are none.
+ */
+char *sendq_hold(SENDQ *q, int timeout_ms, size_t *sizep){
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	P(&q->lock);
+	P(&q->mutex);
+	while(!q->closed && q->count > 0){
+		SENDQ_ITEM *item = &q->items[q->head];
+		V(&q->mutex);
+		int r = write_item(q, item, MSG_DONTWAIT);
+		P(&q->mutex);
+		if(r == 1){
+			pop(q);
+			continue;
+		}
+		if(r == -1){
+			debug("Error writing to connection %d, queued packets dropped", q->fd);
+			drop_all(q);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000
+					  + (now.tv_nsec - start.tv_nsec) / 1000000);
+		if(left <= 0){
+			break;
+		}
+		V(&q->mutex);
+		struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+		poll(&pfd, 1, left);
+		P(&q->mutex);
+	}
+	size_t size = 0;
+	for(int i = 0; i < q->count; i++){
+		size += item_size(&q->items[(q->head + i) % SENDQ_LEN]);
+	}
+	char *data = NULL;
+	if(size > 0){
+		size -= q->sent;
+		data = (char *) Malloc(size);
+		size_t skip = q->sent, off = 0;
+		for(int i = 0; i < q->count; i++){
+			SENDQ_ITEM *item = &q->items[(q->head + i) % SENDQ_LEN];
+			char *parts[2] = { (char *) &item->wire, item->payload != NULL ? item->payload->data : NULL };
+			size_t lens[2] = { item->wire_len, item->payload != NULL ? item->payload->size : 0 };
+			for(int j = 0; j < 2; j++){
+				size_t n = skip < lens[j] ? lens[j] - skip : 0;
+				memcpy(data + off, parts[j] + lens[j] - n, n);
+				off += n;
+				skip -= lens[j] - n;
+			}
+		}
+	}
+	V(&q->mutex);
+	*sizep = size;
+	return data;
+}
+
+/*
+ * Let writing to a connection resume after sendq_hold(), as when the
+ * connection has not been handed over after all.  The packets it left
+ * queued are written as usual.
+ *
+ * @param q  The SENDQ of the connection.
+ */
+void sendq_release(SENDQ *q){
+	P(&q->mutex);
+	V(&q->lock);
+	if(q->count > 0 && !q->scheduled && !q->closed){
+		schedule(q);
+	}
+	V(&q->mutex);
+}
+
+/*
+ * Set the version of the protocol used on a connection, for the packets
+ * sent or queued from now on.
+ *
+ * @param q  The SENDQ of the connection.
+ * @param version  The version.
+ */
+void sendq_set_version(SENDQ *q, int version){
+	P(&q->lock);
+	P(&q->mutex);
+	__atomic_store_n(&q->version, version, __ATOMIC_RELAXED);
+	V(&q->mutex);
+	V(&q->lock);
+}
+
+/*
+ * Get the version of the protocol used on a connection.
+ *
+ * @param q  The SENDQ of the connection.
+ * @return the version, 1 unless set with sendq_set_version().
+ */
+int sendq_get_version(SENDQ *q){
+	return __atomic_load_n(&q->version, __ATOMIC_RELAXED);
+}
+
+/*
+ * Make a batch current on the calling thread, so that the packets it
+ * sends are collected in it, if the io_uring backend is in use.
+ * Otherwise, packets are written as usual.
+ *
+ * @param batch  The batch, which need not be initialized.
+ */
+void sendq_batch_begin(SENDQ_BATCH *batch){
+	batch->count = 0;
+	if(uring_enabled()){
+		current_batch = batch;
+	}
+}
+
+/*
+ * Get the batch current on the calling thread.
+ *
+ * @return the current batch, or NULL if there is none.
+ */
+SENDQ_BATCH *sendq_batch_current(void){
+	return current_batch;
+}
+
+/*
+ * Make a batch begun by another thread current on the calling thread,
+ * or make no batch current.
+ *
+ * @param batch  The batch, or NULL.
+ * @return the batch that was current on the calling thread, or NULL.
+ */
+SENDQ_BATCH *sendq_batch_join(SENDQ_BATCH *batch){
+	SENDQ_BATCH *previous = current_batch;
+	current_batch = batch;
+	return previous;
+}
+
+/*
+ * Make no batch current on the calling thread, and write the packets
+ * collected in a batch, in the order in which they were sent.
+ *
+ * @param batch  The batch, which must have been begun with
+ * sendq_batch_begin().
+ */
+void sendq_batch_end(SENDQ_BATCH *batch){
+	if(current_batch == batch){
+		current_batch = NULL;
+	}
+	if(batch->count > 0){
+		flush_batch(batch);
+	}
+}
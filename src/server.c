@@ -1,5 +1,25 @@
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <stdarg.h>
+
 #include "jeux_globals.h"
 #include "server.h"
+#include "server_ext.h"
+#include "client_ext.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "game_ext.h"
+#include "federation.h"
+#include "bot.h"
+#include "protocol_ext.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "timeout.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "coro.h"
+#include "sendq.h"
 #include "csapp.h"
 #include "debug.h"
 
@@ -7,15 +27,95 @@
 
 // static sem_t logout_in_progress;
 
+/*
+ * A service waiting for the logouts in progress to finish before it
+ * unregisters its client.
+ */
+typedef struct logout_wait {
+	CORO_EVENT done;
+	struct logout_wait *next;
+} LOGOUT_WAIT;
+
 static int logout_in_progress = 0;
+static LOGOUT_WAIT *logout_waiters; // signalled when no logout is in progress
 static sem_t mutex1;
 // static int unregister_in_progress = 0;
 // static sem_t mutex2;
 
+static void *start_service(void *arg);
+static void *serve(CLIENT *client, PLAYER *player);
+static int invite(CLIENT *client, char *p, int role);
+static void serve_batch(CLIENT *client, char *payload, size_t size);
+static char *record_report(PLAYER *player);
+static char *history_report(PLAYER *player, char *fields);
+
 static void mutex_init(void){
 	Sem_init(&mutex1, 0, 1);
 	// Sem_init(&mutex2, 0, 1);
 }
+
+/*
+ * Note the end of a logout, and wake the services waiting for the
+ * logouts in progress if it was the last.
+ */
+static void end_logout(void){
+	P(&mutex1);
+	LOGOUT_WAIT *w = --logout_in_progress == 0 ? logout_waiters : NULL;
+	if(w != NULL){
+		logout_waiters = NULL;
+	}
+	V(&mutex1);
+	while(w != NULL){
+		LOGOUT_WAIT *next = w->next;
+		coro_event_signal(&w->done);
+		w = next;
+	}
+}
+
+/*
+ * Wait until no logout is in progress.  A coroutine lets the others of
+ * its thread run meanwhile, as the logout may be that of one of them.
+ */
+static void wait_for_logouts(void){
+	LOGOUT_WAIT w;
+	P(&mutex1);
+	if(logout_in_progress == 0){
+		V(&mutex1);
+		return;
+	}
+	coro_event_init(&w.done);
+	w.next = logout_waiters;
+	logout_waiters = &w;
+	V(&mutex1);
+	coro_event_wait(&w.done);
+}
+
+/*
+ * Idle time limit of a connection.  The service loop records when each
+ * packet is received, and the timeout checks this when it expires: it
+ * either shuts the connection down, which makes the service loop see EOF,
+ * or sets itself again for the rest of the limit.  This way no timeout
+ * needs to be set for each packet.
+ */
+typedef struct idle_limit {
+	int fd;
+	uint64_t last; // timeout_now() when the last packet was received
+	TIMEOUT *timeout;
+} IDLE_LIMIT;
+
+static void idle_expired(void *arg){
+	IDLE_LIMIT *idle = (IDLE_LIMIT *) arg;
+	uint64_t idle_ms = timeout_now() - __atomic_load_n(&idle->last, __ATOMIC_RELAXED);
+	if(upgrade_in_progress()){
+		// the connection may be about to be handed over: check again later
+		timeout_set(idle->timeout, client_idle_timeout);
+	} else if(idle_ms >= client_idle_timeout){
+		debug("[%d] Idle for %lu ms, shutting down connection", idle->fd, (unsigned long) idle_ms);
+		shutdown(idle->fd, SHUT_RDWR);
+	} else {
+		timeout_set(idle->timeout, client_idle_timeout - idle_ms);
+	}
+}
 /*
  * Thread function for the thread that handles a particular client.
  *
@@ -37,50 +137,119 @@ static void mutex_init(void){
  * down the connection as part of graceful termination.
  */
 void *jeux_client_service(void *arg){
-	int connfd, n, login=0;
+	// detach for automatic reaping
+	Pthread_detach(pthread_self());
+	return start_service(arg);
+}
+
+/*
+ * Coroutine function for the coroutine that handles a particular client,
+ * as jeux_client_service() does for a thread.
+ *
+ * @param  Pointer to a variable that holds the file descriptor for
+ * the client connection, which is freed.
+ */
+void jeux_client_coroutine(void *arg){
+	start_service(arg);
+}
+
+/*
+ * Register the client of a new connection and run its service loop.
+ */
+static void *start_service(void *arg){
+	int connfd;
 	// retrieve connfd, free arg
 	connfd = *((int *) arg);
 	Free(arg);
 
-	// detach for automatic reaping
+	debug("[%d] Starting client service", connfd);
+	TRACE(TRACE_SERVICE_START, connfd, 0, 0);
+	capture_open(connfd);
+
+	// register with client registry
+	CLIENT *client = creg_register(client_registry, connfd);
+
+	// failed to register client (client_registry is full)
+	if(client == NULL){
+		debug("client registry full.");
+		Close(connfd);
+		upgrade_leave();
+		return 0;
+	}
+
+	// replies are small and must not wait for the acknowledgement of the
+	// previous segment
+	int one = 1;
+	setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return serve(client, NULL);
+}
+
+/*
+ * Thread function for the thread that handles a client whose connection
+ * has been handed over by another server process, and which has already
+ * been registered, and logged in if it was logged in before.
+ *
+ * @param  The CLIENT, whose registration is taken over by the thread.
+ * @return  NULL
+ */
+void *jeux_adopted_client_service(void *arg){
+	CLIENT *client = (CLIENT *) arg;
 	Pthread_detach(pthread_self());
+	int connfd = client_get_fd(client);
+	debug("[%d] Resuming client service after handoff", connfd);
+	TRACE(TRACE_SERVICE_START, connfd, 0, 0);
+	capture_open(connfd);
+	PLAYER *player = client_get_player(client);
+	if(player != NULL){
+		player_ref(player, "for reference held by server thread");
+	}
+	return serve(client, player);
+}
 
-	CLIENT *client = NULL;
-	PLAYER *player = NULL;
+/*
+ * The service loop of a registered client, which is logged in if a
+ * PLAYER is given.  The reference to the PLAYER is taken over.
+ */
+static void *serve(CLIENT *client, PLAYER *player){
+	int connfd = client_get_fd(client), n, login = player != NULL;
 	JEUX_PACKET_HEADER header;
+	JEUX_PACKET_EXT ext;
 	pthread_once_t once = PTHREAD_ONCE_INIT;
 	pthread_once(&once, mutex_init);
 
-
 	char *payload;
 	char *result = Malloc(sizeof(char));
 	*result = '\0';
 	char *board = Malloc(sizeof(char));
 	*board = '\0';
+	// a payload with a null terminator added, kept off the stack of a coroutine
+	char *text = Malloc(UINT16_MAX + 1);
 	clockid_t clock_id = CLOCK_MONOTONIC;
 	struct timespec tp;
 
-	debug("[%d] Starting client service", connfd);
-
-	// register with client registry
-	client = creg_register(client_registry, connfd);
-
-	// failed to register client (client_registry is full)
-	if(client == NULL){
-		debug("client registry full.");
-		if(result != NULL){
-			Free(result);
-		}
-		Close(connfd);
-		return 0;
+	IDLE_LIMIT idle = { connfd, timeout_now(), NULL };
+	if(client_idle_timeout > 0){
+		idle.timeout = timeout_create(idle_expired, &idle);
+		timeout_set(idle.timeout, client_idle_timeout);
 	}
 
+	// with the io_uring backend, packets are received by its receiver thread
+	URING_CONN *uconn = uring_open(connfd);
+
 	// Service Loop
-	while(!(n = proto_recv_packet(connfd, &header, (void **) &payload))){
+	// a handoff to another server process can only happen between packets
+	while(upgrade_wait(connfd) == 0
+	      && !(n = uring_recv_packet(uconn, connfd, client_get_version(client), &header, &ext, (void **) &payload))){
 		uint8_t type = header.type;
-		uint8_t id = header.id;
+		int id = ext.id > INT_MAX ? -1 : (int) ext.id;
 		uint8_t role = header.role; // role of the target packet - invite
 		uint16_t size = ntohs(header.size);
+		uint64_t received = stats_now();
+		if(idle.timeout != NULL){
+			__atomic_store_n(&idle.last, timeout_now(), __ATOMIC_RELAXED);
+		}
+		client_set_request(client, ext.request);
+		TRACE(TRACE_REQUEST, connfd, type, ext.id);
 		// uint32_t timesec = ntohl(header.timestamp_sec);
 		// uint32_t timensec = ntohl(header.timestamp_nsec);
 
@@ -90,21 +259,40 @@ void *jeux_client_service(void *arg){
 		// clock_settime(clock_id, &tp);
 
 
-		if(type == JEUX_LOGIN_PKT){ // LOGIN ---------------------------------
-			debug("[%d] LOGIN packet received", connfd);
+		if(type == JEUX_HELLO_PKT){ // HELLO ---------------------------------
+			if(login || role < 1){
+				client_send_nack(client);
+			} else {
+				// the ACK is the last packet of the old version
+				int version = role < JEUX_VERSION_MAX ? role : JEUX_VERSION_MAX;
+				header.type = JEUX_ACK_PKT;
+				header.role = version;
+				header.size = 0;
+				clock_gettime(clock_id, &tp);
+				header.timestamp_sec = htonl(tp.tv_sec);
+				header.timestamp_nsec = htonl(tp.tv_nsec);
+				client_send_packet_id(client, &header, 0, NULL);
+				client_set_version(client, version);
+			}
+
+		} else if(type == JEUX_LOGIN_PKT){ // LOGIN ---------------------------------
 			if(login){
 				debug("[%d] Already logged in", connfd);
 				client_send_nack(client);
 			} else{
 				// move payload to my temporary storage (add a null terminator)
-				char p[size+1];
+				char *p = text;
 				for(int i = 0; i< size; i++){
 					p[i] = payload[i];
 				}
 				p[size] = '\0';
 				// Free(payload);
 
-				debug("Login '%s'", p);
+				// a resume token after the username resumes a parked session
+				char *token = NULL;
+				if(client_resume_grace > 0 && (token = strchr(p, ' ')) != NULL){
+					*token++ = '\0';
+				}
 
 				player = preg_register(player_registry, p);
 				// debug("player %p registered", player);
@@ -112,18 +300,33 @@ void *jeux_client_service(void *arg){
 				if(player == NULL){
 					debug("preg_register error while processing LOGIN packet");
 					client_send_nack(client);
+				} else if(token != NULL){
+					// the ACK is sent by client_resume()
+					CLIENT *resumed = client_resume(client, player, token);
+					if(resumed == NULL){
+						client_send_nack(client);
+					} else {
+						client = resumed;
+						login = 1;
+					}
 				} else {
 					// create player (logged in client)
 					int i = client_login(client, player);
 					if(i == 0){
 						// client login successful
-						client_send_ack(client, NULL, 0);
+						token = client_get_resume_token(client);
+						client_send_ack(client, token, token != NULL ? strlen(token) : 0);
 						login = 1;
 					} else {
 						// client login unsuccessful
 						client_send_nack(client);
 					}
 				}
+				// the connection may try to log in again
+				if(!login && player != NULL){
+					player_unref(player, "because login has failed");
+					player = NULL;
+				}
 			}
 		} else if(!login){  // HAVEN'T LOGGEDIN ---------------------------------
 			debug("[%d] Please log in first then you can do that", connfd);
@@ -131,7 +334,6 @@ void *jeux_client_service(void *arg){
 							// LOGGEDIN -----------------------------------------
 
 		} else if(type == JEUX_USERS_PKT){ // USERS -----------------------------
-			debug("[%d] USERS packet received", connfd);
 
 			// get all the logged in players (NULL terminated)
 			PLAYER **players = creg_all_players(client_registry);
@@ -182,59 +384,135 @@ void *jeux_client_service(void *arg){
 			Free(players);
 			client_send_ack(client, result, strlen(result));
 
-		} else if(type == JEUX_INVITE_PKT){ // INVITE -----------------------------
-			debug("[%d] INVITE packet received", connfd);
+		} else if(type == JEUX_BATCH_PKT){ // BATCH -----------------------------
+			serve_batch(client, payload, size);
+
+		} else if(type == JEUX_STATS_PKT){ // STATS -----------------------------
+			char *report = stats_report();
+			if(report == NULL){
+				client_send_nack(client);
+			} else {
+				// the report is truncated if it does not fit in one packet
+				size_t len = strlen(report);
+				client_send_ack(client, report, len > UINT16_MAX ? UINT16_MAX : len);
+				free(report);
+			}
+
+		} else if(type == JEUX_RECORD_PKT){ // RECORD -----------------------------
+			// move payload to my temporary storage (add a null terminator)
+			char *p = text;
+			memcpy(p, payload, size);
+			p[size] = '\0';
+			// with no username, the record is the client's own
+			PLAYER *subject = size == 0 ? player_ref(player, "for record being reported")
+				: preg_lookup(player_registry, p);
+			char *report = subject != NULL ? record_report(subject) : NULL;
+			if(report == NULL){
+				client_send_nack(client);
+			} else {
+				// the report is truncated if it does not fit in one packet
+				size_t len = strlen(report);
+				client_send_ack(client, report, len > UINT16_MAX ? UINT16_MAX : len);
+				free(report);
+			}
+			if(subject != NULL){
+				player_unref(subject, "because record has been reported");
+			}
+
+		} else if(type == JEUX_HISTORY_PKT){ // HISTORY -----------------------------
+			// move payload to my temporary storage (add a null terminator)
+			char *p = text;
+			memcpy(p, payload, size);
+			p[size] = '\0';
+			// the username ends at the first tab, if there are other fields
+			char *fields = strchr(p, '\t');
+			if(fields != NULL){
+				*fields++ = '\0';
+			}
+			// with no username, the history is the client's own
+			PLAYER *subject = p[0] == '\0' ? player_ref(player, "for history being reported")
+				: preg_lookup(player_registry, p);
+			char *report = subject != NULL ? history_report(subject, fields) : NULL;
+			if(report == NULL){
+				client_send_nack(client);
+			} else {
+				// the report has been cut at a line that fits in one packet
+				client_send_ack(client, report, strlen(report));
+				Free(report);
+			}
+			if(subject != NULL){
+				player_unref(subject, "because history has been reported");
+			}
+
+		} else if(type == JEUX_WATCH_PKT){ // WATCH -----------------------------
 			// move payload to my temporary storage (add a null terminator)
-			char p[size+1];
+			char *p = text;
 			for(int i = 0; i< size; i++){
 				p[i] = payload[i];
 			}
 			p[size] = '\0';
-			debug("[%d] Invite '%s'", connfd, p);
+			// the ACK is sent by client_watch_game(), ahead of any MOVED
+			if(client_watch_game(client, p) == -1){
+				client_send_nack(client);
+			}
 
-			// create target client pointer
-			CLIENT *target = creg_lookup(client_registry, p);
-			if(target == NULL){ // this target does not exist
-				debug("this target username (%s) does not exist", p);
+		} else if(type == JEUX_UNWATCH_PKT){ // UNWATCH -----------------------------
+			if(client_unwatch_game(client, id) != 0){
 				client_send_nack(client);
 			} else {
+				client_send_ack(client, NULL, 0);
+			}
 
-				int source_role;
-				if(role == 1){
-					source_role = 2;
-				} else {
-					source_role = 1;
+		} else if(type == JEUX_HINT_PKT){ // HINT -----------------------------
+			GAME_ROLE outcome;
+			int distance;
+			char *move = client_get_hint(client, id, &outcome, &distance);
+			if(move == NULL){
+				client_send_nack(client);
+			} else {
+				char hint[strlen(move) + 16];
+				snprintf(hint, sizeof(hint), "%s %d", move, distance);
+				header.type = JEUX_ACK_PKT;
+				header.role = outcome;
+				header.size = htons(strlen(hint));
+				clock_gettime(clock_id, &tp);
+				header.timestamp_sec = htonl(tp.tv_sec);
+				header.timestamp_nsec = htonl(tp.tv_nsec);
+				if(client_send_packet_id(client, &header, id, hint) == -1){
+					debug("client_send_packet() error while processing HINT packet");
 				}
-				// client make invitation
-				int source_id = client_make_invitation(client, target, source_role, role);
-				if(source_id == -1){ // this target does not exist
-					debug("client_make_invitation failed while processing invite packet");
-					client_send_nack(client);
-				} else {
-
-					// decrement references if needed
-					client_unref(target, "after invitation attempt");
+				Free(move);
+			}
 
-					// client send ack
-					header.type = JEUX_ACK_PKT;
-					header.id = source_id;
-					header.role = 0;
-					header.size = 0;
-					clock_gettime(clock_id, &tp);
-					header.timestamp_sec = htonl(tp.tv_sec);
-					header.timestamp_nsec = htonl(tp.tv_nsec);
+		} else if(type == JEUX_INVITE_PKT){ // INVITE -----------------------------
+			// move payload to my temporary storage (add a null terminator)
+			char *p = text;
+			for(int i = 0; i< size; i++){
+				p[i] = payload[i];
+			}
+			p[size] = '\0';
 
-					if(client_send_packet(client, &header, NULL) != 0){
-						debug("send packet failed after processing invite packet");
-						client_send_nack(client);
-					}
+			int source_id = invite(client, p, role);
+			if(source_id == -1){
+				debug("client_make_invitation failed while processing invite packet");
+				client_send_nack(client);
+			} else {
+				// client send ack
+				header.type = JEUX_ACK_PKT;
+				header.role = 0;
+				header.size = 0;
+				clock_gettime(clock_id, &tp);
+				header.timestamp_sec = htonl(tp.tv_sec);
+				header.timestamp_nsec = htonl(tp.tv_nsec);
+
+				if(client_send_packet_id(client, &header, source_id, NULL) != 0){
+					debug("send packet failed after processing invite packet");
+					client_send_nack(client);
 				}
 			}
 
 		} else if(type == JEUX_REVOKE_PKT){ // REVOKE -----------------------------
-			debug("[%d] REVOKE packet received", connfd);
 			int revokeid = id;
-			debug("[%d] Revoke '%d'", connfd, revokeid);
 			if(client_revoke_invitation(client, revokeid) != 0){
 				debug("client_revoke_invitation() error while processing REVOKE packet");
 				client_send_nack(client);
@@ -243,9 +521,7 @@ void *jeux_client_service(void *arg){
 			}
 
 		} else if(type == JEUX_DECLINE_PKT){ // DECLINE -----------------------------
-			debug("[%d] DECLINE packet received", connfd);
 			int declineid = id;
-			debug("[%d] Decline '%d'", connfd, declineid);
 			if(client_decline_invitation(client, declineid) != 0){
 				debug("client_decline_invitation() error while processing DECLINE packet");
 				client_send_nack(client);
@@ -254,9 +530,7 @@ void *jeux_client_service(void *arg){
 			}
 
 		} else if(type == JEUX_ACCEPT_PKT){ // ACCEPT -------------------------------------
-			debug("[%d] ACCEPT packet received", connfd);
 			int acceptid = id;
-			debug("[%d] Accept'%d'", connfd, acceptid);
 			char *str;
 			if(client_accept_invitation(client, acceptid, &str) != 0){
 				debug("client_accept_invitation() error while processing ACCEPT packet");
@@ -266,7 +540,6 @@ void *jeux_client_service(void *arg){
 				if(str==NULL){
 					// printf("PROGRAM REACHED HERE 1\n");
 					header.type = JEUX_ACK_PKT;
-					header.id = id;
 					header.role = 0;
 					header.size = 0;
 					clockid_t clock_id = CLOCK_MONOTONIC;
@@ -274,7 +547,7 @@ void *jeux_client_service(void *arg){
 					clock_gettime(clock_id, &tp);
 					header.timestamp_sec = htonl(tp.tv_sec);
 					header.timestamp_nsec = htonl(tp.tv_nsec);
-					if(client_send_packet(client, &header, NULL) == -1){
+					if(client_send_packet_id(client, &header, id, NULL) == -1){
 						debug("client_send_packet() error while processing ACCEPT packet");
 						client_send_nack(client);
 					}
@@ -286,7 +559,6 @@ void *jeux_client_service(void *arg){
 					board[strlen(str)] = '\0';
 					strcpy(board, str);
 					header.type = JEUX_ACK_PKT;
-					header.id = id;
 					header.role = 0;
 					header.size = htons(strlen(str));
 					clockid_t clock_id = CLOCK_MONOTONIC;
@@ -294,7 +566,7 @@ void *jeux_client_service(void *arg){
 					clock_gettime(clock_id, &tp);
 					header.timestamp_sec = htonl(tp.tv_sec);
 					header.timestamp_nsec = htonl(tp.tv_nsec);
-					if(client_send_packet(client, &header, str) == -1){
+					if(client_send_packet_id(client, &header, id, str) == -1){
 						debug("client_send_packet() error while processing ACCEPT packet");
 						client_send_nack(client);
 					}
@@ -304,29 +576,29 @@ void *jeux_client_service(void *arg){
 			}
 
 		} else if(type == JEUX_MOVE_PKT){ // MOVE -------------------------------------
-			debug("[%d] MOVE packet received", connfd);
 			int gameid = id;
 
 			// move payload to my temporary storage (add a null terminator)
-			char p[size+1];
+			char *p = text;
 			for(int i = 0; i< size; i++){
 				p[i] = payload[i];
 			}
 			p[size] = '\0';
 
-			debug("[%d] Move'%d' (%s)", connfd, gameid, p);
 
+			// the reply and the MOVED to the opponent are written together
+			SENDQ_BATCH batch;
+			sendq_batch_begin(&batch);
 			if(client_make_move(client, gameid, p) != 0){
 				debug("client_make_move() error while processing MOVE packet");
 				client_send_nack(client);
 			} else {
 				client_send_ack(client, NULL, 0);
 			}
+			sendq_batch_end(&batch);
 
 		} else if(type == JEUX_RESIGN_PKT){ // RESIGN -----------------------------------------------
-			debug("[%d] RESIGN packet received", connfd);
 			int gameid = id;
-			debug("[%d] Decline '%d'", connfd, gameid);
 			if(client_resign_game(client, gameid) != 0){
 				debug("client_resign_game() error while processing RESIGN packet");
 				client_send_nack(client);
@@ -339,6 +611,7 @@ void *jeux_client_service(void *arg){
 			// printf("Packet received: %d.%d type=%d id=%d role=%d size=%d", timesec, timensec, type, id, role, size);
 			client_send_nack(client);
 		}
+		stats_record_latency(type, stats_now() - received);
 		// Free payload after each packet
 		if(payload != NULL){
 			Free(payload);
@@ -347,10 +620,15 @@ void *jeux_client_service(void *arg){
 
 	// EOF encountered
 	// debug("EOF encountered");
+	if(idle.timeout != NULL){
+		timeout_free(idle.timeout);
+	}
 	if(player != NULL){
 		player_unref(player, "because server thread is discarding reference to logged in player");
 	}
-	if(login){
+	// a session that is parked stays logged in until it is resumed or expires
+	int parked = login && client_park(client) == 0;
+	if(login && !parked){
 		P(&mutex1);
 		logout_in_progress++;
 		V(&mutex1);
@@ -358,9 +636,7 @@ void *jeux_client_service(void *arg){
 		if(client_logout(client) != 0){
 			debug("client_logout failed");
 		}
-		P(&mutex1);
-		logout_in_progress--;
-		V(&mutex1);
+		end_logout();
 	}
 	if(result != NULL){
 		Free(result);
@@ -368,18 +644,27 @@ void *jeux_client_service(void *arg){
 	if(board != NULL){
 		Free(board);
 	}
+	Free(text);
 	// P(&mutex2);
 	// logout_in_progress++;
 	// V(&mutex2);
-	while(logout_in_progress){;}
-	if((creg_unregister(client_registry, client) != 0)){
-		debug("creg_unregister failed");
+	wait_for_logouts();
+	if(!parked){
+		// nothing may be written to the connection once it has been closed
+		client_close_output(client);
+		if((creg_unregister(client_registry, client) != 0)){
+			debug("creg_unregister failed");
+		}
 	}
 	// P(&mutex2);
 	// logout_in_progress--;
 	// V(&mutex2);
 	debug("[%d] Ending client service", connfd);
+	TRACE(TRACE_SERVICE_END, connfd, 0, 0);
+	capture_close(connfd);
+	uring_close(uconn);
 	Close(connfd);
+	upgrade_leave();
 	return 0;
 }
 
@@ -414,3 +699,258 @@ void *jeux_client_service(void *arg){
 // 	return result;
 // }
 
+/*
+ * Invite a player to a game, as requested by an INVITE packet.
+ *
+ * @param client  The CLIENT making the invitation.
+ * @param p  The payload: the username of the target, optionally followed
+ * by a space and a time control.
+ * @param role  The role to which the target is invited.
+ * @return the ID assigned by the client to the invitation, or -1 if it
+ * could not be made.
+ */
+static int invite(CLIENT *client, char *p, int role){
+	// an optional time control follows the username
+	unsigned long base = client_time_base, increment = client_time_increment;
+	char *control = strchr(p, ' ');
+	if(control != NULL){
+		*control++ = '\0';
+		if(client_parse_time_control(control, &base, &increment) != 0){
+			return -1;
+		}
+	}
+
+	// create target client pointer
+	CLIENT *target = creg_lookup(client_registry, p);
+	// a player logged in on another node is invited through a proxy
+	if(target == NULL && fed_enabled()){
+		target = fed_lookup(p);
+	}
+	// and the server's bot through its own CLIENT
+	if(target == NULL){
+		target = bot_lookup(p);
+	}
+	if(target == NULL){ // this target does not exist
+		debug("this target username (%s) does not exist", p);
+		return -1;
+	}
+	int source_role = role == 1 ? 2 : 1;
+	int source_id = client_make_timed_invitation(client, target, source_role, role, base, increment);
+	// decrement references if needed
+	client_unref(target, "after invitation attempt");
+	return source_id;
+}
+
+/*
+ * Room taken in the result of a BATCH by the result of a sub-request, at
+ * most: its header, and the state of the game in the ACK to an ACCEPT.
+ */
+static size_t batch_result_room(JEUX_BATCH_ITEM *item){
+	return sizeof(*item) + (item->type == JEUX_ACCEPT_PKT ? GAME_STATE_MAX : 0);
+}
+
+/*
+ * Carry out the sub-requests of a BATCH packet, and answer it with an
+ * ACK carrying their results, or a NACK if it is malformed or its results
+ * might not fit in the payload of the ACK.  The packets sent to other
+ * clients meanwhile are written together, with the io_uring backend, as
+ * for a single MOVE.
+ */
+static void serve_batch(CLIENT *client, char *payload, size_t size){
+	// check every sub-request before carrying out any
+	size_t off = 0;
+	size_t room = 0;
+	while(off < size){
+		JEUX_BATCH_ITEM item;
+		if(size - off < sizeof(item)){
+			client_send_nack(client);
+			return;
+		}
+		memcpy(&item, payload + off, sizeof(item));
+		off += sizeof(item) + ntohs(item.size);
+		room += batch_result_room(&item);
+		if(off > size || item.type < JEUX_INVITE_PKT || item.type > JEUX_RESIGN_PKT
+		   || room > UINT16_MAX){
+			client_send_nack(client);
+			return;
+		}
+	}
+
+	char *results = Malloc(room > 0 ? room : 1);
+	size_t len = 0;
+	SENDQ_BATCH batch;
+	sendq_batch_begin(&batch);
+	for(off = 0; off < size; ){
+		JEUX_BATCH_ITEM item;
+		memcpy(&item, payload + off, sizeof(item));
+		off += sizeof(item);
+		size_t n = ntohs(item.size);
+		char *p = Malloc(n + 1);
+		memcpy(p, payload + off, n);
+		p[n] = '\0';
+		off += n;
+		uint32_t id = ntohl(item.id);
+		int gameid = id > INT_MAX ? -1 : (int) id;
+		char *state = NULL;
+		int ok = 0;
+		switch(item.type){
+		case JEUX_INVITE_PKT:
+			gameid = invite(client, p, item.role);
+			ok = gameid != -1;
+			id = gameid;
+			break;
+		case JEUX_REVOKE_PKT:
+			ok = client_revoke_invitation(client, gameid) == 0;
+			break;
+		case JEUX_ACCEPT_PKT:
+			ok = client_accept_invitation(client, gameid, &state) == 0;
+			break;
+		case JEUX_DECLINE_PKT:
+			ok = client_decline_invitation(client, gameid) == 0;
+			break;
+		case JEUX_MOVE_PKT:
+			ok = client_make_move(client, gameid, p) == 0;
+			break;
+		case JEUX_RESIGN_PKT:
+			ok = client_resign_game(client, gameid) == 0;
+			break;
+		}
+		Free(p);
+		size_t state_len = state != NULL ? strlen(state) : 0;
+		item.type = ok ? JEUX_ACK_PKT : JEUX_NACK_PKT;
+		item.role = 0;
+		item.size = htons(state_len);
+		item.id = htonl(ok ? id : 0);
+		memcpy(results + len, &item, sizeof(item));
+		len += sizeof(item);
+		if(state != NULL){
+			memcpy(results + len, state, state_len);
+			len += state_len;
+			Free(state);
+		}
+	}
+	client_send_ack(client, results, len);
+	sendq_batch_end(&batch);
+	Free(results);
+}
+
+static void report_opponent(PLAYER *player, PLAYER *opponent, unsigned long record[3], void *arg){
+	fprintf((FILE *) arg, "%s\t%lu\t%lu\t%lu\n", player_get_name(opponent), record[0], record[1], record[2]);
+}
+
+/*
+ * Report the record of a player: a line with the player's username,
+ * rating and numbers of games won, lost and drawn, then a line with the
+ * same numbers for each opponent.  The report is in malloc'ed storage,
+ * which the caller must free.
+ */
+static char *record_report(PLAYER *player){
+	char *buf;
+	size_t len;
+	FILE *f = open_memstream(&buf, &len);
+	if(f == NULL){
+		return NULL;
+	}
+	unsigned long record[3];
+	player_get_record(player, record);
+	fprintf(f, "%s\t%d\t%lu\t%lu\t%lu\n", player_get_name(player), player_get_rating(player),
+		record[0], record[1], record[2]);
+	player_foreach_opponent(player, report_opponent, f);
+	fclose(f);
+	return buf;
+}
+
+#define HISTORY_MAX_BUCKETS 4096
+
+/*
+ * A report being formatted into storage the size of the largest payload.
+ * Lines are added whole, until one does not fit.
+ */
+typedef struct report {
+	size_t len;
+	char buf[UINT16_MAX + 1];
+} REPORT;
+
+static int report_line(REPORT *r, char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+	va_end(ap);
+	if(n < 0 || (size_t) n >= sizeof(r->buf) - r->len){
+		r->buf[r->len] = '\0';
+		return -1;
+	}
+	r->len += n;
+	return 0;
+}
+
+static int report_change(HISTORY_ENTRY *entry, void *arg){
+	return report_line((REPORT *) arg, "%lu\t%d\t%s\t%c\n", (unsigned long) entry->time, entry->rating,
+			   player_get_name(entry->opponent),
+			   entry->result == HISTORY_WON ? 'W' : entry->result == HISTORY_LOST ? 'L' : 'D');
+}
+
+/*
+ * Parse a field of the payload of a HISTORY packet: a decimal number,
+ * followed by a tab or the end of the payload.
+ */
+static int parse_field(char **sp, uint64_t *valuep){
+	char *end;
+	if(!isdigit((unsigned char) **sp)){
+		return -1;
+	}
+	errno = 0;
+	*valuep = strtoull(*sp, &end, 10);
+	if(errno != 0 || (*end != '\t' && *end != '\0')){
+		return -1;
+	}
+	*sp = *end == '\t' ? end + 1 : end;
+	return 0;
+}
+
+/*
+ * Report the rating history of a player: a line for each change of the
+ * player's rating in a range of times, or a line for each interval of the
+ * range with changes.  The report is in malloc'ed storage, which the
+ * caller must free.  It ends with the last line that fits in a packet, so
+ * that a report of many changes can be continued by a request for the
+ * range starting at the time of its last line.
+ *
+ * @param fields  The fields of the request after the username, or NULL if
+ * there are none: the start and end of the range, then the number of
+ * intervals.
+ * @return the report, or NULL if the fields are malformed.
+ */
+static char *history_report(PLAYER *player, char *fields){
+	uint64_t from = 0, to = UINT64_MAX, nbuckets = 0;
+	if(fields != NULL){
+		if(parse_field(&fields, &from) == -1 || parse_field(&fields, &to) == -1){
+			return NULL;
+		}
+		if(*fields != '\0' && (parse_field(&fields, &nbuckets) == -1 || *fields != '\0'
+					|| nbuckets == 0 || nbuckets > HISTORY_MAX_BUCKETS)){
+			return NULL;
+		}
+	}
+	REPORT *r = (REPORT *) Malloc(sizeof(REPORT));
+	r->len = 0;
+	r->buf[0] = '\0';
+	HISTORY *history = player_get_history(player);
+	if(nbuckets == 0){
+		history_scan(history, from, to, report_change, r);
+	} else {
+		HISTORY_BUCKET *buckets = (HISTORY_BUCKET *) Malloc(nbuckets * sizeof(HISTORY_BUCKET));
+		int n = history_downsample(history, from, to, buckets, nbuckets);
+		for(int i = 0; i < n; i++){
+			if(report_line(r, "%lu\t%lu\t%d\t%d\t%d\n", (unsigned long) buckets[i].start,
+				       buckets[i].count, buckets[i].min, buckets[i].max, buckets[i].last) == -1){
+				break;
+			}
+		}
+		Free(buckets);
+	}
+	char *report = (char *) Malloc(r->len + 1);
+	memcpy(report, r->buf, r->len + 1);
+	Free(r);
+	return report;
+}
@@ -0,0 +1,116 @@
+#include "spsc.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define CACHE_LINE 64
+
+typedef struct spsc_msg {
+	SPSC_FUNC func;
+	void *arg;
+} SPSC_MSG;
+
+struct spsc_queue {
+	// written by the consumer
+	unsigned long head __attribute__((aligned(CACHE_LINE)));
+	unsigned long tail_cache;   // consumer's copy of tail
+	// written by the producer
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	unsigned long head_cache;   // producer's copy of head
+	// never written after creation
+	unsigned long mask __attribute__((aligned(CACHE_LINE)));
+	SPSC_MSG *slots;
+};
+
+/*
+ * Create a new, empty SPSC_QUEUE.
+ *
+ * @param capacity  Maximum number of messages, rounded up to a power of two.
+ * @return the newly created SPSC_QUEUE.
+ */
+SPSC_QUEUE *spsc_create(unsigned int capacity){
+	unsigned long size = 1;
+	while(size < capacity){
+		size <<= 1;
+	}
+	SPSC_QUEUE *q;
+	if(posix_memalign((void **) &q, CACHE_LINE, sizeof(SPSC_QUEUE)) != 0){
+		unix_error("Cannot allocate message queue");
+	}
+	memset(q, 0, sizeof(SPSC_QUEUE));
+	q->mask = size - 1;
+	q->slots = (SPSC_MSG *) Calloc(size, sizeof(SPSC_MSG));
+	return q;
+}
+
+/*
+ * Free an SPSC_QUEUE, discarding any messages left in it.
+ *
+ * @param q  The SPSC_QUEUE to be freed.
+ */
+void spsc_free(SPSC_QUEUE *q){
+	if(q == NULL){
+		return;
+	}
+	Free(q->slots);
+	free(q);
+}
+
+/*
+ * Add a message to a queue.  Only the producer of the queue may call this.
+ *
+ * @param q  The queue.
+ * @param func  The function to be run by the consumer.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the message was added, -1 if the queue is full.
+ */
+int spsc_push(SPSC_QUEUE *q, SPSC_FUNC func, void *arg){
+	unsigned long tail = q->tail;
+	if(tail - q->head_cache > q->mask){
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if(tail - q->head_cache > q->mask){
+			return -1;
+		}
+	}
+	SPSC_MSG *slot = &q->slots[tail & q->mask];
+	slot->func = func;
+	slot->arg = arg;
+	// the message is complete before the consumer can see it
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Take the oldest message from a queue.  Only the consumer of the queue
+ * may call this.
+ *
+ * @param q  The queue.
+ * @param funcp  Pointer to a variable into which to store the function.
+ * @param argp  Pointer to a variable into which to store its argument.
+ * @return 0 if a message was taken, -1 if the queue is empty.
+ */
+int spsc_pop(SPSC_QUEUE *q, SPSC_FUNC *funcp, void **argp){
+	unsigned long head = q->head;
+	if(head == q->tail_cache){
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if(head == q->tail_cache){
+			return -1;
+		}
+	}
+	SPSC_MSG *slot = &q->slots[head & q->mask];
+	*funcp = slot->func;
+	*argp = slot->arg;
+	// the slot has been read before the producer can reuse it
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Determine whether a queue is empty.  Only the consumer of the queue may
+ * rely on the answer: to anyone else it may already be out of date.
+ *
+ * @param q  The queue.
+ * @return nonzero if the queue holds no message, otherwise 0.
+ */
+int spsc_empty(SPSC_QUEUE *q){
+	return q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
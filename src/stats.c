@@ -0,0 +1,287 @@
+#include <time.h>
+
+#include "stats.h"
+#include "protocol_ext.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Counters of one packet type.
+ */
+typedef struct type_stats {
+	uint64_t recv_pkts;
+	uint64_t recv_bytes;
+	uint64_t sent_pkts;
+	uint64_t sent_bytes;
+	uint64_t latency_count;
+	uint64_t latency_sum;   // nanoseconds
+	uint64_t latency_max;   // nanoseconds
+	uint64_t hist[STATS_NBUCKETS];
+} TYPE_STATS;
+
+/*
+ * Per-thread block of counters.  Only the owning thread writes to a block,
+ * so the counters are updated with plain atomic loads and stores rather
+ * than read-modify-write instructions.  Blocks are never freed; when a
+ * thread exits its block is released for reuse by a later thread, with
+ * the counts accumulated so far left in place.
+ */
+typedef struct stats_block {
+	TYPE_STATS types[STATS_NTYPES];
+	int in_use;
+	struct stats_block *next;
+} STATS_BLOCK;
+
+static STATS_BLOCK *blocks = NULL;
+static pthread_key_t block_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread STATS_BLOCK *my_block = NULL;
+
+static const char *type_names[STATS_NTYPES] = JEUX_PACKET_NAMES;
+
+static void release_block(void *arg){
+	STATS_BLOCK *blk = (STATS_BLOCK *) arg;
+	__atomic_store_n(&blk->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_once_init(void){
+	pthread_key_create(&block_key, release_block);
+}
+
+/*
+ * Get the block of the calling thread, claiming a free one or
+ * allocating a new one the first time the thread gets here.
+ */
+static STATS_BLOCK *get_block(void){
+	if(my_block != NULL){
+		return my_block;
+	}
+	pthread_once(&stats_once, stats_once_init);
+	STATS_BLOCK *blk;
+	for(blk = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); blk != NULL; blk = blk->next){
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&blk->in_use, &expected, 1, 0,
+					       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+	if(blk == NULL){
+		blk = (STATS_BLOCK *) Calloc(1, sizeof(STATS_BLOCK));
+		blk->in_use = 1;
+		blk->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&blocks, &blk->next, blk, 0,
+						   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	my_block = blk;
+	pthread_setspecific(block_key, blk);
+	return blk;
+}
+
+/*
+ * Add to a counter owned by the calling thread.  A relaxed load and store
+ * suffice, because no other thread writes the counter, and they keep the
+ * readers from seeing a torn value.
+ */
+static inline void bump(uint64_t *counter, uint64_t n){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t peek(uint64_t *counter){
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map a latency to its histogram bucket.  Values below 2^STATS_SUB_BITS
+ * get a bucket each; above that, each power of two is split into
+ * 2^STATS_SUB_BITS buckets according to the bits following the leading one.
+ */
+static int bucket_of(uint64_t ns){
+	if(ns < (1 << STATS_SUB_BITS)){
+		return (int) ns;
+	}
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (int) ((ns >> (msb - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1));
+	int b = ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+	return b < STATS_NBUCKETS ? b : STATS_NBUCKETS - 1;
+}
+
+/*
+ * Smallest latency that falls into a bucket.
+ */
+static uint64_t bucket_low(int b){
+	if(b < (1 << STATS_SUB_BITS)){
+		return (uint64_t) b;
+	}
+	int msb = (b >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	uint64_t sub = b & ((1 << STATS_SUB_BITS) - 1);
+	return ((uint64_t) 1 << msb) | (sub << (msb - STATS_SUB_BITS));
+}
+
+/*
+ * Get the current time from the monotonic clock, in nanoseconds.
+ */
+uint64_t stats_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Record the receipt of a packet.
+ *
+ * @param type  The type of the packet.
+ * @param bytes  The total size of the packet, including the header.
+ */
+void stats_record_recv(int type, size_t bytes){
+	if(type < 0 || type >= STATS_NTYPES){
+		return;
+	}
+	TYPE_STATS *ts = &get_block()->types[type];
+	bump(&ts->recv_pkts, 1);
+	bump(&ts->recv_bytes, bytes);
+}
+
+/*
+ * Record the sending of a packet.
+ *
+ * @param type  The type of the packet.
+ * @param bytes  The total size of the packet, including the header.
+ */
+void stats_record_send(int type, size_t bytes){
+	if(type < 0 || type >= STATS_NTYPES){
+		return;
+	}
+	TYPE_STATS *ts = &get_block()->types[type];
+	bump(&ts->sent_pkts, 1);
+	bump(&ts->sent_bytes, bytes);
+}
+
+/*
+ * Record the time taken to process a request.
+ *
+ * @param type  The type of the request packet.
+ * @param ns  The time from receipt of the request to the sending of
+ * the response, in nanoseconds.
+ */
+void stats_record_latency(int type, uint64_t ns){
+	if(type < 0 || type >= STATS_NTYPES){
+		return;
+	}
+	TYPE_STATS *ts = &get_block()->types[type];
+	bump(&ts->latency_count, 1);
+	bump(&ts->latency_sum, ns);
+	if(ns > peek(&ts->latency_max)){
+		__atomic_store_n(&ts->latency_max, ns, __ATOMIC_RELAXED);
+	}
+	bump(&ts->hist[bucket_of(ns)], 1);
+}
+
+/*
+ * Sum the blocks of all threads.  The counters continue to change while
+ * they are being read, so the result is only approximately consistent.
+ */
+static void aggregate(TYPE_STATS *total){
+	memset(total, 0, STATS_NTYPES * sizeof(TYPE_STATS));
+	for(STATS_BLOCK *blk = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); blk != NULL; blk = blk->next){
+		for(int t = 0; t < STATS_NTYPES; t++){
+			TYPE_STATS *src = &blk->types[t];
+			TYPE_STATS *dst = &total[t];
+			dst->recv_pkts += peek(&src->recv_pkts);
+			dst->recv_bytes += peek(&src->recv_bytes);
+			dst->sent_pkts += peek(&src->sent_pkts);
+			dst->sent_bytes += peek(&src->sent_bytes);
+			dst->latency_count += peek(&src->latency_count);
+			dst->latency_sum += peek(&src->latency_sum);
+			uint64_t max = peek(&src->latency_max);
+			if(max > dst->latency_max){
+				dst->latency_max = max;
+			}
+			for(int b = 0; b < STATS_NBUCKETS; b++){
+				dst->hist[b] += peek(&src->hist[b]);
+			}
+		}
+	}
+}
+
+/*
+ * Latency below which the given fraction (in thousandths) of the samples
+ * fall, taken from the histogram in microseconds.
+ */
+static double percentile(TYPE_STATS *ts, int permille){
+	uint64_t n = 0;
+	for(int b = 0; b < STATS_NBUCKETS; b++){
+		n += ts->hist[b];
+	}
+	if(n == 0){
+		return 0.0;
+	}
+	uint64_t rank = (n * permille + 999) / 1000;
+	uint64_t seen = 0;
+	for(int b = 0; b < STATS_NBUCKETS; b++){
+		seen += ts->hist[b];
+		if(seen >= rank){
+			return bucket_low(b) / 1000.0;
+		}
+	}
+	return ts->latency_max / 1000.0;
+}
+
+/*
+ * Produce a report of the statistics accumulated by all threads.
+ * The report is a text string, with one line per packet type that
+ * has been seen, in malloc'ed storage that the caller must free.
+ *
+ * @return the report.
+ */
+char *stats_report(void){
+	TYPE_STATS *total = (TYPE_STATS *) Malloc(STATS_NTYPES * sizeof(TYPE_STATS));
+	aggregate(total);
+	char *buf;
+	size_t len;
+	FILE *f = open_memstream(&buf, &len);
+	if(f == NULL){
+		Free(total);
+		return NULL;
+	}
+	fprintf(f, "type\trecv\trecv_bytes\tsent\tsent_bytes\tp50_us\tp90_us\tp99_us\tmax_us\n");
+	for(int t = 0; t < STATS_NTYPES; t++){
+		TYPE_STATS *ts = &total[t];
+		if(ts->recv_pkts == 0 && ts->sent_pkts == 0){
+			continue;
+		}
+		if(type_names[t] != NULL){
+			fprintf(f, "%s", type_names[t]);
+		} else {
+			fprintf(f, "%d", t);
+		}
+		fprintf(f, "\t%lu\t%lu\t%lu\t%lu",
+			(unsigned long) ts->recv_pkts, (unsigned long) ts->recv_bytes,
+			(unsigned long) ts->sent_pkts, (unsigned long) ts->sent_bytes);
+		if(ts->latency_count > 0){
+			fprintf(f, "\t%.1f\t%.1f\t%.1f\t%.1f\n",
+				percentile(ts, 500), percentile(ts, 900), percentile(ts, 990),
+				ts->latency_max / 1000.0);
+		} else {
+			fprintf(f, "\t-\t-\t-\t-\n");
+		}
+	}
+	fclose(f);
+	Free(total);
+	return buf;
+}
+
+/*
+ * Write a report of the statistics accumulated by all threads.
+ *
+ * @param f  The stream to which the report is to be written.
+ */
+void stats_dump(FILE *f){
+	char *report = stats_report();
+	if(report == NULL){
+		return;
+	}
+	fputs(report, f);
+	fflush(f);
+	free(report);
+}
@@ -0,0 +1,242 @@
+#include "strand.h"
+#include "scheduler.h"
+#include "coro.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Maximum number of tasks a worker will run from one strand before
+ * yielding to other work, so that a busy game cannot starve the others.
+ */
+#define STRAND_BATCH 16
+
+typedef struct strand_task_node {
+	STRAND_TASK task;
+	void *arg;
+	struct strand *strand; // when sharded, the strand the task was posted to
+	struct strand_task_node *next;
+} TASK_NODE;
+
+typedef struct strand {
+	TASK_NODE *head;
+	TASK_NODE *tail;
+	int scheduled; // strand is queued in the scheduler or being run by a worker
+	int finalized; // strand_fini() was called while a worker held the strand
+	int shard;     // shard whose thread runs every task, or -1
+	sem_t mutex;
+} STRAND;
+
+static int next_shard = 0;
+
+static __thread STRAND *current_strand = NULL;
+
+/*
+ * Completion record used by strand_call() to wait for its task.
+ */
+typedef struct strand_call {
+	STRAND_TASK task;
+	void *arg;
+	CORO_EVENT done;
+} STRAND_CALL;
+
+/*
+ * Scheduler task that runs up to STRAND_BATCH tasks of a strand.
+ * If tasks remain afterwards, the strand yields its worker and is
+ * resubmitted, otherwise it is marked idle.
+ */
+static void strand_run(void *arg){
+	STRAND *strand = (STRAND *) arg;
+	current_strand = strand;
+	for(int n = 0; ; n++){
+		P(&strand->mutex);
+		TASK_NODE *node = strand->head;
+		if(node == NULL){
+			strand->scheduled = 0;
+			int finalized = strand->finalized;
+			V(&strand->mutex);
+			// the owner let go of the strand while its last task was finishing
+			if(finalized){
+				Free(strand);
+			}
+			break;
+		}
+		if(n == STRAND_BATCH){
+			V(&strand->mutex);
+			sched_defer(strand_run, strand);
+			break;
+		}
+		strand->head = node->next;
+		if(strand->head == NULL){
+			strand->tail = NULL;
+		}
+		V(&strand->mutex);
+
+		node->task(node->arg);
+		Free(node);
+	}
+	current_strand = NULL;
+}
+
+/*
+ * Message that runs a task of a strand homed on a shard, for
+ * strand_call().  The shard's thread runs one message at a time, so the
+ * tasks of the strand need no queue of their own to be serialized, and
+ * the strand itself is not touched once the task has returned.
+ */
+static void shard_call(void *arg){
+	TASK_NODE *node = (TASK_NODE *) arg;
+	STRAND *previous = current_strand;
+	current_strand = node->strand;
+	node->task(node->arg);
+	current_strand = previous;
+}
+
+/*
+ * Message that runs a task posted with strand_post() to a strand homed
+ * on a shard.
+ */
+static void shard_post(void *arg){
+	shard_call(arg);
+	Free(arg);
+}
+
+/*
+ * Create a new, empty STRAND.  When the coroutine threads are shards, the
+ * STRAND is homed on the shard of the calling thread, or if that is not
+ * one, on each shard in turn, and its tasks all run there.
+ *
+ * @return the newly created STRAND, or NULL if creation fails.
+ */
+STRAND *strand_create(void){
+	STRAND *strand = (STRAND *) Malloc(sizeof(STRAND));
+	strand->head = NULL;
+	strand->tail = NULL;
+	strand->scheduled = 0;
+	strand->finalized = 0;
+	strand->shard = -1;
+	if(coro_sharded()){
+		strand->shard = coro_shard();
+		if(strand->shard < 0){
+			strand->shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % coro_nshards();
+		}
+	}
+	Sem_init(&strand->mutex, 0, 1);
+	return strand;
+}
+
+/*
+ * Free a STRAND.  No further tasks may be posted to the STRAND, and it
+ * must not be referenced again.  If a worker is still finishing the last
+ * task of the STRAND, then the worker frees it once that task is done.
+ *
+ * @param strand  The STRAND to be freed.
+ */
+void strand_fini(STRAND *strand){
+	if(strand == NULL){
+		return;
+	}
+	// a task homed on a shard never touches its strand after it returns
+	if(strand->shard >= 0){
+		Free(strand);
+		return;
+	}
+	P(&strand->mutex);
+	if(strand->scheduled){
+		strand->finalized = 1;
+		V(&strand->mutex);
+		return;
+	}
+	V(&strand->mutex);
+	Free(strand);
+}
+
+/*
+ * Post a task to a STRAND.  The task will be run asynchronously, after
+ * all the tasks previously posted to the same STRAND have completed.
+ *
+ * @param strand  The STRAND to which the task is to be posted.
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was successfully posted, otherwise -1.
+ */
+int strand_post(STRAND *strand, STRAND_TASK task, void *arg){
+	if(strand == NULL || task == NULL){
+		return -1;
+	}
+	TASK_NODE *node = (TASK_NODE *) Malloc(sizeof(TASK_NODE));
+	node->task = task;
+	node->arg = arg;
+	node->strand = strand;
+	node->next = NULL;
+	if(strand->shard >= 0){
+		coro_post(strand->shard, shard_post, node);
+		return 0;
+	}
+
+	P(&strand->mutex);
+	if(strand->tail == NULL){
+		strand->head = node;
+	} else {
+		strand->tail->next = node;
+	}
+	strand->tail = node;
+	int wake = !strand->scheduled;
+	strand->scheduled = 1;
+	V(&strand->mutex);
+
+	// only an idle strand needs to be handed to the scheduler
+	if(wake){
+		sched_submit(strand_run, strand);
+	}
+	return 0;
+}
+
+static void strand_call_task(void *arg){
+	STRAND_CALL *call = (STRAND_CALL *) arg;
+	call->task(call->arg);
+	coro_event_signal(&call->done);
+}
+
+/*
+ * Run a task on a STRAND and wait for it to complete.  If the calling
+ * thread is already executing a task of the same STRAND, then the task
+ * is simply run in-line.
+ *
+ * @param strand  The STRAND on which the task is to be run.
+ * @param task  The function to be run.
+ * @param arg  Argument to be passed to the function.
+ * @return 0 if the task was run, otherwise -1.
+ */
+int strand_call(STRAND *strand, STRAND_TASK task, void *arg){
+	if(strand == NULL || task == NULL){
+		return -1;
+	}
+	if(strand_is_current(strand)){
+		task(arg);
+		return 0;
+	}
+	if(strand->shard >= 0){
+		TASK_NODE node = { task, arg, strand, NULL };
+		coro_call(strand->shard, shard_call, &node);
+		return 0;
+	}
+	// a coroutine lets the others of its thread run while it waits
+	STRAND_CALL call;
+	call.task = task;
+	call.arg = arg;
+	coro_event_init(&call.done);
+	strand_post(strand, strand_call_task, &call);
+	coro_event_wait(&call.done);
+	return 0;
+}
+
+/*
+ * Determine whether the calling thread is currently executing a task
+ * of the specified STRAND.
+ *
+ * @param strand  The STRAND to be queried.
+ * @return 1 if the caller is running on the STRAND, otherwise 0.
+ */
+int strand_is_current(STRAND *strand){
+	return strand != NULL && current_strand == strand;
+}
@@ -0,0 +1,241 @@
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+
+#include "timeout.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define SLOT_MASK (TIMEOUT_SLOTS - 1)
+
+typedef struct timeout {
+	TIMEOUT_FUNC func;
+	void *arg;
+	uint64_t expires;        // Tick at which the timeout expires
+	int pending;
+	struct timeout *next;    // Links in the list of a slot
+	struct timeout **pprev;
+} TIMEOUT;
+
+static TIMEOUT *wheel[TIMEOUT_LEVELS][TIMEOUT_SLOTS];
+static uint64_t now_tick;       // Last tick processed
+static int npending;
+static TIMEOUT *running;        // Timeout whose function is being called
+static pthread_t ticker_tid;
+static int ticker_idle;         // Ticker is waiting for a timeout to be set
+static sem_t wheel_mutex;
+static sem_t ticker_wakeup;
+static pthread_once_t ticker_once = PTHREAD_ONCE_INIT;
+
+static void *ticker(void *arg);
+
+static void ticker_init(void){
+	Sem_init(&wheel_mutex, 0, 1);
+	Sem_init(&ticker_wakeup, 0, 0);
+	now_tick = timeout_now() / TIMEOUT_TICK_MS;
+	ticker_idle = 1;
+	Pthread_create(&ticker_tid, NULL, ticker, NULL);
+}
+
+/*
+ * Get the current time on the clock used by timeouts.
+ *
+ * @return the current time, in milliseconds since some arbitrary start.
+ */
+uint64_t timeout_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Put a timeout in the slot that covers its expiry.  The expiry must not
+ * be earlier than the current tick.  Must be called with the wheel mutex
+ * held.
+ */
+static void place(TIMEOUT *t){
+	uint64_t delta = t->expires - now_tick;
+	uint64_t expires = t->expires;
+	int level = 0;
+	while(level < TIMEOUT_LEVELS - 1 && delta >= (uint64_t) 1 << (TIMEOUT_LEVEL_BITS * (level + 1))){
+		level++;
+	}
+	if(delta >= (uint64_t) 1 << (TIMEOUT_LEVEL_BITS * TIMEOUT_LEVELS)){
+		// beyond the range of the top wheel: park it in the last slot
+		expires = now_tick + ((uint64_t) 1 << (TIMEOUT_LEVEL_BITS * TIMEOUT_LEVELS)) - 1;
+	}
+	TIMEOUT **slot = &wheel[level][(expires >> (TIMEOUT_LEVEL_BITS * level)) & SLOT_MASK];
+	t->next = *slot;
+	if(t->next != NULL){
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void unlink_timeout(TIMEOUT *t){
+	*t->pprev = t->next;
+	if(t->next != NULL){
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Advance the wheel by one tick, moving the timeouts of the slots of
+ * higher wheels that have been reached down the wheels, and call the
+ * functions of the timeouts that expire.  Must be called with the wheel
+ * mutex held; the mutex is released while the functions are called.
+ */
+static void advance(void){
+	now_tick++;
+	for(int level = 1; level < TIMEOUT_LEVELS; level++){
+		if((now_tick & (((uint64_t) 1 << (TIMEOUT_LEVEL_BITS * level)) - 1)) != 0){
+			break;
+		}
+		TIMEOUT **slot = &wheel[level][(now_tick >> (TIMEOUT_LEVEL_BITS * level)) & SLOT_MASK];
+		TIMEOUT *list = *slot;
+		*slot = NULL;
+		while(list != NULL){
+			TIMEOUT *t = list;
+			list = t->next;
+			place(t);
+		}
+	}
+	TIMEOUT **slot = &wheel[0][now_tick & SLOT_MASK];
+	while(*slot != NULL){
+		TIMEOUT *t = *slot;
+		unlink_timeout(t);
+		t->pending = 0;
+		npending--;
+		running = t;
+		V(&wheel_mutex);
+		t->func(t->arg);
+		P(&wheel_mutex);
+		running = NULL;
+	}
+}
+
+/*
+ * Thread that advances the wheel once per tick while any timeout is
+ * pending.  Signals are blocked, so that no signal handler can interrupt
+ * a timeout function that another thread is waiting for.
+ */
+static void *ticker(void *arg){
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	Pthread_detach(pthread_self());
+	while(1){
+		P(&wheel_mutex);
+		while(npending == 0){
+			ticker_idle = 1;
+			V(&wheel_mutex);
+			P(&ticker_wakeup);
+			P(&wheel_mutex);
+		}
+		uint64_t next = now_tick + 1;
+		V(&wheel_mutex);
+
+		struct timespec ts;
+		ts.tv_sec = next * TIMEOUT_TICK_MS / 1000;
+		ts.tv_nsec = (next * TIMEOUT_TICK_MS % 1000) * 1000000;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		// catch up on any ticks missed while the ticker was not running
+		uint64_t target = timeout_now() / TIMEOUT_TICK_MS;
+		P(&wheel_mutex);
+		while(now_tick < target){
+			advance();
+		}
+		V(&wheel_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Create a TIMEOUT, which is initially not pending.
+ *
+ * @param func  The function to be called when the TIMEOUT expires.
+ * @param arg  Argument to be passed to the function.
+ * @return the newly created TIMEOUT.
+ */
+TIMEOUT *timeout_create(TIMEOUT_FUNC func, void *arg){
+	pthread_once(&ticker_once, ticker_init);
+	TIMEOUT *t = (TIMEOUT *) Calloc(1, sizeof(TIMEOUT));
+	t->func = func;
+	t->arg = arg;
+	return t;
+}
+
+/*
+ * Set a TIMEOUT to expire after a specified time, replacing any expiry
+ * that was pending.  This may be called from the function of the TIMEOUT
+ * itself, to set it again.
+ *
+ * @param timeout  The TIMEOUT to be set.
+ * @param ms  Number of milliseconds from now at which the TIMEOUT is to
+ * expire.
+ * @return 1 if the TIMEOUT was already pending, otherwise 0.
+ */
+int timeout_set(TIMEOUT *timeout, unsigned long ms){
+	// the first tick that starts no earlier than the expiry time
+	uint64_t expires = (timeout_now() + ms + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS;
+	P(&wheel_mutex);
+	int was_pending = timeout->pending;
+	if(was_pending){
+		unlink_timeout(timeout);
+	} else {
+		timeout->pending = 1;
+		npending++;
+	}
+	if(ticker_idle){
+		// the ticker stopped counting ticks while it was idle
+		ticker_idle = 0;
+		now_tick = timeout_now() / TIMEOUT_TICK_MS;
+		V(&ticker_wakeup);
+	}
+	timeout->expires = expires > now_tick ? expires : now_tick + 1;
+	place(timeout);
+	V(&wheel_mutex);
+	return was_pending;
+}
+
+/*
+ * Cancel a pending TIMEOUT.  If the function of the TIMEOUT is being
+ * called at the time, then this waits for it to return, unless called
+ * from that function; once this has returned, the function is not
+ * running and will not be called until the TIMEOUT is set again.
+ *
+ * @param timeout  The TIMEOUT to be cancelled.
+ * @return 1 if the TIMEOUT was pending, otherwise 0.
+ */
+int timeout_cancel(TIMEOUT *timeout){
+	P(&wheel_mutex);
+	int was_pending = timeout->pending;
+	if(was_pending){
+		unlink_timeout(timeout);
+		timeout->pending = 0;
+		npending--;
+	}
+	// timeout functions are brief, so just wait for it to be done
+	while(running == timeout && !pthread_equal(pthread_self(), ticker_tid)){
+		V(&wheel_mutex);
+		sched_yield();
+		P(&wheel_mutex);
+	}
+	V(&wheel_mutex);
+	return was_pending;
+}
+
+/*
+ * Cancel a TIMEOUT, as by timeout_cancel(), and free it.
+ *
+ * @param timeout  The TIMEOUT to be freed.
+ */
+void timeout_free(TIMEOUT *timeout){
+	timeout_cancel(timeout);
+	Free(timeout);
+}
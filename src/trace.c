@@ -0,0 +1,184 @@
+#include <time.h>
+
+#include "trace.h"
+#include "csapp.h"
+#include "debug.h"
+
+/*
+ * Per-thread ring of events.  Only the owning thread writes to a ring.
+ * head counts the events ever written; the event with index i is stored
+ * in slot i mod TRACE_RING_SIZE and is valid as long as i >= head - size.
+ * Rings are never freed; when a thread exits its ring is released for
+ * reuse by a later thread, with the events recorded so far left in place.
+ */
+typedef struct trace_ring {
+	TRACE_EVENT events[TRACE_RING_SIZE];
+	uint64_t head;
+	int in_use;
+	struct trace_ring *next;
+} TRACE_RING;
+
+int trace_enabled = 0;
+
+static char *trace_path = NULL;
+static TRACE_RING *rings = NULL;
+static unsigned int next_thread = 0;
+static sem_t dump_mutex;
+static pthread_key_t ring_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread TRACE_RING *my_ring = NULL;
+static __thread uint16_t my_thread;
+
+static void release_ring(void *arg){
+	TRACE_RING *ring = (TRACE_RING *) arg;
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_once_init(void){
+	Sem_init(&dump_mutex, 0, 1);
+	pthread_key_create(&ring_key, release_ring);
+}
+
+/*
+ * Get the ring of the calling thread, claiming a free one or
+ * allocating a new one the first time the thread gets here.
+ */
+static TRACE_RING *get_ring(void){
+	if(my_ring != NULL){
+		return my_ring;
+	}
+	pthread_once(&trace_once, trace_once_init);
+	TRACE_RING *ring;
+	for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0,
+					       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+			break;
+		}
+	}
+	if(ring == NULL){
+		ring = (TRACE_RING *) Calloc(1, sizeof(TRACE_RING));
+		ring->in_use = 1;
+		ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, 0,
+						   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	my_ring = ring;
+	my_thread = (uint16_t) __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+/*
+ * Enable tracing.
+ *
+ * @param path  Name of the file to which the rings are to be written
+ * by trace_dump().
+ */
+void trace_init(char *path){
+	pthread_once(&trace_once, trace_once_init);
+	trace_path = path;
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+	debug("Tracing to %s", path);
+}
+
+/*
+ * Record an event in the ring of the calling thread.  Normally called
+ * through the TRACE() macro.
+ *
+ * @param event  The type of the event.
+ * @param arg0, arg1, arg2  Arguments of the event.
+ */
+void trace_record(int event, uint32_t arg0, uint64_t arg1, uint64_t arg2){
+	TRACE_RING *ring = get_ring();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t i = ring->head;
+	TRACE_EVENT *ev = &ring->events[i & (TRACE_RING_SIZE - 1)];
+	ev->timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	ev->event = (uint16_t) event;
+	ev->thread = my_thread;
+	ev->arg0 = arg0;
+	ev->arg1 = arg1;
+	ev->arg2 = arg2;
+	// publish the event only once it is complete
+	__atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the valid events of one ring into buf, which has room for
+ * TRACE_RING_SIZE events.  The owner may be writing concurrently, so the
+ * events that it may have overwritten during the copy are dropped.
+ * Returns the number of events copied.
+ */
+static size_t copy_ring(TRACE_RING *ring, TRACE_EVENT *buf){
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for(uint64_t i = first; i < head; i++){
+		buf[i - first] = ring->events[i & (TRACE_RING_SIZE - 1)];
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	// the owner may be writing event now, over the slot of event
+	// now - TRACE_RING_SIZE, so only the events after that are intact
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t valid = now + 1 > TRACE_RING_SIZE ? now + 1 - TRACE_RING_SIZE : 0;
+	if(valid <= first){
+		return head - first;
+	}
+	if(valid >= head){
+		return 0;
+	}
+	memmove(buf, buf + (valid - first), (head - valid) * sizeof(TRACE_EVENT));
+	return head - valid;
+}
+
+/*
+ * Write the events currently held in the rings of all threads to the file
+ * given to trace_init(), replacing any previous contents.  Events that are
+ * overwritten while the dump is in progress are omitted.  Does nothing if
+ * tracing is not enabled.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+int trace_dump(void){
+	if(!trace_enabled){
+		return 0;
+	}
+	P(&dump_mutex);
+	// write a temporary file and rename it, so readers never see a partial dump
+	char tmp[strlen(trace_path) + 5];
+	sprintf(tmp, "%s.tmp", trace_path);
+	FILE *f = fopen(tmp, "w");
+	if(f == NULL){
+		debug("Cannot open trace file %s", tmp);
+		V(&dump_mutex);
+		return -1;
+	}
+	TRACE_FILE_HEADER hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TRACE_MAGIC;
+	hdr.version = TRACE_VERSION;
+	hdr.event_size = sizeof(TRACE_EVENT);
+	// the header is rewritten once the counts are known
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	TRACE_EVENT *buf = (TRACE_EVENT *) Malloc(TRACE_RING_SIZE * sizeof(TRACE_EVENT));
+	for(TRACE_RING *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+		size_t n = copy_ring(ring, buf);
+		fwrite(buf, sizeof(TRACE_EVENT), n, f);
+		hdr.count += n;
+		hdr.nthreads++;
+	}
+	Free(buf);
+	rewind(f);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	int err = ferror(f);
+	if(fclose(f) != 0 || err || rename(tmp, trace_path) != 0){
+		debug("Failed to write trace file %s", trace_path);
+		V(&dump_mutex);
+		return -1;
+	}
+	debug("Wrote %lu trace events to %s", (unsigned long) hdr.count, trace_path);
+	V(&dump_mutex);
+	return 0;
+}
@@ -0,0 +1,765 @@
+#include <poll.h>
+#include <sys/un.h>
+
+#include "client_registry.h"
+#include "client_ext.h"
+#include "creg_snapshot.h"
+#include "game_ext.h"
+#include "invitation_ext.h"
+#include "player_ext.h"
+#include "player_registry_ext.h"
+#include "player_store.h"
+#include "server_ext.h"
+#include "upgrade.h"
+#include "protocol_ext.h"
+#include "jeux_globals.h"
+#include "scheduler.h"
+#include "strand.h"
+#include "capture.h"
+#include "gamelog.h"
+#include "trace.h"
+#include "timeout.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define HANDOFF_MAGIC 0x4a455558 // "JEUX"
+#define HANDOFF_VERSION 4
+#define HANDOFF_MAX_FDS 250      // file descriptors per message, below SCM_MAX_FD
+#define HANDOFF_QUIESCE_MS 5000  // time allowed for threads to stop
+#define HANDOFF_FLUSH_MS 1000    // time allowed for writing queued packets
+
+/*
+ * The first message of a handoff.  The file descriptors follow in batches
+ * of at most HANDOFF_MAX_FDS, listening sockets first, the first batch
+ * with this message and the others each with a single byte, and then
+ * the state, as text: the P and H lines of the players, as described in
+ * player_store.h, and
+ *
+ *   C <fd> <token>|- <len>:<name>|-         a client, fd being its index
+ *                                           among the file descriptors
+ *   V <fd> <version>                        the version of the protocol
+ *                                           used by a client, if not 1
+ *   O <fd> <hex>                            output queued for a client
+ *                                           but not yet written, in hex
+ *   I <source> <source id> <target> <target id> <source role>
+ *     <target role> <base> <increment> <accepted>
+ *     [<nmoves> <move>... <first ms> <second ms>]
+ *                                           an invitation, source and
+ *                                           target being fd indices
+ */
+typedef struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nfds;
+	uint32_t nlisten;
+	uint32_t size; // size of the state
+} HANDOFF_HEADER;
+
+static int enabled;        // an upgrade socket is being listened on
+static int handing_off;
+static int live;           // acceptor and service threads counted
+static int quiesced;       // threads waiting for the handoff to end
+static int waiting;        // the handoff is waiting for the threads
+static int wake_pipe[2];   // made readable while handing off
+static int *hand_listenfds;
+static int nhand;
+static sem_t mutex;
+static sem_t all_quiet;
+static sem_t resume;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init(void){
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&all_quiet, 0, 0);
+	Sem_init(&resume, 0, 0);
+}
+
+/*
+ * Wake the handoff if all counted threads are waiting.  Must be called
+ * with the mutex held.
+ */
+static void check_quiet(void){
+	if(waiting && quiesced >= live){
+		waiting = 0;
+		V(&all_quiet);
+	}
+}
+
+/*
+ * Make upgrade_wait() take part in handoffs.
+ */
+static int enable(void){
+	if(__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	if(pipe(wake_pipe) < 0){
+		return -1;
+	}
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Count an acceptor or service thread that is about to start.  A thread
+ * that starts a service thread calls this on its behalf, so that the
+ * connection it was started for cannot be missed by a handoff.
+ */
+void upgrade_enter(void){
+	pthread_once(&once, init);
+	P(&mutex);
+	live++;
+	V(&mutex);
+}
+
+/*
+ * Stop counting an acceptor or service thread that is ending.
+ */
+void upgrade_leave(void){
+	pthread_once(&once, init);
+	P(&mutex);
+	live--;
+	check_quiet();
+	V(&mutex);
+}
+
+/*
+ * Wait until a file descriptor is readable.  If a handoff starts
+ * meanwhile, the calling thread stays here until it has failed, and
+ * never returns if it succeeds.  If no upgrade socket is being listened
+ * on, this returns at once.
+ *
+ * @param fd  The file descriptor.
+ * @return 0.
+ */
+int upgrade_wait(int fd){
+	if(!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	while(1){
+		struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+		if(!__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE) && poll(fds, 2, -1) < 0){
+			continue;
+		}
+		// nothing more may be read once a handoff has started
+		if(__atomic_load_n(&handing_off, __ATOMIC_ACQUIRE)){
+			P(&mutex);
+			quiesced++;
+			check_quiet();
+			V(&mutex);
+			P(&resume);
+			continue;
+		}
+		if(fds[0].revents != 0){
+			return 0;
+		}
+	}
+}
+
+/*
+ * Determine whether a handoff is in progress.
+ *
+ * @return nonzero if a handoff is in progress, otherwise 0.
+ */
+int upgrade_in_progress(void){
+	return __atomic_load_n(&handing_off, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stop all counted threads between packets, and wait until they have
+ * all stopped, or until HANDOFF_QUIESCE_MS have passed, as a thread may
+ * be in the middle of reading a packet that is slow to arrive.
+ * Returns 0 if all threads have stopped, otherwise -1.
+ */
+static int quiesce(void){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += HANDOFF_QUIESCE_MS / 1000;
+	P(&mutex);
+	__atomic_store_n(&handing_off, 1, __ATOMIC_RELEASE);
+	if(write(wake_pipe[1], "u", 1) != 1){
+		debug("Cannot wake threads for handoff");
+	}
+	while(quiesced < live){
+		waiting = 1;
+		V(&mutex);
+		int r;
+		while((r = sem_timedwait(&all_quiet, &deadline)) == -1 && errno == EINTR)
+			;
+		P(&mutex);
+		if(r == -1 && waiting){
+			waiting = 0;
+			V(&mutex);
+			return -1;
+		}
+		if(r == -1){
+			// woken just as the wait timed out
+			P(&all_quiet);
+		}
+	}
+	V(&mutex);
+	return 0;
+}
+
+/*
+ * Let the threads stopped by quiesce() carry on.
+ */
+static void unquiesce(void){
+	char c;
+	P(&mutex);
+	__atomic_store_n(&handing_off, 0, __ATOMIC_RELEASE);
+	if(read(wake_pipe[0], &c, 1) != 1){
+		debug("Cannot clear handoff wakeup");
+	}
+	for(; quiesced > 0; quiesced--){
+		V(&resume);
+	}
+	V(&mutex);
+}
+
+/*
+ * Wait until the scheduler has run every task submitted to it, such as
+ * the posting of the results of games, or until about a second has
+ * passed.
+ */
+static void drain_scheduler(void){
+	for(int tries = 0; tries < 1000; tries++){
+		unsigned long submitted = 0, executed = 0;
+		for(int i = 0; i < sched_nworkers(); i++){
+			SCHED_STATS stats;
+			if(sched_get_stats(i, &stats) == 0){
+				submitted += stats.submitted;
+				executed += stats.executed;
+			}
+		}
+		if(executed >= submitted){
+			return;
+		}
+		usleep(1000);
+	}
+	debug("Scheduler not drained before handoff");
+}
+
+/*
+ * A snapshot of a game in progress, taken on its strand.
+ */
+typedef struct game_snapshot {
+	GAME *game;
+	unsigned char moves[GAME_MAX_MOVES];
+	int nmoves;
+	long clock[2];
+} GAME_SNAPSHOT;
+
+static void snapshot_task(void *arg){
+	GAME_SNAPSHOT *snap = (GAME_SNAPSHOT *) arg;
+	snap->nmoves = game_get_moves(snap->game, snap->moves);
+	snap->clock[0] = game_get_clock(snap->game, FIRST_PLAYER_ROLE);
+	snap->clock[1] = game_get_clock(snap->game, SECOND_PLAYER_ROLE);
+}
+
+static void set_limit_task(void *arg){
+	client_set_time_limit((INVITATION *) arg);
+}
+
+static int client_index(CLIENT **clients, CLIENT *client){
+	for(int i = 0; clients[i] != NULL; i++){
+		if(clients[i] == client){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Write the state of the server, as described above.  The client with
+ * index i in clients has file descriptor index nhand + i, and unsent[i]
+ * holds the nunsent[i] bytes of output not yet written to it.
+ */
+static void write_state(FILE *out, CLIENT **clients, INVITATION ***invlists, int *invlengths,
+			char **unsent, size_t *nunsent){
+	pstore_write(out);
+	for(int i = 0; clients[i] != NULL; i++){
+		PLAYER *player = client_get_player(clients[i]);
+		char *token = player != NULL ? client_get_resume_token(clients[i]) : NULL;
+		fprintf(out, "C %d %s ", nhand + i, token != NULL ? token : "-");
+		if(player != NULL){
+			fprintf(out, "%zu:%s\n", strlen(player_get_name(player)), player_get_name(player));
+		} else {
+			fprintf(out, "-\n");
+		}
+		if(client_get_version(clients[i]) != 1){
+			fprintf(out, "V %d %d\n", nhand + i, client_get_version(clients[i]));
+		}
+		if(nunsent[i] > 0){
+			fprintf(out, "O %d ", nhand + i);
+			for(size_t j = 0; j < nunsent[i]; j++){
+				fprintf(out, "%02x", (unsigned char) unsent[i][j]);
+			}
+			fprintf(out, "\n");
+		}
+	}
+	for(int i = 0; clients[i] != NULL; i++){
+		for(int id = 0; id < invlengths[i]; id++){
+			INVITATION *inv = invlists[i][id];
+			if(inv == NULL || inv_get_source(inv) != clients[i]){
+				continue;
+			}
+			int target = client_index(clients, inv_get_target(inv));
+			int target_id = -1;
+			for(int j = 0; target >= 0 && j < invlengths[target]; j++){
+				if(invlists[target][j] == inv){
+					target_id = j;
+				}
+			}
+			if(target_id == -1){
+				// it is being removed: the game has just ended
+				continue;
+			}
+			unsigned long increment;
+			unsigned long base = inv_get_time_control(inv, &increment);
+			GAME *game = inv_get_game(inv);
+			fprintf(out, "I %d %d %d %d %d %d %lu %lu %d", nhand + i, id, nhand + target, target_id,
+				inv_get_source_role(inv), inv_get_target_role(inv), base, increment, game != NULL);
+			if(game != NULL){
+				GAME_SNAPSHOT snap = { game };
+				strand_call(game_get_strand(game), snapshot_task, &snap);
+				fprintf(out, " %d", snap.nmoves);
+				for(int m = 0; m < snap.nmoves; m++){
+					fprintf(out, " %d", snap.moves[m]);
+				}
+				fprintf(out, " %ld %ld", snap.clock[0], snap.clock[1]);
+			}
+			fprintf(out, "\n");
+		}
+	}
+}
+
+/*
+ * Send file descriptors in batches, the first with the header.
+ */
+static int send_fds(int sock, HANDOFF_HEADER *hdr, int *fds, int nfds){
+	int sent = 0;
+	do {
+		int n = nfds - sent < HANDOFF_MAX_FDS ? nfds - sent : HANDOFF_MAX_FDS;
+		char one = 0;
+		struct iovec iov;
+		iov.iov_base = sent == 0 ? (void *) hdr : &one;
+		iov.iov_len = sent == 0 ? sizeof(*hdr) : 1;
+		char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if(n > 0){
+			msg.msg_control = control;
+			msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+			memcpy(CMSG_DATA(cmsg), fds + sent, n * sizeof(int));
+		}
+		if(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0){
+			return -1;
+		}
+		sent += n;
+	} while(sent < nfds);
+	return 0;
+}
+
+/*
+ * Receive file descriptors in batches, the first with the header.
+ */
+static int recv_fds(int sock, HANDOFF_HEADER *hdr, int **fdsp){
+	int *fds = NULL;
+	int received = 0;
+	do {
+		char one;
+		struct iovec iov;
+		iov.iov_base = received == 0 && fds == NULL ? (void *) hdr : &one;
+		iov.iov_len = received == 0 && fds == NULL ? sizeof(*hdr) : 1;
+		char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t) iov.iov_len){
+			break;
+		}
+		if(fds == NULL){
+			if(hdr->magic != HANDOFF_MAGIC || hdr->version != HANDOFF_VERSION || hdr->nlisten > hdr->nfds){
+				break;
+			}
+			fds = (int *) Malloc((hdr->nfds + 1) * sizeof(int));
+		}
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+			int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if(received + n > (int) hdr->nfds){
+				break;
+			}
+			memcpy(fds + received, CMSG_DATA(cmsg), n * sizeof(int));
+			received += n;
+		}
+	} while(received < (int) hdr->nfds);
+	if(fds == NULL || received < (int) hdr->nfds){
+		for(int i = 0; i < received; i++){
+			close(fds[i]);
+		}
+		if(fds != NULL){
+			Free(fds);
+		}
+		return -1;
+	}
+	*fdsp = fds;
+	return 0;
+}
+
+/*
+ * Hand the server over to the process connected to an upgrade socket.
+ * Returns only if the handoff fails.
+ */
+static void hand_over(int sock){
+	debug("Handing over to new server process");
+	if(quiesce() == -1){
+		debug("Threads did not stop for handoff");
+		unquiesce();
+		return;
+	}
+	// nothing that can change the state is running now, except the
+	// scheduler and the timeouts, which are stopped or waited for
+	client_end_parked();
+	CLIENT **clients = creg_all_clients(client_registry);
+	int nclients = 0;
+	while(clients[nclients] != NULL){
+		nclients++;
+	}
+	INVITATION ***invlists = (INVITATION ***) Malloc((nclients + 1) * sizeof(INVITATION **));
+	int *invlengths = (int *) Malloc((nclients + 1) * sizeof(int));
+	for(int i = 0; i < nclients; i++){
+		client_unwatch_all(clients[i]);
+		invlists[i] = client_get_invitations(clients[i], &invlengths[i]);
+		for(int id = 0; id < invlengths[i]; id++){
+			if(invlists[i][id] != NULL){
+				inv_set_timeout(invlists[i][id], 0, NULL);
+			}
+		}
+	}
+	drain_scheduler();
+	// stop output at a packet boundary, or hand over the rest of the packet
+	char **unsent = (char **) Malloc((nclients + 1) * sizeof(char *));
+	size_t *nunsent = (size_t *) Malloc((nclients + 1) * sizeof(size_t));
+	uint64_t deadline = timeout_now() + HANDOFF_FLUSH_MS;
+	for(int i = 0; i < nclients; i++){
+		uint64_t now = timeout_now();
+		unsent[i] = sendq_hold(client_get_sendq(clients[i]), now < deadline ? deadline - now : 0,
+				       &nunsent[i]);
+	}
+
+	char *state = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&state, &size);
+	write_state(out, clients, invlists, invlengths, unsent, nunsent);
+	fclose(out);
+	for(int i = 0; i < nclients; i++){
+		if(unsent[i] != NULL){
+			Free(unsent[i]);
+		}
+	}
+	Free(unsent);
+	Free(nunsent);
+
+	int nfds = nhand + nclients;
+	int *fds = (int *) Malloc((nfds + 1) * sizeof(int));
+	memcpy(fds, hand_listenfds, nhand * sizeof(int));
+	for(int i = 0; i < nclients; i++){
+		fds[nhand + i] = client_get_fd(clients[i]);
+	}
+	HANDOFF_HEADER hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, nfds, nhand, size };
+	char ack;
+	int ok = send_fds(sock, &hdr, fds, nfds) == 0 && rio_writen(sock, state, size) == (ssize_t) size
+		&& read(sock, &ack, 1) == 1;
+	Free(fds);
+	free(state);
+	if(ok){
+		debug("Handoff of %d clients complete", nclients);
+		trace_dump();
+		capture_fini();
+		gamelog_fini();
+		exit(EXIT_SUCCESS);
+	}
+
+	debug("Handoff failed, carrying on");
+	for(int i = 0; i < nclients; i++){
+		sendq_release(client_get_sendq(clients[i]));
+		for(int id = 0; id < invlengths[i]; id++){
+			INVITATION *inv = invlists[i][id];
+			if(inv == NULL){
+				continue;
+			}
+			if(inv_get_source(inv) == clients[i]){
+				GAME *game = inv_get_game(inv);
+				if(game != NULL){
+					strand_call(game_get_strand(game), set_limit_task, inv);
+				} else {
+					client_set_time_limit(inv);
+				}
+			}
+			inv_unref(inv, "because invitations list is being discarded");
+		}
+		if(invlists[i] != NULL){
+			Free(invlists[i]);
+		}
+		client_unref(clients[i], "because clients list is being discarded");
+	}
+	Free(invlists);
+	Free(invlengths);
+	Free(clients);
+	unquiesce();
+}
+
+static void *upgrade_thread(void *arg){
+	int listenfd = *(int *) arg;
+	Free(arg);
+	// like the ticker, so that no signal handler runs while threads are stopped
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	Pthread_detach(pthread_self());
+	while(1){
+		int sock = accept(listenfd, NULL, NULL);
+		if(sock < 0){
+			continue;
+		}
+		hand_over(sock);
+		close(sock);
+	}
+	return NULL;
+}
+
+/*
+ * Listen at an upgrade socket path for a new server process to take over
+ * from this one, handing over the specified listening sockets.  The
+ * listening sockets must be non-blocking.  This makes upgrade_wait()
+ * take part in the handoff.
+ *
+ * @param path  The path of the upgrade socket.
+ * @param listenfds  The listening sockets.
+ * @param n  The number of listening sockets.
+ * @return 0 if successful, otherwise -1.
+ */
+int upgrade_listen(char *path, int *listenfds, int n){
+	pthread_once(&once, init);
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0){
+		return -1;
+	}
+	// only the owner of the server may take it over
+	unlink(path);
+	mode_t mask = umask(077);
+	int bound = bind(fd, (SA *) &addr, sizeof(addr));
+	umask(mask);
+	if(bound < 0 || listen(fd, 1) < 0 || enable() == -1){
+		close(fd);
+		return -1;
+	}
+	hand_listenfds = listenfds;
+	nhand = n;
+	int *fdp = (int *) Malloc(sizeof(int));
+	*fdp = fd;
+	pthread_t tid;
+	Pthread_create(&tid, NULL, upgrade_thread, fdp);
+	return 0;
+}
+
+/*
+ * Restore the state sent by the old server process, storing the CLIENTs
+ * restored in clients, indexed by file descriptor index.  Returns 0 if
+ * successful, otherwise -1.
+ */
+static int restore_state(char *state, int *fds, int nlisten, int nfds, CLIENT **clients){
+	char *line = state;
+	char name[1024];
+	while(*line != '\0'){
+		char *next = strchr(line, '\n');
+		if(next == NULL){
+			return -1;
+		}
+		*next++ = '\0';
+		char *s = line + 2;
+		if(line[0] == 'P' || line[0] == 'H'){
+			if(pstore_restore(line) == -1){
+				return -1;
+			}
+		} else if(line[0] == 'C'){
+			int fd = strtol(s, &s, 10);
+			char token[64];
+			if(fd < nlisten || fd >= nfds || clients[fd] != NULL || sscanf(s, " %63s ", token) != 1){
+				return -1;
+			}
+			s = strchr(s + 1, ' ') + 1;
+			PLAYER *player = NULL;
+			if(*s != '-'){
+				if(pstore_parse_name(&s, name, sizeof(name)) == -1){
+					return -1;
+				}
+				player = preg_register(player_registry, name);
+			}
+			clients[fd] = client_restore(fds[fd], player, strcmp(token, "-") != 0 ? token : NULL);
+			if(player != NULL){
+				player_unref(player, "because client has been restored");
+			}
+			if(clients[fd] == NULL){
+				return -1;
+			}
+		} else if(line[0] == 'V'){
+			int fd, version;
+			if(sscanf(s, "%d %d", &fd, &version) != 2 || fd < 0 || fd >= nfds || clients[fd] == NULL
+			   || version < 1 || version > JEUX_VERSION_MAX){
+				return -1;
+			}
+			client_set_version(clients[fd], version);
+		} else if(line[0] == 'O'){
+			int fd = strtol(s, &s, 10);
+			size_t len = *s == ' ' ? strlen(++s) : 1;
+			if(fd < 0 || fd >= nfds || clients[fd] == NULL || len % 2 != 0){
+				return -1;
+			}
+			unsigned char *data = (unsigned char *) Malloc(len / 2 + 1);
+			size_t n;
+			for(n = 0; n < len / 2 && isxdigit((unsigned char) s[2 * n])
+				    && isxdigit((unsigned char) s[2 * n + 1]); n++){
+				char hex[3] = { s[2 * n], s[2 * n + 1], '\0' };
+				data[n] = strtoul(hex, NULL, 16);
+			}
+			int ok = n == len / 2 && sendq_push_bytes(client_get_sendq(clients[fd]), data, n) == 0;
+			Free(data);
+			if(!ok){
+				return -1;
+			}
+		} else if(line[0] == 'I'){
+			int source, source_id, target, target_id, source_role, target_role, accepted, n;
+			unsigned long base, increment;
+			if(sscanf(s, "%d %d %d %d %d %d %lu %lu %d%n", &source, &source_id, &target, &target_id,
+				  &source_role, &target_role, &base, &increment, &accepted, &n) != 9){
+				return -1;
+			}
+			s += n;
+			CLIENT *src = source >= 0 && source < nfds ? clients[source] : NULL;
+			CLIENT *tgt = target >= 0 && target < nfds ? clients[target] : NULL;
+			if(src == NULL || tgt == NULL){
+				return -1;
+			}
+			INVITATION *inv = inv_create(src, tgt, source_role, target_role);
+			inv_set_time_control(inv, base, increment);
+			int ok = client_restore_invitation(src, source_id, inv) == 0
+				&& client_restore_invitation(tgt, target_id, inv) == 0;
+			if(ok && accepted){
+				unsigned char moves[GAME_MAX_MOVES];
+				int nmoves = strtol(s, &s, 10);
+				ok = nmoves >= 0 && nmoves <= GAME_MAX_MOVES;
+				for(int m = 0; ok && m < nmoves; m++){
+					moves[m] = strtol(s, &s, 10);
+				}
+				long first = strtol(s, &s, 10);
+				long second = strtol(s, &s, 10);
+				ok = ok && inv_accept(inv) == 0
+					&& game_restore(inv_get_game(inv), moves, nmoves, first, second) == 0;
+			}
+			if(ok){
+				client_set_time_limit(inv);
+			}
+			inv_unref(inv, "because invitation has been restored");
+			if(!ok){
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+		line = next;
+	}
+	return 0;
+}
+
+/*
+ * Take over from the server process listening at an upgrade socket path,
+ * if there is one.  Its state is restored, and a service thread is
+ * started for each of its client connections.  This must be called after
+ * the registries and the scheduler have been initialized, and before any
+ * connection is accepted.
+ *
+ * @param path  The path of the upgrade socket.
+ * @param listenfdsp  Variable into which to store a malloc'ed array of
+ * the listening sockets handed over.
+ * @return the number of listening sockets handed over, 0 if there is no
+ * server process to take over from, or -1 if the handoff failed.
+ */
+int upgrade_receive(char *path, int **listenfdsp){
+	pthread_once(&once, init);
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0){
+		return -1;
+	}
+	if(connect(sock, (SA *) &addr, sizeof(addr)) < 0){
+		// no server to take over from
+		close(sock);
+		return 0;
+	}
+	debug("Taking over from server process at %s", path);
+	HANDOFF_HEADER hdr;
+	int *fds;
+	if(recv_fds(sock, &hdr, &fds) == -1){
+		close(sock);
+		return -1;
+	}
+	char *state = (char *) Malloc(hdr.size + 1);
+	CLIENT **clients = (CLIENT **) Calloc(hdr.nfds + 1, sizeof(CLIENT *));
+	int ok = rio_readn(sock, state, hdr.size) == (ssize_t) hdr.size;
+	state[ok ? hdr.size : 0] = '\0';
+	// the service threads started below must take part in later handoffs
+	ok = ok && enable() == 0 && restore_state(state, fds, hdr.nlisten, hdr.nfds, clients) == 0;
+	Free(state);
+	char ack = 1;
+	ok = ok && write(sock, &ack, 1) == 1;
+	close(sock);
+	if(!ok){
+		// the old process carries on serving, and this one is to exit
+		debug("Handoff from %s failed", path);
+		for(int i = 0; i < (int) hdr.nfds; i++){
+			close(fds[i]);
+		}
+		Free(clients);
+		Free(fds);
+		return -1;
+	}
+	int nclients = 0;
+	for(int i = hdr.nlisten; i < (int) hdr.nfds; i++){
+		if(clients[i] == NULL){
+			close(fds[i]);
+			continue;
+		}
+		upgrade_enter();
+		pthread_t tid;
+		Pthread_create(&tid, NULL, jeux_adopted_client_service, clients[i]);
+		nclients++;
+	}
+	debug("Took over %d listening sockets and %d clients", hdr.nlisten, nclients);
+	Free(clients);
+	*listenfdsp = fds;
+	return hdr.nlisten;
+}
@@ -0,0 +1,534 @@
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "protocol_ext.h"
+#include "csapp.h"
+#include "debug.h"
+
+#define URING_BGID 0          // buffer group of the provided buffers
+#define SEND_TAG 1            // low bit of the user data of a send
+#define CANCEL_DATA 0         // user data of a cancellation
+
+typedef struct uring_conn {
+	int fd;
+	char *buf;                // Data received but not yet taken as packets
+	size_t len;
+	size_t size;
+	int armed;                // A multishot recv is outstanding
+	int eof;                  // EOF or an error has been seen
+	int pausing;              // Receiving has been stopped until drained
+	int closing;
+	int waiting;              // The service thread waits for more data
+	sem_t ready;              // Posted when data arrives for a waiting thread
+	sem_t stopped;            // Posted when the recv of a closing connection ends
+	sem_t mutex;
+} URING_CONN;
+
+static int enabled;
+static int ring_fd = -1;
+static unsigned sq_tail;                 // Next submission queue entry to fill
+static unsigned sq_entries;
+static unsigned *sq_ktail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+static unsigned *cq_khead, *cq_ktail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static struct io_uring_buf_ring *buf_ring;
+static char *bufs;
+static unsigned short buf_tail;          // Only touched by the receiver thread
+static sem_t sq_mutex;                   // Held while filling and submitting entries
+
+static int submit(void);
+
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+	return syscall(SYS_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*
+ * Get the next free submission queue entry, cleared.  Must be called with
+ * sq_mutex held, and the entries obtained submitted with submit() before
+ * it is released.  If the queue is full, the entries already in it are
+ * submitted first.
+ */
+static struct io_uring_sqe *get_sqe(void){
+	if(sq_tail - __atomic_load_n(sq_ktail, __ATOMIC_RELAXED) >= sq_entries){
+		submit();
+	}
+	unsigned index = sq_tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	sq_tail++;
+	return sqe;
+}
+
+/*
+ * Submit the entries obtained with get_sqe().  Must be called with
+ * sq_mutex held.  Returns 0 if they have all been submitted, otherwise
+ * -1.
+ */
+static int submit(void){
+	unsigned n = sq_tail - __atomic_load_n(sq_ktail, __ATOMIC_RELAXED);
+	__atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+	while(n > 0){
+		int r = enter(n, 0, 0);
+		if(r < 0){
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+				// the receiver thread is emptying the completion queue
+				sched_yield();
+				continue;
+			}
+			return -1;
+		}
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * Give a buffer back to the kernel.  The new tail is published by
+ * publish_bufs().  Only called by the receiver thread, or before it starts.
+ */
+static void recycle_buf(unsigned short bid){
+	struct io_uring_buf *b = &buf_ring->bufs[buf_tail & (URING_NBUFS - 1)];
+	b->addr = (unsigned long) (bufs + (size_t) bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	buf_tail++;
+}
+
+static void publish_bufs(void){
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void prep_recv(struct io_uring_sqe *sqe, int fd, void *data){
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (unsigned long) data;
+}
+
+/*
+ * Prepare a multishot recv on a connection, unless one is outstanding or
+ * the connection is not to be received from.  Must be called with
+ * sq_mutex held.  Returns 1 if the recv has been prepared.
+ */
+static int prep_arm(URING_CONN *conn){
+	P(&conn->mutex);
+	int ok = !conn->armed && !conn->eof && !conn->pausing && !conn->closing;
+	if(ok){
+		prep_recv(get_sqe(), conn->fd, conn);
+		conn->armed = 1;
+	}
+	V(&conn->mutex);
+	return ok;
+}
+
+/*
+ * Arm a multishot recv on a connection, as prep_arm() does, and submit it.
+ */
+static void arm(URING_CONN *conn){
+	P(&sq_mutex);
+	if(prep_arm(conn) && submit() == -1){
+		debug("[%d] Cannot arm receive: %s", conn->fd, strerror(errno));
+		P(&conn->mutex);
+		conn->armed = 0;
+		conn->eof = 1;
+		if(conn->waiting){
+			conn->waiting = 0;
+			V(&conn->ready);
+		}
+		V(&conn->mutex);
+	}
+	V(&sq_mutex);
+}
+
+/*
+ * Prepare the cancellation of the outstanding recv of a connection.  Its
+ * final completion is seen by the receiver thread.  Must be called with
+ * sq_mutex held.
+ */
+static void prep_cancel(URING_CONN *conn){
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) conn;
+	sqe->user_data = CANCEL_DATA;
+}
+
+/*
+ * Handle the completion of a recv, arming it again if it has ended and
+ * the connection is still to be received from.  Must be called with
+ * sq_mutex held, by the receiver thread.
+ */
+static void recv_completed(URING_CONN *conn, struct io_uring_cqe *cqe){
+	int pause = 0, ended = !(cqe->flags & IORING_CQE_F_MORE);
+	P(&conn->mutex);
+	if(cqe->flags & IORING_CQE_F_BUFFER){
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if(cqe->res > 0){
+			if(conn->len + cqe->res > conn->size){
+				conn->size = 2 * (conn->len + cqe->res);
+				conn->buf = Realloc(conn->buf, conn->size);
+			}
+			memcpy(conn->buf + conn->len, bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+			conn->len += cqe->res;
+		}
+		recycle_buf(bid);
+	}
+	if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)){
+		conn->eof = 1;
+	}
+	if(!conn->pausing && conn->len > URING_MAX_BUFFERED){
+		// the service thread is not keeping up
+		conn->pausing = 1;
+		pause = !ended && !conn->closing;
+	}
+	if(conn->waiting){
+		conn->waiting = 0;
+		V(&conn->ready);
+	}
+	if(ended){
+		conn->armed = 0;
+	}
+	int closing = conn->closing;
+	V(&conn->mutex);
+	if(ended && closing){
+		V(&conn->stopped);
+	} else if(ended){
+		prep_arm(conn);
+	} else if(pause){
+		prep_cancel(conn);
+	}
+}
+
+/*
+ * Thread that collects the completions of the ring: the data received on
+ * every connection, and the results of chains of sends.  Signals are
+ * blocked, as for the other background threads.
+ */
+static void *receiver(void *arg){
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	Pthread_detach(pthread_self());
+	while(1){
+		if(enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+			debug("io_uring_enter error in receiver: %s", strerror(errno));
+		}
+		// receives are armed again under the mutex, so that a connection
+		// being closed is never armed again after it has been cancelled
+		P(&sq_mutex);
+		unsigned head = __atomic_load_n(cq_khead, __ATOMIC_RELAXED);
+		unsigned tail = __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++){
+			struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+			unsigned long data = cqe->user_data;
+			if(data == CANCEL_DATA){
+				continue;
+			}
+			if(data & SEND_TAG){
+				URING_SEND *send = (URING_SEND *) (data & ~(unsigned long) SEND_TAG);
+				send->res = cqe->res;
+				V((sem_t *) send->chain);
+			} else {
+				recv_completed((URING_CONN *) data, cqe);
+			}
+		}
+		__atomic_store_n(cq_khead, head, __ATOMIC_RELEASE);
+		// buffers must be back in the ring before receives are armed again
+		publish_bufs();
+		if(submit() == -1){
+			debug("Cannot submit from receiver: %s", strerror(errno));
+		}
+		V(&sq_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Check that multishot recv with provided buffers works, on a socket pair.
+ */
+static int probe_multishot(void){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0){
+		return -1;
+	}
+	int ok = 0;
+	P(&sq_mutex);
+	prep_recv(get_sqe(), sv[0], (void *) 2);
+	if(submit() == 0 && write(sv[1], "j", 1) == 1){
+		// the first completion carries the byte, the second the EOF
+		int seen = 0;
+		while(seen < 2){
+			if(enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+				break;
+			}
+			unsigned head = *cq_khead;
+			unsigned tail = __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE);
+			for(; head != tail; head++){
+				struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+				if(cqe->flags & IORING_CQE_F_BUFFER){
+					recycle_buf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+				}
+				if(seen == 0){
+					ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+					shutdown(sv[1], SHUT_WR);
+				}
+				seen++;
+				if(!(cqe->flags & IORING_CQE_F_MORE)){
+					seen = 2;
+				}
+			}
+			__atomic_store_n(cq_khead, head, __ATOMIC_RELEASE);
+			if(!ok){
+				break;
+			}
+		}
+		publish_bufs();
+	}
+	V(&sq_mutex);
+	close(sv[0]);
+	close(sv[1]);
+	return ok ? 0 : -1;
+}
+
+/*
+ * Set up the io_uring backend and start its receiver thread, if the
+ * kernel supports it.
+ *
+ * @return 0 if the backend is in use, otherwise -1.
+ */
+int uring_init(void){
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+	if(ring_fd < 0){
+		debug("io_uring not available: %s", strerror(errno));
+		return -1;
+	}
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)){
+		debug("io_uring lacks required features");
+		close(ring_fd);
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+	char *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring_fd, IORING_OFF_SQ_RING);
+	sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	buf_ring = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED){
+		debug("Cannot map io_uring: %s", strerror(errno));
+		close(ring_fd);
+		return -1;
+	}
+	sq_ktail = (unsigned *) (ring + params.sq_off.tail);
+	sq_mask = (unsigned *) (ring + params.sq_off.ring_mask);
+	sq_array = (unsigned *) (ring + params.sq_off.array);
+	cq_khead = (unsigned *) (ring + params.cq_off.head);
+	cq_ktail = (unsigned *) (ring + params.cq_off.tail);
+	cq_mask = (unsigned *) (ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+	sq_tail = *sq_ktail;
+	sq_entries = params.sq_entries;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) buf_ring;
+	reg.ring_entries = URING_NBUFS;
+	reg.bgid = URING_BGID;
+	if(syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		debug("io_uring provided buffer rings not available: %s", strerror(errno));
+		close(ring_fd);
+		return -1;
+	}
+	bufs = (char *) Malloc((size_t) URING_NBUFS * URING_BUF_SIZE);
+	for(int i = 0; i < URING_NBUFS; i++){
+		recycle_buf(i);
+	}
+	publish_bufs();
+	Sem_init(&sq_mutex, 0, 1);
+	if(probe_multishot() == -1){
+		debug("io_uring multishot receive not available");
+		close(ring_fd);
+		return -1;
+	}
+	pthread_t tid;
+	Pthread_create(&tid, NULL, receiver, NULL);
+	enabled = 1;
+	debug("Using io_uring backend");
+	return 0;
+}
+
+/*
+ * Determine whether the io_uring backend is in use.
+ *
+ * @return nonzero if uring_init() has succeeded, otherwise 0.
+ */
+int uring_enabled(void){
+	return enabled;
+}
+
+/*
+ * Start receiving from a connection with the io_uring backend.
+ *
+ * @param fd  File descriptor of the connection.
+ * @return the URING_CONN of the connection, or NULL if the backend is not
+ * in use, in which case uring_recv_packet() reads the connection directly.
+ */
+URING_CONN *uring_open(int fd){
+	if(!enabled){
+		return NULL;
+	}
+	URING_CONN *conn = (URING_CONN *) Calloc(1, sizeof(URING_CONN));
+	conn->fd = fd;
+	conn->size = URING_BUF_SIZE;
+	conn->buf = Malloc(conn->size);
+	Sem_init(&conn->ready, 0, 0);
+	Sem_init(&conn->stopped, 0, 0);
+	Sem_init(&conn->mutex, 0, 1);
+	arm(conn);
+	return conn;
+}
+
+/*
+ * Stop receiving from a connection and free its URING_CONN.  Once this
+ * has returned, the kernel no longer uses the file descriptor on behalf of
+ * the backend, and it may be closed.
+ *
+ * @param conn  The URING_CONN, or NULL.
+ */
+void uring_close(URING_CONN *conn){
+	if(conn == NULL){
+		return;
+	}
+	P(&sq_mutex);
+	P(&conn->mutex);
+	conn->closing = 1;
+	int armed = conn->armed;
+	V(&conn->mutex);
+	// no recv can be armed once closing is set, so the one cancelled is the last
+	if(armed){
+		prep_cancel(conn);
+		if(submit() == -1){
+			debug("[%d] Cannot cancel receive: %s", conn->fd, strerror(errno));
+		}
+	}
+	V(&sq_mutex);
+	if(armed){
+		P(&conn->stopped);
+	}
+	Free(conn->buf);
+	Free(conn);
+}
+
+/*
+ * Receive a packet, blocking until one is available, as
+ * proto_recv_packet_ext() does.
+ *
+ * @param conn  The URING_CONN of the connection, or NULL if the
+ * connection is to be read directly.
+ * @param fd  File descriptor of the connection.
+ * @param version  The version of the protocol used on the connection.
+ * @param hdr  Pointer to caller-supplied storage for the version 1
+ *   packet header.
+ * @param ext  Storage for the fields of the header that version 1 has no
+ *   room for, or NULL if they are not wanted.
+ * @param payloadp  Pointer to a variable into which to store a pointer to
+ *   any payload received, which the caller must free.
+ * @return  0 in case of successful reception, -1 on EOF or error.
+ */
+int uring_recv_packet(URING_CONN *conn, int fd, int version, JEUX_PACKET_HEADER *hdr,
+		      JEUX_PACKET_EXT *ext, void **payloadp){
+	if(conn == NULL){
+		return proto_recv_packet_ext(fd, version, hdr, ext, payloadp);
+	}
+	size_t hdr_size = proto_header_size(version);
+	*payloadp = NULL;
+	P(&conn->mutex);
+	while(1){
+		if(conn->len >= hdr_size){
+			proto_unframe_header(version, conn->buf, hdr, ext);
+			size_t total = hdr_size + ntohs(hdr->size);
+			if(conn->len >= total){
+				break;
+			}
+		}
+		if(conn->eof){
+			V(&conn->mutex);
+			return -1;
+		}
+		conn->waiting = 1;
+		V(&conn->mutex);
+		P(&conn->ready);
+		P(&conn->mutex);
+	}
+	size_t size = ntohs(hdr->size);
+	if(size > 0){
+		char *payload = Malloc(size + 1);
+		memcpy(payload, conn->buf + hdr_size, size);
+		payload[size] = '\0';
+		*payloadp = payload;
+	}
+	conn->len -= hdr_size + size;
+	memmove(conn->buf, conn->buf + hdr_size + size, conn->len);
+	int resume = conn->pausing && !conn->armed && conn->len <= URING_MAX_BUFFERED / 2;
+	if(resume){
+		conn->pausing = 0;
+	}
+	V(&conn->mutex);
+	if(resume){
+		arm(conn);
+	}
+	proto_packet_received(fd, hdr, *payloadp);
+	return 0;
+}
+
+/*
+ * Submit a chain of linked sends with a single system call, and wait
+ * until all of them have completed.  Each send starts only once the
+ * previous one has completed in full; if one fails or is short, the rest
+ * of the chain fails with -ECANCELED, and it is up to the caller to
+ * finish them.
+ *
+ * @param sends  The sends.
+ * @param n  The number of sends, at most URING_ENTRIES.
+ * @return 0 if the chain was submitted, -1 if it could not be, in which
+ * case none of the sends has been made.
+ */
+int uring_send_chain(URING_SEND *sends, int n){
+	sem_t done;
+	Sem_init(&done, 0, 0);
+	P(&sq_mutex);
+	for(int i = 0; i < n; i++){
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sends[i].fd;
+		sqe->addr = (unsigned long) &sends[i].msg;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->flags = i < n - 1 ? IOSQE_IO_LINK : 0;
+		sqe->user_data = (unsigned long) &sends[i] | SEND_TAG;
+		sends[i].chain = &done;
+	}
+	if(submit() == -1){
+		// nothing was consumed by the kernel: take the entries back
+		sq_tail -= n;
+		__atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+		V(&sq_mutex);
+		sem_destroy(&done);
+		return -1;
+	}
+	V(&sq_mutex);
+	for(int i = 0; i < n; i++){
+		P(&done);
+	}
+	sem_destroy(&done);
+	return 0;
+}
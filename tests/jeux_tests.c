@@ -5,6 +5,17 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
+#include <poll.h>
+
+#include "csapp.h"
+#include "protocol_ext.h"
+#include "game_ext.h"
+#include "player_ext.h"
+#include "history.h"
+#include "player_registry_ext.h"
+#include "player_store.h"
+#include "jeux_globals.h"
+#include "strand.h"
 
 /* Directory in which to create test output files. */
 #define TEST_OUTPUT "test_output/"
@@ -41,7 +52,7 @@ Test(student_suite, 00_start_server, .timeout = 30) {
     fprintf(stderr, "Starting server...");
     if((server_pid = fork()) == 0) {
 	execlp("valgrind", "jeux", "--leak-check=full", "--track-fds=yes", "--track-origins=yes",
-	       "--error-exitcode=37", "--log-file="TEST_OUTPUT"valgrind.out", "bin/jeux", "-p", "9999", NULL);
+	       "--error-exitcode=37", "--log-file="TEST_OUTPUT"valgrind.out", "bin/jeux", "-p", "9999", "-r", "3", NULL);
 	fprintf(stderr, "Failed to exec server\n");
 	abort();
     }
@@ -74,3 +85,503 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/jclient -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Send a packet with the given type, ID, role and payload (a string, or NULL).
+ */
+static void send_packet(int fd, int type, int id, int role, char *payload) {
+    JEUX_PACKET_HEADER hdr = { .type = type, .id = id, .role = role,
+			       .size = htons(payload != NULL ? strlen(payload) : 0) };
+    cr_assert_eq(proto_send_packet(fd, &hdr, payload), 0, "Cannot send packet of type %d", type);
+}
+
+/*
+ * Receive a packet, check its type, and return its payload, if any, which
+ * the caller must free.
+ */
+static void *expect_packet(int fd, int type, JEUX_PACKET_HEADER *hdr) {
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, hdr, &data), 0, "Expected packet of type %d, got none", type);
+    cr_assert_eq(hdr->type, type, "expected packet of type %d, was %d", type, hdr->type);
+    return data;
+}
+
+/*
+ * Check that nothing arrives on a connection within the given time.
+ */
+static void expect_nothing(int fd, int msecs) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    cr_assert_eq(poll(&pfd, 1, msecs), 0, "A packet arrived unexpectedly");
+}
+
+/*
+ * Connect to the server and log in, returning the connection.
+ */
+static int login(char *name) {
+    int fd = open_clientfd("localhost", "9999");
+    cr_assert_geq(fd, 0, "Cannot connect to server");
+    JEUX_PACKET_HEADER hdr;
+    send_packet(fd, JEUX_LOGIN_PKT, 0, 0, name);
+    free(expect_packet(fd, JEUX_ACK_PKT, &hdr));
+    return fd;
+}
+
+/*
+ * Have source invite target, with the given payload, to a game in which
+ * source plays first, and have target accept.  The IDs of the game for
+ * each of them are returned through sid and tid.
+ */
+static void start_game(int source, int target, char *payload, int *sid, int *tid) {
+    JEUX_PACKET_HEADER hdr;
+    send_packet(source, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, payload);
+    free(expect_packet(source, JEUX_ACK_PKT, &hdr));
+    *sid = hdr.id;
+    free(expect_packet(target, JEUX_INVITED_PKT, &hdr));
+    *tid = hdr.id;
+    send_packet(target, JEUX_ACCEPT_PKT, *tid, 0, NULL);
+    free(expect_packet(target, JEUX_ACK_PKT, &hdr));
+    free(expect_packet(source, JEUX_ACCEPTED_PKT, &hdr));
+}
+
+/*
+ * Make a move, and check that the opponent is sent MOVED.
+ */
+static void move(int player, int id, int opponent, char *str) {
+    JEUX_PACKET_HEADER hdr;
+    send_packet(player, JEUX_MOVE_PKT, id, 0, str);
+    free(expect_packet(player, JEUX_ACK_PKT, &hdr));
+    free(expect_packet(opponent, JEUX_MOVED_PKT, &hdr));
+}
+
+/*
+ * Append a BATCH sub-request to buf, returning the new length.
+ */
+static size_t batch_item(char *buf, size_t len, int type, int id, int role, char *payload) {
+    JEUX_BATCH_ITEM item = { .type = type, .role = role, .id = htonl(id),
+			     .size = htons(payload != NULL ? strlen(payload) : 0) };
+    memcpy(buf + len, &item, sizeof(item));
+    len += sizeof(item);
+    if(payload != NULL) {
+	memcpy(buf + len, payload, strlen(payload));
+	len += strlen(payload);
+    }
+    return len;
+}
+
+Test(student_suite, 02_batch, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/02_batch\n");
+    int a = login("batch_alice");
+    int b = login("batch_bob");
+    char buf[256];
+    size_t len = 0;
+    for(int i = 0; i < 3; i++)
+	len = batch_item(buf, len, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "batch_bob");
+    len = batch_item(buf, len, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "batch_nobody");
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_BATCH_PKT, .size = htons(len) };
+    cr_assert_eq(proto_send_packet(a, &hdr, buf), 0, "Cannot send BATCH");
+    char *data = NULL;
+    cr_assert_eq(proto_recv_packet(a, &hdr, (void **) &data), 0, "No reply to BATCH");
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT, "BATCH was not ACKed");
+    // one result for each sub-request, in order
+    int types[4], n = 0;
+    for(size_t off = 0; off < ntohs(hdr.size); n++) {
+	JEUX_BATCH_ITEM item;
+	memcpy(&item, data + off, sizeof(item));
+	cr_assert_lt(n, 4, "More results than sub-requests");
+	types[n] = item.type;
+	off += sizeof(item) + ntohs(item.size);
+    }
+    free(data);
+    cr_assert_eq(n, 4, "expected %d results, was %d", 4, n);
+    for(int i = 0; i < 3; i++)
+	cr_assert_eq(types[i], JEUX_ACK_PKT, "INVITE %d was not ACKed", i);
+    cr_assert_eq(types[3], JEUX_NACK_PKT, "INVITE of an unknown player was not NACKed");
+    for(int i = 0; i < 3; i++) {
+	data = NULL;
+	cr_assert_eq(proto_recv_packet(b, &hdr, (void **) &data), 0, "No INVITED");
+	cr_assert_eq(hdr.type, JEUX_INVITED_PKT, "expected INVITED, was %d", hdr.type);
+	free(data);
+    }
+    // a sub-request of a type that cannot be batched: nothing is carried out
+    len = batch_item(buf, 0, JEUX_USERS_PKT, 0, 0, NULL);
+    hdr = (JEUX_PACKET_HEADER){ .type = JEUX_BATCH_PKT, .size = htons(len) };
+    cr_assert_eq(proto_send_packet(a, &hdr, buf), 0, "Cannot send BATCH");
+    data = NULL;
+    cr_assert_eq(proto_recv_packet(a, &hdr, (void **) &data), 0, "No reply to BATCH");
+    cr_assert_eq(hdr.type, JEUX_NACK_PKT, "Malformed BATCH was not NACKed");
+    free(data);
+    // results that might not fit in one payload: nothing is carried out
+    char big[512 * sizeof(JEUX_BATCH_ITEM)];
+    len = 0;
+    for(int i = 0; i < 512; i++)
+	len = batch_item(big, len, JEUX_ACCEPT_PKT, 0, 0, NULL);
+    hdr = (JEUX_PACKET_HEADER){ .type = JEUX_BATCH_PKT, .size = htons(len) };
+    cr_assert_eq(proto_send_packet(a, &hdr, big), 0, "Cannot send BATCH");
+    data = NULL;
+    cr_assert_eq(proto_recv_packet(a, &hdr, (void **) &data), 0, "No reply to BATCH");
+    cr_assert_eq(hdr.type, JEUX_NACK_PKT, "Oversized BATCH was not NACKed");
+    free(data);
+    close(a);
+    close(b);
+}
+
+Test(student_suite, 03_watch, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/03_watch\n");
+    int a = login("watch_alice");
+    int b = login("watch_bob");
+    int c = login("watch_carol");
+    JEUX_PACKET_HEADER hdr;
+    send_packet(c, JEUX_WATCH_PKT, 0, 0, "watch_alice");
+    free(expect_packet(c, JEUX_NACK_PKT, &hdr));
+    int aid, bid;
+    start_game(a, b, "watch_bob", &aid, &bid);
+    send_packet(c, JEUX_WATCH_PKT, 0, 0, "watch_bob");
+    char *state = expect_packet(c, JEUX_ACK_PKT, &hdr);
+    cr_assert(ntohs(hdr.size) > 0, "WATCH was not sent the state of the game");
+    free(state);
+    int wid = hdr.id;
+    move(a, aid, b, "5");
+    free(expect_packet(c, JEUX_MOVED_PKT, &hdr));
+    cr_assert_eq(hdr.id, wid, "expected watch ID %d, was %d", wid, hdr.id);
+    send_packet(c, JEUX_UNWATCH_PKT, wid, 0, NULL);
+    free(expect_packet(c, JEUX_ACK_PKT, &hdr));
+    move(b, bid, a, "1");
+    expect_nothing(c, 300);
+    send_packet(c, JEUX_UNWATCH_PKT, wid, 0, NULL);
+    free(expect_packet(c, JEUX_NACK_PKT, &hdr));
+    close(a);
+    close(b);
+    close(c);
+}
+
+Test(student_suite, 04_time_control, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/04_time_control\n");
+    int a = login("clock_alice");
+    int b = login("clock_bob");
+    JEUX_PACKET_HEADER hdr;
+    send_packet(a, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, "clock_bob 1+x");
+    free(expect_packet(a, JEUX_NACK_PKT, &hdr));
+    int aid, bid;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_game(a, b, "clock_bob 1+0", &aid, &bid);
+    // clock_alice plays first but never moves, so the flag falls after a second
+    free(expect_packet(a, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, SECOND_PLAYER_ROLE, "expected winner %d, was %d", SECOND_PLAYER_ROLE, hdr.role);
+    free(expect_packet(b, JEUX_ENDED_PKT, &hdr));
+    cr_assert_eq(hdr.role, SECOND_PLAYER_ROLE, "expected winner %d, was %d", SECOND_PLAYER_ROLE, hdr.role);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    cr_assert_geq(elapsed, 0.9, "The game ended after %.2f seconds", elapsed);
+    send_packet(a, JEUX_MOVE_PKT, aid, 0, "5");
+    free(expect_packet(a, JEUX_NACK_PKT, &hdr));
+    close(a);
+    close(b);
+}
+
+/*
+ * Send a LOGIN with the given payload over a connection, and return the
+ * resume token, as a string, from the ACK, or NULL if it was NACKed.
+ */
+static char *login_token(int fd, char *payload) {
+    JEUX_PACKET_HEADER hdr;
+    char *data = NULL;
+    send_packet(fd, JEUX_LOGIN_PKT, 0, 0, payload);
+    cr_assert_eq(proto_recv_packet(fd, &hdr, (void **) &data), 0, "No reply to LOGIN");
+    if(hdr.type == JEUX_NACK_PKT) {
+	free(data);
+	return NULL;
+    }
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT, "expected ACK or NACK, was %d", hdr.type);
+    cr_assert(ntohs(hdr.size) > 0, "LOGIN was not sent a resume token");
+    char *token = strndup(data, ntohs(hdr.size));
+    free(data);
+    return token;
+}
+
+Test(student_suite, 05_resume, .init = init, .fini = fini, .timeout = 5) {
+    fprintf(stderr, "server_suite/05_resume\n");
+    int a = open_clientfd("localhost", "9999");
+    cr_assert_geq(a, 0, "Cannot connect to server");
+    char *token = login_token(a, "resume_alice");
+    cr_assert_not_null(token, "LOGIN was not ACKed");
+    int b = login("resume_bob");
+    int aid, bid;
+    start_game(a, b, "resume_bob", &aid, &bid);
+    move(a, aid, b, "5");
+    // the session of resume_alice is parked, and the MOVED to it held
+    close(a);
+    usleep(200000);
+    JEUX_PACKET_HEADER hdr;
+    send_packet(b, JEUX_MOVE_PKT, bid, 0, "1");
+    free(expect_packet(b, JEUX_ACK_PKT, &hdr));
+    int c = open_clientfd("localhost", "9999");
+    cr_assert_geq(c, 0, "Cannot connect to server");
+    cr_assert_null(login_token(c, "resume_alice"), "Plain LOGIN of a parked session was ACKed");
+    cr_assert_null(login_token(c, "resume_alice 0000000000000000"), "LOGIN with a wrong token was ACKed");
+    char buf[64];
+    snprintf(buf, sizeof(buf), "resume_alice %s", token);
+    char *fresh = login_token(c, buf);
+    cr_assert_not_null(fresh, "LOGIN with the resume token was not ACKed");
+    cr_assert_str_neq(fresh, token, "The resume token was not replaced");
+    free(expect_packet(c, JEUX_MOVED_PKT, &hdr));
+    cr_assert_eq(hdr.id, aid, "expected game ID %d, was %d", aid, hdr.id);
+    move(c, aid, b, "9");
+    free(token);
+    free(fresh);
+    close(b);
+    close(c);
+}
+
+#define STRAND_TASKS 2000
+
+/*
+ * Progress of the tasks posted to one STRAND.  Only the STRAND's own
+ * tasks touch next, so it needs no lock; busy catches two of them
+ * running at the same time.
+ */
+typedef struct strand_log {
+    int busy;
+    int next;
+    int errors;
+} STRAND_LOG;
+
+typedef struct strand_item {
+    STRAND_LOG *log;
+    int seq;
+} STRAND_ITEM;
+
+static void strand_task(void *arg) {
+    STRAND_ITEM *item = arg;
+    STRAND_LOG *log = item->log;
+    if(__atomic_exchange_n(&log->busy, 1, __ATOMIC_SEQ_CST))
+	log->errors++;
+    if(item->seq != log->next)
+	log->errors++;
+    log->next++;
+    __atomic_store_n(&log->busy, 0, __ATOMIC_SEQ_CST);
+}
+
+static void strand_noop(void *arg) {
+}
+
+Test(unit_suite, strand_order, .timeout = 10) {
+    static STRAND_ITEM items[4][STRAND_TASKS];
+    STRAND_LOG logs[4] = { 0 };
+    STRAND *strands[4];
+    for(int i = 0; i < 4; i++) {
+	strands[i] = strand_create();
+	cr_assert_not_null(strands[i], "Cannot create strand");
+    }
+    // interleave the strands, so that their tasks run concurrently
+    for(int n = 0; n < STRAND_TASKS; n++) {
+	for(int i = 0; i < 4; i++) {
+	    items[i][n] = (STRAND_ITEM){ .log = &logs[i], .seq = n };
+	    cr_assert_eq(strand_post(strands[i], strand_task, &items[i][n]), 0, "Cannot post task");
+	}
+    }
+    // a call runs after everything posted before it
+    for(int i = 0; i < 4; i++) {
+	cr_assert_eq(strand_call(strands[i], strand_noop, NULL), 0);
+	cr_assert_eq(logs[i].next, STRAND_TASKS, "strand %d: expected %d tasks, ran %d",
+		     i, STRAND_TASKS, logs[i].next);
+	cr_assert_eq(logs[i].errors, 0, "strand %d: tasks ran out of order or overlapped", i);
+	strand_fini(strands[i]);
+    }
+}
+
+Test(unit_suite, v2_header_round_trip, .timeout = 5) {
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_MOVED_PKT, .role = SECOND_PLAYER_ROLE,
+			       .size = htons(5), .id = 0x78 };
+    JEUX_PACKET_EXT ext = { .id = 0x12345678, .request = 4242, .flags = JEUX_FLAG_RESPONSE };
+    JEUX_WIRE_HEADER wire;
+    cr_assert_eq(proto_frame_header(2, &hdr, &ext, &wire), proto_header_size(2));
+    cr_assert_eq(proto_header_size(2), sizeof(JEUX_PACKET_HEADER_V2));
+    cr_assert_eq(ntohl(wire.v2.id), 0x12345678, "The full ID was not framed");
+    JEUX_PACKET_HEADER out;
+    JEUX_PACKET_EXT out_ext;
+    proto_unframe_header(2, &wire, &out, &out_ext);
+    cr_assert_eq(out.type, JEUX_MOVED_PKT);
+    cr_assert_eq(out.role, SECOND_PLAYER_ROLE);
+    cr_assert_eq(ntohs(out.size), 5);
+    cr_assert_eq(out.id, 0x78, "expected the low 8 bits of the ID, was 0x%x", out.id);
+    cr_assert_eq(out_ext.id, 0x12345678);
+    cr_assert_eq(out_ext.request, 4242);
+    cr_assert_eq(out_ext.flags, JEUX_FLAG_RESPONSE);
+    // version 1 has room for the low 8 bits of the ID only
+    cr_assert_eq(proto_frame_header(1, &hdr, &ext, &wire), sizeof(JEUX_PACKET_HEADER));
+    cr_assert_eq(wire.v1.id, 0x78);
+}
+
+Test(unit_suite, v2_send_recv, .timeout = 5) {
+    int fds[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    JEUX_PACKET_HEADER hdr = { .type = JEUX_ACK_PKT, .size = htons(5) };
+    JEUX_PACKET_EXT ext = { .id = 70000, .request = 9, .flags = JEUX_FLAG_RESPONSE };
+    cr_assert_eq(proto_send_packet_ext(fds[0], 2, &hdr, &ext, "hello"), 0);
+    JEUX_PACKET_HEADER out;
+    JEUX_PACKET_EXT out_ext;
+    char *data = NULL;
+    cr_assert_eq(proto_recv_packet_ext(fds[1], 2, &out, &out_ext, (void **) &data), 0);
+    cr_assert_eq(out.type, JEUX_ACK_PKT);
+    cr_assert_eq(ntohs(out.size), 5);
+    cr_assert_eq(out_ext.id, 70000);
+    cr_assert_eq(out_ext.request, 9);
+    cr_assert_eq(memcmp(data, "hello", 5), 0, "Payload was not received intact");
+    free(data);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void play(GAME *game, GAME_ROLE role, char *str) {
+    GAME_MOVE *move = game_parse_move(game, role, str);
+    cr_assert_not_null(move, "Move %s was not parsed", str);
+    cr_assert_eq(game_apply_move(game, move), 0, "Move %s was not applied", str);
+    free(move);
+}
+
+Test(unit_suite, tablebase, .timeout = 5) {
+    game_tablebase_init();
+    GAME *game = game_create();
+    cr_assert_eq(game_perfect_outcome(game), NULL_ROLE, "Perfect play from the start is not a draw");
+    cr_assert_eq(game_moves_to_end(game), 9);
+    // X threatens 1-2-3 and O threatens 4-5-6: X wins at once
+    play(game, FIRST_PLAYER_ROLE, "1");
+    play(game, SECOND_PLAYER_ROLE, "4");
+    play(game, FIRST_PLAYER_ROLE, "2");
+    play(game, SECOND_PLAYER_ROLE, "5");
+    cr_assert_eq(game_perfect_outcome(game), FIRST_PLAYER_ROLE);
+    cr_assert_eq(game_moves_to_end(game), 1);
+    GAME_MOVE *best = game_best_move(game);
+    cr_assert_not_null(best);
+    cr_assert_eq(game_apply_move(game, best), 0);
+    free(best);
+    cr_assert(game_is_over(game), "The best move did not end the game");
+    cr_assert_eq(game_get_winner(game), FIRST_PLAYER_ROLE);
+    cr_assert_null(game_best_move(game), "A game that is over has a best move");
+    cr_assert_eq(game_moves_to_end(game), 0);
+    game_unref(game, "test is over");
+}
+
+static void collect_opponent(PLAYER *player, PLAYER *opponent, unsigned long record[3], void *arg) {
+    char *buf = arg;
+    sprintf(buf + strlen(buf), "%s %lu %lu %lu;", player_get_name(opponent),
+	    record[0], record[1], record[2]);
+}
+
+Test(unit_suite, records, .timeout = 5) {
+    PLAYER *alice = player_create("alice");
+    PLAYER *bob = player_create("bob");
+    PLAYER *carol = player_create("carol");
+    player_post_result(alice, bob, 1);
+    player_post_result(alice, bob, 0);
+    player_post_result(alice, carol, 2);
+    unsigned long record[3];
+    player_get_record(alice, record);
+    cr_assert(record[0] == 1 && record[1] == 1 && record[2] == 1,
+	      "alice: expected 1 1 1, was %lu %lu %lu", record[0], record[1], record[2]);
+    player_get_record(bob, record);
+    cr_assert(record[0] == 0 && record[1] == 1 && record[2] == 1,
+	      "bob: expected 0 1 1, was %lu %lu %lu", record[0], record[1], record[2]);
+    // the opponent first played last comes first
+    char buf[256] = "";
+    player_foreach_opponent(alice, collect_opponent, buf);
+    cr_assert_str_eq(buf, "carol 0 1 0;bob 1 0 1;", "was %s", buf);
+    buf[0] = '\0';
+    player_foreach_opponent(carol, collect_opponent, buf);
+    cr_assert_str_eq(buf, "alice 1 0 0;", "was %s", buf);
+}
+
+/*
+ * Count the entries of a history scanned, and check their order.  The
+ * array passed holds the last time seen, the number of entries counted,
+ * and the number wanted, or 0 for all of them.
+ */
+static int count_entries(HISTORY_ENTRY *entry, void *arg) {
+    unsigned long *acc = arg;
+    if(acc[2] != 0 && acc[1] == acc[2])
+	return -1;
+    cr_assert_geq(entry->time, acc[0], "Entries are out of order");
+    acc[0] = entry->time;
+    acc[1]++;
+    return 0;
+}
+
+Test(unit_suite, history_range, .timeout = 5) {
+    HISTORY *history = history_create();
+    int n = 2 * HISTORY_SEGMENT_ENTRIES + 5;
+    for(int i = 0; i < n; i++)
+	history_append(history, 10 * i, 1500 + i, NULL, HISTORY_WON);
+    unsigned long acc[3] = { 0, 0, 0 };
+    cr_assert_eq(history_scan(history, 10 * 1000, 10 * 1100, count_entries, acc), 100);
+    cr_assert_eq(acc[1], 100);
+    cr_assert_eq(acc[0], 10 * 1099);
+    unsigned long stop[3] = { 0, 0, 5 };
+    cr_assert_eq(history_scan(history, 0, 10 * n, count_entries, stop), 5,
+		 "The scan did not stop when asked");
+    unsigned long none[3] = { 0, 0, 0 };
+    cr_assert_eq(history_scan(history, 10 * n, 20 * n, count_entries, none), 0);
+    HISTORY_BUCKET buckets[4];
+    int nb = history_downsample(history, 0, 10 * n, buckets, 4);
+    cr_assert_eq(nb, 4);
+    unsigned long total = 0;
+    for(int i = 0; i < nb; i++)
+	total += buckets[i].count;
+    cr_assert_eq(total, n);
+    cr_assert_eq(buckets[0].start, 0);
+    cr_assert_eq(buckets[0].min, 1500);
+    cr_assert_eq(buckets[nb - 1].max, 1500 + n - 1);
+    cr_assert_eq(buckets[nb - 1].last, 1500 + n - 1);
+    history_free(history);
+}
+
+Test(unit_suite, history_clock_set_back, .timeout = 5) {
+    HISTORY *history = history_create();
+    for(int i = 0; i < HISTORY_SEGMENT_ENTRIES; i++)
+	history_append(history, 100, 1500, NULL, HISTORY_DRAWN);
+    // the first entry of the next segment is earlier than the last one
+    history_append(history, 50, 1516, NULL, HISTORY_WON);
+    unsigned long acc[3] = { 0, 0, 0 };
+    cr_assert_eq(history_scan(history, 0, 100, count_entries, acc), 0,
+		 "An entry went back in time");
+    cr_assert_eq(history_scan(history, 100, 101, count_entries, acc), HISTORY_SEGMENT_ENTRIES + 1);
+    history_free(history);
+}
+
+Test(unit_suite, pstore_round_trip, .timeout = 5) {
+    player_registry = preg_init();
+    PLAYER *alice = preg_register(player_registry, "alice smith");
+    PLAYER *bob = preg_register(player_registry, "bob");
+    player_post_result(alice, bob, 1);
+    player_post_result(alice, bob, 0);
+    player_set_rating(bob, 1234);
+    char *text;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    pstore_write(out);
+    fclose(out);
+
+    // restore into a new registry
+    player_registry = preg_init();
+    char *save, *line = strtok_r(text, "\n", &save);
+    for(; line != NULL; line = strtok_r(NULL, "\n", &save))
+	cr_assert_eq(pstore_restore(line), 0, "Line %s was not restored", line);
+    free(text);
+    PLAYER *alice2 = preg_lookup(player_registry, "alice smith");
+    PLAYER *bob2 = preg_lookup(player_registry, "bob");
+    cr_assert(alice2 != NULL && bob2 != NULL, "Players were not restored");
+    cr_assert_neq(alice2, alice);
+    cr_assert_eq(player_get_rating(alice2), player_get_rating(alice));
+    cr_assert_eq(player_get_rating(bob2), 1234);
+    unsigned long record[3];
+    player_get_record(alice2, record);
+    cr_assert(record[0] == 1 && record[1] == 0 && record[2] == 1,
+	      "expected 1 0 1, was %lu %lu %lu", record[0], record[1], record[2]);
+    char buf[256] = "";
+    player_foreach_opponent(bob2, collect_opponent, buf);
+    cr_assert_str_eq(buf, "alice smith 0 1 1;", "was %s", buf);
+
+    cr_assert_eq(pstore_restore("P x 1 2 3 3:bob"), -1, "Malformed rating was accepted");
+    cr_assert_eq(pstore_restore("P 1500 1 2 3 9:bob"), -1, "Overlong name was accepted");
+    cr_assert_eq(pstore_restore("Q 1"), -1, "Unknown line was accepted");
+}
@@ -0,0 +1,398 @@
+/*
+ * jdir: player directory for a federation of Jeux servers (options -D, -N).
+ *
+ * Usage: jdir (-s <path> | -p <port>)
+ *
+ * Listens on the UNIX socket at the given path, or on the given TCP port,
+ * for connections from the nodes of the federation, and keeps the node
+ * each logged-in username is claimed by.  Each node sends requests one per
+ * line and receives one line in reply to each, in order:
+ *
+ *   JOIN <node>          OK, or TAKEN if another connection has joined as
+ *                        the node
+ *   PING                 PONG
+ *   REG <name> <node>    OK, or TAKEN <node> if another node has the name
+ *   UNREG <name> <node>  OK
+ *   LOOKUP <name>        NODE <node>, or NONE
+ *   TICKET <node>        TICKET <ticket>, for a link to <node> from the node
+ *                        joined as over the connection
+ *   REDEEM <ticket>      NODE <node>, the node the ticket was issued to, if
+ *                        it was for a link to the node joined as over the
+ *                        connection; otherwise NONE
+ *
+ * where <node> is the address the node listens on for links from the
+ * others.  REG and UNREG are answered with ERROR unless <node> is the node
+ * joined as over the connection.  A node opening a link names itself with a ticket, which the
+ * node at the other end redeems, so that the name cannot be forged by
+ * whoever can reach that node.  A ticket can be redeemed only once, and a
+ * new ticket for the same link replaces it.  Any other request is
+ * answered with ERROR.  The join, the names claimed and the tickets issued
+ * over a connection are released when it is closed, as when its node
+ * exits.
+ *
+ * A JOIN is first-come for each address: the directory cannot tell the
+ * node listening on an address from any other process that can reach the
+ * directory, so it must only be reachable by the nodes themselves (a UNIX
+ * socket with restricted permissions, or a TCP port on a private network).
+ *
+ * All connections are served from a single thread with poll.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define LINE_MAX_LEN 512
+#define TICKET_LEN 32
+
+typedef struct conn {
+	int fd;
+	char *node;     // node joined as over the connection, or NULL
+	char buf[LINE_MAX_LEN];
+	size_t len;
+} CONN;
+
+typedef struct entry {
+	char *name;
+	char *node;
+	int owner;      // connection the name was claimed over
+} ENTRY;
+
+static CONN *conns;
+static struct pollfd *pfds;
+static int nconns, maxconns;
+
+typedef struct ticket {
+	char id[TICKET_LEN + 1];
+	char *from;     // node the ticket was issued to
+	char *to;       // node the link is to
+	int owner;      // connection the ticket was issued over
+} TICKET;
+
+static ENTRY *entries;
+static int nentries, maxentries;
+
+static TICKET *tickets;
+static int ntickets, maxtickets;
+
+static ENTRY *find_entry(char *name){
+	for(int i = 0; i < nentries; i++){
+		if(strcmp(entries[i].name, name) == 0){
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+static void remove_entry(ENTRY *e){
+	free(e->name);
+	free(e->node);
+	*e = entries[--nentries];
+}
+
+static void remove_ticket(TICKET *t){
+	free(t->from);
+	free(t->to);
+	*t = tickets[--ntickets];
+}
+
+static CONN *find_node(char *node){
+	for(int i = 0; i < nconns; i++){
+		if(conns[i].node != NULL && strcmp(conns[i].node, node) == 0){
+			return &conns[i];
+		}
+	}
+	return NULL;
+}
+
+static void *grow(void *p, int *max, size_t elem){
+	*max = *max == 0 ? 16 : 2 * *max;
+	p = realloc(p, *max * elem);
+	if(p == NULL){
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+/*
+ * Issue a ticket for a link from the node joined as over a connection to
+ * another node, replacing any issued before for the same link.
+ */
+static void issue_ticket(CONN *c, char *to, char *reply, size_t size){
+	unsigned char bytes[TICKET_LEN / 2];
+	if(getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)){
+		snprintf(reply, size, "ERROR\n");
+		return;
+	}
+	TICKET *t = NULL;
+	for(int i = 0; i < ntickets; i++){
+		if(tickets[i].owner == c->fd && strcmp(tickets[i].to, to) == 0){
+			t = &tickets[i];
+			break;
+		}
+	}
+	if(t == NULL){
+		if(ntickets == maxtickets){
+			tickets = grow(tickets, &maxtickets, sizeof(TICKET));
+		}
+		t = &tickets[ntickets++];
+		t->from = strdup(c->node);
+		t->to = strdup(to);
+		t->owner = c->fd;
+	}
+	for(int i = 0; i < (int) sizeof(bytes); i++){
+		sprintf(t->id + 2 * i, "%02x", bytes[i]);
+	}
+	snprintf(reply, size, "TICKET %s\n", t->id);
+}
+
+/*
+ * Redeem a ticket for a link to the node joined as over a connection.
+ */
+static void redeem_ticket(CONN *c, char *id, char *reply, size_t size){
+	for(int i = 0; i < ntickets; i++){
+		if(strcmp(tickets[i].id, id) == 0 && strcmp(tickets[i].to, c->node) == 0){
+			snprintf(reply, size, "NODE %s\n", tickets[i].from);
+			remove_ticket(&tickets[i]);
+			return;
+		}
+	}
+	snprintf(reply, size, "NONE\n");
+}
+
+/*
+ * Handle one request line, received over a connection, and write the
+ * reply into reply.
+ */
+static void handle(CONN *c, char *line, char *reply, size_t size){
+	int fd = c->fd;
+	char *cmd = strtok(line, " \r");
+	char *name = strtok(NULL, " \r");
+	char *node = strtok(NULL, " \r");
+	ENTRY *e = name != NULL ? find_entry(name) : NULL;
+	if(cmd == NULL){
+		snprintf(reply, size, "ERROR\n");
+	} else if(strcmp(cmd, "JOIN") == 0 && name != NULL && c->node == NULL){
+		// the node's address is the only argument
+		if(find_node(name) != NULL){
+			snprintf(reply, size, "TAKEN\n");
+			return;
+		}
+		c->node = strdup(name);
+		snprintf(reply, size, "OK\n");
+	} else if(strcmp(cmd, "TICKET") == 0 && name != NULL && c->node != NULL){
+		issue_ticket(c, name, reply, size);
+	} else if(strcmp(cmd, "REDEEM") == 0 && name != NULL && c->node != NULL){
+		redeem_ticket(c, name, reply, size);
+	} else if(strcmp(cmd, "PING") == 0){
+		snprintf(reply, size, "PONG\n");
+	} else if(strcmp(cmd, "REG") == 0 && node != NULL
+		  && c->node != NULL && strcmp(node, c->node) == 0){
+		if(e != NULL && strcmp(e->node, node) != 0){
+			snprintf(reply, size, "TAKEN %s\n", e->node);
+			return;
+		}
+		if(e == NULL){
+			if(nentries == maxentries){
+				entries = grow(entries, &maxentries, sizeof(ENTRY));
+			}
+			e = &entries[nentries++];
+			e->name = strdup(name);
+			e->node = strdup(node);
+		}
+		e->owner = fd;
+		snprintf(reply, size, "OK\n");
+	} else if(strcmp(cmd, "UNREG") == 0 && node != NULL
+		  && c->node != NULL && strcmp(node, c->node) == 0){
+		if(e != NULL && strcmp(e->node, node) == 0){
+			remove_entry(e);
+		}
+		snprintf(reply, size, "OK\n");
+	} else if(strcmp(cmd, "LOOKUP") == 0 && name != NULL){
+		if(e != NULL){
+			snprintf(reply, size, "NODE %s\n", e->node);
+		} else {
+			snprintf(reply, size, "NONE\n");
+		}
+	} else {
+		snprintf(reply, size, "ERROR\n");
+	}
+}
+
+/*
+ * Close a connection and release the join, the names claimed and the
+ * tickets issued over it.
+ */
+static void drop(int i){
+	int fd = conns[i].fd;
+	for(int j = 0; j < nentries; ){
+		if(entries[j].owner == fd){
+			remove_entry(&entries[j]);
+		} else {
+			j++;
+		}
+	}
+	for(int j = 0; j < ntickets; ){
+		if(tickets[j].owner == fd){
+			remove_ticket(&tickets[j]);
+		} else {
+			j++;
+		}
+	}
+	free(conns[i].node);
+	close(fd);
+	conns[i] = conns[--nconns];
+	pfds[i + 1] = pfds[nconns + 1];
+}
+
+/*
+ * Read what has arrived on a connection and answer each complete line.
+ * @return 0 if the connection is still open, -1 if it has been closed.
+ */
+static int serve(int i){
+	CONN *c = &conns[i];
+	ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	if(n <= 0){
+		if(n < 0 && errno == EINTR){
+			return 0;
+		}
+		drop(i);
+		return -1;
+	}
+	c->len += n;
+	char *start = c->buf, *nl;
+	while((nl = memchr(start, '\n', c->buf + c->len - start)) != NULL){
+		char reply[LINE_MAX_LEN + 16];
+		*nl = '\0';
+		handle(c, start, reply, sizeof(reply));
+		size_t len = strlen(reply), off = 0;
+		while(off < len){
+			ssize_t w = write(c->fd, reply + off, len - off);
+			if(w < 0 && errno == EINTR){
+				continue;
+			}
+			if(w <= 0){
+				drop(i);
+				return -1;
+			}
+			off += w;
+		}
+		start = nl + 1;
+	}
+	c->len -= start - c->buf;
+	memmove(c->buf, start, c->len);
+	if(c->len == sizeof(c->buf)){
+		fprintf(stderr, "Request too long, closing connection\n");
+		drop(i);
+		return -1;
+	}
+	return 0;
+}
+
+static int open_listener(char *path, char *port){
+	int fd;
+	if(path != NULL){
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(path) >= sizeof(addr.sun_path)){
+			fprintf(stderr, "Socket path too long: %s\n", path);
+			return -1;
+		}
+		strcpy(addr.sun_path, path);
+		unlink(path);
+		if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+		   || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+			perror(path);
+			return -1;
+		}
+	} else {
+		struct sockaddr_in addr;
+		int one = 1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons((unsigned short) atoi(port));
+		if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+		   || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+		   || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+			perror(port);
+			return -1;
+		}
+	}
+	if(listen(fd, 64) < 0){
+		perror("listen");
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "Usage: %s (-s <path> | -p <port>)\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+	char *path = NULL, *port = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "s:p:")) != -1){
+		switch(opt){
+		case 's': path = optarg; break;
+		case 'p': port = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if((path == NULL) == (port == NULL)){
+		usage(argv[0]);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	int lfd = open_listener(path, port);
+	if(lfd < 0){
+		exit(EXIT_FAILURE);
+	}
+
+	while(1){
+		if(nconns + 1 >= maxconns){
+			int max = maxconns;
+			conns = grow(conns, &max, sizeof(CONN));
+			pfds = grow(pfds, &maxconns, sizeof(struct pollfd));
+		}
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for(int i = 0; i < nconns; i++){
+			pfds[i + 1].fd = conns[i].fd;
+			pfds[i + 1].events = POLLIN;
+		}
+		if(poll(pfds, nconns + 1, -1) < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		// Connections are served from the last, as drop() moves the last
+		// one into the place of the one it closes.
+		for(int i = nconns - 1; i >= 0; i--){
+			if(pfds[i + 1].revents != 0){
+				serve(i);
+			}
+		}
+		if(pfds[0].revents & POLLIN){
+			int fd = accept(lfd, NULL, NULL);
+			if(fd >= 0){
+				conns[nconns].fd = fd;
+				conns[nconns].node = NULL;
+				conns[nconns].len = 0;
+				nconns++;
+			}
+		}
+	}
+}
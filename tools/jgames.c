@@ -0,0 +1,124 @@
+/*
+ * jgames: list the games in a game log written by the Jeux server (option -g).
+ *
+ * Usage: jgames <segment>...
+ *
+ * The games in the given segment files are printed one per line, in the
+ * order of the files given and of the games within each file, as
+ * tab-separated fields:
+ *
+ *   time  first  second  result  ending  moves
+ *
+ * where time is the end of the game in local time, result is 1-0, 0-1 or
+ * 1/2-1/2 from the point of view of the first player, ending is "finished",
+ * "resigned" or "flagged" (lost on time), and moves lists the squares (1 to
+ * 9) in the order played.
+ * To list a whole log in order, pass all its segments sorted by name, as
+ * the shell does when they are given by a wildcard.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gamelog.h"
+
+static char *result_name(int winner){
+	switch(winner){
+	case FIRST_PLAYER_ROLE:
+		return "1-0";
+	case SECOND_PLAYER_ROLE:
+		return "0-1";
+	default:
+		return "1/2-1/2";
+	}
+}
+
+static char *ending_name(int ending){
+	switch(ending){
+	case GAMELOG_RESIGNED:
+		return "resigned";
+	case GAMELOG_FLAGGED:
+		return "flagged";
+	default:
+		return "finished";
+	}
+}
+
+static void print_record(GAMELOG_RECORD *rec){
+	char when[32];
+	time_t sec = rec->time / 1000000000;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+	char *p = (char *) (rec + 1);
+	char *first = p + rec->nmoves;
+	char *second = first + rec->name_len[0];
+	printf("%s.%03lu\t%.*s\t%.*s\t%s\t%s\t", when,
+	       (unsigned long) (rec->time % 1000000000) / 1000000,
+	       rec->name_len[0], first, rec->name_len[1], second,
+	       result_name(rec->winner), ending_name(rec->ending));
+	for(int i = 0; i < rec->nmoves; i++){
+		printf("%s%d", i > 0 ? " " : "", GAME_MOVE_SPOT((unsigned char) p[i]) + 1);
+	}
+	printf("\n");
+}
+
+/*
+ * Print the games in one segment.  Returns -1 if the segment is not
+ * valid, or is truncated in the middle of a record.
+ */
+static int list_segment(char *path){
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	rewind(f);
+	char *buf = malloc(len > 0 ? len : 1);
+	if(buf == NULL || fread(buf, 1, len, f) != (size_t) len){
+		fprintf(stderr, "%s: cannot read\n", path);
+		fclose(f);
+		free(buf);
+		return -1;
+	}
+	fclose(f);
+	GAMELOG_SEGMENT_HEADER *hdr = (GAMELOG_SEGMENT_HEADER *) buf;
+	if(len < sizeof(*hdr) || hdr->magic != GAMELOG_MAGIC || hdr->version != GAMELOG_VERSION){
+		fprintf(stderr, "%s: not a Jeux game log segment\n", path);
+		free(buf);
+		return -1;
+	}
+	int ret = 0;
+	long off = sizeof(*hdr);
+	while(off + (long) sizeof(GAMELOG_RECORD) <= len){
+		GAMELOG_RECORD *rec = (GAMELOG_RECORD *) (buf + off);
+		if(rec->size == 0){
+			break;
+		}
+		if(rec->size < sizeof(*rec) || off + rec->size > len
+		   || sizeof(*rec) + rec->nmoves + rec->name_len[0] + rec->name_len[1] > rec->size){
+			fprintf(stderr, "%s: bad record at offset %ld\n", path, off);
+			ret = -1;
+			break;
+		}
+		print_record(rec);
+		off += rec->size;
+	}
+	free(buf);
+	return ret;
+}
+
+int main(int argc, char *argv[]){
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s <segment>...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	int status = EXIT_SUCCESS;
+	for(int i = 1; i < argc; i++){
+		if(list_segment(argv[i]) == -1){
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,600 @@
+/*
+ * jloadgen: load generator for the Jeux server.
+ *
+ * Usage: jloadgen -p <port> [-h <host>] [-c <connections>] [-d <seconds>]
+ *                 [-r <rate>] [-m <mix>] [-u <prefix>] [-s <seed>]
+ *
+ * Opens the specified number of connections (default 100), pairs them up
+ * and logs each one in under a distinct name.  Each pair then repeatedly
+ * runs a scenario chosen at random according to the mix:
+ *
+ *   users   One side sends USERS.
+ *   game    One side invites the other, the other accepts, and they play
+ *           random moves until the game ends.
+ *   resign  As for game, but the side to move resigns after a random
+ *           number (0-4) of moves.
+ *
+ * The mix is given as comma-separated name=weight pairs (default
+ * "users=50,game=40,resign=10").  The rate is the total number of scenarios
+ * started per second over all pairs, or 0 (the default) to start a new one
+ * as soon as a pair finishes its previous one.  After the duration (default
+ * 10 seconds) has elapsed, no new scenarios are started and the outstanding
+ * ones are given two seconds to finish.
+ *
+ * All connections are driven from a single thread with epoll.  At the end,
+ * a table is printed giving, for each request type, the number of requests
+ * sent, the number of NACKs received, the throughput, and percentiles of
+ * the time from sending the request to receiving its ACK or NACK.
+ *
+ * Note that the server accepts at most MAX_CLIENTS (64) connections;
+ * connections beyond that are closed by the server and reported as lost.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include "protocol.h"
+#include "game.h"
+
+#define MAX_PENDING 8       // Requests in flight on one connection
+#define MAX_EVENTS 256
+#define DRAIN_SECONDS 2
+
+typedef enum { SCN_USERS, SCN_GAME, SCN_RESIGN, NSCENARIOS } SCENARIO;
+static char *scenario_names[NSCENARIOS] = { "users", "game", "resign" };
+
+/*
+ * Request types for which latencies are recorded.
+ */
+static int request_types[] = {
+	JEUX_LOGIN_PKT, JEUX_USERS_PKT, JEUX_INVITE_PKT,
+	JEUX_ACCEPT_PKT, JEUX_MOVE_PKT, JEUX_RESIGN_PKT
+};
+static char *type_names[] = {
+	[JEUX_LOGIN_PKT] = "LOGIN", [JEUX_USERS_PKT] = "USERS",
+	[JEUX_INVITE_PKT] = "INVITE", [JEUX_ACCEPT_PKT] = "ACCEPT",
+	[JEUX_MOVE_PKT] = "MOVE", [JEUX_RESIGN_PKT] = "RESIGN",
+};
+#define NTYPES (JEUX_RESIGN_PKT + 1)
+
+/*
+ * Latency samples of one request type, in nanoseconds.
+ */
+typedef struct samples {
+	uint64_t *v;
+	size_t n, cap;
+	unsigned long nacks;
+} SAMPLES;
+
+static SAMPLES samples[NTYPES];
+
+typedef struct pair PAIR;
+
+typedef struct conn {
+	int fd;
+	int index;
+	char name[64];
+	PAIR *pair;
+	int logged_in;
+	int game_id;                // Invitation/game ID as seen by this side
+	struct {                    // FIFO of requests awaiting ACK/NACK
+		int type;
+		uint64_t sent;
+	} pending[MAX_PENDING];
+	int npending, phead;
+	char *rbuf;
+	size_t rlen, rcap;
+	char *wbuf;
+	size_t wlen, wcap;
+	int want_out;               // EPOLLOUT is registered
+} CONN;
+
+struct pair {
+	CONN *a, *b;                // a invites and plays X; b accepts and plays O
+	int active;                 // A scenario is in progress
+	SCENARIO scenario;
+	char board[9];
+	int moves;                  // Moves made in the current game
+	int resign_after;           // Moves after which to resign
+	int over;                   // Game is over as far as we know
+	int ended;                  // ENDED packets received
+};
+
+static int epfd;
+static CONN *conns;
+static PAIR *pairs;
+static int nconns, npairs;
+static int *idle;               // Stack of idle pair indices
+static int nidle;
+static int weights[NSCENARIOS] = { 50, 40, 10 };
+static unsigned long completed[NSCENARIOS];
+static unsigned long lost = 0, protocol_errors = 0;
+static int stopping = 0;
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(int type, uint64_t ns, int nack){
+	SAMPLES *s = &samples[type];
+	if(nack){
+		s->nacks++;
+	}
+	if(s->n == s->cap){
+		s->cap = s->cap ? 2 * s->cap : 1024;
+		s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+		if(s->v == NULL){
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s->v[s->n++] = ns;
+}
+
+static void set_out(CONN *c, int want){
+	if(c->want_out == want){
+		return;
+	}
+	struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c };
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_out = want;
+}
+
+static void flush(CONN *c){
+	size_t off = 0;
+	while(off < c->wlen){
+		ssize_t n = send(c->fd, c->wbuf + off, c->wlen - off, MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			return;     // the error shows up as EOF on the read side
+		}
+		off += n;
+	}
+	memmove(c->wbuf, c->wbuf + off, c->wlen - off);
+	c->wlen -= off;
+	set_out(c, c->wlen > 0);
+}
+
+/*
+ * Queue a request on a connection and remember when it was sent.
+ */
+static void send_request(CONN *c, int type, int id, int role, char *payload){
+	size_t size = payload != NULL ? strlen(payload) : 0;
+	if(c->npending == MAX_PENDING){
+		protocol_errors++;
+		return;
+	}
+	JEUX_PACKET_HEADER hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.type = type;
+	hdr.id = id;
+	hdr.role = role;
+	hdr.size = htons(size);
+	if(c->wlen + sizeof(hdr) + size > c->wcap){
+		c->wcap = 2 * (c->wlen + sizeof(hdr) + size);
+		c->wbuf = realloc(c->wbuf, c->wcap);
+	}
+	memcpy(c->wbuf + c->wlen, &hdr, sizeof(hdr));
+	memcpy(c->wbuf + c->wlen + sizeof(hdr), payload, size);
+	c->wlen += sizeof(hdr) + size;
+	int slot = (c->phead + c->npending) % MAX_PENDING;
+	c->pending[slot].type = type;
+	c->pending[slot].sent = now_ns();
+	c->npending++;
+	flush(c);
+}
+
+static void make_idle(PAIR *p){
+	p->active = 0;
+	idle[nidle++] = p - pairs;
+}
+
+static SCENARIO pick_scenario(void){
+	int total = 0;
+	for(int i = 0; i < NSCENARIOS; i++){
+		total += weights[i];
+	}
+	int r = rand() % total;
+	for(int i = 0; i < NSCENARIOS; i++){
+		if(r < weights[i]){
+			return i;
+		}
+		r -= weights[i];
+	}
+	return SCN_USERS;
+}
+
+static void start_scenario(PAIR *p){
+	p->active = 1;
+	p->scenario = pick_scenario();
+	if(p->scenario == SCN_USERS){
+		send_request(p->a, JEUX_USERS_PKT, 0, 0, NULL);
+		return;
+	}
+	memset(p->board, ' ', sizeof(p->board));
+	p->moves = 0;
+	p->over = 0;
+	p->ended = 0;
+	p->resign_after = p->scenario == SCN_RESIGN ? rand() % 5 : -1;
+	// the target plays second, so the inviter moves first
+	send_request(p->a, JEUX_INVITE_PKT, 0, SECOND_PLAYER_ROLE, p->b->name);
+}
+
+static int board_over(char *b){
+	static int lines[8][3] = {
+		{0,1,2}, {3,4,5}, {6,7,8}, {0,3,6}, {1,4,7}, {2,5,8}, {0,4,8}, {2,4,6}
+	};
+	for(int i = 0; i < 8; i++){
+		if(b[lines[i][0]] != ' ' && b[lines[i][0]] == b[lines[i][1]]
+		   && b[lines[i][1]] == b[lines[i][2]]){
+			return 1;
+		}
+	}
+	return memchr(b, ' ', 9) == NULL;
+}
+
+/*
+ * It is c's turn in the pair's game: move, or resign if the scenario
+ * calls for it now.
+ */
+static void take_turn(PAIR *p, CONN *c){
+	if(p->over){
+		return;
+	}
+	if(p->moves == p->resign_after){
+		p->over = 1;
+		send_request(c, JEUX_RESIGN_PKT, c->game_id, 0, NULL);
+		return;
+	}
+	int free_spots[9], n = 0;
+	for(int i = 0; i < 9; i++){
+		if(p->board[i] == ' '){
+			free_spots[n++] = i;
+		}
+	}
+	int spot = free_spots[rand() % n];
+	p->board[spot] = c == p->a ? 'X' : 'O';
+	p->moves++;
+	p->over = board_over(p->board);
+	char move[2] = { '1' + spot, '\0' };
+	send_request(c, JEUX_MOVE_PKT, c->game_id, 0, move);
+}
+
+static void maybe_finish(PAIR *p){
+	if(!p->active || p->a->npending > 0 || p->b->npending > 0){
+		return;
+	}
+	if(p->scenario != SCN_USERS && p->ended < 2){
+		return;
+	}
+	completed[p->scenario]++;
+	make_idle(p);
+}
+
+/*
+ * Abandon the game in progress after a NACK, by resigning it.
+ */
+static void abandon_game(PAIR *p, CONN *c){
+	protocol_errors++;
+	if(!p->over && c->game_id >= 0){
+		p->over = 1;
+		send_request(c, JEUX_RESIGN_PKT, c->game_id, 0, NULL);
+	}
+}
+
+static void handle_packet(CONN *c, JEUX_PACKET_HEADER *hdr){
+	PAIR *p = c->pair;
+	CONN *other = c == p->a ? p->b : p->a;
+	int type = hdr->type;
+	if(type == JEUX_ACK_PKT || type == JEUX_NACK_PKT){
+		if(c->npending == 0){
+			protocol_errors++;
+			return;
+		}
+		int req = c->pending[c->phead].type;
+		record(req, now_ns() - c->pending[c->phead].sent, type == JEUX_NACK_PKT);
+		c->phead = (c->phead + 1) % MAX_PENDING;
+		c->npending--;
+		if(type == JEUX_NACK_PKT){
+			if(req == JEUX_LOGIN_PKT){
+				fprintf(stderr, "Login of %s refused\n", c->name);
+			} else if(req == JEUX_INVITE_PKT || req == JEUX_ACCEPT_PKT){
+				// no game was started, so no ENDED will arrive
+				p->ended = 2;
+				protocol_errors++;
+			} else if(req == JEUX_MOVE_PKT){
+				abandon_game(p, c);
+			} else if(req == JEUX_RESIGN_PKT){
+				p->ended = 2;
+			}
+		} else if(req == JEUX_LOGIN_PKT){
+			c->logged_in = 1;
+			if(other->logged_in){
+				make_idle(p);
+			}
+		} else if(req == JEUX_INVITE_PKT){
+			c->game_id = hdr->id;
+		}
+		maybe_finish(p);
+		return;
+	}
+	switch(type){
+	case JEUX_INVITED_PKT:
+		c->game_id = hdr->id;
+		send_request(c, JEUX_ACCEPT_PKT, c->game_id, 0, NULL);
+		break;
+	case JEUX_ACCEPTED_PKT:
+	case JEUX_MOVED_PKT:
+		take_turn(p, c);
+		break;
+	case JEUX_ENDED_PKT:
+		p->ended++;
+		maybe_finish(p);
+		break;
+	default:
+		break;
+	}
+}
+
+static void close_conn(CONN *c){
+	if(c->fd < 0){
+		return;
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	lost++;
+}
+
+static void handle_input(CONN *c){
+	while(1){
+		if(c->rcap - c->rlen < 4096){
+			c->rcap = c->rcap ? 2 * c->rcap : 8192;
+			c->rbuf = realloc(c->rbuf, c->rcap);
+		}
+		ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+		if(n == 0){
+			close_conn(c);
+			return;
+		}
+		if(n < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				close_conn(c);
+			}
+			break;
+		}
+		c->rlen += n;
+	}
+	size_t off = 0;
+	while(c->rlen - off >= sizeof(JEUX_PACKET_HEADER)){
+		JEUX_PACKET_HEADER hdr;
+		memcpy(&hdr, c->rbuf + off, sizeof(hdr));
+		size_t size = ntohs(hdr.size);
+		if(c->rlen - off < sizeof(hdr) + size){
+			break;
+		}
+		off += sizeof(hdr) + size;
+		handle_packet(c, &hdr);
+	}
+	memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+	c->rlen -= off;
+}
+
+static int open_conn(struct addrinfo *ai){
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if(fd < 0){
+		return -1;
+	}
+	if(connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(SAMPLES *s, double p){
+	if(s->n == 0){
+		return 0.0;
+	}
+	size_t i = (size_t) (p * (s->n - 1) + 0.5);
+	return s->v[i] / 1000.0;
+}
+
+static void report(double elapsed){
+	printf("# connections=%d pairs=%d elapsed=%.3fs lost=%lu errors=%lu\n",
+	       nconns, npairs, elapsed, lost, protocol_errors);
+	for(int i = 0; i < NSCENARIOS; i++){
+		printf("# scenario %s completed=%lu rate=%.1f/s\n",
+		       scenario_names[i], completed[i], completed[i] / elapsed);
+	}
+	printf("type\tcount\tnacks\trate\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\n");
+	for(size_t i = 0; i < sizeof(request_types) / sizeof(request_types[0]); i++){
+		int t = request_types[i];
+		SAMPLES *s = &samples[t];
+		qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+		printf("%s\t%zu\t%lu\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+		       type_names[t], s->n, s->nacks, s->n / elapsed,
+		       pct(s, 0.50), pct(s, 0.90), pct(s, 0.99), pct(s, 0.999),
+		       s->n ? s->v[s->n - 1] / 1000.0 : 0.0);
+	}
+}
+
+static void parse_mix(char *mix){
+	memset(weights, 0, sizeof(weights));
+	char *save, *tok;
+	for(tok = strtok_r(mix, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+		char *eq = strchr(tok, '=');
+		int found = 0;
+		for(int i = 0; eq != NULL && i < NSCENARIOS; i++){
+			if(strncmp(tok, scenario_names[i], eq - tok) == 0
+			   && strlen(scenario_names[i]) == (size_t) (eq - tok)){
+				weights[i] = atoi(eq + 1);
+				found = 1;
+			}
+		}
+		if(!found){
+			fprintf(stderr, "Bad mix entry '%s'\n", tok);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(weights[SCN_USERS] + weights[SCN_GAME] + weights[SCN_RESIGN] <= 0){
+		fprintf(stderr, "Mix has no positive weights\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-c <connections>] [-d <seconds>] "
+		"[-r <rate>] [-m <mix>] [-u <prefix>] [-s <seed>]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+	char *host = "localhost", *port = NULL, *prefix = NULL;
+	double duration = 10, rate = 0;
+	unsigned int seed = time(NULL);
+	char default_prefix[16];
+	int opt;
+	nconns = 100;
+	while((opt = getopt(argc, argv, "h:p:c:d:r:m:u:s:")) != -1){
+		switch(opt){
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': nconns = atoi(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'r': rate = atof(optarg); break;
+		case 'm': parse_mix(optarg); break;
+		case 'u': prefix = optarg; break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(port == NULL || nconns < 2){
+		usage(argv[0]);
+	}
+	srand(seed);
+	if(prefix == NULL){
+		snprintf(default_prefix, sizeof(default_prefix), "lg%d-", (int) getpid());
+		prefix = default_prefix;
+	}
+	npairs = nconns / 2;
+	nconns = 2 * npairs;
+
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) nconns + 16){
+		rl.rlim_cur = rl.rlim_max < (rlim_t) nconns + 16 ? rl.rlim_max : (rlim_t) nconns + 16;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(host, port, &hints, &ai);
+	if(err != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	epfd = epoll_create1(0);
+	conns = calloc(nconns, sizeof(CONN));
+	pairs = calloc(npairs, sizeof(PAIR));
+	idle = calloc(npairs, sizeof(int));
+	if(epfd < 0 || conns == NULL || pairs == NULL || idle == NULL){
+		perror("setup");
+		exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < nconns; i++){
+		CONN *c = &conns[i];
+		c->index = i;
+		c->game_id = -1;
+		c->pair = &pairs[i / 2];
+		snprintf(c->name, sizeof(c->name), "%s%d", prefix, i);
+		if(i % 2 == 0){
+			pairs[i / 2].a = c;
+		} else {
+			pairs[i / 2].b = c;
+		}
+		if((c->fd = open_conn(ai)) < 0){
+			fprintf(stderr, "Connection %d failed: %s\n", i, strerror(errno));
+			lost++;
+			continue;
+		}
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+		send_request(c, JEUX_LOGIN_PKT, 0, 0, c->name);
+	}
+	freeaddrinfo(ai);
+
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t) (duration * 1e9);
+	uint64_t interval = rate > 0 ? (uint64_t) (1e9 / rate) : 0;
+	uint64_t next_start = start;
+	struct epoll_event events[MAX_EVENTS];
+	while(1){
+		uint64_t now = now_ns();
+		if(!stopping && now >= end){
+			stopping = 1;
+			end = now + DRAIN_SECONDS * 1000000000ULL;
+		}
+		if(stopping){
+			int busy = 0;
+			for(int i = 0; i < npairs && !busy; i++){
+				busy = pairs[i].active && pairs[i].a->fd >= 0 && pairs[i].b->fd >= 0;
+			}
+			if(!busy || now >= end){
+				break;
+			}
+		}
+		while(!stopping && nidle > 0 && now >= next_start){
+			PAIR *p = &pairs[idle[--nidle]];
+			if(p->a->fd >= 0 && p->b->fd >= 0){
+				start_scenario(p);
+			}
+			next_start = interval ? next_start + interval : now;
+		}
+		int timeout = 100;
+		if(!stopping && nidle > 0 && interval){
+			timeout = next_start > now ? (int) ((next_start - now) / 1000000) : 0;
+		}
+		int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		for(int i = 0; i < n; i++){
+			CONN *c = (CONN *) events[i].data.ptr;
+			if(c->fd >= 0 && (events[i].events & EPOLLOUT)){
+				flush(c);
+			}
+			if(c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))){
+				handle_input(c);
+			}
+		}
+	}
+	report((now_ns() - start) / 1e9);
+	for(int i = 0; i < nconns; i++){
+		if(conns[i].fd >= 0){
+			close(conns[i].fd);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ * jreplay: replay a packet capture (server option -c) against a server.
+ *
+ * Usage: jreplay -p <port> [-h <host>] [-s <speed>] [-v] <capture>
+ *
+ * For each connection in the capture, a connection is opened to the
+ * server, the packets that the server originally received on it are sent
+ * again, and the connection is closed, at the same relative times as in
+ * the capture divided by the speed (default 1), or with speed 0 as fast
+ * as possible.  In either case the causal order of the capture is kept:
+ * nothing is sent until every request that the server had answered before
+ * the corresponding moment in the capture has been answered in the replay.
+ * So a request that the server received after answering another is never
+ * replayed ahead of it, while requests that overlapped in the capture may
+ * overlap again.
+ *
+ * The packets received from the server on each connection are compared,
+ * ignoring timestamps, with those it sent in the capture, and the first
+ * difference on each connection is reported (all of them with -v).
+ * Responses (ACK/NACK) and notifications are compared as separate streams,
+ * since how they interleave depends on timing.  Then,
+ * for each request type, percentiles of the request-to-ACK/NACK latency in
+ * the capture and in the replay are printed.  The exit status is 0 if the
+ * response streams all matched and 1 otherwise.
+ *
+ * For the responses to match, the server must start out in the same state
+ * as the captured one, normally freshly started, since player ratings
+ * persist for the life of the server.  Connections that negotiated
+ * version 2 of the protocol are replayed with version 1, without their
+ * HELLO, so IDs are compared only in their low 8 bits.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "capture.h"
+#include "protocol_ext.h"
+
+#define DRAIN_NS 2000000000ULL  // Time allowed for the server to finish up
+
+typedef struct packet {
+	uint64_t t;
+	JEUX_PACKET_HEADER hdr;
+	char *payload;
+	int64_t latency;            // To the matching ACK/NACK, or -1
+	int answered;               // ACK/NACK received in the replay
+} PACKET;
+
+typedef struct plist {
+	PACKET *v;
+	size_t n, cap;
+} PLIST;
+
+typedef struct action {
+	int kind;                   // CAPTURE_OPEN, CAPTURE_CLOSE or CAPTURE_IN
+	uint32_t conn;
+	size_t index;               // For CAPTURE_IN, index into the sent list
+} ACTION;
+
+typedef struct rconn {
+	int fd;
+	int state;                  // 0: not opened, 1: open, 2: closed for writing, 3: done
+	PLIST sent;                 // Packets received by the server in the capture
+	PLIST expected;             // Packets sent by the server in the capture
+	PLIST received;             // Packets received from the server in the replay
+	size_t unanswered_capture;  // Index into sent of oldest IN without an ACK/NACK
+	size_t next_request;        // Index into sent of the next replayed request to be answered
+	size_t nsent;               // Requests sent in the replay
+	int skip_answer;            // The answer to a HELLO left out is still to come
+	char *rbuf;
+	size_t rlen, rcap;
+} RCONN;
+
+static RCONN *conns = NULL;
+static size_t nconns = 0;
+static ACTION *actions = NULL;
+static size_t nactions = 0, actions_cap = 0;
+static uint64_t *action_times = NULL;
+static int verbose = 0;
+
+/*
+ * Requests answered in the capture, in order of the time of the answer.
+ * Before an action is replayed, all the requests answered before its
+ * captured time must have been answered in the replay.
+ */
+typedef struct dependency {
+	uint64_t answered_at;
+	uint32_t conn;
+	size_t index;
+} DEPENDENCY;
+
+static DEPENDENCY *deps = NULL;
+static size_t ndeps = 0, deps_cap = 0, deps_done = 0;
+
+/*
+ * Latencies per request type, in the capture and in the replay.
+ */
+typedef struct latencies {
+	uint64_t *v;
+	size_t n, cap;
+} LATENCIES;
+
+static LATENCIES captured_lat[JEUX_EXT_PKT_LIMIT], replayed_lat[JEUX_EXT_PKT_LIMIT];
+
+static const char *packet_names[JEUX_EXT_PKT_LIMIT] = JEUX_PACKET_NAMES;
+
+static void *xrealloc(void *p, size_t size){
+	p = realloc(p, size);
+	if(p == NULL){
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static PACKET *plist_add(PLIST *l){
+	if(l->n == l->cap){
+		l->cap = l->cap ? 2 * l->cap : 16;
+		l->v = xrealloc(l->v, l->cap * sizeof(PACKET));
+	}
+	PACKET *p = &l->v[l->n++];
+	memset(p, 0, sizeof(*p));
+	p->latency = -1;
+	return p;
+}
+
+static void lat_add(LATENCIES *l, uint64_t ns){
+	if(l->n == l->cap){
+		l->cap = l->cap ? 2 * l->cap : 64;
+		l->v = xrealloc(l->v, l->cap * sizeof(uint64_t));
+	}
+	l->v[l->n++] = ns;
+}
+
+static RCONN *get_conn(uint32_t id){
+	if(id >= nconns){
+		size_t n = id + 1;
+		conns = xrealloc(conns, n * sizeof(RCONN));
+		memset(conns + nconns, 0, (n - nconns) * sizeof(RCONN));
+		for(size_t i = nconns; i < n; i++){
+			conns[i].fd = -1;
+		}
+		nconns = n;
+	}
+	return &conns[id];
+}
+
+static void add_action(int kind, uint32_t conn, size_t index, uint64_t t){
+	if(nactions == actions_cap){
+		actions_cap = actions_cap ? 2 * actions_cap : 256;
+		actions = xrealloc(actions, actions_cap * sizeof(ACTION));
+		action_times = xrealloc(action_times, actions_cap * sizeof(uint64_t));
+	}
+	actions[nactions] = (ACTION) { kind, conn, index };
+	action_times[nactions++] = t;
+}
+
+static int is_response(int type){
+	return type == JEUX_ACK_PKT || type == JEUX_NACK_PKT;
+}
+
+/*
+ * Read the capture file, splitting it into the packets of each connection
+ * and the sequence of actions to be replayed.
+ */
+static void load(char *path){
+	FILE *f = fopen(path, "r");
+	if(f == NULL){
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	CAPTURE_FILE_HEADER fh;
+	if(fread(&fh, sizeof(fh), 1, f) != 1 || fh.magic != CAPTURE_MAGIC || fh.version != CAPTURE_VERSION){
+		fprintf(stderr, "%s: not a Jeux capture file\n", path);
+		exit(EXIT_FAILURE);
+	}
+	CAPTURE_RECORD rec;
+	while(fread(&rec, sizeof(rec), 1, f) == 1){
+		if(rec.kind == CAPTURE_OPEN || rec.kind == CAPTURE_CLOSE){
+			if(rec.conn != 0){
+				get_conn(rec.conn);
+				add_action(rec.kind, rec.conn, 0, rec.timestamp);
+			}
+			continue;
+		}
+		JEUX_PACKET_HEADER hdr;
+		if(fread(&hdr, sizeof(hdr), 1, f) != 1){
+			break;
+		}
+		size_t size = ntohs(hdr.size);
+		char *payload = NULL;
+		if(size > 0){
+			payload = malloc(size);
+			if(payload == NULL || fread(payload, 1, size, f) != size){
+				break;
+			}
+		}
+		if(rec.conn == 0){
+			free(payload);
+			continue;
+		}
+		RCONN *c = get_conn(rec.conn);
+		// the capture holds the packets of every connection as in version
+		// 1 of the protocol, so a HELLO and its answer are left out
+		if((rec.kind == CAPTURE_IN && hdr.type == JEUX_HELLO_PKT)
+		   || (rec.kind != CAPTURE_IN && is_response(hdr.type) && c->skip_answer)){
+			c->skip_answer = rec.kind == CAPTURE_IN;
+			free(payload);
+			continue;
+		}
+		PACKET *p = plist_add(rec.kind == CAPTURE_IN ? &c->sent : &c->expected);
+		p->t = rec.timestamp;
+		p->hdr = hdr;
+		p->payload = payload;
+		if(rec.kind == CAPTURE_IN){
+			add_action(CAPTURE_IN, rec.conn, c->sent.n - 1, rec.timestamp);
+		} else if(is_response(hdr.type) && c->unanswered_capture < c->sent.n){
+			PACKET *req = &c->sent.v[c->unanswered_capture++];
+			req->latency = rec.timestamp - req->t;
+			if(ndeps == deps_cap){
+				deps_cap = deps_cap ? 2 * deps_cap : 256;
+				deps = xrealloc(deps, deps_cap * sizeof(DEPENDENCY));
+			}
+			deps[ndeps++] = (DEPENDENCY) { rec.timestamp, rec.conn, c->unanswered_capture - 1 };
+			if(req->hdr.type < JEUX_EXT_PKT_LIMIT){
+				lat_add(&captured_lat[req->hdr.type], req->latency);
+			}
+		}
+	}
+	fclose(f);
+}
+
+static int open_conn(struct addrinfo *ai){
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if(fd < 0){
+		return -1;
+	}
+	if(connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+		close(fd);
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static int write_all(int fd, void *buf, size_t n){
+	char *p = buf;
+	while(n > 0){
+		ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+		if(w < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+static void perform(ACTION *a, struct addrinfo *ai){
+	RCONN *c = &conns[a->conn];
+	switch(a->kind){
+	case CAPTURE_OPEN:
+		if((c->fd = open_conn(ai)) < 0){
+			fprintf(stderr, "Connection %u: connect failed: %s\n", a->conn, strerror(errno));
+			c->state = 3;
+		} else {
+			c->state = 1;
+		}
+		break;
+	case CAPTURE_CLOSE:
+		if(c->state == 1){
+			shutdown(c->fd, SHUT_WR);
+			c->state = 2;
+		}
+		break;
+	case CAPTURE_IN:
+		if(c->state == 1){
+			PACKET *p = &c->sent.v[a->index];
+			p->t = now_ns();   // reused as the replay send time
+			size_t size = ntohs(p->hdr.size);
+			if(write_all(c->fd, &p->hdr, sizeof(p->hdr)) < 0
+			   || (size > 0 && write_all(c->fd, p->payload, size) < 0)){
+				fprintf(stderr, "Connection %u: send failed: %s\n", a->conn, strerror(errno));
+			} else {
+				c->nsent++;
+			}
+		}
+		break;
+	}
+}
+
+static void handle_packet(RCONN *c, JEUX_PACKET_HEADER *hdr, char *payload){
+	PACKET *p = plist_add(&c->received);
+	p->t = now_ns();
+	p->hdr = *hdr;
+	size_t size = ntohs(hdr->size);
+	if(size > 0){
+		p->payload = malloc(size);
+		memcpy(p->payload, payload, size);
+	}
+	if(is_response(hdr->type) && c->next_request < c->nsent){
+		PACKET *req = &c->sent.v[c->next_request++];
+		req->answered = 1;
+		if(req->hdr.type < JEUX_EXT_PKT_LIMIT){
+			lat_add(&replayed_lat[req->hdr.type], p->t - req->t);
+		}
+	}
+}
+
+static void handle_input(RCONN *c){
+	if(c->rcap - c->rlen < 4096){
+		c->rcap = c->rcap ? 2 * c->rcap : 8192;
+		c->rbuf = xrealloc(c->rbuf, c->rcap);
+	}
+	ssize_t n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+	if(n <= 0){
+		close(c->fd);
+		c->fd = -1;
+		c->state = 3;
+		return;
+	}
+	c->rlen += n;
+	size_t off = 0;
+	while(c->rlen - off >= sizeof(JEUX_PACKET_HEADER)){
+		JEUX_PACKET_HEADER hdr;
+		memcpy(&hdr, c->rbuf + off, sizeof(hdr));
+		size_t size = ntohs(hdr.size);
+		if(c->rlen - off < sizeof(hdr) + size){
+			break;
+		}
+		handle_packet(c, &hdr, c->rbuf + off + sizeof(hdr));
+		off += sizeof(hdr) + size;
+	}
+	memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+	c->rlen -= off;
+}
+
+/*
+ * Determine whether every request answered in the capture before time t
+ * has also been answered in the replay.  Requests on connections that
+ * have been lost can never be answered and are not waited for.
+ */
+static int caught_up(uint64_t t){
+	while(deps_done < ndeps && deps[deps_done].answered_at < t){
+		RCONN *c = &conns[deps[deps_done].conn];
+		if(!c->sent.v[deps[deps_done].index].answered && c->state != 3){
+			return 0;
+		}
+		deps_done++;
+	}
+	return 1;
+}
+
+static int cmp_deps(const void *a, const void *b){
+	const DEPENDENCY *x = a, *y = b;
+	return x->answered_at < y->answered_at ? -1 : x->answered_at > y->answered_at;
+}
+
+static int all_done(void){
+	for(size_t i = 0; i < nconns; i++){
+		if(conns[i].state == 1 || conns[i].state == 2){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int same_packet(PACKET *a, PACKET *b){
+	size_t size = ntohs(a->hdr.size);
+	return a->hdr.type == b->hdr.type && a->hdr.id == b->hdr.id && a->hdr.role == b->hdr.role
+		&& a->hdr.size == b->hdr.size && (size == 0 || memcmp(a->payload, b->payload, size) == 0);
+}
+
+static void describe(char *buf, size_t len, PACKET *p){
+	if(p == NULL){
+		snprintf(buf, len, "(nothing)");
+		return;
+	}
+	int type = p->hdr.type;
+	int size = ntohs(p->hdr.size);
+	snprintf(buf, len, "%s id=%d role=%d size=%d%s%.*s%s",
+		 type < JEUX_EXT_PKT_LIMIT ? packet_names[type] : "?", p->hdr.id, p->hdr.role, size,
+		 size > 0 ? " [" : "", size > 40 ? 40 : size, size > 0 ? p->payload : "", size > 0 ? "]" : "");
+}
+
+/*
+ * Find the next packet at or after index *k in a list that is (if
+ * responses is nonzero) or is not (otherwise) an ACK/NACK.
+ */
+static PACKET *next_of_class(PLIST *l, size_t *k, int responses){
+	while(*k < l->n && is_response(l->v[*k].hdr.type) != responses){
+		(*k)++;
+	}
+	return *k < l->n ? &l->v[(*k)++] : NULL;
+}
+
+/*
+ * Compare the packets received on one connection with those expected.
+ * Responses (ACK/NACK) and notifications are compared as two separate
+ * streams, because the relative order of a response and a notification
+ * caused by another connection depends on timing.  Returns the number of
+ * differences.
+ */
+static int compare_conn(size_t id, RCONN *c){
+	int diffs = 0;
+	for(int responses = 1; responses >= 0; responses--){
+		size_t ek = 0, rk = 0;
+		for(int n = 0; ; n++){
+			PACKET *e = next_of_class(&c->expected, &ek, responses);
+			PACKET *r = next_of_class(&c->received, &rk, responses);
+			if(e == NULL && r == NULL){
+				break;
+			}
+			if(e != NULL && r != NULL && same_packet(e, r)){
+				continue;
+			}
+			if(diffs++ == 0 || verbose){
+				char eb[128], rb[128];
+				describe(eb, sizeof(eb), e);
+				describe(rb, sizeof(rb), r);
+				printf("# conn %zu %s %d: expected %s, got %s\n", id,
+				       responses ? "response" : "notification", n, eb, rb);
+			}
+		}
+	}
+	return diffs;
+}
+
+/*
+ * Compare the packets received on all connections with those expected.
+ * Returns the number of connections on which they differed.
+ */
+static int compare(void){
+	int bad = 0;
+	for(size_t i = 1; i < nconns; i++){
+		if(compare_conn(i, &conns[i]) > 0){
+			bad++;
+		}
+	}
+	return bad;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(LATENCIES *l, double p){
+	if(l->n == 0){
+		return 0.0;
+	}
+	return l->v[(size_t) (p * (l->n - 1) + 0.5)] / 1000.0;
+}
+
+static void report(int bad, double elapsed){
+	size_t packets = 0;
+	for(size_t i = 0; i < nconns; i++){
+		packets += conns[i].expected.n;
+	}
+	printf("# connections=%zu expected_packets=%zu mismatched_connections=%d elapsed=%.3fs\n",
+	       nconns > 0 ? nconns - 1 : 0, packets, bad, elapsed);
+	printf("type\tcaptured\treplayed\tcap_p50_us\tcap_p99_us\trep_p50_us\trep_p99_us\n");
+	for(int t = 0; t < JEUX_EXT_PKT_LIMIT; t++){
+		LATENCIES *c = &captured_lat[t], *r = &replayed_lat[t];
+		if(c->n == 0 && r->n == 0){
+			continue;
+		}
+		qsort(c->v, c->n, sizeof(uint64_t), cmp_u64);
+		qsort(r->v, r->n, sizeof(uint64_t), cmp_u64);
+		printf("%s\t%zu\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\n", packet_names[t], c->n, r->n,
+		       pct(c, 0.5), pct(c, 0.99), pct(r, 0.5), pct(r, 0.99));
+	}
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "Usage: %s -p <port> [-h <host>] [-s <speed>] [-v] <capture>\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+	char *host = "localhost", *port = NULL;
+	double speed = 1.0;
+	int opt;
+	while((opt = getopt(argc, argv, "h:p:s:v")) != -1){
+		switch(opt){
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 's': speed = atof(optarg); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(port == NULL || optind != argc - 1 || speed < 0){
+		usage(argv[0]);
+	}
+	load(argv[optind]);
+	qsort(deps, ndeps, sizeof(DEPENDENCY), cmp_deps);
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(host, port, &hints, &ai);
+	if(err != 0){
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	struct pollfd *pfds = calloc(nconns + 1, sizeof(struct pollfd));
+	RCONN **pconns = calloc(nconns + 1, sizeof(RCONN *));
+	uint64_t t0 = nactions > 0 ? action_times[0] : 0;
+	uint64_t start = now_ns();
+	uint64_t deadline = 0;
+	size_t next = 0;
+	while(1){
+		uint64_t now = now_ns();
+		while(next < nactions){
+			if(speed > 0 && now < start + (uint64_t) ((action_times[next] - t0) / speed)){
+				break;
+			}
+			if(!caught_up(action_times[next])){
+				break;
+			}
+			perform(&actions[next++], ai);
+		}
+		if(next == nactions){
+			if(deadline == 0){
+				deadline = now + DRAIN_NS;
+			}
+			if(all_done() || now >= deadline){
+				break;
+			}
+		}
+		int timeout = 100;
+		if(speed > 0 && next < nactions && caught_up(action_times[next])){
+			uint64_t due = start + (uint64_t) ((action_times[next] - t0) / speed);
+			timeout = due > now ? (int) ((due - now) / 1000000) : 0;
+		}
+		int n = 0;
+		for(size_t i = 0; i < nconns; i++){
+			if(conns[i].fd >= 0){
+				pfds[n].fd = conns[i].fd;
+				pfds[n].events = POLLIN;
+				pconns[n++] = &conns[i];
+			}
+		}
+		if(poll(pfds, n, timeout) <= 0){
+			continue;
+		}
+		for(int i = 0; i < n; i++){
+			if(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+				handle_input(pconns[i]);
+			}
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+	freeaddrinfo(ai);
+	int bad = compare();
+	report(bad, elapsed);
+	return bad > 0 ? 1 : 0;
+}
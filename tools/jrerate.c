@@ -0,0 +1,370 @@
+/*
+ * jrerate: recompute the ratings of all players from a game log written by
+ * the Jeux server (option -g), and write them out as a player store that
+ * the server loads with option -P.
+ *
+ * Usage: jrerate [-k <k>] [-r <rating>] [-j <threads>] [-o <file>] <segment>...
+ *
+ * The games in the given segment files are replayed in the order of the
+ * files given and of the games within each file, so a whole log is
+ * replayed in order when all its segments are passed sorted by name, as
+ * the shell does when they are given by a wildcard.  Every player starts
+ * with the given rating (default PLAYER_INITIAL_RATING) and each game
+ * updates the ratings of its players as the server does (see rating.h),
+ * with the given K-factor (default RATING_K_FACTOR).  The player store,
+ * written to the given file (default the standard output), holds the
+ * recomputed rating and the numbers of games won, lost and drawn of each
+ * player, and the head-to-head record of each pair of players, in the
+ * format described in player_store.h.
+ *
+ * The games are divided into chronological partitions of equal size, one
+ * for each thread (default one per CPU).  Each thread decodes the records
+ * of its partition and numbers the players in them; the numbers are then
+ * mapped to those of a table of all the players, in order of partition.
+ * The rating of a player after a game depends on every earlier game of
+ * both its players, so the ratings are computed in a single pass over the
+ * decoded games, which involves no names or records.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gamelog.h"
+#include "rating.h"
+
+#define JRERATE_MAX_THREADS 1024
+
+/*
+ * A table of names, numbered in order of insertion.  The names are not
+ * copied: they point into the mapped segments.
+ */
+typedef struct names {
+	int *slots;         // open addressing: number of the name, or -1
+	size_t nslots;      // a power of two, at least twice n
+	char **name;
+	uint16_t *len;
+	int n;
+} NAMES;
+
+/*
+ * A decoded game: the numbers of its players, first player first, and
+ * its result, as for rating_update().
+ */
+typedef struct decoded_game {
+	int players[2];
+	int result;
+} DECODED_GAME;
+
+/*
+ * A chronological partition of the games, decoded by a thread of its own.
+ */
+typedef struct partition {
+	GAMELOG_RECORD **recs;  // the records of the partition
+	size_t nrecs;
+	DECODED_GAME *games;    // the decoded games, numbered within names
+	NAMES names;
+	int *map;               // number of each name in the table of all players
+	pthread_t tid;
+} PARTITION;
+
+/*
+ * The head-to-head record of a pair of players, in a hash table keyed by
+ * the pair.
+ */
+typedef struct pair {
+	uint64_t key;           // numbers of the players, lower in the high half
+	unsigned long wins[2];  // games won by the lower and the higher number
+	unsigned long draws;
+} PAIR;
+
+static void *xrealloc(void *p, size_t size){
+	p = realloc(p, size);
+	if(p == NULL){
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static uint64_t hash_name(char *name, size_t len){
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for(size_t i = 0; i < len; i++){
+		h = (h ^ (unsigned char) name[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_key(uint64_t key){
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	return key ^ (key >> 33);
+}
+
+/*
+ * Find the number of a name in a table, adding it if it is not there.
+ */
+static int intern(NAMES *t, char *name, size_t len){
+	if(2 * (size_t) (t->n + 1) > t->nslots){
+		size_t nslots = t->nslots > 0 ? 2 * t->nslots : 256;
+		int *slots = xrealloc(NULL, nslots * sizeof(int));
+		memset(slots, -1, nslots * sizeof(int));
+		for(int i = 0; i < t->n; i++){
+			size_t s = hash_name(t->name[i], t->len[i]) & (nslots - 1);
+			while(slots[s] != -1){
+				s = (s + 1) & (nslots - 1);
+			}
+			slots[s] = i;
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->nslots = nslots;
+		t->name = xrealloc(t->name, nslots / 2 * sizeof(char *));
+		t->len = xrealloc(t->len, nslots / 2 * sizeof(uint16_t));
+	}
+	size_t s = hash_name(name, len) & (t->nslots - 1);
+	for(int i; (i = t->slots[s]) != -1; s = (s + 1) & (t->nslots - 1)){
+		if(t->len[i] == len && memcmp(t->name[i], name, len) == 0){
+			return i;
+		}
+	}
+	t->name[t->n] = name;
+	t->len[t->n] = len;
+	return t->slots[s] = t->n++;
+}
+
+/*
+ * Map a segment and append its records to *recsp.  Returns -1 if the
+ * segment is not valid, or is truncated in the middle of a record.
+ */
+static int map_segment(char *path, GAMELOG_RECORD ***recsp, size_t *nrecsp, size_t *caprecsp){
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0){
+		perror(path);
+		if(fd >= 0){
+			close(fd);
+		}
+		return -1;
+	}
+	size_t len = st.st_size;
+	char *buf = len > 0 ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	GAMELOG_SEGMENT_HEADER *hdr = (GAMELOG_SEGMENT_HEADER *) buf;
+	if(buf == MAP_FAILED || len < sizeof(*hdr) || hdr->magic != GAMELOG_MAGIC
+	   || hdr->version != GAMELOG_VERSION){
+		fprintf(stderr, "%s: not a Jeux game log segment\n", path);
+		return -1;
+	}
+	// the segment stays mapped, as the names point into it
+	size_t off = sizeof(*hdr);
+	while(off + sizeof(GAMELOG_RECORD) <= len){
+		GAMELOG_RECORD *rec = (GAMELOG_RECORD *) (buf + off);
+		if(rec->size == 0){
+			break;
+		}
+		if(rec->size < sizeof(*rec) || off + rec->size > len
+		   || sizeof(*rec) + rec->nmoves + rec->name_len[0] + rec->name_len[1] > rec->size){
+			fprintf(stderr, "%s: bad record at offset %zu\n", path, off);
+			return -1;
+		}
+		if(*nrecsp == *caprecsp){
+			*caprecsp = *caprecsp > 0 ? 2 * *caprecsp : 4096;
+			*recsp = xrealloc(*recsp, *caprecsp * sizeof(GAMELOG_RECORD *));
+		}
+		(*recsp)[(*nrecsp)++] = rec;
+		off += rec->size;
+	}
+	return 0;
+}
+
+/*
+ * Thread function that decodes the games of a partition.
+ */
+static void *decode_partition(void *arg){
+	PARTITION *part = (PARTITION *) arg;
+	part->games = xrealloc(NULL, (part->nrecs > 0 ? part->nrecs : 1) * sizeof(DECODED_GAME));
+	for(size_t i = 0; i < part->nrecs; i++){
+		GAMELOG_RECORD *rec = part->recs[i];
+		char *first = (char *) (rec + 1) + rec->nmoves;
+		char *second = first + rec->name_len[0];
+		DECODED_GAME *game = &part->games[i];
+		game->players[0] = intern(&part->names, first, rec->name_len[0]);
+		game->players[1] = intern(&part->names, second, rec->name_len[1]);
+		game->result = rec->winner == FIRST_PLAYER_ROLE ? 1
+			: rec->winner == SECOND_PLAYER_ROLE ? 2 : 0;
+	}
+	return NULL;
+}
+
+/*
+ * Find the head-to-head record of a pair of players, adding one if it is
+ * not there.  The table has room for one pair per game, so it never fills.
+ */
+static PAIR *find_pair(PAIR *pairs, size_t npairs, int a, int b){
+	uint64_t key = (uint64_t) a << 32 | (uint32_t) b;
+	size_t s = hash_key(key) & (npairs - 1);
+	while(pairs[s].key != UINT64_MAX && pairs[s].key != key){
+		s = (s + 1) & (npairs - 1);
+	}
+	pairs[s].key = key;
+	return &pairs[s];
+}
+
+static void write_name(FILE *out, NAMES *t, int i){
+	fprintf(out, "%u:%.*s", t->len[i], t->len[i], t->name[i]);
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "Usage: %s [-k <k>] [-r <rating>] [-j <threads>] [-o <file>] <segment>...\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Parse the argument of an option that must be a positive number no
+ * larger than max, exiting if it is not.
+ */
+static int parse_positive(char *arg, long max, char *what){
+	char *end;
+	errno = 0;
+	long v = strtol(arg, &end, 10);
+	if(errno != 0 || end == arg || *end != '\0' || v <= 0 || v > max){
+		fprintf(stderr, "Invalid %s: %s\n", what, arg);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+int main(int argc, char *argv[]){
+	int k = RATING_K_FACTOR, initial = PLAYER_INITIAL_RATING;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	char *outfile = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "k:r:j:o:")) != -1){
+		switch(opt){
+		case 'k': k = parse_positive(optarg, RATING_K_FACTOR_MAX, "K-factor"); break;
+		case 'r': initial = parse_positive(optarg, INT_MAX / 2, "initial rating"); break;
+		case 'j': nthreads = parse_positive(optarg, JRERATE_MAX_THREADS, "number of threads"); break;
+		case 'o': outfile = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind >= argc){
+		usage(argv[0]);
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+
+	GAMELOG_RECORD **recs = NULL;
+	size_t nrecs = 0, caprecs = 0;
+	for(int i = optind; i < argc; i++){
+		if(map_segment(argv[i], &recs, &nrecs, &caprecs) == -1){
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// decode the partitions in parallel
+	if((size_t) nthreads > nrecs / 1024 + 1){
+		nthreads = nrecs / 1024 + 1;
+	}
+	PARTITION *parts = calloc(nthreads, sizeof(PARTITION));
+	if(parts == NULL){
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for(int p = 0; p < nthreads; p++){
+		size_t lo = nrecs * p / nthreads, hi = nrecs * (p + 1) / nthreads;
+		parts[p].recs = recs + lo;
+		parts[p].nrecs = hi - lo;
+		if(pthread_create(&parts[p].tid, NULL, decode_partition, &parts[p]) != 0){
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	NAMES all = { 0 };
+	for(int p = 0; p < nthreads; p++){
+		pthread_join(parts[p].tid, NULL);
+		parts[p].map = xrealloc(NULL, (parts[p].names.n + 1) * sizeof(int));
+		for(int i = 0; i < parts[p].names.n; i++){
+			parts[p].map[i] = intern(&all, parts[p].names.name[i], parts[p].names.len[i]);
+		}
+	}
+
+	// replay the games in order
+	int *ratings = xrealloc(NULL, (all.n + 1) * sizeof(int));
+	unsigned long (*records)[3] = calloc(all.n + 1, sizeof(*records));
+	size_t npairs = 1;
+	while(npairs < 2 * nrecs){
+		npairs *= 2;
+	}
+	PAIR *pairs = xrealloc(NULL, npairs * sizeof(PAIR));
+	if(records == NULL){
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(pairs, 0, npairs * sizeof(PAIR));
+	for(size_t s = 0; s < npairs; s++){
+		pairs[s].key = UINT64_MAX;
+	}
+	for(int i = 0; i < all.n; i++){
+		ratings[i] = initial;
+	}
+	for(int p = 0; p < nthreads; p++){
+		for(size_t g = 0; g < parts[p].nrecs; g++){
+			DECODED_GAME *game = &parts[p].games[g];
+			int a = parts[p].map[game->players[0]], b = parts[p].map[game->players[1]];
+			rating_update(&ratings[a], &ratings[b], game->result, k);
+			PAIR *pair = find_pair(pairs, npairs, a < b ? a : b, a < b ? b : a);
+			if(game->result == 0){
+				records[a][2]++;
+				records[b][2]++;
+				pair->draws++;
+			} else {
+				int winner = game->result == 1 ? a : b, loser = game->result == 1 ? b : a;
+				records[winner][0]++;
+				records[loser][1]++;
+				pair->wins[winner == (a < b ? a : b) ? 0 : 1]++;
+			}
+		}
+	}
+
+	FILE *out = outfile != NULL ? fopen(outfile, "w") : stdout;
+	if(out == NULL){
+		perror(outfile);
+		exit(EXIT_FAILURE);
+	}
+	for(int i = 0; i < all.n; i++){
+		fprintf(out, "P %d %lu %lu %lu ", ratings[i], records[i][0], records[i][1], records[i][2]);
+		write_name(out, &all, i);
+		fprintf(out, "\n");
+	}
+	// as the server writes it, each pair from the side of the lesser name
+	for(size_t s = 0; s < npairs; s++){
+		if(pairs[s].key == UINT64_MAX){
+			continue;
+		}
+		int lo = pairs[s].key >> 32, hi = (uint32_t) pairs[s].key;
+		int c = memcmp(all.name[lo], all.name[hi], all.len[lo] < all.len[hi] ? all.len[lo] : all.len[hi]);
+		int swap = c > 0 || (c == 0 && all.len[lo] > all.len[hi]);
+		int first = swap ? hi : lo, second = swap ? lo : hi;
+		fprintf(out, "H %lu %lu %lu ", pairs[s].wins[swap], pairs[s].wins[1 - swap], pairs[s].draws);
+		write_name(out, &all, first);
+		fprintf(out, " ");
+		write_name(out, &all, second);
+		fprintf(out, "\n");
+	}
+	if(fclose(out) != 0){
+		perror(outfile != NULL ? outfile : "stdout");
+		exit(EXIT_FAILURE);
+	}
+	fprintf(stderr, "%zu games, %d players, %d threads\n", nrecs, all.n, nthreads);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+/*
+ * jtrace: decode a trace file written by the Jeux server (option -t).
+ *
+ * Usage: jtrace [-j] <file>
+ *
+ * The events of all threads are merged in time order and printed one per
+ * line as text, or with -j as JSON in the Chrome trace-event format,
+ * which can be loaded into chrome://tracing or Perfetto.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "protocol_ext.h"
+
+/*
+ * Names of the events and of their arguments (NULL if unused).
+ */
+static struct {
+	char *name;
+	char *args[3];
+} event_info[TRACE_NEVENTS] = {
+	[TRACE_NONE] = { "none", { NULL, NULL, NULL } },
+	[TRACE_PKT_RECV] = { "pkt_recv", { "fd", "type", "size" } },
+	[TRACE_PKT_SEND] = { "pkt_send", { "fd", "type", "size" } },
+	[TRACE_SERVICE_START] = { "service", { "fd", NULL, NULL } },
+	[TRACE_SERVICE_END] = { "service", { "fd", NULL, NULL } },
+	[TRACE_CLIENT_REF] = { "client_ref", { "refcnt", "client", NULL } },
+	[TRACE_CLIENT_UNREF] = { "client_unref", { "refcnt", "client", NULL } },
+	[TRACE_PLAYER_REF] = { "player_ref", { "refcnt", "player", NULL } },
+	[TRACE_PLAYER_UNREF] = { "player_unref", { "refcnt", "player", NULL } },
+	[TRACE_GAME_REF] = { "game_ref", { "refcnt", "game", NULL } },
+	[TRACE_GAME_UNREF] = { "game_unref", { "refcnt", "game", NULL } },
+	[TRACE_INVITATION_REF] = { "invitation_ref", { "refcnt", "invitation", NULL } },
+	[TRACE_INVITATION_UNREF] = { "invitation_unref", { "refcnt", "invitation", NULL } },
+	[TRACE_REQUEST] = { "request", { "fd", "type", "id" } },
+};
+
+static const char *packet_names[JEUX_EXT_PKT_LIMIT] = JEUX_PACKET_NAMES;
+
+static int compare_events(const void *a, const void *b){
+	const TRACE_EVENT *x = a, *y = b;
+	if(x->timestamp != y->timestamp){
+		return x->timestamp < y->timestamp ? -1 : 1;
+	}
+	return (int) x->thread - (int) y->thread;
+}
+
+static int is_packet_event(int ev){
+	return ev == TRACE_PKT_RECV || ev == TRACE_PKT_SEND || ev == TRACE_REQUEST;
+}
+
+/*
+ * Print the value of one argument.  Object addresses are printed in hex,
+ * packet types by name.
+ */
+static void print_arg(FILE *out, TRACE_EVENT *e, int i, uint64_t v, int json){
+	if(i == 1 && is_packet_event(e->event) && v < JEUX_EXT_PKT_LIMIT){
+		fprintf(out, json ? "\"%s\"" : "%s", packet_names[v]);
+	} else if(i == 1 && e->event >= TRACE_CLIENT_REF && e->event <= TRACE_INVITATION_UNREF){
+		fprintf(out, json ? "\"0x%lx\"" : "0x%lx", (unsigned long) v);
+	} else {
+		fprintf(out, "%lu", (unsigned long) v);
+	}
+}
+
+static void print_text(FILE *out, TRACE_EVENT *events, size_t n){
+	uint64_t t0 = n > 0 ? events[0].timestamp : 0;
+	for(size_t i = 0; i < n; i++){
+		TRACE_EVENT *e = &events[i];
+		uint64_t args[3] = { e->arg0, e->arg1, e->arg2 };
+		fprintf(out, "%12.3f us  [%3u]  ", (e->timestamp - t0) / 1000.0, e->thread);
+		if(e->event >= TRACE_NEVENTS){
+			fprintf(out, "event%u %u %lu %lu\n", e->event, e->arg0,
+				(unsigned long) e->arg1, (unsigned long) e->arg2);
+			continue;
+		}
+		fprintf(out, "%s", e->event == TRACE_SERVICE_END ? "service_end" :
+			e->event == TRACE_SERVICE_START ? "service_start" : event_info[e->event].name);
+		for(int a = 0; a < 3; a++){
+			if(event_info[e->event].args[a] != NULL){
+				fprintf(out, " %s=", event_info[e->event].args[a]);
+				print_arg(out, e, a, args[a], 0);
+			}
+		}
+		fprintf(out, "\n");
+	}
+}
+
+/*
+ * Chrome trace-event JSON.  Service start and end become a duration
+ * ("B"/"E") spanning the life of the connection on its thread; all other
+ * events are instants.
+ */
+static void print_json(FILE *out, TRACE_EVENT *events, size_t n){
+	fprintf(out, "{\"traceEvents\":[\n");
+	for(size_t i = 0; i < n; i++){
+		TRACE_EVENT *e = &events[i];
+		uint64_t args[3] = { e->arg0, e->arg1, e->arg2 };
+		char *ph = e->event == TRACE_SERVICE_START ? "B" : e->event == TRACE_SERVICE_END ? "E" : "i";
+		char *name = e->event < TRACE_NEVENTS ? event_info[e->event].name : "unknown";
+		fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+			i > 0 ? ",\n" : "", name, ph, e->timestamp / 1000.0, e->thread);
+		if(*ph == 'i'){
+			fprintf(out, ",\"s\":\"t\"");
+		}
+		fprintf(out, ",\"args\":{");
+		int first = 1;
+		for(int a = 0; a < 3 && e->event < TRACE_NEVENTS; a++){
+			if(event_info[e->event].args[a] != NULL){
+				fprintf(out, "%s\"%s\":", first ? "" : ",", event_info[e->event].args[a]);
+				print_arg(out, e, a, args[a], 1);
+				first = 0;
+			}
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n]}\n");
+}
+
+int main(int argc, char *argv[]){
+	int json = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "j")) != -1){
+		switch(opt){
+		case 'j':
+			json = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j] <file>\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind != argc - 1){
+		fprintf(stderr, "Usage: %s [-j] <file>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	FILE *f = fopen(argv[optind], "r");
+	if(f == NULL){
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	TRACE_FILE_HEADER hdr;
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC){
+		fprintf(stderr, "%s: not a Jeux trace file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if(hdr.version != TRACE_VERSION || hdr.event_size != sizeof(TRACE_EVENT)){
+		fprintf(stderr, "%s: unsupported trace version %u\n", argv[optind], hdr.version);
+		exit(EXIT_FAILURE);
+	}
+	TRACE_EVENT *events = malloc((hdr.count + 1) * sizeof(TRACE_EVENT));
+	if(events == NULL){
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	size_t n = fread(events, sizeof(TRACE_EVENT), hdr.count, f);
+	if(n != hdr.count){
+		fprintf(stderr, "%s: truncated (%zu of %lu events)\n", argv[optind], n, (unsigned long) hdr.count);
+	}
+	fclose(f);
+	qsort(events, n, sizeof(TRACE_EVENT), compare_events);
+	if(json){
+		print_json(stdout, events, n);
+	} else {
+		print_text(stdout, events, n);
+	}
+	free(events);
+	return 0;
+}